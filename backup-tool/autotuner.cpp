@@ -0,0 +1,187 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// autotuner.cpp
+//
+#include "autotuner.hpp"
+
+#include "filesystem-common.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+
+namespace backup
+{
+
+    Autotuner::Autotuner(const std::size_t minLimit, const std::size_t maxLimit)
+        : m_minLimit(minLimit)
+        , m_maxLimit(maxLimit)
+        , m_startTime(Clock_t::now())
+        , m_prevSampleTime(m_startTime)
+        , m_tunedTaskers()
+    {}
+
+    void Autotuner::add(
+        const std::wstring & name, ITunableTasker & tasker, const bool isMeasuredInBytes)
+    {
+        TunedTasker tuned;
+        tuned.name                 = name;
+        tuned.tasker_ptr           = &tasker;
+        tuned.is_measured_in_bytes = isMeasuredInBytes;
+        m_tunedTaskers.push_back(tuned);
+    }
+
+    std::vector<std::wstring> Autotuner::updateIfTime()
+    {
+        std::vector<std::wstring> decisions;
+
+        const Clock_t::time_point now{ Clock_t::now() };
+        const std::size_t elapsedMs{ elapsedCountMs(m_prevSampleTime, now) };
+
+        if (elapsedMs < sample_period_ms)
+        {
+            return decisions;
+        }
+
+        m_prevSampleTime = now;
+
+        const double elapsedSec{ static_cast<double>(elapsedMs) / 1000.0 };
+
+        for (TunedTasker & tuned : m_tunedTaskers)
+        {
+            const std::wstring decision{ update(tuned, elapsedSec) };
+
+            if (!decision.empty())
+            {
+                decisions.push_back(
+                    L"Autotune at " + prettyTimeDurationString(m_startTime) + L":  " + decision);
+            }
+        }
+
+        return decisions;
+    }
+
+    Clock_t::time_point Autotuner::nextUpdateTime() const
+    {
+        return (m_prevSampleTime + std::chrono::milliseconds(sample_period_ms));
+    }
+
+    std::wstring Autotuner::limitsString() const
+    {
+        std::wstring str;
+
+        for (const TunedTasker & tuned : m_tunedTaskers)
+        {
+            if (!str.empty())
+            {
+                str += L", ";
+            }
+
+            str += tuned.name;
+            str += L"=";
+            str += std::to_wstring(tuned.tasker_ptr->activeLimit());
+        }
+
+        return str;
+    }
+
+    std::wstring Autotuner::update(TunedTasker & tuned, const double elapsedSec)
+    {
+        const TaskQueueStatus status{ tuned.tasker_ptr->status() };
+
+        const std::size_t completed{ (
+            tuned.is_measured_in_bytes ? status.completed_bytes : status.completed_count) };
+
+        const double throughput{ static_cast<double>(completed - tuned.prev_completed) /
+                                 elapsedSec };
+
+        tuned.prev_completed = completed;
+
+        if ((0 == status.queue_size) || tuned.tasker_ptr->isManuallyLimited())
+        {
+            tuned.has_prev_sample = false;
+            return L"";
+        }
+
+        std::wstring reason;
+        if (!tuned.has_prev_sample)
+        {
+            reason = L"first sample";
+        }
+        else if (throughput > (tuned.prev_throughput * (1.0 + noise_fraction)))
+        {
+            reason = L"better";
+        }
+        else if (throughput < (tuned.prev_throughput * (1.0 - noise_fraction)))
+        {
+            reason = L"worse";
+            tuned.direction = -tuned.direction;
+        }
+        else
+        {
+            reason = L"no better";
+            tuned.direction = -1;
+        }
+
+        const bool hadPrevSample{ tuned.has_prev_sample };
+        const double prevThroughput{ tuned.prev_throughput };
+
+        tuned.has_prev_sample = true;
+        tuned.prev_throughput = throughput;
+
+        const std::size_t limit{ tuned.tasker_ptr->activeLimit() };
+
+        const std::size_t maxLimit{ std::min(m_maxLimit, tuned.tasker_ptr->resourceCount()) };
+
+        const std::size_t newLimit{ std::clamp(
+            ((tuned.direction > 0) ? (limit + 1) : ((limit > 0) ? (limit - 1) : 0)),
+            std::min(m_minLimit, maxLimit),
+            maxLimit) };
+
+        // turn around at the bounds
+        if (newLimit == limit)
+        {
+            tuned.direction = -tuned.direction;
+            return L"";
+        }
+
+        tuned.tasker_ptr->setActiveLimit(newLimit);
+
+        std::wstring str;
+        str += tuned.name;
+        str += L" ";
+        str += std::to_wstring(limit);
+        str += L"->";
+        str += std::to_wstring(newLimit);
+        str += L"  (";
+        str += throughputString(tuned, throughput);
+
+        if (hadPrevSample)
+        {
+            str += L" was ";
+            str += throughputString(tuned, prevThroughput);
+        }
+
+        str += L", ";
+        str += reason;
+        str += L", queued=";
+        str += std::to_wstring(status.queue_size);
+        str += L")";
+
+        return str;
+    }
+
+    std::wstring Autotuner::throughputString(const TunedTasker & tuned, const double throughput)
+    {
+        if (tuned.is_measured_in_bytes)
+        {
+            return (fileSizeToString(static_cast<std::size_t>(throughput)) + L"/s");
+        }
+        else
+        {
+            return (std::to_wstring(std::llround(throughput)) + L"/s");
+        }
+    }
+
+} // namespace backup
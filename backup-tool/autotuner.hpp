@@ -0,0 +1,76 @@
+#ifndef BACKUP_AUTOTUNER_HPP_INCLUDED
+#define BACKUP_AUTOTUNER_HPP_INCLUDED
+//
+// autotuner.hpp
+//
+#include "tasker.hpp"
+#include "util.hpp"
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+namespace backup
+{
+
+    // Adjusts the active limit of each tasker while a job runs, to find how many of each kind of
+    // task should execute at once on whatever hardware this is.  The best mix on an NVMe drive is
+    // nothing like the best mix on a NAS full of spinning disks, so it has to be measured.
+    //
+    // Each tasker is tuned on its own by simple hill climbing:  Every sample period its throughput
+    // is compared to the last sample's, and if it got better the limit keeps moving the same way,
+    // if it got worse the limit moves back the other way, and if it made no real difference then
+    // the limit shrinks, because fewer tasks for the same throughput is better.  Samples are only
+    // taken while a tasker had tasks waiting, because otherwise its throughput is limited by how
+    // fast it is given work, not by its limit.  A tasker's limit is never changed again once a
+    // user has set it with BackupTool::setConcurrency().
+    //
+    // Nothing in here is thread safe, it is only ever used by the thread that called run().
+    class Autotuner
+    {
+        struct TunedTasker
+        {
+            std::wstring name;
+            ITunableTasker * tasker_ptr = nullptr;
+            bool is_measured_in_bytes   = false;
+            int direction               = 1;
+            bool has_prev_sample        = false;
+            double prev_throughput      = 0.0;
+            std::size_t prev_completed  = 0;
+        };
+
+      public:
+        Autotuner(const std::size_t minLimit, const std::size_t maxLimit);
+
+        // throughput is measured in completed bytes/s if isMeasuredInBytes, otherwise tasks/s
+        void add(const std::wstring & name, ITunableTasker & tasker, const bool isMeasuredInBytes);
+
+        // returns a description of every decision made, which might be none, and none are made
+        // unless at least sample_period_ms has passed since the last time this was called
+        std::vector<std::wstring> updateIfTime();
+
+        Clock_t::time_point nextUpdateTime() const;
+
+        std::wstring limitsString() const;
+
+      private:
+        std::wstring update(TunedTasker & tuned, const double elapsedSec);
+
+        static std::wstring throughputString(const TunedTasker & tuned, const double throughput);
+
+      private:
+        static inline constexpr std::size_t sample_period_ms{ 1000 };
+
+        // changes in throughput smaller than this fraction are treated as noise
+        static inline constexpr double noise_fraction{ 0.1 };
+
+        std::size_t m_minLimit;
+        std::size_t m_maxLimit;
+        Clock_t::time_point m_startTime;
+        Clock_t::time_point m_prevSampleTime;
+        std::vector<TunedTasker> m_tunedTaskers;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_AUTOTUNER_HPP_INCLUDED
@@ -9,19 +9,61 @@
 #include "util.hpp"
 
 #include <algorithm>
+#include <chrono>
+#include <future>
+#include <iomanip>
+#include <sstream>
 
 namespace backup
 {
 
     BackupTool::BackupTool(const std::vector<std::string> & args)
+        : BackupTool(args, nullptr)
+    {}
+
+    BackupTool::BackupTool(const std::vector<std::string> & args, Executor & executor)
+        : BackupTool(args, &executor)
+    {}
+
+    BackupTool::BackupTool(const std::vector<std::string> & args, Executor * executorPtr)
         : BaseFileOperations(args)
-        , m_copyTasker(*this, options().thread_counts.copy)
-        , m_removeTasker(*this, options().thread_counts.remove)
-        , m_fileCompareTasker(*this, options().thread_counts.file_compare)
-        , m_dirCompareTasker(*this, options().thread_counts.dir_compare)
+        , m_ownedExecutorUPtr((executorPtr == nullptr) ? std::make_unique<Executor>() : nullptr)
+        , m_executor((executorPtr == nullptr) ? *m_ownedExecutorUPtr : *executorPtr)
+        , m_entryStore()
+        , m_copyTasker(
+              *this,
+              m_entryStore,
+              makeResourceCount(options().thread_counts.copy),
+              options().task_orders.copy,
+              !options().background)
+        , m_removeTasker(
+              *this,
+              m_entryStore,
+              makeResourceCount(options().thread_counts.remove),
+              options().task_orders.remove)
+        , m_fileCompareTasker(
+              *this,
+              m_entryStore,
+              makeResourceCount(options().thread_counts.file_compare),
+              options().task_orders.file_compare,
+              !options().background)
+        , m_dirCompareTasker(
+              *this,
+              m_entryStore,
+              makeResourceCount(options().thread_counts.dir_compare),
+              options().task_orders.dir_compare)
+        , m_autotuner(options().autotune_min, options().autotune_max)
+        , m_peakQueueBytes(0)
+        , m_isHelpedJobFinished(false)
         , m_statusPeriodMs(5000)
         , m_startTime(Clock_t::now()) // intentionally start time after all the resource init
-    {}
+        , m_prevStatusTime(m_startTime)
+        , m_prevFileDeviceBytes()
+        , m_prevCopyDeviceBytes()
+    {
+        setupAutotuner();
+        setupSpillLimits();
+    }
 
     void BackupTool::run()
     {
@@ -31,6 +73,8 @@ namespace backup
         {
             startAndWaitForAllThreadsToFinish();
             handleAnyExceptions();
+            finishDirSnapshots();
+            finishDigestTree();
             wasExceptionError = false;
         }
         catch (const keypress_caused_abort & ex)
@@ -57,6 +101,16 @@ namespace backup
 
         const CounterResults counterResults{ printCounterResults() };
 
+        if (options().verbose)
+        {
+            printLine(
+                L"Queued tasks used at most " + fileSizeToString(m_peakQueueBytes) +
+                L" of memory");
+        }
+
+        printDirSnapshotResults();
+        printDigestTreeResults();
+
         Color resultColor{ Color::Default };
         std::wstring resultStr;
 
@@ -65,7 +119,7 @@ namespace backup
             resultStr   = L"ERROR (something casued the app to abort)";
             resultColor = Color::Red;
         }
-        else if (options().job == Job::Compare)
+        else if ((options().job == Job::Compare) || (options().job == Job::Diff))
         {
             if (counterResults.errors || counterResults.mismatches)
             {
@@ -96,7 +150,7 @@ namespace backup
                 resultColor = Color::Yellow;
             }
         }
-        else // Cull
+        else if (options().job == Job::Cull)
         {
             if (counterResults.errors)
             {
@@ -113,6 +167,51 @@ namespace backup
                 resultStr   = L"No extras to delete!";
                 resultColor = Color::Yellow;
             }
+
+            if (options().trash && counterResults.removes && !options().dry_run)
+            {
+                printLine(
+                    L"Extras were moved into the trash at \"" + pathToWideString(trashRunPath()) +
+                    L"\" (use --purge-trash to delete them for good)");
+            }
+
+            // the dir was made before anything was culled, so don't leave it behind if it's empty
+            if (options().trash && !options().dry_run)
+            {
+                ErrorCode_t errorCodeIgnored;
+                fs::remove(trashRunPath(), errorCodeIgnored);
+            }
+        }
+        else if (options().job == Job::Export)
+        {
+            if (counterResults.errors)
+            {
+                resultStr   = L"FAIL";
+                resultColor = Color::Red;
+            }
+            else
+            {
+                resultStr   = L"Success";
+                resultColor = Color::Green;
+            }
+        }
+        else // Purge
+        {
+            if (counterResults.errors)
+            {
+                resultStr   = L"FAIL";
+                resultColor = Color::Red;
+            }
+            else if (counterResults.removes || options().dry_run)
+            {
+                resultStr   = L"Success";
+                resultColor = Color::Green;
+            }
+            else
+            {
+                resultStr   = L"Trash is already empty!";
+                resultColor = Color::Yellow;
+            }
         }
 
         if (options().dry_run)
@@ -120,7 +219,8 @@ namespace backup
             resultStr += L" (dryrun)";
         }
 
-        if ((options().job != Job::Cull) && (options().skip_file_read))
+        if ((options().job != Job::Cull) && (options().job != Job::Purge) &&
+            (options().job != Job::Export) && (options().skip_file_read))
         {
             resultStr += L" (skip_file_read -which means only file sizes were checked)";
         }
@@ -137,33 +237,394 @@ namespace backup
         }
     }
 
+    void BackupTool::printDirSnapshotResults()
+    {
+        if (!options().snapshot)
+        {
+            return;
+        }
+
+        for (const WhichDir whichDir : { WhichDir::Source, WhichDir::Destination })
+        {
+            const DirSnapshot & snapshot{ dirSnapshots().get(whichDir) };
+            const std::size_t usedCount{ snapshot.usedCount() };
+            const std::size_t dirCount{ usedCount + snapshot.unusedCount() };
+            if (0 == dirCount)
+            {
+                continue;
+            }
+
+            printLine(
+                std::wstring(toString(whichDir)) + L" dir listings reused from the snapshot:  " +
+                std::to_wstring(usedCount) + L" of " + std::to_wstring(dirCount) + L" (" +
+                calcPercentString(usedCount, dirCount) + L")");
+        }
+    }
+
+    void BackupTool::printDigestTreeResults()
+    {
+        const DigestTree & tree{ digestTree() };
+        if (!tree.isOpen())
+        {
+            return;
+        }
+
+        printLine(
+            L"Digests showed " + std::to_wstring(tree.verifiedCount()) +
+            L" files were unchanged without reading them, and " +
+            std::to_wstring(tree.readCount()) + L" were read");
+
+        if (tree.silentChangeCount() > 0)
+        {
+            printLine(
+                L"Warning:  " + std::to_wstring(tree.silentChangeCount()) +
+                    L" files changed since the last run without being touched, see SilentChange "
+                    L"above",
+                Color::Yellow);
+        }
+
+        if (0 == tree.rootDigest())
+        {
+            printLine(L"No Merkle root digest because not everything was found the same");
+        }
+        else
+        {
+            std::wostringstream ss;
+            ss << L"Merkle root digest " << std::hex << std::setw(16) << std::setfill(L'0')
+               << tree.rootDigest();
+
+            if (tree.isRootUnchanged())
+            {
+                ss << L", the same as the last run";
+            }
+
+            printLine(ss.str());
+        }
+
+        const std::vector<PathString_t> & changedKeys{ tree.changedKeys() };
+        if (!changedKeys.empty())
+        {
+            printLine(
+                L"Since the last run the digests changed in " +
+                std::to_wstring(changedKeys.size()) + L" dirs");
+
+            if (options().verbose)
+            {
+                for (const PathString_t & key : changedKeys)
+                {
+                    printLine(L"    " + pathToWideString(options().path_dpair.dst / key));
+                }
+            }
+        }
+    }
+
     void BackupTool::startAndWaitForAllThreadsToFinish()
     {
+        // purging the trash is never urgent, so only this one thread is used to keep it low impact
+        if (options().job == Job::Purge)
+        {
+            purgeTrash();
+            return;
+        }
+
+        // A manifest has to be written in order, so one thread walks the tree, and a diff has
+        // nothing to schedule, so one thread hands out its key ranges.  Either way the executor
+        // threads only help that one thread, see HelperQueue.
+        if ((options().job == Job::Export) || (options().job == Job::Diff))
+        {
+            m_executor.ensureThreadCount(options().thread_counts.file_compare);
+
+            auto helpedFuture{ std::async(std::launch::async, [&]() {
+                if (options().job == Job::Export)
+                {
+                    exportManifest();
+                }
+                else
+                {
+                    diffManifests();
+                }
+
+                m_isHelpedJobFinished = true;
+                m_executor.notifyAll();
+            }) };
+
+            // the taskers are never started, so they have no status worth printing
+            m_executor.run(*this, [&]() {
+                return (Clock_t::now() + std::chrono::milliseconds(m_statusPeriodMs));
+            });
+
+            helpedFuture.get();
+            return;
+        }
+
+        m_executor.ensureThreadCount(maxConcurrentTaskCount());
+
         scheduleDirectoryCompare(
             EntryConstRefDPair_t{ options().entry_dpair.src, options().entry_dpair.dst });
 
         m_fileCompareTasker.start();
-
         m_dirCompareTasker.start();
-        m_dirCompareTasker.waitUntilFinished();
 
-        // copy and remove threads must wait for all dirComparer threads to finish before starting,
+        m_executor.run(*this, [&]() {
+            const Clock_t::time_point nextStatusTime{ printStatusUpdateIfTime() };
+
+            if (!options().autotune)
+            {
+                return nextStatusTime;
+            }
+
+            autotuneIfTime();
+            return std::min(nextStatusTime, m_autotuner.nextUpdateTime());
+        });
+
+        if (options().autotune)
+        {
+            printAutotuneLine(L"Autotune finished with " + m_autotuner.limitsString());
+        }
+    }
+
+    std::size_t BackupTool::concurrency(const TaskType type) const
+    {
+        // clang-format off
+        switch (type)
+        {
+            case TaskType::DirCompare:  { return m_dirCompareTasker.activeLimit(); }
+            case TaskType::FileCompare: { return m_fileCompareTasker.activeLimit(); }
+            case TaskType::Copy:        { return m_copyTasker.activeLimit(); }
+            case TaskType::Remove:      { return m_removeTasker.activeLimit(); }
+            default:                    { return 0; }
+        }
+        // clang-format on
+    }
+
+    void BackupTool::setConcurrency(const TaskType type, const std::size_t count)
+    {
+        // clang-format off
+        switch (type)
+        {
+            case TaskType::DirCompare:  { m_dirCompareTasker.setManualLimit(count); break; }
+            case TaskType::FileCompare: { m_fileCompareTasker.setManualLimit(count); break; }
+            case TaskType::Copy:        { m_copyTasker.setManualLimit(count); break; }
+            case TaskType::Remove:      { m_removeTasker.setManualLimit(count); break; }
+            default:                    { return; }
+        }
+        // clang-format on
+
+        // raising a limit might have added resources, so there might not be enough threads
+        m_executor.ensureThreadCount(maxConcurrentTaskCount());
+    }
+
+    // Copy and remove can never execute at the same time as dir compare (see
+    // updateTaskersFinished()), so this is the most tasks that could ever be executing at once.
+    // The file compare and copy taskers have that many for every device queue they have.
+    std::size_t BackupTool::maxConcurrentTaskCount() const
+    {
+        const std::size_t copyCount{ m_copyTasker.resourceCount() * m_copyTasker.queueCount() };
+
+        return (
+            (m_fileCompareTasker.resourceCount() * m_fileCompareTasker.queueCount()) +
+            std::max(
+                m_dirCompareTasker.resourceCount(),
+                std::max(copyCount, m_removeTasker.resourceCount())));
+    }
+
+    // the autotuner can only raise a tasker's limit as high as its resource count
+    std::size_t BackupTool::makeResourceCount(const std::size_t threadCount) const
+    {
+        if (options().autotune && (threadCount > 0))
+        {
+            return std::max(threadCount, options().autotune_max);
+        }
+        else
+        {
+            return threadCount;
+        }
+    }
+
+    void BackupTool::setupAutotuner()
+    {
+        if (!options().autotune)
+        {
+            return;
+        }
+
+        // start at the usual thread counts, see makeResourceCount()
+        m_dirCompareTasker.setActiveLimit(options().thread_counts.dir_compare);
+        m_fileCompareTasker.setActiveLimit(options().thread_counts.file_compare);
+        m_copyTasker.setActiveLimit(options().thread_counts.copy);
+        m_removeTasker.setActiveLimit(options().thread_counts.remove);
+
+        // file compares that skip reading are too quick for their bytes to mean anything
+        const bool isFileCompareMeasuredInBytes{ !options().skip_file_read };
+
+        auto addIfUsed =
+            [&](const std::wstring & name, ITunableTasker & tasker, const bool inBytes) {
+                if (tasker.resourceCount() > 0)
+                {
+                    m_autotuner.add(name, tasker, inBytes);
+                }
+            };
+
+        addIfUsed(L"Dirs", m_dirCompareTasker, false);
+        addIfUsed(L"Files", m_fileCompareTasker, isFileCompareMeasuredInBytes);
+        addIfUsed(L"Copies", m_copyTasker, true);
+        addIfUsed(L"Deletes", m_removeTasker, false);
+
+        printAutotuneLine(
+            L"Autotune starting with " + m_autotuner.limitsString() + L" and bounds [" +
+            std::to_wstring(options().autotune_min) + L", " +
+            std::to_wstring(options().autotune_max) + L"]");
+    }
+
+    // each queue spills once it uses its share of the memory budget, see isOverQueueMemoryBudget()
+    void BackupTool::setupSpillLimits()
+    {
+        if (0 == options().queue_memory_mb)
+        {
+            return;
+        }
+
+        const std::size_t limitBytes{ (options().queue_memory_mb * 1024 * 1024) / 4 };
+
+        m_dirCompareTasker.setSpillLimit(limitBytes, options().spill_dir);
+        m_fileCompareTasker.setSpillLimit(limitBytes, options().spill_dir);
+        m_copyTasker.setSpillLimit(limitBytes, options().spill_dir);
+        m_removeTasker.setSpillLimit(limitBytes, options().spill_dir);
+    }
+
+    void BackupTool::autotuneIfTime()
+    {
+        for (const std::wstring & decision : m_autotuner.updateIfTime())
+        {
+            printAutotuneLine(decision);
+        }
+    }
+
+    // every autotune decision always goes in the logfile so that runs can be reproduced
+    void BackupTool::printAutotuneLine(const std::wstring & str)
+    {
+        if (options().verbose)
+        {
+            printLine(str, Color::Gray);
+        }
+        else
+        {
+            printLineToLogfileOnly(str);
+        }
+    }
+
+    bool BackupTool::executeAnyTask(const std::size_t workerIndex)
+    {
+        if (willAbort())
+        {
+            return false;
+        }
+
+        try
+        {
+            // these are parts of a task that is already executing, so they come first
+            if (helperQueue().tryHelp())
+            {
+                return true;
+            }
+
+            // Each thread starts looking in a different tasker so that they spread out over all
+            // the kinds of tasks, but any thread will take any task that is ready.  The resource
+            // counts of each tasker are what limit how many of each can execute at once.
+            for (std::size_t i{ 0 }; i < 4; ++i)
+            {
+                // clang-format off
+                bool wasTaskExecuted{ false };
+                switch ((workerIndex + i) % 4)
+                {
+                    case 0:  { wasTaskExecuted = m_fileCompareTasker.tryExecuteTask(); break; }
+                    case 1:  { wasTaskExecuted = m_dirCompareTasker.tryExecuteTask(); break; }
+                    case 2:  { wasTaskExecuted = m_copyTasker.tryExecuteTask(); break; }
+                    default: { wasTaskExecuted = m_removeTasker.tryExecuteTask(); break; }
+                }
+                // clang-format on
+
+                if (wasTaskExecuted)
+                {
+                    return true;
+                }
+            }
+
+            updateTaskersFinished();
+        }
+        catch (...)
+        {
+            addSubThreadException(std::current_exception());
+        }
+
+        return false;
+    }
+
+    bool BackupTool::isAnyTaskReady() const
+    {
+        return (
+            m_fileCompareTasker.isReadyToExecute() || m_dirCompareTasker.isReadyToExecute() ||
+            m_copyTasker.isReadyToExecute() || m_removeTasker.isReadyToExecute() ||
+            helperQueue().isAnyWaiting());
+    }
+
+    bool BackupTool::isFinished() const
+    {
+        if (haveAnyExceptionsBeenThrown())
+        {
+            return true;
+        }
+
+        if ((options().job == Job::Export) || (options().job == Job::Diff))
+        {
+            return m_isHelpedJobFinished;
+        }
+
+        return (
+            m_dirCompareTasker.isFinished() && m_fileCompareTasker.isFinished() &&
+            m_copyTasker.isFinished() && m_removeTasker.isFinished());
+    }
+
+    void BackupTool::updateTaskersFinished()
+    {
+        // copy and remove tasks must wait for all dir compare tasks to finish before starting,
         // because they will change directory contents while other threads are iterating over them
-        m_copyTasker.start();
-        m_removeTasker.start();
+        if (m_dirCompareTasker.updateIsFinished())
+        {
+            m_copyTasker.start();
+            m_removeTasker.start();
+        }
+
+        m_fileCompareTasker.updateIsFinished();
+        m_copyTasker.updateIsFinished();
+        m_removeTasker.updateIsFinished();
+    }
 
-        m_fileCompareTasker.waitUntilFinished();
+    // also keeps track of the most memory the queues ever used
+    std::size_t BackupTool::queueBytesTotal()
+    {
+        const std::size_t total{ m_dirCompareTasker.queueBytes() +
+                                 m_fileCompareTasker.queueBytes() + m_copyTasker.queueBytes() +
+                                 m_removeTasker.queueBytes() };
+
+        std::size_t peak{ m_peakQueueBytes.load() };
+        while ((total > peak) && !m_peakQueueBytes.compare_exchange_weak(peak, total))
+        {
+        }
 
-        m_copyTasker.waitUntilFinished();
-        m_removeTasker.waitUntilFinished();
+        return total;
     }
 
-    void BackupTool::notifyAll()
+    bool BackupTool::isOverQueueMemoryBudget()
     {
-        m_fileCompareTasker.notifyAll();
-        m_dirCompareTasker.notifyAll();
-        m_copyTasker.notifyAll();
-        m_removeTasker.notifyAll();
+        const std::size_t total{ queueBytesTotal() };
+
+        if (0 == options().queue_memory_mb)
+        {
+            return false;
+        }
+
+        return (total > (options().queue_memory_mb * 1024 * 1024));
     }
 
     void BackupTool::scheduleFileCompare(const EntryConstRefDPair_t & entryDPair)
@@ -176,9 +637,10 @@ namespace backup
         m_dirCompareTasker.enqueue(entryDPair);
     }
 
-    void BackupTool::scheduleFileCopy(const EntryConstRefDPair_t & entryDPair)
+    void BackupTool::scheduleFileCopy(
+        const EntryConstRefDPair_t & entryDPair, const EntryHandle_t handle)
     {
-        m_copyTasker.enqueue(entryDPair);
+        m_copyTasker.enqueue(entryDPair, handle);
     }
 
     void BackupTool::scheduleFileRemove(const EntryConstRefDPair_t & entryDPair)
@@ -186,12 +648,15 @@ namespace backup
         m_removeTasker.enqueue(entryDPair);
     }
 
-    void BackupTool::printStatusUpdateIfTime()
+    Clock_t::time_point BackupTool::printStatusUpdateIfTime()
     {
+        // returns the time when this should be called again, which is always in the future
         if ((elapsedCountMs(m_startTime) < m_statusPeriodMs) ||
             (elapsedCountMs(lastPrintTime()) < m_statusPeriodMs))
         {
-            return;
+            return (
+                std::max(m_startTime, lastPrintTime()) +
+                std::chrono::milliseconds(m_statusPeriodMs));
         }
 
         // wait three seconds longer between consecutive status prints
@@ -207,10 +672,15 @@ namespace backup
         const TaskQueueStatus copyStatus{ m_copyTasker.status() };
         const TaskQueueStatus removeStatus{ m_removeTasker.status() };
 
+        // after printing, the next status time is always measured from now, even if quiet
+        // prevents printLine() from changing lastPrintTime()
+        const Clock_t::time_point nextTimeAfterPrint{ Clock_t::now() +
+                                                      std::chrono::milliseconds(m_statusPeriodMs) };
+
         if (m_dirCompareTasker.isFinished() && m_fileCompareTasker.isFinished() &&
             m_copyTasker.isFinished() && m_removeTasker.isFinished())
         {
-            return;
+            return nextTimeAfterPrint;
         }
 
         const std::wstring dirProgressStr{ std::to_wstring(dirStatus.completed_count) };
@@ -308,12 +778,88 @@ namespace backup
         streamTaskQueueStatus(
             L"Deletes", removeStatus, removePrevCompletedCount, removeProgressStr);
 
+        const std::size_t queueBytes{ queueBytesTotal() };
+        if (queueBytes > 0)
+        {
+            ss << L", queued_memory=" << fileSizeToString(queueBytes);
+        }
+
+        const std::size_t spilledCount{ dirStatus.spilled_count + fileStatus.spilled_count +
+                                        copyStatus.spilled_count + removeStatus.spilled_count };
+
+        if (spilledCount > 0)
+        {
+            ss << L", spilled_to_disk=" << spilledCount;
+        }
+
+        const double elapsedSec{ static_cast<double>(elapsedCountMs(m_prevStatusTime)) / 1000.0 };
+        m_prevStatusTime = Clock_t::now();
+
+        ss << deviceThroughputString(
+            L"Files", m_fileCompareTasker, elapsedSec, m_prevFileDeviceBytes);
+
+        ss << deviceThroughputString(L"Copies", m_copyTasker, elapsedSec, m_prevCopyDeviceBytes);
+
         printLine(ss.str(), Color::Gray);
 
         dirPrevCompletedCount    = dirStatus.completed_count;
         filePrevCompletedCount   = fileStatus.completed_count;
         copyPrevCompletedCount   = copyStatus.completed_count;
         removePrevCompletedCount = removeStatus.completed_count;
+
+        return nextTimeAfterPrint;
+    }
+
+    // Something like ", Files_by_device=[8:1>8:17 120M/s, 8:1>8:33 2.1M/s]", but only once a
+    // tasker has more than one device queue, and only for the queues that are doing anything.
+    template <typename Tasker_t>
+    std::wstring BackupTool::deviceThroughputString(
+        const std::wstring & name,
+        const Tasker_t & tasker,
+        const double elapsedSec,
+        std::vector<std::size_t> & prevCompletedBytes) const
+    {
+        const std::size_t count{ tasker.queueCount() };
+        if ((count < 2) || (elapsedSec <= 0.0))
+        {
+            return L"";
+        }
+
+        prevCompletedBytes.resize(count, 0);
+
+        auto deviceStr = [](const std::uint64_t device) {
+            return ((0 == device) ? std::wstring(L"?") : deviceToString(device));
+        };
+
+        std::wstring str;
+        for (std::size_t i{ 0 }; i < count; ++i)
+        {
+            const TaskQueueStatus status{ tasker.status(i) };
+
+            const std::size_t bytes{ status.completed_bytes -
+                                     std::min(status.completed_bytes, prevCompletedBytes[i]) };
+
+            prevCompletedBytes[i] = status.completed_bytes;
+
+            if ((0 == bytes) && status.isDone())
+            {
+                continue;
+            }
+
+            const DeviceDPair_t & devices{ tasker.devices(i) };
+            const double bytesPerSec{ static_cast<double>(bytes) / elapsedSec };
+
+            str += ((str.empty()) ? L"" : L", ");
+            str += deviceStr(devices.src) + L">" + deviceStr(devices.dst) + L" ";
+            str += fileSizeToString(static_cast<std::size_t>(bytesPerSec)) + L"/s";
+        }
+
+        if (str.empty())
+        {
+            return L"";
+        }
+
+        return (L", " + name + L"_by_device=[" + str + L"]");
     }
 
 } // namespace backup
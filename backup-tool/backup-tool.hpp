@@ -3,18 +3,31 @@
 //
 // backup-tool.hpp
 //
+#include "autotuner.hpp"
 #include "base-file-operations.hpp"
+#include "executor.hpp"
 #include "tasker.hpp"
 
+#include <atomic>
+#include <memory>
+#include <string>
+#include <vector>
+
 namespace backup
 {
 
     class BackupTool
         : public BaseFileOperations
         , public IBackupContext
+        , public IExecutorJob
     {
       public:
+        // makes its own Executor that only lives as long as this object
         BackupTool(const std::vector<std::string> & args);
+
+        // uses the given Executor's threads, and adds more threads to it if it needs to
+        BackupTool(const std::vector<std::string> & args, Executor & executor);
+
         virtual ~BackupTool() = default;
 
         void run();
@@ -33,19 +46,61 @@ namespace backup
 
         const TaskQueueStatus removeTaskerStatus() const { return m_removeTasker.status(); }
 
+        // These can be called from any thread at any time, even while run() is executing.  Setting
+        // a concurrency also stops --autotune from changing it for the rest of the run.
+        std::size_t concurrency(const TaskType type) const;
+        void setConcurrency(const TaskType type, const std::size_t count);
+
       private:
+        // if executorPtr is null then this object makes and owns its own Executor
+        BackupTool(const std::vector<std::string> & args, Executor * executorPtr);
+
         void printFinalResults(const bool didAbortEarly);
+        void printDirSnapshotResults();
+        void printDigestTreeResults();
         void startAndWaitForAllThreadsToFinish();
 
         void scheduleFileCompare(const EntryConstRefDPair_t & entryDPair) override;
         void scheduleDirectoryCompare(const EntryConstRefDPair_t & entryDPair) override;
-        void scheduleFileCopy(const EntryConstRefDPair_t & entryDPair) override;
+        void scheduleFileCopy(
+            const EntryConstRefDPair_t & entryDPair, const EntryHandle_t handle) override;
         void scheduleFileRemove(const EntryConstRefDPair_t & entryDPair) override;
+        void notifyHelpers() override { m_executor.notifyAll(); }
+
+        void updateTaskersFinished();
+        Clock_t::time_point printStatusUpdateIfTime();
+        std::size_t makeResourceCount(const std::size_t threadCount) const;
+        std::size_t maxConcurrentTaskCount() const;
+        void setupAutotuner();
+        void setupSpillLimits();
+        void autotuneIfTime();
+        void printAutotuneLine(const std::wstring & str);
+        std::size_t queueBytesTotal();
+
+        template <typename Tasker_t>
+        std::wstring deviceThroughputString(
+            const std::wstring & name,
+            const Tasker_t & tasker,
+            const double elapsedSec,
+            std::vector<std::size_t> & prevCompletedBytes) const;
+
+        // all functions below are IExecutorJob interface functions
+        bool executeAnyTask(const std::size_t workerIndex) override;
+        bool isAnyTaskReady() const override;
+        bool isFinished() const override;
 
         // all functions below are IBackupContext interface functions
-        void notifyAll() override;
+        void notifyOne() override { m_executor.notifyOne(); }
+        void notifyAll() override { m_executor.notifyAll(); }
 
         bool willAbort() override { return haveAnyExceptionsBeenThrown(); }
+        bool isOverQueueMemoryBudget() override;
+
+        // each queue has its own resources, so there might not be enough threads anymore
+        void onDeviceQueueAdded() override
+        {
+            m_executor.ensureThreadCount(maxConcurrentTaskCount());
+        }
 
         FileCompareTasker & fileCompareTasker() override { return m_fileCompareTasker; }
         DirectoryCompareTasker & directoryCompareTasker() override { return m_dirCompareTasker; }
@@ -63,16 +118,28 @@ namespace backup
             return compareFileContents(res);
         }
 
-        void printStatusUpdateIfTime() override;
-
       private:
+        std::unique_ptr<Executor> m_ownedExecutorUPtr;
+        Executor & m_executor;
+
+        EntryStore m_entryStore;
         CopyTasker m_copyTasker;
         RemoveTasker m_removeTasker;
         FileCompareTasker m_fileCompareTasker;
         DirectoryCompareTasker m_dirCompareTasker;
+        Autotuner m_autotuner;
+        std::atomic<std::size_t> m_peakQueueBytes;
+
+        // set once exportManifest() or diffManifests() returns, since they have no tasks to finish
+        std::atomic<bool> m_isHelpedJobFinished;
 
         std::size_t m_statusPeriodMs;
         const Clock_t::time_point m_startTime;
+
+        // for the throughput of each device queue in the status updates
+        Clock_t::time_point m_prevStatusTime;
+        std::vector<std::size_t> m_prevFileDeviceBytes;
+        std::vector<std::size_t> m_prevCopyDeviceBytes;
     };
 
 } // namespace backup
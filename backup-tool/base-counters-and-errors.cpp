@@ -104,7 +104,7 @@ namespace backup
     void BaseCountersAndErrors::printAndCountMismatch(
         const Mismatch mismatch, const Entry & entry, const std::wstring & message)
     {
-        if (options().job == Job::Compare)
+        if ((options().job == Job::Compare) || (options().job == Job::Diff))
         {
             printEntryEvent(L"Mismatch", toString(mismatch), entry, message, Color::Yellow);
         }
@@ -151,7 +151,7 @@ namespace backup
             }
         };
 
-        if (options().job == Job::Compare)
+        if ((options().job == Job::Compare) || (options().job == Job::Diff))
         {
             printCounterSummary(m_srcTreeCounter);
             printCounterSummary(m_dstTreeCounter);
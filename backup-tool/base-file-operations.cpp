@@ -5,12 +5,18 @@
 //
 #include "base-file-operations.hpp"
 
+#include "content-digest.hpp"
 #include "str-util.hpp"
 #include "util.hpp"
 
 #include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <ctime>
 #include <future>
+#include <iomanip>
+#include <iterator>
+#include <stdexcept>
 
 namespace backup
 {
@@ -18,21 +24,99 @@ namespace backup
     BaseFileOperations::BaseFileOperations(const std::vector<std::string> & args)
         : BaseCountersAndErrors(args)
         , m_subThreadExceptions()
-    {}
+        , m_trashRunPath(makeTrashRunPath())
+        , m_maxListedEntryCount(makeMaxListedEntryCount())
+        , m_helperQueue()
+        , m_hardLinks()
+        , m_digestTree()
+        , m_manifestReader()
+        , m_dirSnapshots()
+    {
+        // the limit is for the whole process, so only the first of these to be made sets it
+        if (DirFd::keptLimit() == 0)
+        {
+            DirFd::setKeptLimit(DirFd::makeDefaultKeptLimit());
+        }
+
+        // A run that doesn't stat every file (i.e. --cull) can use a snapshot but can't make one,
+        // and a dry run never writes anything into dst.
+        if (options().snapshot && (options().job != Job::Purge))
+        {
+            const bool willWrite{ !options().dry_run && options().metadata_needs.file_size };
+
+            for (const WhichDir whichDir : { WhichDir::Source, WhichDir::Destination })
+            {
+                std::wstring warning;
+                if (!m_dirSnapshots.get(whichDir).open(
+                        whichDir,
+                        options().path_dpair.get(whichDir),
+                        DirSnapshot::makePath(options().path_dpair.dst, whichDir),
+                        willWrite,
+                        warning))
+                {
+                    printLine((L"Warning:  " + warning), Color::Yellow);
+                }
+            }
+        }
+
+        if (options().digests)
+        {
+            std::wstring warning;
+            if (!m_digestTree.open(
+                    options().path_dpair,
+                    DigestTree::makePath(options().path_dpair.dst),
+                    !options().dry_run,
+                    warning))
+            {
+                printLine((L"Warning:  " + warning), Color::Yellow);
+            }
+        }
+
+        if (options().isDstManifest())
+        {
+            std::wstring error;
+            if (!m_manifestReader.open(options().manifest_path, error))
+            {
+                printLine((L"Error: " + error), Color::Red);
+                throw silent_runtime_error();
+            }
+        }
+    }
+
+    void BaseFileOperations::finishDirSnapshots()
+    {
+        for (const WhichDir whichDir : { WhichDir::Source, WhichDir::Destination })
+        {
+            std::wstring error;
+            if (!m_dirSnapshots.get(whichDir).finish(error))
+            {
+                printLine((L"Warning:  " + error), Color::Yellow);
+            }
+        }
+    }
+
+    void BaseFileOperations::finishDigestTree()
+    {
+        std::wstring error;
+        if (!m_digestTree.finish(error))
+        {
+            printLine((L"Warning:  " + error), Color::Yellow);
+        }
+    }
 
     bool BaseFileOperations::copy(CopyTaskResources & resources)
     {
         try
         {
-            const EntryConstRefDPair_t entryDPair{ resources.entry_dpair.src,
-                                                   resources.entry_dpair.dst };
+            const EntryConstRefDPair_t entryDPair{ resources.entryDPair().src,
+                                                   resources.entryDPair().dst };
 
             assert(entryDPair.src.which_dir == WhichDir::Source);
             assert(entryDPair.dst.which_dir == WhichDir::Destination);
-            assert(!entryDPair.src.path.empty() && !entryDPair.dst.path.empty());
+            assert(!entryDPair.src.isEmpty() && !entryDPair.dst.isEmpty());
             assert(entryDPair.src.is_file == entryDPair.dst.is_file);
 
-            const bool alreadyExists{ existsIgnoringErrors(entryDPair.dst.path, false) };
+            const bool alreadyExists{ existsIgnoringErrors(entryDPair.dst, false) };
             if (alreadyExists)
             {
                 if (!remove(resources))
@@ -81,11 +165,20 @@ namespace backup
     {
         try
         {
-            const auto & entry{ resources.entry_dpair.dst };
+            const auto & entry{ resources.entryDPair().dst };
 
-            assert(!entry.path.empty());
+            assert(!entry.isEmpty());
             assert(entry.which_dir == WhichDir::Destination);
 
+            // if the job didn't list the sizes of files then only the removed ones are looked up
+            const bool willLookUpSize{ entry.is_file && !options().metadata_needs.file_size };
+            Entry sizedEntry;
+            if (willLookUpSize)
+            {
+                sizedEntry      = entry;
+                sizedEntry.size = fileSizeIgnoringErrors(entry);
+            }
+
             std::wstring detailStr{ L"(" };
 
             if (options().dry_run)
@@ -94,30 +187,51 @@ namespace backup
             }
             else
             {
-                assert(existsIgnoringErrors(entry.path, true));
+                // a link to nothing doesn't exist, but is only listed when link targets aren't
+                assert(
+                    existsIgnoringErrors(entry, true) || !options().metadata_needs.link_target);
 
-                ErrorCode_t errorCodeRemove;
-                const auto removedCount{ fs::remove_all(entry.path, errorCodeRemove) };
-                if (!printAndCountErrorCodeIf(errorCodeRemove, Error::Remove, entry))
+                bool wasMovedToTrash{ false };
+                if (options().trash && !moveToTrash(entry, wasMovedToTrash))
                 {
                     return false;
                 }
 
-                if (removedCount == 0)
+                if (wasMovedToTrash)
                 {
-                    printAndCountError(Error::Remove, entry, L"remove_all() returned zero");
-                    return false;
+                    detailStr += L"Trash";
                 }
+                else
+                {
+                    const DirFd & dirFd{ entry.dirFd() };
+
+                    ErrorCode_t errorCodeRemove;
+                    const auto removedCount{
+                        (dirFd.isOpen())
+                            ? dirFd.removeAllAt(entry.name(), entry.is_file, errorCodeRemove)
+                            : fs::remove_all(entry.path(), errorCodeRemove)
+                    };
+                    if (!printAndCountErrorCodeIf(errorCodeRemove, Error::Remove, entry))
+                    {
+                        return false;
+                    }
+
+                    if (removedCount == 0)
+                    {
+                        printAndCountError(Error::Remove, entry, L"remove_all() returned zero");
+                        return false;
+                    }
 
-                assert(!existsIgnoringErrors(entry.path, false));
+                    detailStr += L"x";
+                    detailStr += std::to_wstring(removedCount);
+                }
 
-                detailStr += L"x";
-                detailStr += std::to_wstring(removedCount);
+                assert(!existsIgnoringErrors(entry, false));
             }
 
             detailStr += L")";
             printEntryEvent(L"Deleted", detailStr, entry);
-            countRemove(entry);
+            countRemove((willLookUpSize) ? sizedEntry : entry);
             return true;
         }
         catch (...)
@@ -136,12 +250,18 @@ namespace backup
                 return true;
             }
 
-            const EntryConstRefDPair_t entryDPair{ resources.entry_dpair.src,
-                                                   resources.entry_dpair.dst };
+            // a manifest has nothing to open, so its dst file never is
+            if (m_manifestReader.isOpen())
+            {
+                return compareFileToManifest(resources);
+            }
+
+            const EntryConstRefDPair_t entryDPair{ resources.entryDPair().src,
+                                                   resources.entryDPair().dst };
 
             auto & fileDPair{ resources.file_dpair };
 
-            assert(!entryDPair.src.path.empty() && !entryDPair.dst.path.empty());
+            assert(!entryDPair.src.isEmpty() && !entryDPair.dst.isEmpty());
             assert(entryDPair.src.is_file);
             assert(entryDPair.dst.is_file);
             assert(entryDPair.src.size > 0);
@@ -150,23 +270,53 @@ namespace backup
             assert(entryDPair.src.which_dir == WhichDir::Source);
             assert(entryDPair.dst.which_dir == WhichDir::Destination);
 
-            if (!printAndCountStreamErrorIf(fileDPair.src.stream, Error::Open, entryDPair.src))
+            // only one link to the same files reads them, and the rest wait for what it found
+            HardLinks::CompareClaim compareClaim(m_hardLinks, entryDPair.src, entryDPair.dst);
+
+            if (compareClaim.known() == HardLinks::Compared::Same)
+            {
+                return true;
+            }
+
+            if (compareClaim.known() == HardLinks::Compared::Different)
+            {
+                resources.teardown();
+                handleMismatch(Mismatch::Modified, entryDPair, L"", resources.entry_handle);
+                return false;
+            }
+
+            if (!printAndCountFileErrorIf(fileDPair.src, Error::Open, entryDPair.src))
             {
                 return false;
             }
 
-            if (!printAndCountStreamErrorIf(fileDPair.dst.stream, Error::Open, entryDPair.dst))
+            if (!printAndCountFileErrorIf(fileDPair.dst, Error::Open, entryDPair.dst))
             {
                 return false;
             }
 
+            // counted here so that the files found different are counted as read too
+            if (m_digestTree.isOpen())
+            {
+                m_digestTree.countVerify(true);
+            }
+
+            // stamped before reading, so any change made while reading is seen by the next run
+            DigestTree::FileDigest fileDigest;
+            ContentDigest contentDigest;
+            const bool willDigest{ m_digestTree.isOpen() &&
+                                   stampFile(entryDPair.src, fileDigest.src_stamp) &&
+                                   stampFile(entryDPair.dst, fileDigest.dst_stamp) };
+
+            const IoProfile & ioProfile{ options().io_profile };
+
             std::size_t remainingSize{ entryDPair.src.size };
-            std::size_t readSize{ std::min(remainingSize, FileReadResources::min_read_size) };
+            std::size_t readSize{ std::min(remainingSize, ioProfile.min_read_size) };
 
             while (remainingSize > 0)
             {
                 assert(readSize <= remainingSize);
-                assert(readSize <= FileReadResources::max_read_size);
+                assert(readSize <= ioProfile.max_read_size);
 
                 // start to read src file with new thread
                 auto srcReadFuture{ std::async(
@@ -201,18 +351,25 @@ namespace backup
                     // file so our file might still be open when another thread tries to copy or
                     // delete it so we must teardown now before calling handleMismatch() and we must
                     // be sure to simply return afterwards and not use resources after
+                    compareClaim.finish(HardLinks::Compared::Different);
                     resources.teardown();
-                    handleMismatch(Mismatch::Modified, entryDPair);
+                    handleMismatch(
+                        Mismatch::Modified, entryDPair, L"", resources.entry_handle);
                     return false;
                 }
 
+                if (willDigest)
+                {
+                    contentDigest.add(&fileDPair.src.buffer[0], readSize);
+                }
+
                 remainingSize -= readSize;
 
                 readSize *= 2;
 
-                if (readSize > FileReadResources::max_read_size)
+                if (readSize > ioProfile.max_read_size)
                 {
-                    readSize = FileReadResources::max_read_size;
+                    readSize = ioProfile.max_read_size;
                 }
 
                 if (readSize > remainingSize)
@@ -221,6 +378,15 @@ namespace backup
                 }
             }
 
+            compareClaim.finish(HardLinks::Compared::Same);
+
+            if (willDigest)
+            {
+                fileDigest.size   = entryDPair.src.size;
+                fileDigest.digest = contentDigest.value();
+                addFileDigest(entryDPair.dst, fileDigest);
+            }
+
             return true;
         }
         catch (...)
@@ -236,30 +402,50 @@ namespace backup
         {
             // don't exit early here even if dry run so that we can verify the directory traversal
 
-            assert(resources.entry_dpair.src.which_dir == WhichDir::Source);
-            assert(!resources.entry_dpair.src.is_file);
-            assert(!resources.entry_dpair.src.path.empty());
-            assert(resources.entry_dpair.src.size == 0);
+            assert(resources.entryDPair().src.which_dir == WhichDir::Source);
+            assert(!resources.entryDPair().src.is_file);
+            assert(!resources.entryDPair().src.isEmpty());
+            assert(resources.entryDPair().src.size == 0);
             //
-            assert(resources.entry_dpair.dst.which_dir == WhichDir::Destination);
-            assert(!resources.entry_dpair.dst.is_file);
-            assert(!resources.entry_dpair.dst.path.empty());
-            assert(resources.entry_dpair.dst.size == 0);
+            assert(resources.entryDPair().dst.which_dir == WhichDir::Destination);
+            assert(!resources.entryDPair().dst.is_file);
+            assert(!resources.entryDPair().dst.isEmpty());
+            assert(resources.entryDPair().dst.size == 0);
+
+            // all the Entrys listed from each dir share one of these, see DirNode
+            const DirPair<DirNodePtr_t> dirNodeDPair{
+                std::make_shared<DirNode>(resources.entryDPair().src.path()),
+                std::make_shared<DirNode>(resources.entryDPair().dst.path())
+            };
 
             // start to parse src directory with new thread
             auto srcParseFuture{ std::async(
                 std::launch::async,
                 &BaseFileOperations::makeEntrysForAllInDirectory,
                 this,
-                resources.entry_dpair.src,
+                std::cref(resources.entryDPair().src),
+                std::cref(dirNodeDPair.src),
                 std::ref(resources.file_entrys_dpair.src),
-                std::ref(resources.dir_entrys_dpair.src)) };
+                std::ref(resources.dir_entrys_dpair.src),
+                &resources.file_runs_dpair.src,
+                &resources.dir_runs_dpair.src) };
 
             // start and finish parsing dst directory with this thread now
-            const bool dstParseSuccess{ makeEntrysForAllInDirectory(
-                resources.entry_dpair.dst,
-                resources.file_entrys_dpair.dst,
-                resources.dir_entrys_dpair.dst) };
+            const bool dstParseSuccess{ (m_manifestReader.isOpen())
+                                            ? makeEntrysFromManifest(
+                                                  resources.entryDPair().dst,
+                                                  dirNodeDPair.dst,
+                                                  resources.file_entrys_dpair.dst,
+                                                  resources.dir_entrys_dpair.dst,
+                                                  &resources.file_runs_dpair.dst,
+                                                  &resources.dir_runs_dpair.dst)
+                                            : makeEntrysForAllInDirectory(
+                                                  resources.entryDPair().dst,
+                                                  dirNodeDPair.dst,
+                                                  resources.file_entrys_dpair.dst,
+                                                  resources.dir_entrys_dpair.dst,
+                                                  &resources.file_runs_dpair.dst,
+                                                  &resources.dir_runs_dpair.dst) };
 
             // wait for the src parse thread to finish
             const bool srcParseSuccess{ srcParseFuture.get() };
@@ -269,19 +455,36 @@ namespace backup
                 return false;
             }
 
+            const std::size_t srcFileCount{ resources.file_entrys_dpair.src.size() +
+                                             resources.file_runs_dpair.src.entryCount() };
+
+            const std::size_t srcDirCount{ resources.dir_entrys_dpair.src.size() +
+                                           resources.dir_runs_dpair.src.entryCount() };
+
+            if (m_digestTree.isOpen())
+            {
+                PathString_t digestKey;
+                if (m_digestTree.makeKey(resources.entryDPair().dst.path(), digestKey))
+                {
+                    m_digestTree.addDir(digestKey, srcFileCount, srcDirCount);
+                }
+            }
+
             const bool areAnyFilesToCompare{ !resources.file_entrys_dpair.src.empty() ||
-                                             !resources.file_entrys_dpair.dst.empty() };
+                                             !resources.file_entrys_dpair.dst.empty() ||
+                                             !resources.file_runs_dpair.src.isEmpty() ||
+                                             !resources.file_runs_dpair.dst.isEmpty() };
 
             const bool areAnyDirsToCompare{ !resources.dir_entrys_dpair.src.empty() ||
-                                            !resources.dir_entrys_dpair.dst.empty() };
+                                            !resources.dir_entrys_dpair.dst.empty() ||
+                                            !resources.dir_runs_dpair.src.isEmpty() ||
+                                            !resources.dir_runs_dpair.dst.isEmpty() };
 
             if (!areAnyFilesToCompare && !areAnyDirsToCompare)
             {
                 return true;
             }
 
-            const std::size_t srcFileCount{ resources.file_entrys_dpair.src.size() };
-            const std::size_t srcDirCount{ resources.dir_entrys_dpair.src.size() };
             if (options().verbose && (srcFileCount + srcDirCount) >= 5000)
             {
                 std::wostringstream ss;
@@ -293,11 +496,21 @@ namespace backup
                 printWarningEvent(
                     L"BigDir",
                     WhichDir::Source,
-                    resources.entry_dpair.src.is_file,
-                    resources.entry_dpair.src.path.wstring(),
+                    resources.entryDPair().src.is_file,
+                    pathToWideString(resources.entryDPair().src.path()),
                     ss.str());
             }
 
+            // these read any spilled runs back in name order, merged with what is still in memory
+            EntryCursor srcFileCursor(
+                resources.file_entrys_dpair.src, resources.file_runs_dpair.src);
+
+            EntryCursor dstFileCursor(
+                resources.file_entrys_dpair.dst, resources.file_runs_dpair.dst);
+
+            EntryCursor srcDirCursor(resources.dir_entrys_dpair.src, resources.dir_runs_dpair.src);
+            EntryCursor dstDirCursor(resources.dir_entrys_dpair.dst, resources.dir_runs_dpair.dst);
+
             // start to compare file entrys with new thread (if needed)
             std::future<bool> fileComapreFuture;
             if (areAnyFilesToCompare)
@@ -306,9 +519,10 @@ namespace backup
                     std::launch::async,
                     &BaseFileOperations::comparEntrysWithSameType,
                     this,
-                    resources.entry_dpair,
-                    resources.file_entrys_dpair.src,
-                    resources.file_entrys_dpair.dst);
+                    std::cref(resources.entryDPair()),
+                    std::cref(dirNodeDPair.dst),
+                    std::ref(srcFileCursor),
+                    std::ref(dstFileCursor));
             }
 
             // start and finish comparing dir entrys with this thread now (if needed)
@@ -316,9 +530,7 @@ namespace backup
             if (areAnyDirsToCompare)
             {
                 dirCompareSuccess = comparEntrysWithSameType(
-                    resources.entry_dpair,
-                    resources.dir_entrys_dpair.src,
-                    resources.dir_entrys_dpair.dst);
+                    resources.entryDPair(), dirNodeDPair.dst, srcDirCursor, dstDirCursor);
             }
 
             // wait for the file parse thread to finish (if needed)
@@ -334,32 +546,49 @@ namespace backup
         }
     }
 
-    void BaseFileOperations::handleAnyExceptions()
-    {
-        printLine(m_subThreadExceptions.makeSummaryString(), Color::Red);
-        m_subThreadExceptions.reThrowFirst();
-    }
-
-    bool BaseFileOperations::fileRead(
-        const Entry & entry, const std::size_t readSize, FileReadResources & resources)
+    bool BaseFileOperations::purgeTrash()
     {
         try
         {
-            assert(entry.is_file);
-            assert(!entry.path.empty());
-            assert(entry.size > 0);
+            const fs::path trashPath{ makeTrashPath(options().path_dpair.dst) };
+            if (!existsIgnoringErrors(trashPath, true))
+            {
+                return true;
+            }
 
-            assert(readSize > 0);
-            assert(readSize <= entry.size);
-            assert(readSize <= resources.buffer.size());
+            // each run that used --trash made its own subdir in here, so delete them one at a time
+            const Entry trashEntry(WhichDir::Destination, false, trashPath, 0);
+
+            EntryVec_t fileEntrys;
+            EntryVec_t dirEntrys;
+            const DirNodePtr_t trashDirNodePtr{ std::make_shared<DirNode>(trashPath) };
+            if (!makeEntrysForAllInDirectory(trashEntry, trashDirNodePtr, fileEntrys, dirEntrys))
+            {
+                return false;
+            }
+
+            EntryDPair_t entryDPair;
+            RemoveTaskResources resources;
+            resources.entry_dpair_ptr = &entryDPair;
+
+            bool wereAnyErrors{ false };
+
+            auto removeTrashEntry = [&](const Entry & entry) {
+                entryDPair.dst = entry;
+                resources.setup();
 
-            assert(!resources.buffer.empty());
-            assert(resources.min_read_size <= resources.max_read_size);
-            assert(resources.stream);
-            assert(resources.stream.is_open());
+                if (!remove(resources))
+                {
+                    wereAnyErrors = true;
+                }
 
-            resources.stream.read(&resources.buffer[0], static_cast<std::streamsize>(readSize));
-            return printAndCountStreamErrorIf(resources.stream, Error::Read, entry);
+                resources.teardown();
+            };
+
+            std::for_each(std::begin(dirEntrys), std::end(dirEntrys), removeTrashEntry);
+            std::for_each(std::begin(fileEntrys), std::end(fileEntrys), removeTrashEntry);
+
+            return !wereAnyErrors;
         }
         catch (...)
         {
@@ -368,224 +597,1462 @@ namespace backup
         }
     }
 
-    bool BaseFileOperations::makeEntrysForAllInDirectory(
-        const Entry & dirEntry, EntryVec_t & fileEntrys, EntryVec_t & dirEntrys)
+    bool BaseFileOperations::exportManifest()
     {
         try
         {
-            assert(!dirEntry.path.empty());
-            assert(!dirEntry.is_file);
-            assert(dirEntry.size == 0);
+            const PathString_t & rootStr{ options().path_dpair.src.native() };
 
-            ErrorCode_t errorCodeMakeDirIter;
-            fs::directory_iterator iter(dirEntry.path, errorCodeMakeDirIter);
-            if (!printAndCountErrorCodeIf(errorCodeMakeDirIter, Error::DirIterMake, dirEntry))
+            std::wstring error;
+            ManifestWriter writer;
+            if (!options().dry_run && !writer.open(options().manifest_path, rootStr, error))
             {
-                return false;
+                throw std::runtime_error(strutil::toNarrowString(error));
             }
 
-            const fs::directory_iterator iterEnd;
+            // Dirs are taken from the back, and the subdirs of each are put back in reverse, so
+            // they are walked in name order, which is the order a manifest has to be in.
+            EntryVec_t dirStack{ options().entry_dpair.src };
+
+            std::vector<ManifestEntry> manifestEntrys;
+            std::size_t dirCount{ 0 };
+            std::size_t entryCount{ 0 };
 
-            while (iter != iterEnd)
+            while (!dirStack.empty())
             {
-                makeAndStoreEntry(dirEntry.which_dir, *iter, fileEntrys, dirEntrys);
-                incrementDirectoryIterator(dirEntry, iter);
-            }
+                const Entry dirEntry{ std::move(dirStack.back()) };
+                dirStack.pop_back();
 
-            // sorting by name is required by comparEntrysWithSameType()
-            // processing things in alphabetical order also helps the app behave in the expected way
-            auto sortEntrysByName = [](EntryVec_t & vec) {
-                if (vec.size() < 2)
+                const fs::path dirPath{ dirEntry.path() };
+
+                PathString_t key;
+                if (!makeRelativeKey(WhichDir::Source, rootStr, dirPath, key))
                 {
-                    return;
+                    continue;
                 }
 
-                std::sort(std::begin(vec), std::end(vec), [](const auto & A, const auto & B) {
-                    return (A.name < B.name);
-                });
-            };
+                // a dir that can't be listed isn't in the manifest, so it can't match anything
+                EntryVec_t fileEntrys;
+                EntryVec_t dirEntrys;
+                const DirNodePtr_t dirNodePtr{ std::make_shared<DirNode>(dirPath) };
+                if (!makeEntrysForAllInDirectory(dirEntry, dirNodePtr, fileEntrys, dirEntrys))
+                {
+                    continue;
+                }
+
+                makeManifestEntrys(fileEntrys, dirEntrys, manifestEntrys);
+
+                if (!options().dry_run && !writer.addDir(key, manifestEntrys, error))
+                {
+                    throw std::runtime_error(strutil::toNarrowString(error));
+                }
 
-            sortEntrysByName(fileEntrys);
-            sortEntrysByName(dirEntrys);
+                ++dirCount;
+                entryCount += manifestEntrys.size();
+
+                dirStack.insert(std::end(dirStack), std::rbegin(dirEntrys), std::rend(dirEntrys));
+            }
+
+            if (!writer.finish(error))
+            {
+                throw std::runtime_error(strutil::toNarrowString(error));
+            }
+
+            printLine(
+                L"The manifest has " + std::to_wstring(dirCount) + L" dirs with " +
+                std::to_wstring(entryCount) + L" files and dirs in them");
 
             return true;
         }
         catch (...)
         {
             m_subThreadExceptions.add(std::current_exception());
+            return false;
         }
-
-        return false;
     }
 
-    bool BaseFileOperations::comparEntrysWithSameType(
-        const EntryDPair_t & parentEntryDPair,
-        const EntryVec_t & srcEntrys,
-        const EntryVec_t & dstEntrys)
+    bool BaseFileOperations::diffManifests()
     {
         try
         {
-            assert(parentEntryDPair.src.which_dir == WhichDir::Source);
-            assert(!parentEntryDPair.src.is_file);
-            assert(!parentEntryDPair.src.path.empty());
-            assert(parentEntryDPair.src.size == 0);
-            //
-            assert(parentEntryDPair.dst.which_dir == WhichDir::Destination);
-            assert(!parentEntryDPair.dst.is_file);
-            assert(!parentEntryDPair.dst.path.empty());
-            assert(parentEntryDPair.dst.size == 0);
-
-            auto srcIter{ std::begin(srcEntrys) };
-            const auto srcIterEnd{ std::end(srcEntrys) };
-
-            auto dstIter{ std::begin(dstEntrys) };
-            const auto dstIterEnd{ std::end(dstEntrys) };
+            DirPair<ManifestReader> readerDPair;
+            for (const WhichDir whichDir : { WhichDir::Source, WhichDir::Destination })
+            {
+                std::wstring error;
+                if (!readerDPair.get(whichDir).open(options().path_dpair.get(whichDir), error))
+                {
+                    throw std::runtime_error(strutil::toNarrowString(error));
+                }
+            }
 
-            const EntryDPair_t emptyEntryDPair{ Entry(WhichDir::Source, false, fs::path(), 0),
-                                                Entry(
-                                                    WhichDir::Destination, false, fs::path(), 0) };
+            // more parts than threads, so one part with a lot in it doesn't leave the rest idle
+            const std::size_t threadCount{ std::max(1_st, options().thread_counts.file_compare) };
+            const std::vector<PathString_t> splitKeys{ readerDPair.src.makeSplitKeys(
+                threadCount * manifest_diff_parts_per_thread) };
 
-            while ((srcIterEnd != srcIter) || (dstIterEnd != dstIter))
+            // A part that throws is counted like any other task, so the rest can tell that the
+            // diff is already useless and skip the work.
+            std::vector<HelperQueue::Part_t> parts;
+            for (std::size_t i{ 0 }; i <= splitKeys.size(); ++i)
             {
-                // only one of these two can possibly be the empty entry
-                const EntryConstRefDPair_t entryDPair{
-                    ((srcIterEnd == srcIter) ? emptyEntryDPair.src : *srcIter),
-                    ((dstIterEnd == dstIter) ? emptyEntryDPair.dst : *dstIter)
-                };
-
-                const int nameCompareResult = [&]() {
-                    if (srcIterEnd == srcIter)
+                parts.push_back([&, i]() {
+                    if (haveAnyExceptionsBeenThrown())
                     {
-                        return 1;
-                    }
-                    else if (dstIterEnd == dstIter)
-                    {
-                        return -1;
+                        return;
                     }
-                    else
-                    {
-                        return entryDPair.src.name.compare(entryDPair.dst.name);
-                    }
-                }();
-
-                if (nameCompareResult > 0)
-                {
-                    // extra case
-
-                    // In this case the src entry is not correct, and actually never could be.  So
-                    // use the src parent dir entry as a subsitute because that will help produce
-                    // better logging information.
-                    handleMismatch(
-                        Mismatch::Extra,
-                        EntryConstRefDPair_t{ parentEntryDPair.src, entryDPair.dst });
-
-                    ++dstIter;
-                }
-                else if (nameCompareResult < 0)
-                {
-                    // missing case
 
-                    if (options().job != Job::Cull)
+                    try
                     {
-                        // In this case the dst entry is not correct and a replacement must be
-                        // created. The dst Entry is created to be exactly the same as the src,
-                        // except for the path. This new dst Entry could be either a file or dir,
-                        // and could either exist or not.
-                        const Entry fixedDstEntry(
-                            WhichDir::Destination,
-                            entryDPair.src.is_file,
-                            (parentEntryDPair.dst.path / entryDPair.src.name),
-                            entryDPair.src.size);
-
-                        handleMismatch(
-                            Mismatch::Missing,
-                            EntryConstRefDPair_t{ entryDPair.src, fixedDstEntry });
+                        diffManifestPart(
+                            readerDPair,
+                            ((0 == i) ? PathStringView_t() : PathStringView_t(splitKeys[i - 1])),
+                            ((splitKeys.size() == i) ? PathStringView_t()
+                                                     : PathStringView_t(splitKeys[i])));
                     }
-
-                    ++srcIter;
-                }
-                else
-                {
-                    // two entrys with same name and same type case
-
-                    if (!entryDPair.src.is_file || (options().job != Job::Cull))
+                    catch (...)
                     {
-                        compareEntrysWithSameTypeAndName(entryDPair);
+                        m_subThreadExceptions.add(std::current_exception());
                     }
-
-                    ++srcIter;
-                    ++dstIter;
-                }
+                });
             }
 
+            m_helperQueue.runAll(parts, [&]() { notifyHelpers(); });
+
             return true;
         }
         catch (...)
         {
             m_subThreadExceptions.add(std::current_exception());
+            return false;
         }
-
-        return false;
     }
 
-    void BaseFileOperations::compareEntrysWithSameTypeAndName(
-        const EntryConstRefDPair_t & entryDPair)
+    void BaseFileOperations::handleAnyExceptions()
     {
-        assert(entryDPair.src.which_dir == WhichDir::Source);
-        assert(entryDPair.dst.which_dir == WhichDir::Destination);
-        assert(!entryDPair.src.path.empty() && !entryDPair.dst.path.empty());
-        assert(entryDPair.src.is_file == entryDPair.dst.is_file);
-        assert(entryDPair.src.name == entryDPair.dst.name);
-        assert(entryDPair.src.extension == entryDPair.dst.extension);
+        printLine(m_subThreadExceptions.makeSummaryString(), Color::Red);
+        m_subThreadExceptions.reThrowFirst();
+    }
 
-        if (entryDPair.src.is_file)
+    bool BaseFileOperations::fileRead(
+        const Entry & entry, const std::size_t readSize, FileReadResources & resources)
+    {
+        try
         {
-            if (entryDPair.src.size == entryDPair.dst.size)
+            assert(entry.is_file);
+            assert(!entry.isEmpty());
+            assert(entry.size > 0);
+
+            assert(readSize > 0);
+            assert(readSize <= entry.size);
+
+            if (resources.buffer.size() < readSize)
             {
-                if (!options().skip_file_read && (entryDPair.src.size > 0))
-                {
-                    scheduleFileCompare(entryDPair);
-                }
+                resources.buffer.resize(readSize);
+            }
+
+            if (resources.is_using_file_fd)
+            {
+                assert(resources.file_fd.isOpen());
+                resources.file_fd.read(&resources.buffer[0], readSize, resources.error_code);
             }
             else
             {
-                handleMismatch(Mismatch::Size, entryDPair);
+                assert(resources.stream);
+                assert(resources.stream.is_open());
+
+                resources.stream.read(
+                    &resources.buffer[0], static_cast<std::streamsize>(readSize));
             }
+
+            return printAndCountFileErrorIf(resources, Error::Read, entry);
         }
-        else
+        catch (...)
         {
-            scheduleDirectoryCompare(entryDPair);
+            m_subThreadExceptions.add(std::current_exception());
+            return false;
         }
     }
 
-    void BaseFileOperations::makeAndStoreEntry(
-        const WhichDir whichDir,
-        const fs::directory_entry & dirEntry,
-        EntryVec_t & fileEntrys,
-        EntryVec_t & dirEntrys)
+    bool BaseFileOperations::printAndCountFileErrorIf(
+        const FileReadResources & resources, const Error error, const Entry & entry)
     {
-        bool isFile{ false };
-        bool hasSize{ false };
-        if (!setTypeOrHandleError(whichDir, dirEntry, isFile, hasSize))
+        if (resources.is_using_file_fd)
         {
-            return;
+            return printAndCountErrorCodeIf(resources.error_code, error, entry);
         }
-
+        else
+        {
+            return printAndCountStreamErrorIf(resources.stream, error, entry);
+        }
+    }
+
+    bool BaseFileOperations::readAndDigestFile(
+        const Entry & entry,
+        FileReadResources & resources,
+        ProgressCounter_t & progress,
+        std::uint64_t & digest)
+    {
+        const IoProfile & ioProfile{ options().io_profile };
+
+        ContentDigest contentDigest;
+        std::size_t remainingSize{ entry.size };
+        std::size_t readSize{ std::min(remainingSize, ioProfile.min_read_size) };
+
+        while (remainingSize > 0)
+        {
+            if (!fileRead(entry, readSize, resources))
+            {
+                return false;
+            }
+
+            contentDigest.add(&resources.buffer[0], readSize);
+            remainingSize -= readSize;
+
+            progress = static_cast<Progress_t>(
+                (static_cast<double>(entry.size - remainingSize) /
+                 static_cast<double>(entry.size)) *
+                100.0);
+
+            readSize = std::min(remainingSize, std::min((readSize * 2), ioProfile.max_read_size));
+        }
+
+        digest = contentDigest.value();
+        return true;
+    }
+
+    bool BaseFileOperations::makeEntrysForAllInDirectory(
+        const Entry & dirEntry,
+        const DirNodePtr_t & dirNodePtr,
+        EntryVec_t & fileEntrys,
+        EntryVec_t & dirEntrys,
+        EntryRuns * const fileRunsPtr,
+        EntryRuns * const dirRunsPtr)
+    {
+        try
+        {
+            assert(!dirEntry.isEmpty());
+            assert(!dirEntry.is_file);
+            assert(dirEntry.size == 0);
+            assert(dirNodePtr);
+
+            // the app's own dir at the top of the dst tree is never compared, see tool_dir_name
+            const bool isDstTopDir{ (WhichDir::Destination == dirEntry.which_dir) &&
+                                    (dirNodePtr->path() == options().path_dpair.dst) };
+
+            const bool canSpill{ (m_maxListedEntryCount > 0) && (nullptr != fileRunsPtr) &&
+                                 (nullptr != dirRunsPtr) };
+
+            auto spillIfTooBig = [&](EntryVec_t & vec, EntryRuns & runs) {
+                if (vec.size() >= m_maxListedEntryCount)
+                {
+                    runs.spill(options().spill_dir, vec);
+                }
+            };
+
+            if (is_dir_fd_supported)
+            {
+                DirFd dirFd;
+                ErrorCode_t errorCodeOpen;
+                dirFd.open(dirEntry.dirFd(), dirEntry.name(), dirNodePtr->path(), errorCodeOpen);
+                if (!printAndCountErrorCodeIf(errorCodeOpen, Error::DirIterMake, dirEntry))
+                {
+                    return false;
+                }
+
+                auto spillIfTooBigBoth = [&]() {
+                    if (canSpill)
+                    {
+                        spillIfTooBig(fileEntrys, *fileRunsPtr);
+                        spillIfTooBig(dirEntrys, *dirRunsPtr);
+                    }
+                };
+
+                // a dir that hasn't changed since the last run isn't listed again, see DirSnapshot
+                DirSnapshot & snapshot{ m_dirSnapshots.get(dirEntry.which_dir) };
+                PathString_t snapshotKey;
+                InodeStamp dirStamp;
+                ErrorCode_t errorCodeStamp;
+                const bool isInSnapshot{ (snapshot.isLoaded() || snapshot.isWriting()) &&
+                                         snapshot.makeKey(dirNodePtr->path(), snapshotKey) &&
+                                         dirFd.stamp(dirStamp, errorCodeStamp) };
+
+                DirSnapshot::DirRecord snapshotRecord;
+                std::vector<DirSnapshot::ListedEntry> snapshotEntrys;
+                const bool wasFound{ isInSnapshot && snapshot.isLoaded() &&
+                                     snapshot.find(snapshotKey, dirStamp, snapshotRecord) &&
+                                     DirSnapshot::readEntrys(snapshotRecord, snapshotEntrys) };
+
+                if (isInSnapshot && snapshot.isLoaded())
+                {
+                    snapshot.countUse(wasFound);
+                }
+
+                // only --quick-check trusts what the files were, and not just what they were named
+                const bool wasMadeFromSnapshot{ wasFound && options().quick_check &&
+                                                makeEntrysFromSnapshot(
+                                                    dirEntry.which_dir,
+                                                    dirNodePtr,
+                                                    dirFd,
+                                                    snapshotEntrys,
+                                                    fileEntrys,
+                                                    dirEntrys,
+                                                    spillIfTooBigBoth) };
+
+                if (wasMadeFromSnapshot)
+                {
+                    snapshot.record(
+                        snapshotKey,
+                        dirStamp,
+                        snapshotRecord.entry_count,
+                        snapshotRecord.begin,
+                        snapshotRecord.end);
+                }
+                else
+                {
+                    // names are listed in batches so that huge directories can be stat'ed in
+                    // parallel, see makeAndStoreEntrysAt()
+                    std::vector<ListedName> listedNames;
+                    std::size_t statCount{ 0 };
+
+                    // a dir is only kept if every entry in it was made without any errors
+                    bool willRecord{ isInSnapshot && snapshot.isWriting() };
+                    serialize::Bytes_t snapshotBytes;
+                    std::size_t snapshotEntryCount{ 0 };
+
+                    auto storeListedNames = [&]() {
+                        makeAndStoreEntrysAt(
+                            dirEntry.which_dir,
+                            dirNodePtr,
+                            dirFd,
+                            listedNames,
+                            statCount,
+                            fileEntrys,
+                            dirEntrys);
+
+                        for (const ListedName & listedName : listedNames)
+                        {
+                            willRecord = (willRecord && listedName.is_valid);
+                            if (!willRecord)
+                            {
+                                break;
+                            }
+
+                            DirSnapshot::appendEntry(
+                                snapshotBytes,
+                                { listedName.name,
+                                  listedName.type,
+                                  listedName.is_file,
+                                  listedName.size,
+                                  listedName.links.inode,
+                                  listedName.links.count });
+
+                            ++snapshotEntryCount;
+                        }
+
+                        listedNames.clear();
+                        statCount = 0;
+
+                        spillIfTooBigBoth();
+                    };
+
+                    auto addListedName = [&](const PathStringView_t storedName,
+                                             const fs::file_type type) {
+                        ListedName & listedName{ listedNames.emplace_back() };
+                        listedName.name = storedName;
+                        listedName.type = type;
+
+                        if (willStatAt(type))
+                        {
+                            ++statCount;
+                        }
+
+                        if (listedNames.size() >= listed_name_batch_size)
+                        {
+                            storeListedNames();
+                        }
+                    };
+
+                    auto handleName = [&](const PathChar_t * name, const fs::file_type type) {
+                        if (isDstTopDir && (tool_dir_name == name))
+                        {
+                            return;
+                        }
+
+                        addListedName(dirNodePtr->storeName(name), type);
+                    };
+
+                    ErrorCode_t errorCodeList;
+                    if (wasFound)
+                    {
+                        // the names can't have changed, but what they are might have
+                        for (const DirSnapshot::ListedEntry & entry : snapshotEntrys)
+                        {
+                            addListedName(dirNodePtr->storeName(entry.name), entry.type);
+                        }
+                    }
+                    else
+                    {
+                        // the same as incrementDirectoryIterator(), whatever was listed before an
+                        // error is still used
+                        dirFd.forEachName(handleName, errorCodeList);
+                        printAndCountErrorCodeIf(errorCodeList, Error::DirIterInc, dirEntry);
+                    }
+
+                    storeListedNames();
+
+                    if (willRecord && !errorCodeList)
+                    {
+                        snapshot.record(
+                            snapshotKey,
+                            dirStamp,
+                            snapshotEntryCount,
+                            snapshotBytes.data(),
+                            (snapshotBytes.data() + snapshotBytes.size()));
+                    }
+                }
+
+                // every Entry made above can now use this, see DirNode
+                dirNodePtr->keepDirFd(std::move(dirFd));
+            }
+            else
+            {
+                ErrorCode_t errorCodeMakeDirIter;
+                fs::directory_iterator iter(dirNodePtr->path(), errorCodeMakeDirIter);
+                if (!printAndCountErrorCodeIf(errorCodeMakeDirIter, Error::DirIterMake, dirEntry))
+                {
+                    return false;
+                }
+
+                const fs::directory_iterator iterEnd;
+
+                while (iter != iterEnd)
+                {
+                    if (!isDstTopDir || (iter->path().filename() != tool_dir_name))
+                    {
+                        makeAndStoreEntry(
+                            dirEntry.which_dir, dirNodePtr, *iter, fileEntrys, dirEntrys);
+
+                        if (canSpill)
+                        {
+                            spillIfTooBig(fileEntrys, *fileRunsPtr);
+                            spillIfTooBig(dirEntrys, *dirRunsPtr);
+                        }
+                    }
+
+                    incrementDirectoryIterator(dirEntry, iter);
+                }
+            }
+
+            // processing things in alphabetical order also helps the app behave in the expected way
+            sortEntrysByNameWithHelpers(fileEntrys);
+            sortEntrysByNameWithHelpers(dirEntrys);
+
+            return true;
+        }
+        catch (...)
+        {
+            m_subThreadExceptions.add(std::current_exception());
+        }
+
+        return false;
+    }
+
+    bool BaseFileOperations::makeEntrysFromManifest(
+        const Entry & dirEntry,
+        const DirNodePtr_t & dirNodePtr,
+        EntryVec_t & fileEntrys,
+        EntryVec_t & dirEntrys,
+        EntryRuns * const fileRunsPtr,
+        EntryRuns * const dirRunsPtr)
+    {
+        try
+        {
+            assert(!dirEntry.isEmpty());
+            assert(!dirEntry.is_file);
+            assert(dirEntry.which_dir == WhichDir::Destination);
+            assert(dirNodePtr);
+
+            PathString_t key;
+            std::wstring error;
+            ManifestDirPtr_t manifestDirPtr;
+            if (!makeRelativeKey(
+                    WhichDir::Destination,
+                    options().path_dpair.dst.native(),
+                    dirNodePtr->path(),
+                    key) ||
+                !m_manifestReader.find(key, manifestDirPtr, error))
+            {
+                printAndCountError(
+                    Error::DirIterMake,
+                    dirEntry,
+                    ((error.empty()) ? L"This dir is not in the manifest" : error));
+
+                return false;
+            }
+
+            const bool canSpill{ (m_maxListedEntryCount > 0) && (nullptr != fileRunsPtr) &&
+                                 (nullptr != dirRunsPtr) };
+
+            auto spillIfTooBig = [&](EntryVec_t & vec, EntryRuns & runs) {
+                if (vec.size() >= m_maxListedEntryCount)
+                {
+                    runs.spill(options().spill_dir, vec);
+                }
+            };
+
+            // the names are copied because the ManifestDir is only kept for a while
+            for (const ManifestEntry & manifestEntry : manifestDirPtr->entrys)
+            {
+                // skipped just like when listing the dst tree the manifest was exported from
+                if (key.empty() && (manifestEntry.name == tool_dir_name.native()))
+                {
+                    continue;
+                }
+
+                storeEntry(
+                    WhichDir::Destination,
+                    manifestEntry.is_file,
+                    dirNodePtr,
+                    dirNodePtr->storeName(manifestEntry.name),
+                    0,
+                    manifestEntry.size,
+                    fileEntrys,
+                    dirEntrys);
+
+                if (canSpill)
+                {
+                    spillIfTooBig(fileEntrys, *fileRunsPtr);
+                    spillIfTooBig(dirEntrys, *dirRunsPtr);
+                }
+            }
+
+            // already in name order, but the same sort is what the src was sorted with
+            sortEntrysByNameWithHelpers(fileEntrys);
+            sortEntrysByNameWithHelpers(dirEntrys);
+
+            return true;
+        }
+        catch (...)
+        {
+            m_subThreadExceptions.add(std::current_exception());
+        }
+
+        return false;
+    }
+
+    bool BaseFileOperations::compareFileToManifest(FileCompareTaskResources & resources)
+    {
+        const EntryConstRefDPair_t entryDPair{ resources.entryDPair().src,
+                                               resources.entryDPair().dst };
+
+        PathString_t key;
+        std::wstring error;
+        ManifestDirPtr_t manifestDirPtr;
+        const ManifestEntry * manifestEntryPtr{ nullptr };
+        if (makeRelativeKey(
+                WhichDir::Destination,
+                options().path_dpair.dst.native(),
+                entryDPair.dst.dirNodePtr()->path(),
+                key) &&
+            m_manifestReader.find(key, manifestDirPtr, error))
+        {
+            manifestEntryPtr = manifestDirPtr->find(entryDPair.dst.name());
+        }
+
+        if (nullptr == manifestEntryPtr)
+        {
+            printAndCountError(
+                Error::Read,
+                entryDPair.dst,
+                ((error.empty()) ? L"This file is not in the manifest" : error));
+
+            return false;
+        }
+
+        if (!printAndCountFileErrorIf(resources.file_dpair.src, Error::Open, entryDPair.src))
+        {
+            return false;
+        }
+
+        std::uint64_t digest{ 0 };
+        if (!readAndDigestFile(
+                entryDPair.src, resources.file_dpair.src, resources.progress, digest))
+        {
+            return false;
+        }
+
+        if (digest != manifestEntryPtr->digest)
+        {
+            // see compareFileContents() for why this has to be torn down first
+            resources.teardown();
+            handleMismatch(Mismatch::Modified, entryDPair, L"", resources.entry_handle);
+            return false;
+        }
+
+        return true;
+    }
+
+    void BaseFileOperations::makeManifestEntrys(
+        const EntryVec_t & fileEntrys,
+        const EntryVec_t & dirEntrys,
+        std::vector<ManifestEntry> & manifestEntrys)
+    {
+        std::vector<ManifestEntry> fileManifestEntrys(fileEntrys.size());
+        std::vector<std::uint8_t> wasFileRead(fileEntrys.size(), 0);
+        std::atomic<std::size_t> nextIndex{ 0 };
+
+        // each part takes the next file that no other part has yet
+        auto digestFiles = [&]() {
+            FileReadResources resources;
+            ProgressCounter_t progress{ 0 };
+
+            for (std::size_t i{ nextIndex++ }; i < fileEntrys.size(); i = nextIndex++)
+            {
+                const Entry & entry{ fileEntrys[i] };
+                ManifestEntry & manifestEntry{ fileManifestEntrys[i] };
+                manifestEntry.name    = entry.name();
+                manifestEntry.is_file = true;
+                manifestEntry.size    = entry.size;
+
+                InodeStamp stamp;
+                if (stampFile(entry, stamp))
+                {
+                    manifestEntry.mtime_ns = stamp.mtime_ns;
+                }
+
+                if (entry.size > 0)
+                {
+                    resources.open(entry);
+
+                    wasFileRead[i] =
+                        (printAndCountFileErrorIf(resources, Error::Open, entry) &&
+                         readAndDigestFile(entry, resources, progress, manifestEntry.digest));
+
+                    resources.close();
+                }
+                else
+                {
+                    // empty files and links to anything have nothing to read
+                    manifestEntry.digest = ContentDigest().value();
+                    wasFileRead[i]       = 1;
+                }
+            }
+        };
+
+        // one part for each of the threads that help an export, which the executor provides
+        const std::size_t partCount{ std::clamp(
+            fileEntrys.size(), 1_st, std::max(1_st, options().thread_counts.file_compare)) };
+
+        const std::vector<HelperQueue::Part_t> parts(partCount, digestFiles);
+        m_helperQueue.runAll(parts, [&]() { notifyHelpers(); });
+
+        std::vector<ManifestEntry> dirManifestEntrys;
+        dirManifestEntrys.reserve(dirEntrys.size());
+        for (const Entry & entry : dirEntrys)
+        {
+            ManifestEntry & manifestEntry{ dirManifestEntrys.emplace_back() };
+            manifestEntry.name = entry.name();
+
+            InodeStamp stamp;
+            if (stampFile(entry, stamp))
+            {
+                manifestEntry.mtime_ns = stamp.mtime_ns;
+            }
+        }
+
+        // any file that couldn't be read was already counted as an error, and is left out
+        std::size_t keptCount{ 0 };
+        for (std::size_t i{ 0 }; i < fileManifestEntrys.size(); ++i)
+        {
+            if (wasFileRead[i] != 0)
+            {
+                fileManifestEntrys[keptCount++] = fileManifestEntrys[i];
+            }
+        }
+
+        fileManifestEntrys.resize(keptCount);
+
+        manifestEntrys.clear();
+        manifestEntrys.reserve(fileManifestEntrys.size() + dirManifestEntrys.size());
+
+        std::merge(
+            std::begin(fileManifestEntrys),
+            std::end(fileManifestEntrys),
+            std::begin(dirManifestEntrys),
+            std::end(dirManifestEntrys),
+            std::back_inserter(manifestEntrys),
+            [](const ManifestEntry & left, const ManifestEntry & right) {
+                return (left.name.compare(right.name) < 0);
+            });
+    }
+
+    void BaseFileOperations::diffManifestPart(
+        DirPair<ManifestReader> & readerDPair,
+        const PathStringView_t startKey,
+        const PathStringView_t endKey)
+    {
+        std::wstring error;
+        DirPair<ManifestReader::Cursor> cursorDPair;
+        DirPair<ManifestDir> dirDPair;
+        DirPair<bool> hasDirDPair{ false, false };
+
+        auto nextDir = [&](const WhichDir whichDir) {
+            ManifestDir & dir{ dirDPair.get(whichDir) };
+            bool & hasDir{ hasDirDPair.get(whichDir) };
+
+            // a dst manifest stands in for a dst tree, so the app's dir in it is skipped
+            do
+            {
+                hasDir = cursorDPair.get(whichDir).next(dir, error);
+                if (!error.empty())
+                {
+                    throw std::runtime_error(strutil::toNarrowString(error));
+                }
+            } while (hasDir && (WhichDir::Destination == whichDir) && isToolDirKey(dir.key));
+
+            if (hasDir && !endKey.empty() && (compareManifestKeys(dir.key, endKey) >= 0))
+            {
+                hasDir = false;
+            }
+        };
+
+        for (const WhichDir whichDir : { WhichDir::Source, WhichDir::Destination })
+        {
+            if (!cursorDPair.get(whichDir).open(readerDPair.get(whichDir), startKey, error))
+            {
+                throw std::runtime_error(strutil::toNarrowString(error));
+            }
+
+            nextDir(whichDir);
+        }
+
+        // the subdirs that both have so far, which the part that has the root starts with
+        std::unordered_set<PathString_t> expectedKeys;
+        if (startKey.empty())
+        {
+            expectedKeys.insert(PathString_t());
+        }
+
+        while (hasDirDPair.src || hasDirDPair.dst)
+        {
+            const int keyCompareResult = [&]() {
+                if (!hasDirDPair.src)
+                {
+                    return 1;
+                }
+                else if (!hasDirDPair.dst)
+                {
+                    return -1;
+                }
+                else
+                {
+                    return compareManifestKeys(dirDPair.src.key, dirDPair.dst.key);
+                }
+            }();
+
+            if (0 == keyCompareResult)
+            {
+                expectedKeys.erase(dirDPair.src.key);
+                diffManifestDirs(dirDPair, expectedKeys);
+
+                nextDir(WhichDir::Source);
+                nextDir(WhichDir::Destination);
+                continue;
+            }
+
+            const WhichDir whichDir{ (keyCompareResult < 0) ? WhichDir::Source
+                                                            : WhichDir::Destination };
+
+            const ManifestDir & dir{ dirDPair.get(whichDir) };
+
+            // Almost always this dir was already found Missing or Extra in its parent, so nothing
+            // in it is looked at, just like a compare never lists a dir that the other tree
+            // doesn't have.  But if both parents have it, the other manifest couldn't list it.
+            const bool isParentInPart{ compareManifestKeys(parentManifestKey(dir.key), startKey) >=
+                                       0 };
+
+            if ((expectedKeys.erase(dir.key) > 0) ||
+                (!isParentInPart && isManifestDirInBoth(readerDPair, dir.key)))
+            {
+                // only so the counters match what compareDirectoryContents() counts when one side
+                // can't be listed, so the entrys made are not used
+                EntryVec_t fileEntrys;
+                EntryVec_t dirEntrys;
+                std::vector<std::uint64_t> fileDigests;
+                makeEntrysFromManifestDir(whichDir, dir, fileEntrys, dirEntrys, fileDigests);
+
+                const WhichDir otherWhichDir{ (WhichDir::Source == whichDir)
+                                                  ? WhichDir::Destination
+                                                  : WhichDir::Source };
+
+                printAndCountError(
+                    Error::DirIterMake,
+                    Entry(
+                        otherWhichDir,
+                        false,
+                        (options().path_dpair.get(otherWhichDir) / dir.key),
+                        0),
+                    L"This dir is not in the manifest");
+            }
+
+            nextDir(whichDir);
+        }
+    }
+
+    void BaseFileOperations::diffManifestDirs(
+        const DirPair<ManifestDir> & dirDPair, std::unordered_set<PathString_t> & expectedKeys)
+    {
+        DirPair<EntryVec_t> fileEntrysDPair;
+        DirPair<EntryVec_t> dirEntrysDPair;
+        DirPair<std::vector<std::uint64_t>> fileDigestsDPair;
+
+        for (const WhichDir whichDir : { WhichDir::Source, WhichDir::Destination })
+        {
+            makeEntrysFromManifestDir(
+                whichDir,
+                dirDPair.get(whichDir),
+                fileEntrysDPair.get(whichDir),
+                dirEntrysDPair.get(whichDir),
+                fileDigestsDPair.get(whichDir));
+        }
+
+        const EntryDPair_t emptyEntryDPair{ Entry(WhichDir::Source, false, fs::path(), 0),
+                                            Entry(WhichDir::Destination, false, fs::path(), 0) };
+
+        // the same merge by name as comparEntrysWithSameType(), but with nothing to schedule
+        auto mergeByName = [&](const DirPair<EntryVec_t> & entrysDPair, auto && handleBoth) {
+            const EntryVec_t & srcEntrys{ entrysDPair.src };
+            const EntryVec_t & dstEntrys{ entrysDPair.dst };
+
+            std::size_t srcIndex{ 0 };
+            std::size_t dstIndex{ 0 };
+            while ((srcIndex < srcEntrys.size()) || (dstIndex < dstEntrys.size()))
+            {
+                const int nameCompareResult = [&]() {
+                    if (srcIndex == srcEntrys.size())
+                    {
+                        return 1;
+                    }
+                    else if (dstIndex == dstEntrys.size())
+                    {
+                        return -1;
+                    }
+                    else
+                    {
+                        return srcEntrys[srcIndex].name().compare(dstEntrys[dstIndex].name());
+                    }
+                }();
+
+                if (nameCompareResult > 0)
+                {
+                    handleMismatch(
+                        Mismatch::Extra,
+                        EntryConstRefDPair_t{ emptyEntryDPair.src, dstEntrys[dstIndex++] });
+                }
+                else if (nameCompareResult < 0)
+                {
+                    handleMismatch(
+                        Mismatch::Missing,
+                        EntryConstRefDPair_t{ srcEntrys[srcIndex++], emptyEntryDPair.dst });
+                }
+                else
+                {
+                    handleBoth(srcIndex++, dstIndex++);
+                }
+            }
+        };
+
+        mergeByName(fileEntrysDPair, [&](const std::size_t srcIndex, const std::size_t dstIndex) {
+            const EntryConstRefDPair_t entryDPair{ fileEntrysDPair.src[srcIndex],
+                                                   fileEntrysDPair.dst[dstIndex] };
+
+            if (entryDPair.src.size != entryDPair.dst.size)
+            {
+                handleMismatch(Mismatch::Size, entryDPair);
+            }
+            else if (
+                !options().skip_file_read &&
+                (fileDigestsDPair.src[srcIndex] != fileDigestsDPair.dst[dstIndex]))
+            {
+                handleMismatch(Mismatch::Modified, entryDPair);
+            }
+        });
+
+        mergeByName(dirEntrysDPair, [&](const std::size_t srcIndex, const std::size_t) {
+            expectedKeys.insert(
+                makeChildManifestKey(dirDPair.src.key, dirEntrysDPair.src[srcIndex].name()));
+        });
+    }
+
+    bool BaseFileOperations::isManifestDirInBoth(
+        DirPair<ManifestReader> & readerDPair, const PathStringView_t key)
+    {
+        // the dst side never has the app's dir, see diffManifestPart()
+        if (isToolDirKey(key))
+        {
+            return false;
+        }
+
+        const PathStringView_t parentKey{ parentManifestKey(key) };
+        const PathStringView_t name{ key.substr(
+            std::min(key.size(), (parentKey.size() + ((parentKey.empty()) ? 0 : 1)))) };
+
+        for (const WhichDir whichDir : { WhichDir::Source, WhichDir::Destination })
+        {
+            std::wstring error;
+            ManifestDirPtr_t parentDirPtr;
+            if (!readerDPair.get(whichDir).find(parentKey, parentDirPtr, error))
+            {
+                if (!error.empty())
+                {
+                    throw std::runtime_error(strutil::toNarrowString(error));
+                }
+
+                return false;
+            }
+
+            const ManifestEntry * const entryPtr{ parentDirPtr->find(name) };
+            if ((nullptr == entryPtr) || entryPtr->is_file)
+            {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void BaseFileOperations::makeEntrysFromManifestDir(
+        const WhichDir whichDir,
+        const ManifestDir & dir,
+        EntryVec_t & fileEntrys,
+        EntryVec_t & dirEntrys,
+        std::vector<std::uint64_t> & fileDigests)
+    {
+        const fs::path & manifestPath{ options().path_dpair.get(whichDir) };
+
+        // the paths are only for what gets printed, and start with the manifest's own path
+        const DirNodePtr_t dirNodePtr{ std::make_shared<DirNode>(
+            (dir.key.empty()) ? manifestPath : (manifestPath / dir.key)) };
+
+        for (const ManifestEntry & manifestEntry : dir.entrys)
+        {
+            // a dst manifest stands in for a dst tree, see tool_dir_name
+            if ((WhichDir::Destination == whichDir) && dir.key.empty() &&
+                (manifestEntry.name == tool_dir_name.native()))
+            {
+                continue;
+            }
+
+            storeEntry(
+                whichDir,
+                manifestEntry.is_file,
+                dirNodePtr,
+                dirNodePtr->storeName(manifestEntry.name),
+                0,
+                manifestEntry.size,
+                fileEntrys,
+                dirEntrys);
+
+            if (manifestEntry.is_file)
+            {
+                fileDigests.push_back(manifestEntry.digest);
+            }
+        }
+    }
+
+    bool BaseFileOperations::comparEntrysWithSameType(
+        const EntryDPair_t & parentEntryDPair,
+        const DirNodePtr_t & dstDirNodePtr,
+        EntryCursor & srcCursor,
+        EntryCursor & dstCursor)
+    {
+        try
+        {
+            assert(parentEntryDPair.src.which_dir == WhichDir::Source);
+            assert(!parentEntryDPair.src.is_file);
+            assert(!parentEntryDPair.src.isEmpty());
+            assert(parentEntryDPair.src.size == 0);
+            //
+            assert(parentEntryDPair.dst.which_dir == WhichDir::Destination);
+            assert(!parentEntryDPair.dst.is_file);
+            assert(!parentEntryDPair.dst.isEmpty());
+            assert(parentEntryDPair.dst.size == 0);
+
+            // Only made if there are missing entrys, and only this thread stores names in it, but
+            // it shares the DirFd of dstDirNodePtr so they can still be copied relative to it.
+            DirNodePtr_t missingDirNodePtr;
+
+            const EntryDPair_t emptyEntryDPair{ Entry(WhichDir::Source, false, fs::path(), 0),
+                                                Entry(
+                                                    WhichDir::Destination, false, fs::path(), 0) };
+
+            while (!srcCursor.isEnd() || !dstCursor.isEnd())
+            {
+                // only one of these two can possibly be the empty entry
+                const EntryConstRefDPair_t entryDPair{
+                    (srcCursor.isEnd() ? emptyEntryDPair.src : srcCursor.current()),
+                    (dstCursor.isEnd() ? emptyEntryDPair.dst : dstCursor.current())
+                };
+
+                const int nameCompareResult = [&]() {
+                    if (srcCursor.isEnd())
+                    {
+                        return 1;
+                    }
+                    else if (dstCursor.isEnd())
+                    {
+                        return -1;
+                    }
+                    else
+                    {
+                        return entryDPair.src.name().compare(entryDPair.dst.name());
+                    }
+                }();
+
+                if (nameCompareResult > 0)
+                {
+                    // extra case
+
+                    // In this case the src entry is not correct, and actually never could be.  So
+                    // use the src parent dir entry as a subsitute because that will help produce
+                    // better logging information.
+                    handleMismatch(
+                        Mismatch::Extra,
+                        EntryConstRefDPair_t{ parentEntryDPair.src, entryDPair.dst });
+
+                    dstCursor.next();
+                }
+                else if (nameCompareResult < 0)
+                {
+                    // missing case
+
+                    if (options().job != Job::Cull)
+                    {
+                        // In this case the dst entry is not correct and a replacement must be
+                        // created. The dst Entry is created to be exactly the same as the src,
+                        // except for the path. This new dst Entry could be either a file or dir,
+                        // and could either exist or not.
+                        if (!missingDirNodePtr)
+                        {
+                            missingDirNodePtr = std::make_shared<DirNode>(dstDirNodePtr);
+                        }
+
+                        const Entry fixedDstEntry(
+                            WhichDir::Destination,
+                            entryDPair.src.is_file,
+                            missingDirNodePtr,
+                            entryDPair.src.name(),
+                            entryDPair.src.size);
+
+                        handleMismatch(
+                            Mismatch::Missing,
+                            EntryConstRefDPair_t{ entryDPair.src, fixedDstEntry });
+                    }
+
+                    srcCursor.next();
+                }
+                else
+                {
+                    // two entrys with same name and same type case
+
+                    if (!entryDPair.src.is_file || (options().job != Job::Cull))
+                    {
+                        compareEntrysWithSameTypeAndName(entryDPair);
+                    }
+
+                    srcCursor.next();
+                    dstCursor.next();
+                }
+            }
+
+            return true;
+        }
+        catch (...)
+        {
+            m_subThreadExceptions.add(std::current_exception());
+        }
+
+        return false;
+    }
+
+    void BaseFileOperations::compareEntrysWithSameTypeAndName(
+        const EntryConstRefDPair_t & entryDPair)
+    {
+        assert(entryDPair.src.which_dir == WhichDir::Source);
+        assert(entryDPair.dst.which_dir == WhichDir::Destination);
+        assert(!entryDPair.src.isEmpty() && !entryDPair.dst.isEmpty());
+        assert(entryDPair.src.is_file == entryDPair.dst.is_file);
+        assert(entryDPair.src.name() == entryDPair.dst.name());
+        assert(entryDPair.src.extension() == entryDPair.dst.extension());
+
+        if (entryDPair.src.is_file)
+        {
+            if (entryDPair.src.size == entryDPair.dst.size)
+            {
+                if (!options().skip_file_read && (entryDPair.src.size > 0))
+                {
+                    if (isVerifiedByDigest(entryDPair))
+                    {
+                        return;
+                    }
+
+                    // another link to the same files might have already been compared
+                    const auto compared{ m_hardLinks.knownCompare(
+                        entryDPair.src, entryDPair.dst) };
+
+                    if (compared == HardLinks::Compared::Unknown)
+                    {
+                        scheduleFileCompare(entryDPair);
+                    }
+                    else if (compared == HardLinks::Compared::Different)
+                    {
+                        handleMismatch(Mismatch::Modified, entryDPair);
+                    }
+                }
+                else if (m_digestTree.isOpen())
+                {
+                    // empty files and links to anything have nothing to read
+                    DigestTree::FileDigest fileDigest;
+                    fileDigest.digest = ContentDigest().value();
+                    addFileDigest(entryDPair.dst, fileDigest);
+                }
+            }
+            else
+            {
+                handleMismatch(Mismatch::Size, entryDPair);
+            }
+        }
+        else
+        {
+            scheduleDirectoryCompare(entryDPair);
+        }
+    }
+
+    void BaseFileOperations::makeAndStoreEntry(
+        const WhichDir whichDir,
+        const DirNodePtr_t & parentDirNodePtr,
+        const fs::directory_entry & dirEntry,
+        EntryVec_t & fileEntrys,
+        EntryVec_t & dirEntrys)
+    {
+        ErrorCode_t errorCodeSymlinkStatus;
+        const fs::file_status symlinkStatus{ dirEntry.symlink_status(errorCodeSymlinkStatus) };
+        if (errorCodeSymlinkStatus)
+        {
+            const Entry tempEntry(whichDir, false, dirEntry.path(), 0);
+            printAndCountErrorCodeIf(errorCodeSymlinkStatus, Error::SymlinkStatus, tempEntry);
+            return;
+        }
+
+        ErrorCode_t errorCodeNormalStatus;
+        const fs::file_status normalStatus{ dirEntry.status(errorCodeNormalStatus) };
+        if (errorCodeNormalStatus)
+        {
+            const Entry tempEntry(whichDir, false, dirEntry.path(), 0);
+            printAndCountErrorCodeIf(errorCodeNormalStatus, Error::Status, tempEntry);
+            return;
+        }
+
+        bool isFile{ false };
+        bool hasSize{ false };
+        if (!setTypeOrHandleError(
+                whichDir, dirEntry.path(), symlinkStatus, normalStatus, isFile, hasSize))
+        {
+            return;
+        }
+
         std::size_t size{ 0 };
-        if (isFile && hasSize)
+        if (isFile && hasSize && options().metadata_needs.file_size)
+        {
+            ErrorCode_t errorCode;
+            size = getSizeCommon(dirEntry, errorCode);
+            if (errorCode)
+            {
+                const Entry tempEntry(whichDir, isFile, dirEntry.path(), 0);
+                printAndCountErrorCodeIf(errorCode, Error::Size, tempEntry);
+                return;
+            }
+        }
+
+        storeEntry(
+            whichDir,
+            isFile,
+            parentDirNodePtr,
+            parentDirNodePtr->storeName(dirEntry.path().filename().native()),
+            0,
+            size,
+            fileEntrys,
+            dirEntrys);
+    }
+
+    void BaseFileOperations::sortEntrysByNameWithHelpers(EntryVec_t & entrys)
+    {
+        // listing is dir compare work, so it's split up no more than dir compares are
+        sortEntrysByName(
+            entrys,
+            std::max(1_st, options().thread_counts.dir_compare),
+            [&](const std::vector<SortPart_t> & parts) {
+                m_helperQueue.runAll(parts, [&]() { notifyHelpers(); });
+            });
+    }
+
+    bool BaseFileOperations::willStatAt(const fs::file_type type) const
+    {
+        // A dir has no size, so when readdir() already said it was one there is nothing to stat.
+        // The same goes for files and links when the job doesn't need their sizes.
+        if (type == fs::file_type::directory)
+        {
+            return false;
+        }
+
+        const bool isFileOrLink{ (type == fs::file_type::regular) ||
+                                 (type == fs::file_type::symlink) };
+
+        return (options().metadata_needs.file_size || !isFileOrLink);
+    }
+
+    void BaseFileOperations::makeAndStoreEntrysAt(
+        const WhichDir whichDir,
+        const DirNodePtr_t & parentDirNodePtr,
+        const DirFd & dirFd,
+        std::vector<ListedName> & listedNames,
+        const std::size_t statCount,
+        EntryVec_t & fileEntrys,
+        EntryVec_t & dirEntrys)
+    {
+        auto statPart = [&](const std::size_t first, const std::size_t last) {
+            for (std::size_t i{ first }; i < last; ++i)
+            {
+                ListedName & listedName{ listedNames[i] };
+
+                listedName.is_valid = statEntryAt(
+                    whichDir,
+                    parentDirNodePtr,
+                    dirFd,
+                    listedName.name,
+                    listedName.type,
+                    listedName.is_file,
+                    listedName.link_id,
+                    listedName.links,
+                    listedName.size);
+            }
+        };
+
+        // Each stat is a round trip to the filesystem that the CPU mostly waits on, especially on
+        // network mounts, so when there are enough of them they are split into parts that any
+        // idle thread can help with.  The Entrys are still made here, in the order listed.
+        if (statCount < parallel_stat_min)
+        {
+            statPart(0, listedNames.size());
+        }
+        else
+        {
+            std::vector<HelperQueue::Part_t> parts;
+            for (std::size_t first{ 0 }; first < listedNames.size(); first += stat_part_size)
+            {
+                const std::size_t last{ std::min((first + stat_part_size), listedNames.size()) };
+                parts.push_back([&statPart, first, last]() { statPart(first, last); });
+            }
+
+            m_helperQueue.runAll(parts, [&]() { notifyHelpers(); });
+        }
+
+        for (const ListedName & listedName : listedNames)
+        {
+            if (listedName.is_valid)
+            {
+                storeEntry(
+                    whichDir,
+                    listedName.is_file,
+                    parentDirNodePtr,
+                    listedName.name,
+                    listedName.link_id,
+                    listedName.size,
+                    fileEntrys,
+                    dirEntrys);
+            }
+        }
+    }
+
+    bool BaseFileOperations::statEntryAt(
+        const WhichDir whichDir,
+        const DirNodePtr_t & parentDirNodePtr,
+        const DirFd & dirFd,
+        const PathStringView_t storedName,
+        const fs::file_type type,
+        bool & isFile,
+        LinkId_t & linkId,
+        FileLinks & links,
+        std::size_t & size)
+    {
+        // stored names always end with a zero char, see DirNode::storeName()
+        const PathChar_t * const name{ storedName.data() };
+
+        linkId = 0;
+        links  = FileLinks{};
+
+        std::uintmax_t statSize{ 0 };
+        fs::file_status symlinkStatus{ type };
+        if (willStatAt(type))
+        {
+            ErrorCode_t errorCodeSymlinkStatus;
+            symlinkStatus = dirFd.statusAt(name, false, statSize, links, errorCodeSymlinkStatus);
+            if (errorCodeSymlinkStatus)
+            {
+                const Entry tempEntry(whichDir, false, (parentDirNodePtr->path() / name), 0);
+                printAndCountErrorCodeIf(errorCodeSymlinkStatus, Error::SymlinkStatus, tempEntry);
+                return false;
+            }
+        }
+
+        isFile = fs::is_regular_file(symlinkStatus);
+        bool hasSize{ isFile };
+
+        // the same stat says if it's linked, so spotting hard links costs nothing extra
+        if (isFile)
+        {
+            linkId = m_hardLinks.linkId(links);
+        }
+
+        // only links and unsupported types need anything more, which are rare
+        if (!isFile && !fs::is_directory(symlinkStatus))
+        {
+            const fs::path path{ parentDirNodePtr->path() / name };
+
+            // the linked type is only used to describe the link, see setTypeOrHandleError()
+            const bool willFollowLink{ options().metadata_needs.link_target ||
+                                       !fs::is_symlink(symlinkStatus) };
+
+            std::uintmax_t linkedSize{ 0 };
+            ErrorCode_t errorCodeNormalStatus;
+            const fs::file_status normalStatus{
+                (willFollowLink) ? dirFd.statusAt(name, true, linkedSize, errorCodeNormalStatus)
+                                 : fs::file_status(fs::file_type::unknown)
+            };
+
+            if (errorCodeNormalStatus)
+            {
+                const Entry tempEntry(whichDir, false, path, 0);
+                printAndCountErrorCodeIf(errorCodeNormalStatus, Error::Status, tempEntry);
+                return false;
+            }
+
+            if (!setTypeOrHandleError(
+                    whichDir, path, symlinkStatus, normalStatus, isFile, hasSize))
+            {
+                return false;
+            }
+        }
+
+        size = ((isFile && hasSize) ? static_cast<std::size_t>(statSize) : 0);
+        return true;
+    }
+
+    bool BaseFileOperations::makeEntrysFromSnapshot(
+        const WhichDir whichDir,
+        const DirNodePtr_t & dirNodePtr,
+        const DirFd & dirFd,
+        const std::vector<DirSnapshot::ListedEntry> & listedEntrys,
+        EntryVec_t & fileEntrys,
+        EntryVec_t & dirEntrys,
+        const std::function<void()> & afterBatchFunction)
+    {
+        // A dir stamp can't see a file that was changed in place, so a few evenly spaced files
+        // are stat'ed to make sure they are still the same.  If any one has changed then so might
+        // the rest, so every one of them is stat'ed instead.
+        std::size_t fileCount{ 0 };
+        for (const DirSnapshot::ListedEntry & entry : listedEntrys)
+        {
+            fileCount += static_cast<std::size_t>(entry.is_file);
+        }
+
+        const std::size_t sampleEvery{ std::max(
+            std::size_t(1), (fileCount / std::max(std::size_t(1), snapshot_sample_count))) };
+
+        std::size_t fileIndex{ 0 };
+        std::size_t sampledCount{ 0 };
+        for (const DirSnapshot::ListedEntry & entry : listedEntrys)
         {
+            if (!entry.is_file)
+            {
+                continue;
+            }
+
+            if (((fileIndex++ % sampleEvery) != 0) || (sampledCount >= snapshot_sample_count))
+            {
+                continue;
+            }
+
+            ++sampledCount;
+
+            // names in the snapshot don't end with a zero char
+            const PathString_t name{ entry.name };
+
+            std::uintmax_t size{ 0 };
+            FileLinks links;
             ErrorCode_t errorCode;
-            size = getSizeCommon(dirEntry, errorCode);
-            if (errorCode)
+            const fs::file_status status{ dirFd.statusAt(
+                name.c_str(), false, size, links, errorCode) };
+
+            // links to files are files too, see setTypeOrHandleError(), but never have a size
+            const bool isSame{ fs::is_regular_file(status) ? (size == entry.size)
+                                                           : fs::is_symlink(status) };
+
+            if (errorCode || !isSame || (links.inode != entry.inode))
             {
-                const Entry tempEntry(whichDir, isFile, dirEntry.path(), 0);
-                printAndCountErrorCodeIf(errorCode, Error::Size, tempEntry);
-                return;
+                return false;
+            }
+        }
+
+        for (std::size_t i{ 0 }; i < listedEntrys.size(); ++i)
+        {
+            const DirSnapshot::ListedEntry & entry{ listedEntrys[i] };
+
+            const PathStringView_t storedName{ dirNodePtr->storeName(entry.name) };
+
+            LinkId_t linkId{ 0 };
+            if (entry.is_file)
+            {
+                const FileLinks links{ dirFd.device(), entry.inode, entry.link_count };
+                linkId = m_hardLinks.linkId(links);
+            }
+
+            storeEntry(
+                whichDir,
+                entry.is_file,
+                dirNodePtr,
+                storedName,
+                linkId,
+                entry.size,
+                fileEntrys,
+                dirEntrys);
+
+            if (((i + 1) % listed_name_batch_size) == 0)
+            {
+                afterBatchFunction();
             }
         }
 
+        afterBatchFunction();
+        return true;
+    }
+
+    void BaseFileOperations::storeEntry(
+        const WhichDir whichDir,
+        const bool isFile,
+        const DirNodePtr_t & parentDirNodePtr,
+        const PathStringView_t storedName,
+        const LinkId_t linkId,
+        const std::size_t size,
+        EntryVec_t & fileEntrys,
+        EntryVec_t & dirEntrys)
+    {
         EntryVec_t & vec{ (isFile) ? fileEntrys : dirEntrys };
-        Entry & entry{ vec.emplace_back(whichDir, isFile, dirEntry.path(), size) };
+
+        Entry & entry{ vec.emplace_back(
+            whichDir, isFile, parentDirNodePtr, storedName, size, stored_name_tag) };
+
+        entry.link_id = linkId;
 
         count(entry);
 
@@ -595,7 +2062,7 @@ namespace backup
                 L"BigFile",
                 entry.which_dir,
                 entry.is_file,
-                entry.path.wstring(),
+                pathToWideString(entry.path()),
                 fileSizeToString(entry.size));
         }
     }
@@ -608,18 +2075,93 @@ namespace backup
         if (errorCode)
         {
             const std::wstring errorMessage{ L"Path in that dir that caused the error=\"" +
-                                             iter->path().wstring() + L"\"" };
+                                             pathToWideString(iter->path()) + L"\"" };
 
             printAndCountErrorCodeIf(errorCode, Error::DirIterInc, parentDirEntry, errorMessage);
             iter = fs::directory_iterator();
         }
     }
 
+    bool BaseFileOperations::stampFile(const Entry & entry, InodeStamp & stamp) const
+    {
+        // stored names always end with a zero char, see DirNode::storeName()
+        ErrorCode_t errorCode;
+        return (
+            entry.dirFd().isOpen() && entry.dirFd().stampAt(entry.name().data(), stamp, errorCode));
+    }
+
+    bool BaseFileOperations::isVerifiedByDigest(const EntryConstRefDPair_t & entryDPair)
+    {
+        if (!m_digestTree.isLoaded() || options().scrub)
+        {
+            return false;
+        }
+
+        PathString_t digestKey;
+        DigestTree::FileDigest fileDigest;
+        if (!m_digestTree.makeKey(entryDPair.dst.dirNodePtr()->path(), digestKey) ||
+            !m_digestTree.find(digestKey, entryDPair.dst.name(), fileDigest) ||
+            (fileDigest.size != entryDPair.src.size))
+        {
+            return false;
+        }
+
+        InodeStamp srcStamp;
+        InodeStamp dstStamp;
+        if (!stampFile(entryDPair.src, srcStamp) || !stampFile(entryDPair.dst, dstStamp) ||
+            (srcStamp != fileDigest.src_stamp) || (dstStamp != fileDigest.dst_stamp))
+        {
+            return false;
+        }
+
+        m_digestTree.addFile(digestKey, fileDigest);
+        m_digestTree.countVerify(false);
+        return true;
+    }
+
+    void BaseFileOperations::addFileDigest(const Entry & dstEntry, DigestTree::FileDigest & file)
+    {
+        PathString_t digestKey;
+        if (!m_digestTree.makeKey(dstEntry.dirNodePtr()->path(), digestKey))
+        {
+            return;
+        }
+
+        file.name = dstEntry.name();
+
+        // only a file that nothing has touched since the last run should still have its digest
+        DigestTree::FileDigest oldFile;
+        if ((file.size > 0) && m_digestTree.find(digestKey, file.name, oldFile) &&
+            (oldFile.size == file.size) && (oldFile.src_stamp == file.src_stamp) &&
+            (oldFile.dst_stamp == file.dst_stamp) && (oldFile.digest != file.digest))
+        {
+            m_digestTree.countSilentChange();
+
+            printWarningEvent(
+                L"SilentChange",
+                WhichDir::Destination,
+                true,
+                pathToWideString(dstEntry.path()),
+                L"contents changed since the last run without the file being touched");
+        }
+
+        m_digestTree.addFile(digestKey, file);
+    }
+
     void BaseFileOperations::handleMismatch(
         const Mismatch mismatch,
         const EntryConstRefDPair_t & entryDPair,
-        const std::wstring & message)
+        const std::wstring & message,
+        const EntryHandle_t handle)
     {
+        // even an ignored extra means the two dirs are not the same
+        PathString_t digestKey;
+        if (m_digestTree.isOpen() && entryDPair.dst.dirNodePtr() &&
+            m_digestTree.makeKey(entryDPair.dst.dirNodePtr()->path(), digestKey))
+        {
+            m_digestTree.markChanged(digestKey);
+        }
+
         if ((Mismatch::Extra == mismatch) && options().ignore_extra)
         {
             return;
@@ -632,7 +2174,20 @@ namespace backup
             if (mismatch != Mismatch::Extra)
             {
                 printAndCountMismatch(mismatch, entryDPair.src, message);
-                scheduleFileCopy(entryDPair);
+
+                // a src can have a dir with this name, but in the dst the app's files are in it
+                if ((entryDPair.dst.name() == tool_dir_name.native()) &&
+                    (entryDPair.dst.path() == (options().path_dpair.dst / tool_dir_name)))
+                {
+                    printAndCountError(
+                        Error::Copy,
+                        entryDPair.src,
+                        L"The dst dir with this name is where the app keeps its own files");
+
+                    return;
+                }
+
+                scheduleFileCopy(entryDPair, handle);
             }
         }
         else if (job == Job::Cull)
@@ -643,7 +2198,7 @@ namespace backup
                 scheduleFileRemove(entryDPair);
             }
         }
-        else // Job::Compare case here
+        else // Job::Compare and Job::Diff case here
         {
             const WhichDir whichDirToLog{ (mismatch == Mismatch::Missing) ? WhichDir::Source
                                                                           : WhichDir::Destination };
@@ -654,28 +2209,12 @@ namespace backup
 
     bool BaseFileOperations::setTypeOrHandleError(
         const WhichDir whichDir,
-        const fs::directory_entry & dirEntry,
+        const fs::path & path,
+        const fs::file_status & symlinkStatus,
+        const fs::file_status & normalStatus,
         bool & isFile,
         bool & hasSize)
     {
-        ErrorCode_t errorCodeSymlinkStatus;
-        const fs::file_status symlinkStatus{ dirEntry.symlink_status(errorCodeSymlinkStatus) };
-        if (errorCodeSymlinkStatus)
-        {
-            const Entry tempEntry(whichDir, false, dirEntry.path(), 0);
-            printAndCountErrorCodeIf(errorCodeSymlinkStatus, Error::SymlinkStatus, tempEntry);
-            return false;
-        }
-
-        ErrorCode_t errorCodeNormalStatus;
-        const fs::file_status normalStatus{ dirEntry.status(errorCodeNormalStatus) };
-        if (errorCodeNormalStatus)
-        {
-            const Entry tempEntry(whichDir, false, dirEntry.path(), 0);
-            printAndCountErrorCodeIf(errorCodeNormalStatus, Error::Status, tempEntry);
-            return false;
-        }
-
         const bool isRegularFile{ fs::is_regular_file(symlinkStatus) };
         const bool isDirectory{ fs::is_directory(symlinkStatus) };
         const bool isSymlink{ fs::is_symlink(symlinkStatus) };
@@ -695,7 +2234,11 @@ namespace backup
         }
 
         std::wstring symlinkTypeStr;
-        if (isSymlink)
+        if (isSymlink && !options().metadata_needs.link_target)
+        {
+            symlinkTypeStr = L"symlink";
+        }
+        else if (isSymlink)
         {
             symlinkTypeStr = L"symlink to a ";
             symlinkTypeStr += toString(normalStatus.type());
@@ -704,7 +2247,7 @@ namespace backup
             ErrorCode_t errorCodeTemp;
 
             const std::wstring linkedPathStr{
-                fs::read_symlink(dirEntry.path(), errorCodeTemp).wstring()
+                pathToWideString(fs::read_symlink(path, errorCodeTemp))
             };
 
             if (errorCodeTemp)
@@ -735,7 +2278,7 @@ namespace backup
                 errorMessage += symlinkTypeStr;
             }
 
-            const Entry tempEntry(whichDir, false, dirEntry.path(), 0);
+            const Entry tempEntry(whichDir, false, path, 0);
             printAndCountError(Error::UnsupportedType, tempEntry, errorMessage);
             return false;
         }
@@ -744,7 +2287,7 @@ namespace backup
             if (options().verbose && isSymlink)
             {
                 printWarningEvent(
-                    L"Symlink", whichDir, isFile, dirEntry.path().wstring(), symlinkTypeStr);
+                    L"Symlink", whichDir, isFile, pathToWideString(path), symlinkTypeStr);
             }
 
             return true;
@@ -752,36 +2295,92 @@ namespace backup
     }
 
     bool BaseFileOperations::copyAndCountFile(
-        const EntryConstRefDPair_t & entryDPair, Progress_t & byteCounter)
+        const EntryConstRefDPair_t & entryDPair, ProgressCounter_t & byteCounter)
     {
+        // only the first link to a file is copied, and the rest are linked to that copy
+        HardLinks::CopyClaim copyClaim(m_hardLinks, entryDPair.src);
+
+        if (copyClaim.isCopied() && linkToCopy(copyClaim.copiedDstEntry(), entryDPair.dst))
+        {
+            // nothing was written, so only the file is counted and not its size
+            Entry linkedEntry{ entryDPair.src };
+            linkedEntry.size = 0;
+            countCopy(linkedEntry);
+            return true;
+        }
+
         if (!options().dry_run)
         {
+            const DirFd & srcDirFd{ entryDPair.src.dirFd() };
+            const DirFd & dstDirFd{ entryDPair.dst.dirFd() };
+
             ErrorCode_t errorCode;
-            copyFileCommon(entryDPair.src.path, entryDPair.dst.path, errorCode);
+            if (srcDirFd.isOpen() && dstDirFd.isOpen())
+            {
+                srcDirFd.copyFileAt(
+                    entryDPair.src.name(), dstDirFd, entryDPair.dst.name(), errorCode);
+            }
+            else
+            {
+                copyFileCommon(entryDPair.src.path(), entryDPair.dst.path(), errorCode);
+            }
+
             if (!printAndCountErrorCodeIf(errorCode, Error::Copy, entryDPair.src))
             {
                 return false;
             }
         }
 
+        copyClaim.finish(entryDPair.dst);
+
         countCopy(entryDPair.src);
         byteCounter += entryDPair.src.size;
         return true;
     }
 
+    bool BaseFileOperations::linkToCopy(const Entry & copiedDstEntry, const Entry & dstEntry)
+    {
+        if (options().dry_run)
+        {
+            return true;
+        }
+
+        const DirFd & copiedDirFd{ copiedDstEntry.dirFd() };
+        const DirFd & dstDirFd{ dstEntry.dirFd() };
+
+        ErrorCode_t errorCode;
+        if (copiedDirFd.isOpen() && dstDirFd.isOpen())
+        {
+            copiedDirFd.linkAt(copiedDstEntry.name(), dstDirFd, dstEntry.name(), errorCode);
+        }
+        else
+        {
+            fs::create_hard_link(copiedDstEntry.path(), dstEntry.path(), errorCode);
+        }
+
+        // Not an error, because the file can always be copied instead.  This happens when dst
+        // is on a filesystem without hard links, or under a different mount than the copy, or
+        // when the copy already has as many links as the filesystem allows.
+        return !errorCode;
+    }
+
     bool BaseFileOperations::copyAndCountDirectoryShallow(const EntryConstRefDPair_t & entryDPair)
     {
         if (!options().dry_run)
         {
+            const DirFd & dstDirFd{ entryDPair.dst.dirFd() };
+
             ErrorCode_t errorCode;
-            const bool createDirectorySuccess{ fs::create_directory(
-                entryDPair.dst.path, errorCode) };
+            const bool createDirectorySuccess{
+                (dstDirFd.isOpen()) ? dstDirFd.makeDirectoryAt(entryDPair.dst.name(), errorCode)
+                                    : fs::create_directory(entryDPair.dst.path(), errorCode)
+            };
 
             if (!printAndCountErrorCodeIf(
                     errorCode,
                     Error::CreateDirectory,
                     entryDPair.dst,
-                    entryDPair.src.path.wstring()))
+                    pathToWideString(entryDPair.src.path())))
             {
                 return false;
             }
@@ -789,11 +2388,13 @@ namespace backup
             if (!createDirectorySuccess)
             {
                 printAndCountError(
-                    Error::CreateDirectory, entryDPair.dst, entryDPair.src.path.wstring());
+                    Error::CreateDirectory,
+                    entryDPair.dst,
+                    pathToWideString(entryDPair.src.path()));
                 return false;
             }
 
-            assert(existsIgnoringErrors(entryDPair.dst.path, false));
+            assert(existsIgnoringErrors(entryDPair.dst, false));
         }
 
         countCopy(entryDPair.src);
@@ -801,7 +2402,7 @@ namespace backup
     }
 
     bool BaseFileOperations::copyDirectoryDeep(
-        const EntryConstRefDPair_t & parentDirEntryDPair, Progress_t & byteCounter)
+        const EntryConstRefDPair_t & parentDirEntryDPair, ProgressCounter_t & byteCounter)
     {
         if (!copyAndCountDirectoryShallow(parentDirEntryDPair))
         {
@@ -810,13 +2411,36 @@ namespace backup
 
         bool wereAnyErrors{ false };
 
+        const DirNodePtr_t srcDirNodePtr{ std::make_shared<DirNode>(
+            parentDirEntryDPair.src.path()) };
+
         EntryVec_t fileEntrys;
         EntryVec_t dirEntrys;
-        if (!makeEntrysForAllInDirectory(parentDirEntryDPair.src, fileEntrys, dirEntrys))
+        if (!makeEntrysForAllInDirectory(
+                parentDirEntryDPair.src, srcDirNodePtr, fileEntrys, dirEntrys))
         {
             wereAnyErrors = true;
         }
 
+        const DirNodePtr_t dstDirNodePtr{ std::make_shared<DirNode>(
+            parentDirEntryDPair.dst.path()) };
+
+        // Only so everything can be copied into the new dir relative to it, so if this fails then
+        // whole paths are used instead, and any real problem will be an error when copying.
+        if (is_dir_fd_supported && !options().dry_run)
+        {
+            DirFd dstDirFd;
+            ErrorCode_t errorCodeIgnored;
+            if (dstDirFd.open(
+                    parentDirEntryDPair.dst.dirFd(),
+                    parentDirEntryDPair.dst.name(),
+                    dstDirNodePtr->path(),
+                    errorCodeIgnored))
+            {
+                dstDirNodePtr->keepDirFd(std::move(dstDirFd));
+            }
+        }
+
         auto doCopyWork = [&](const Entry & childSrcEntry) {
             // dst is the same as the src except of course for the path, see
             // comparEntrysWithSameType() dst could be either a file or dir, and could either exist
@@ -824,7 +2448,8 @@ namespace backup
             const Entry childDstEntry(
                 WhichDir::Destination,
                 childSrcEntry.is_file,
-                (parentDirEntryDPair.dst.path / childSrcEntry.name),
+                dstDirNodePtr,
+                childSrcEntry.name(),
                 childSrcEntry.size);
 
             const EntryConstRefDPair_t newEntryDPair{ childSrcEntry, childDstEntry };
@@ -861,4 +2486,140 @@ namespace backup
         return !wereAnyErrors;
     }
 
+    bool BaseFileOperations::moveToTrash(const Entry & entry, bool & wasMoved)
+    {
+        wasMoved = false;
+
+        // keep the same relative path inside the trash so it is easy to see what was culled
+        const fs::path relativePath{ entry.path().lexically_relative(options().path_dpair.dst) };
+        const fs::path trashPath{ m_trashRunPath / relativePath };
+
+        ErrorCode_t errorCodeRename;
+        const DirFd & dirFd{ entry.dirFd() };
+        if (dirFd.isOpen())
+        {
+            // The dirs above it in the trash are made and opened one at a time, each relative to
+            // the last, just like the dirs of the walk, so no whole path is ever used.
+            fs::path trashDirPath{ m_trashRunPath };
+            DirFd trashDirFd;
+            ErrorCode_t errorCodeCreate;
+            trashDirFd.open(DirFd(), PathStringView_t(), trashDirPath, errorCodeCreate);
+
+            for (const fs::path & name : relativePath.parent_path())
+            {
+                if (errorCodeCreate)
+                {
+                    break;
+                }
+
+                trashDirPath /= name;
+                trashDirFd.makeDirectoryAt(name.native(), errorCodeCreate);
+                if (!errorCodeCreate)
+                {
+                    DirFd childDirFd;
+                    childDirFd.open(trashDirFd, name.native(), trashDirPath, errorCodeCreate);
+                    trashDirFd = std::move(childDirFd);
+                }
+            }
+
+            if (!printAndCountErrorCodeIf(
+                    errorCodeCreate, Error::Remove, entry, pathToWideString(trashDirPath)))
+            {
+                return false;
+            }
+
+            dirFd.renameAt(entry.name(), trashDirFd, entry.name(), errorCodeRename);
+        }
+        else
+        {
+            ErrorCode_t errorCodeCreate;
+            fs::create_directories(trashPath.parent_path(), errorCodeCreate);
+            if (!printAndCountErrorCodeIf(
+                    errorCodeCreate,
+                    Error::Remove,
+                    entry,
+                    pathToWideString(trashPath.parent_path())))
+            {
+                return false;
+            }
+
+            fs::rename(entry.path(), trashPath, errorCodeRename);
+        }
+
+        // the trash can't be on another filesystem when it is inside dst, but a mount point
+        // somewhere in the dst tree can still cause this, so just delete it normally instead
+        if (errorCodeRename == std::errc::cross_device_link)
+        {
+            return true;
+        }
+
+        if (!printAndCountErrorCodeIf(
+                errorCodeRename, Error::Remove, entry, pathToWideString(trashPath)))
+        {
+            return false;
+        }
+
+        wasMoved = true;
+        return true;
+    }
+
+    fs::path BaseFileOperations::makeTrashRunPath() const
+    {
+        if ((options().job != Job::Cull) || !options().trash)
+        {
+            return {};
+        }
+
+        using namespace std::chrono;
+        const time_t nowCTime{ system_clock::to_time_t(system_clock::now()) };
+
+        std::ostringstream timeSS;
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable : 4996) // allow use of old unsafe localtime()
+#endif
+        timeSS << std::put_time(localtime(&nowCTime), "%F--%H-%M-%S");
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#endif
+
+        const fs::path trashPath{ makeTrashPath(options().path_dpair.dst) };
+
+        // a dry run never writes anything into dst
+        ErrorCode_t errorCode;
+        if (!options().dry_run)
+        {
+            fs::create_directories(trashPath, errorCode);
+        }
+
+        // Another run against the same dst might start within the same second, so they are
+        // numbered, and each run takes the first dir that it made itself so no two ever share
+        // one.  Any error is left for moveToTrash() to count when it can't use the dir.
+        std::size_t runNumber{ 0 };
+        while (true)
+        {
+            const fs::path runPath{ trashPath /
+                                    (timeSS.str() + "--" + std::to_string(runNumber++)) };
+
+            if (options().dry_run || errorCode || fs::create_directory(runPath, errorCode) ||
+                errorCode)
+            {
+                return runPath;
+            }
+        }
+    }
+
+    std::size_t BaseFileOperations::makeMaxListedEntryCount() const
+    {
+        if (0 == options().queue_memory_mb)
+        {
+            return 0;
+        }
+
+        // Give directory listings a quarter of the budget, and guess 512 bytes for each Entry.
+        // Even a small budget can list a normal sized directory without spilling.
+        const std::size_t budgetBytes{ options().queue_memory_mb * 1024 * 1024 };
+        return std::max(std::size_t(10'000), ((budgetBytes / 4) / 512));
+    }
+
 } // namespace backup
@@ -4,13 +4,32 @@
 // base-file-operations.hpp
 //
 #include "base-counters-and-errors.hpp"
+#include "digest-tree.hpp"
+#include "dir-snapshot.hpp"
+#include "hard-links.hpp"
+#include "helper-queue.hpp"
+#include "manifest.hpp"
 #include "task-resources.hpp"
 
+#include <unordered_set>
+
 namespace backup
 {
 
     class BaseFileOperations : public BaseCountersAndErrors
     {
+        // one name from a directory listing, and what stat'ing it found
+        struct ListedName
+        {
+            PathStringView_t name;
+            fs::file_type type = fs::file_type::none;
+            bool is_valid      = false;
+            bool is_file       = false;
+            LinkId_t link_id   = 0;
+            std::size_t size   = 0;
+            FileLinks links;
+        };
+
       protected:
         BaseFileOperations(const std::vector<std::string> & args);
         ~BaseFileOperations() = default;
@@ -19,61 +38,266 @@ namespace backup
         bool remove(TaskResourcesBase & resources);
         bool compareFileContents(FileCompareTaskResources & resources);
         bool compareDirectoryContents(DirectoryCompareTaskResources & resources);
+        bool purgeTrash();
+
+        // Walks the src dir in name order on this thread, and saves everything in it to the
+        // manifest_path.  The files of each dir are split into as many HelperQueue parts as
+        // there are threads that files are usually compared with.
+        bool exportManifest();
+
+        // Compares the two manifests given in place of the src and dst dirs without reading
+        // anything else.  Both are streamed through in HelperQueue parts split up by key, several
+        // for each of the threads that files are usually compared with.
+        bool diffManifests();
+
+        inline const fs::path & trashRunPath() const noexcept { return m_trashRunPath; }
 
         virtual void scheduleFileCompare(const EntryConstRefDPair_t & entryDPair)      = 0;
         virtual void scheduleDirectoryCompare(const EntryConstRefDPair_t & entryDPair) = 0;
-        virtual void scheduleFileCopy(const EntryConstRefDPair_t & entryDPair)         = 0;
         virtual void scheduleFileRemove(const EntryConstRefDPair_t & entryDPair)       = 0;
 
-        inline bool haveAnyExceptionsBeenThrown()
+        // the handle is no_entry_handle unless the entryDPair is from a queued task
+        virtual void scheduleFileCopy(
+            const EntryConstRefDPair_t & entryDPair, const EntryHandle_t handle) = 0;
+
+        // wakes any idle threads so they can execute parts of m_helperQueue
+        virtual void notifyHelpers() = 0;
+
+        inline HelperQueue & helperQueue() noexcept { return m_helperQueue; }
+        inline const HelperQueue & helperQueue() const noexcept { return m_helperQueue; }
+
+        inline bool haveAnyExceptionsBeenThrown() const
         {
             return (m_subThreadExceptions.wereAnyThrown());
         }
 
+        inline void addSubThreadException(const std::exception_ptr & exPtr)
+        {
+            m_subThreadExceptions.add(exPtr);
+        }
+
         void handleAnyExceptions();
 
+        // replaces the last run's snapshots with the ones this run made, see DirSnapshot
+        void finishDirSnapshots();
+
+        inline const DirPair<DirSnapshot> & dirSnapshots() const noexcept
+        {
+            return m_dirSnapshots;
+        }
+
+        // makes the Merkle digests and replaces the last run's digests, see DigestTree
+        void finishDigestTree();
+
+        inline const DigestTree & digestTree() const noexcept { return m_digestTree; }
+
       private:
         bool fileRead(
             const Entry & entry, const std::size_t readSize, FileReadResources & resources);
 
+        bool printAndCountFileErrorIf(
+            const FileReadResources & resources, const Error error, const Entry & entry);
+
+        // reads all of a file that is already open to make its ContentDigest
+        bool readAndDigestFile(
+            const Entry & entry,
+            FileReadResources & resources,
+            ProgressCounter_t & progress,
+            std::uint64_t & digest);
+
+        // If the runs are given then any listing too big to keep in memory is spilled into them,
+        // and then the entrys left in the vectors are only what didn't fit into any run.  All the
+        // Entrys made share dirNodePtr, which also keeps the DirFd of the listing if it can.
         bool makeEntrysForAllInDirectory(
-            const Entry & dirEntry, EntryVec_t & fileEntrys, EntryVec_t & dirEntrys);
+            const Entry & dirEntry,
+            const DirNodePtr_t & dirNodePtr,
+            EntryVec_t & fileEntrys,
+            EntryVec_t & dirEntrys,
+            EntryRuns * const fileRunsPtr = nullptr,
+            EntryRuns * const dirRunsPtr  = nullptr);
+
+        // the same as makeEntrysForAllInDirectory() but for a dst dir in a manifest
+        bool makeEntrysFromManifest(
+            const Entry & dirEntry,
+            const DirNodePtr_t & dirNodePtr,
+            EntryVec_t & fileEntrys,
+            EntryVec_t & dirEntrys,
+            EntryRuns * const fileRunsPtr,
+            EntryRuns * const dirRunsPtr);
 
+        // the file compare when the dst is a manifest, so only the src file is read
+        bool compareFileToManifest(FileCompareTaskResources & resources);
+
+        // everything that was listed in one dir, with the digests of all the files that could be
+        // read, in the name order a ManifestWriter needs
+        void makeManifestEntrys(
+            const EntryVec_t & fileEntrys,
+            const EntryVec_t & dirEntrys,
+            std::vector<ManifestEntry> & manifestEntrys);
+
+        // Merges the dirs of both manifests with keys from startKey up to but not including
+        // endKey, where an empty endKey means up to the end.
+        void diffManifestPart(
+            DirPair<ManifestReader> & readerDPair,
+            const PathStringView_t startKey,
+            const PathStringView_t endKey);
+
+        // Compares everything in a dir that both manifests have, and adds the keys of the subdirs
+        // that both have to expectedKeys.
+        void diffManifestDirs(
+            const DirPair<ManifestDir> & dirDPair,
+            std::unordered_set<PathString_t> & expectedKeys);
+
+        // true if the parent dir in both manifests has a subdir with this key
+        bool isManifestDirInBoth(
+            DirPair<ManifestReader> & readerDPair, const PathStringView_t key);
+
+        // an Entry for everything in the dir, with the digests of the files in the same order
+        void makeEntrysFromManifestDir(
+            const WhichDir whichDir,
+            const ManifestDir & dir,
+            EntryVec_t & fileEntrys,
+            EntryVec_t & dirEntrys,
+            std::vector<std::uint64_t> & fileDigests);
+
+        // any missing dst Entrys made share the DirFd of dstDirNodePtr
         bool comparEntrysWithSameType(
             const EntryDPair_t & parentEntryDPair,
-            const EntryVec_t & srcEntrys,
-            const EntryVec_t & dstEntrys);
+            const DirNodePtr_t & dstDirNodePtr,
+            EntryCursor & srcCursor,
+            EntryCursor & dstCursor);
 
         void compareEntrysWithSameTypeAndName(const EntryConstRefDPair_t & entryDPair);
 
         void makeAndStoreEntry(
             const WhichDir whichDir,
+            const DirNodePtr_t & parentDirNodePtr,
             const fs::directory_entry & dirEntry,
             EntryVec_t & fileEntrys,
             EntryVec_t & dirEntrys);
 
+        // the same as makeAndStoreEntry() but relative to the DirFd of the listing, and when
+        // there are enough to stat they are split up between any idle threads
+        void makeAndStoreEntrysAt(
+            const WhichDir whichDir,
+            const DirNodePtr_t & parentDirNodePtr,
+            const DirFd & dirFd,
+            std::vector<ListedName> & listedNames,
+            const std::size_t statCount,
+            EntryVec_t & fileEntrys,
+            EntryVec_t & dirEntrys);
+
+        // sortEntrysByName() with a huge listing split up between any idle threads, the same way
+        // makeAndStoreEntrysAt() splits up the stats
+        void sortEntrysByNameWithHelpers(EntryVec_t & entrys);
+
+        // false if the type from readdir() is all the job needs, see MetadataNeeds
+        bool willStatAt(const fs::file_type type) const;
+
+        // returns false if the entry should be skipped, after any errors have been counted
+        bool statEntryAt(
+            const WhichDir whichDir,
+            const DirNodePtr_t & parentDirNodePtr,
+            const DirFd & dirFd,
+            const PathStringView_t storedName,
+            const fs::file_type type,
+            bool & isFile,
+            LinkId_t & linkId,
+            FileLinks & links,
+            std::size_t & size);
+
+        // Makes the Entrys of a dir from what the last run's DirSnapshot found in it instead of
+        // stat'ing them, and returns false without making any if any of the few files checked has
+        // changed since.  The afterBatchFunction is called after every listed_name_batch_size.
+        bool makeEntrysFromSnapshot(
+            const WhichDir whichDir,
+            const DirNodePtr_t & dirNodePtr,
+            const DirFd & dirFd,
+            const std::vector<DirSnapshot::ListedEntry> & listedEntrys,
+            EntryVec_t & fileEntrys,
+            EntryVec_t & dirEntrys,
+            const std::function<void()> & afterBatchFunction);
+
+        // the name must already be stored in parentDirNodePtr, see DirNode::storeName()
+        void storeEntry(
+            const WhichDir whichDir,
+            const bool isFile,
+            const DirNodePtr_t & parentDirNodePtr,
+            const PathStringView_t storedName,
+            const LinkId_t linkId,
+            const std::size_t size,
+            EntryVec_t & fileEntrys,
+            EntryVec_t & dirEntrys);
+
         void
             incrementDirectoryIterator(const Entry & parentDirEntry, fs::directory_iterator & iter);
 
+        // the stamp of a file in its DirFd, or false if it has none
+        bool stampFile(const Entry & entry, InodeStamp & stamp) const;
+
+        // True if the last run found these the same and neither has changed since, and then they
+        // are added to this run's DigestTree without being read.
+        bool isVerifiedByDigest(const EntryConstRefDPair_t & entryDPair);
+
+        // adds two files found the same to this run's DigestTree, see compareFileContents()
+        void addFileDigest(const Entry & dstEntry, DigestTree::FileDigest & file);
+
+        // the handle is only given when the entryDPair is from a queued task, see EntryStore
         void handleMismatch(
             const Mismatch mismatch,
             const EntryConstRefDPair_t & entryDPair,
-            const std::wstring & message = L"");
+            const std::wstring & message = L"",
+            const EntryHandle_t handle   = no_entry_handle);
 
         bool setTypeOrHandleError(
             const WhichDir whichDir,
-            const fs::directory_entry & dirEntry,
+            const fs::path & path,
+            const fs::file_status & symlinkStatus,
+            const fs::file_status & normalStatus,
             bool & isFile,
             bool & hasSize);
 
-        bool copyAndCountFile(const EntryConstRefDPair_t & entryDPair, Progress_t & byteCounter);
+        bool copyAndCountFile(
+            const EntryConstRefDPair_t & entryDPair, ProgressCounter_t & byteCounter);
+
+        // false if the dst couldn't be made a hard link to the copy, so it has to be copied too
+        bool linkToCopy(const Entry & copiedDstEntry, const Entry & dstEntry);
 
         bool copyAndCountDirectoryShallow(const EntryConstRefDPair_t & entryDPair);
 
-        bool copyDirectoryDeep(const EntryConstRefDPair_t & entryDPair, Progress_t & byteCounter);
+        bool copyDirectoryDeep(
+            const EntryConstRefDPair_t & entryDPair, ProgressCounter_t & byteCounter);
+
+        bool moveToTrash(const Entry & entry, bool & wasMoved);
+
+        fs::path makeTrashRunPath() const;
+        std::size_t makeMaxListedEntryCount() const;
 
       private:
         ThreadExceptions m_subThreadExceptions;
+        fs::path m_trashRunPath;
+
+        // zero if directory listings are never spilled, see EntryRuns
+        std::size_t m_maxListedEntryCount;
+
+        HelperQueue m_helperQueue;
+        HardLinks m_hardLinks;
+        DigestTree m_digestTree;
+        ManifestReader m_manifestReader;
+        DirPair<DirSnapshot> m_dirSnapshots;
+
+        // Listings are stat'ed a batch at a time, and a batch with at least parallel_stat_min
+        // names to stat is split into parts of stat_part_size for any idle threads to help with.
+        static inline constexpr std::size_t listed_name_batch_size{ 16 * 1024 };
+        static inline constexpr std::size_t parallel_stat_min{ 1024 };
+        static inline constexpr std::size_t stat_part_size{ 256 };
+
+        // see diffManifests()
+        static inline constexpr std::size_t manifest_diff_parts_per_thread{ 8 };
+
+        // how many files of each dir made from a DirSnapshot are stat'ed to check it, see
+        // --quick-check
+        static inline constexpr std::size_t snapshot_sample_count{ 3 };
     };
 
 } // namespace backup
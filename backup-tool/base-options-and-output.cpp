@@ -11,6 +11,7 @@
 #include <algorithm>
 #include <cassert>
 #include <thread>
+#include <utility>
 
 namespace backup
 {
@@ -36,20 +37,44 @@ namespace backup
         printLine(ss.str());
 
         printLine(
-            L"    Note: This app checks every bit of every file, but ignores all dates/times.",
+            L"    Note: This app checks every bit of every file and ignores all dates/times,\n"
+            L"          except that --snapshot and --digests trust a dir or file whose mtime and\n"
+            L"          ctime haven't changed since the last run, so it isn't listed or read.",
             Color::Yellow);
 
         // clang-format off
     ss.str(L"");
     ss << L"    -\n";
     ss << L"    --compare         Shows all missing/modified/extra files/dirs, but does nothing.\n";
+    ss << L"                      (the destination can also be a manifest file that --export-manifest saved)\n";
     ss << L"    --copy            Copies (replaces) all missing/modified files/dirs.\n";
     ss << L"    --cull            Deletes only the extra files/dirs. (anything not in src)\n";
+    ss << L"    --purge-trash     Deletes everything that --trash moved into the trash of the dst dir, the only dir it needs.\n";
+    ss << L"    --export-manifest=PATH\n";
+    ss << L"                      Saves the names, sizes, and digests of everything in the one dir given to PATH.\n";
+    ss << L"    --diff-manifests  Shows all missing/modified/extra between two manifest files, and reads nothing else.\n";
     ss << L"    -\n";
     ss << L"    --help            Shows this, but does nothing else.\n";
     ss << L"    --dry-run         A safe mode that does nothing except show what WOULD have been done.\n";
     ss << L"    --background      Runs minimal threads to prevent slowing your computer down.\n";
+    ss << L"    --autotune        Keeps adjusting how many of each task run at once to find the fastest mix.\n";
+    ss << L"    --autotune-min=N  The fewest of each task --autotune will run at once. (default 1)\n";
+    ss << L"    --autotune-max=N  The most of each task --autotune will run at once. (default 2x detected threads)\n";
+    ss << L"    --probe           Reads a little from the src and dst at startup to pick read sizes and threads.\n";
+    ss << L"    --profile=PATH    Uses what an earlier --probe saved to PATH, or with --probe saves it there.\n";
+    ss << L"    --queue-memory=N  The most MB that all the waiting tasks should use. (default 1024, 0 means no limit)\n";
+    ss << L"    --spill-dir=PATH  Where tasks and dir listings over --queue-memory are written. (default is the temp dir)\n";
+    ss << L"    --order-dirs=O    The order dirs are compared in:  lifo, fifo, deepest, shallowest. (default lifo)\n";
+    ss << L"    --order-files=O   The order files are compared in:  lifo, fifo, largest, smallest, inode, disk. (default lifo)\n";
+    ss << L"    --order-copies=O  Same as --order-files but for copies.\n";
+    ss << L"    --order-deletes=O Same as --order-files but for deletes.\n";
+    ss << L"                      (inode and disk take files in about the order they are on disk, for spinning disks)\n";
+    ss << L"    --snapshot        Keeps snapshots of src and dst in dst's .backup-tool dir to skip listing unchanged dirs next time.\n";
+    ss << L"    --quick-check     With --snapshot, trusts the sizes in an unchanged dir after stat'ing only a few of its files.\n";
+    ss << L"    --digests         Keeps file and Merkle dir digests in dst's .backup-tool dir so unchanged files aren't read next time.\n";
+    ss << L"    --scrub           The same as --digests but reads every file anyway, and reports any that changed silently.\n";
     ss << L"    --skip-file-read  Files with the exact same size are assumed to have the same contents.\n";
+    ss << L"    --trash           Culled files/dirs are quickly moved into a trash dir instead of deleted.\n";
     ss << L"    --show-relative   Displays relative paths instead of absolute paths.\n";
     ss << L"    --verbose         Shows extra info. (i.e. warns on symlinks/shortcuts/weird stuff).\n";
     ss << L"    --quiet           Shows only errors and the final result.\n";
@@ -98,15 +123,43 @@ namespace backup
         {
             ss << L"Copying";
         }
-        else
+        else if (Job::Cull == m_options.job)
         {
             ss << L"Culling";
         }
+        else if (Job::Export == m_options.job)
+        {
+            ss << L"Exporting Manifest";
+        }
+        else if (Job::Diff == m_options.job)
+        {
+            ss << L"Diffing Manifests";
+        }
+        else
+        {
+            ss << L"Purging Trash";
+        }
 
         ss << L"...\n";
 
-        ss << L"   src: " << m_options.path_str_dpair.src;
-        ss << L"\n   dst: " << m_options.path_str_dpair.dst;
+        if (Job::Purge != m_options.job)
+        {
+            ss << L"   src: " << m_options.path_str_dpair.src << L"\n";
+        }
+
+        if (Job::Export == m_options.job)
+        {
+            ss << L"   manifest: " << pathToWideString(m_options.manifest_path);
+        }
+        else
+        {
+            ss << L"   dst: " << m_options.path_str_dpair.dst;
+
+            if (m_options.isDstManifest() || (Job::Diff == m_options.job))
+            {
+                ss << L" (manifest)";
+            }
+        }
 
         printLine(ss.str());
     }
@@ -128,10 +181,27 @@ namespace backup
         };
 
         appendFlagIf(m_options.background, L"background");
+        appendFlagIf(m_options.autotune, L"autotune");
+        appendFlagIf(m_options.probe, L"probe");
+        appendFlagIf(m_options.snapshot, L"snapshot");
+        appendFlagIf(m_options.quick_check, L"quick_check");
+        appendFlagIf(m_options.digests, L"digests");
+        appendFlagIf(m_options.scrub, L"scrub");
         appendFlagIf(m_options.dry_run, L"dry_run");
         appendFlagIf(m_options.skip_file_read, L"skip_file_read");
         appendFlagIf(m_options.verbose, L"verbose");
         appendFlagIf(m_options.show_relative_path, L"show_relative_path");
+        appendFlagIf(m_options.trash, L"trash");
+
+        // only show the task orders that are not the default
+        auto appendOrderIf = [&](const TaskOrder order, const std::wstring & name) {
+            appendFlagIf((order != TaskOrder::Lifo), (name + L"=" + toString(order)));
+        };
+
+        appendOrderIf(m_options.task_orders.dir_compare, L"order_dirs");
+        appendOrderIf(m_options.task_orders.file_compare, L"order_files");
+        appendOrderIf(m_options.task_orders.copy, L"order_copies");
+        appendOrderIf(m_options.task_orders.remove, L"order_deletes");
 
         if (m_options.ignore_access_error || m_options.ignore_extra || m_options.ignore_unknown ||
             m_options.ignore_warnings)
@@ -170,6 +240,22 @@ namespace backup
             str += std::to_wstring(m_options.thread_counts.copy);
             str += L", delete_threads=";
             str += std::to_wstring(m_options.thread_counts.remove);
+            str += L", queue_memory_mb=";
+            str += std::to_wstring(m_options.queue_memory_mb);
+
+            if (m_options.queue_memory_mb > 0)
+            {
+                str += L", spill_dir=";
+                str += pathToWideString(m_options.spill_dir);
+            }
+
+            if (m_options.autotune)
+            {
+                str += L", autotune_min=";
+                str += std::to_wstring(m_options.autotune_min);
+                str += L", autotune_max=";
+                str += std::to_wstring(m_options.autotune_max);
+            }
         }
 
         if (!str.empty())
@@ -177,6 +263,24 @@ namespace backup
             str = (L"   (" + str + L")");
             printLine(str);
         }
+
+        if (m_options.probe || !m_options.profile_path.empty())
+        {
+            const IoProfile & profile{ m_options.io_profile };
+
+            std::wostringstream ss;
+            ss << L"   src device: " << toString(profile.device_dpair.src) << L"\n";
+            ss << L"   dst device: " << toString(profile.device_dpair.dst) << L"\n";
+            ss << L"   io profile: " << toString(profile);
+
+            if (!m_options.profile_path.empty())
+            {
+                ss << (m_options.probe ? L", saved to \"" : L", loaded from \"");
+                ss << pathToWideString(m_options.profile_path) << L"\"";
+            }
+
+            printLine(ss.str());
+        }
     }
 
     void BaseOptionsAndOutput::printConflictingOptionsWarnings()
@@ -190,12 +294,90 @@ namespace backup
                 Color::Yellow);
         }
 
+        if ((Job::Cull != m_options.job) && m_options.trash)
+        {
+            m_options.trash = false;
+
+            printLine(
+                L"Warning:  The --trash option is only used by the --cull option.", Color::Yellow);
+        }
+
+        if (m_options.background && m_options.autotune)
+        {
+            m_options.autotune = false;
+
+            printLine(
+                L"Warning:  The --autotune option disabled by the --background option.",
+                Color::Yellow);
+        }
+
         if (m_options.quiet && m_options.verbose)
         {
             m_options.quiet = false;
             printLine(
                 L"Warning:  The --quiet option disabled by the --verbose option.", Color::Yellow);
         }
+
+        // both keep their files in the dst dir, which a manifest doesn't have
+        if ((m_options.snapshot || m_options.digests) &&
+            (m_options.isDstManifest() || (Job::Export == m_options.job) ||
+             (Job::Diff == m_options.job)))
+        {
+            m_options.snapshot    = false;
+            m_options.quick_check = false;
+            m_options.digests     = false;
+            m_options.scrub       = false;
+
+            printLine(
+                L"Warning:  The --snapshot and --digests options can't be used with a manifest.",
+                Color::Yellow);
+        }
+
+        if ((Job::Export == m_options.job) && m_options.skip_file_read)
+        {
+            m_options.skip_file_read = false;
+
+            printLine(
+                L"Warning:  The --skip-file-read option disabled by the --export-manifest option, "
+                L"which needs the digest of every file.",
+                Color::Yellow);
+        }
+
+        if (m_options.digests &&
+            (m_options.skip_file_read || (Job::Cull == m_options.job) ||
+             (Job::Purge == m_options.job)))
+        {
+            m_options.digests = false;
+            m_options.scrub   = false;
+
+            printLine(
+                L"Warning:  The --digests and --scrub options are only used when files are read "
+                L"by a compare or copy.",
+                Color::Yellow);
+        }
+
+        if (m_options.quick_check && !m_options.snapshot)
+        {
+            m_options.quick_check = false;
+
+            printLine(
+                L"Warning:  The --quick-check option is only used by the --snapshot option.",
+                Color::Yellow);
+        }
+
+        // device numbers can change between boots, and the profile could be for other disks
+        if (!m_options.probe && !m_options.profile_path.empty())
+        {
+            const DirPair<DeviceInfo> & devices{ m_options.io_profile.device_dpair };
+            if ((findDevice(m_options.path_dpair.src) != devices.src.device) ||
+                (findDevice(m_options.path_dpair.dst) != devices.dst.device))
+            {
+                printLine(
+                    L"Warning:  The --profile was probed on different devices, consider --probe "
+                    L"again.",
+                    Color::Yellow);
+            }
+        }
     }
 
     void BaseOptionsAndOutput::printLine(std::wstring_view str, const Color color)
@@ -292,7 +474,7 @@ namespace backup
             name,
             entry.which_dir,
             entry.is_file,
-            entry.path.wstring(),
+            pathToWideString(entry.path()),
             errorCleaned,
             color);
     }
@@ -314,8 +496,10 @@ namespace backup
     {
         m_output.color(Options::isColorEnabledByDefault());
         setOptions_FromCommandLineArgs(args);
-        setOptions_ThreadCounts();
         setOptions_SourceAndDestinationDirectories();
+        setOptions_ThreadCounts();
+        setOptions_SpillDirectory();
+        setOptions_MetadataNeeds();
     }
 
     void BaseOptionsAndOutput::setOptions_ThreadCounts()
@@ -344,6 +528,8 @@ namespace backup
             m_options.thread_counts.file_compare = halfPlusOne;
         }
 
+        setOptions_IoProfile();
+
         if (Job::Copy == m_options.job)
         {
             m_options.thread_counts.copy = m_options.thread_counts.file_compare;
@@ -358,11 +544,156 @@ namespace backup
         {
             m_options.thread_counts.dir_compare += (m_options.thread_counts.file_compare / 2);
         }
+
+        // the counts above are where --autotune starts, so they must be within its bounds
+        if (m_options.autotune)
+        {
+            if (0 == m_options.autotune_max)
+            {
+                m_options.autotune_max = std::clamp(
+                    (m_options.thread_counts.total_detected * 2), 8_st, 128_st);
+            }
+
+            if ((0 == m_options.autotune_min) ||
+                (m_options.autotune_min > m_options.autotune_max))
+            {
+                printAndThrow(
+                    L"The --autotune-min option must be at least one and no more than the "
+                    L"--autotune-max option.");
+            }
+
+            auto clampToBounds = [&](std::size_t & count) {
+                if (count > 0)
+                {
+                    count = std::clamp(count, m_options.autotune_min, m_options.autotune_max);
+                }
+            };
+
+            clampToBounds(m_options.thread_counts.dir_compare);
+            clampToBounds(m_options.thread_counts.file_compare);
+            clampToBounds(m_options.thread_counts.copy);
+            clampToBounds(m_options.thread_counts.remove);
+        }
+    }
+
+    void BaseOptionsAndOutput::setOptions_IoProfile()
+    {
+        IoProfile & profile{ m_options.io_profile };
+
+        if (m_options.probe)
+        {
+            // only --purge-trash has no src
+            const fs::path & dstPath{ m_options.path_dpair.dst };
+            const fs::path & srcPath{ (m_options.path_dpair.src.empty())
+                                          ? dstPath
+                                          : m_options.path_dpair.src };
+
+            const DeviceInfo srcInfo{ probeDevice(srcPath) };
+            // a manifest is only a file that is read a little at a time, so only the src matters
+            const DeviceInfo dstInfo{ ((dstPath == srcPath) || m_options.isDstManifest())
+                                          ? srcInfo
+                                          : probeDevice(dstPath) };
+
+            profile = makeIoProfile({ srcInfo, dstInfo }, m_options.thread_counts.total_detected);
+
+            std::wstring error;
+            if (!m_options.profile_path.empty() &&
+                !saveIoProfile(profile, m_options.profile_path, error))
+            {
+                printAndThrow(
+                    error + L": \"" + pathToWideString(m_options.profile_path) + L"\"");
+            }
+        }
+        else if (!m_options.profile_path.empty())
+        {
+            std::wstring error;
+            if (!loadIoProfile(profile, m_options.profile_path, error))
+            {
+                printAndThrow(
+                    error + L": \"" + pathToWideString(m_options.profile_path) + L"\"");
+            }
+        }
+
+        // the copy and delete threads are set from this below, and --background always wins
+        if (!m_options.background && (profile.file_threads > 0))
+        {
+            m_options.thread_counts.file_compare = profile.file_threads;
+        }
     }
 
     void BaseOptionsAndOutput::setOptions_SourceAndDestinationDirectories()
     {
-        if (m_options.path_str_dpair.src.empty())
+        // Purging the trash only needs the dst dir, so the one path given is the dst, and there is
+        // no src.  A src given before the dst is allowed but never used.
+        if ((Job::Purge == m_options.job) && m_options.path_str_dpair.dst.empty())
+        {
+            std::swap(m_options.path_dpair.src, m_options.path_dpair.dst);
+            std::swap(m_options.path_str_dpair.src, m_options.path_str_dpair.dst);
+
+            ErrorCode_t errorCode;
+            printAndThrowIf(
+                WhichDir::Destination,
+                (!m_options.path_dpair.dst.empty() &&
+                 !fs::is_directory(m_options.path_dpair.dst, errorCode)),
+                m_options.path_str_dpair.dst,
+                L"Path is a file, and --purge-trash needs the destination directory.");
+        }
+
+        // only --diff-manifests takes a manifest as the src, see setOptions_setPathhSpecific()
+        if ((Job::Diff != m_options.job) && !m_options.path_dpair.src.empty())
+        {
+            ErrorCode_t errorCode;
+            printAndThrowIf(
+                WhichDir::Source,
+                !fs::is_directory(m_options.path_dpair.src, errorCode),
+                m_options.path_str_dpair.src,
+                L"Path is a file, and only --diff-manifests can take a manifest as the source.");
+        }
+
+        // Exporting only reads the one dir given, so that is used as both.  The dst is never
+        // listed, but it's still the dir that the app's own dir would be found in.
+        if (Job::Export == m_options.job)
+        {
+            if (!m_options.path_str_dpair.dst.empty())
+            {
+                printAndThrow(L"The --export-manifest option only takes the one dir to export.");
+            }
+
+            m_options.path_dpair.dst     = m_options.path_dpair.src;
+            m_options.path_str_dpair.dst = m_options.path_str_dpair.src;
+
+            // the manifest being written would be listed and read while it was written
+            PathString_t keyIgnored;
+            if (!m_options.path_dpair.src.empty() &&
+                makeRelativeKey(
+                    WhichDir::Source,
+                    m_options.path_dpair.src.native(),
+                    m_options.manifest_path,
+                    keyIgnored))
+            {
+                printAndThrow(
+                    L"The --export-manifest file can't be inside the dir being exported: \"" +
+                    pathToWideString(m_options.manifest_path) + L"\"");
+            }
+        }
+        else if (Job::Diff == m_options.job)
+        {
+            // the dst was taken as a manifest when it was given, but the src is only checked here
+            ErrorCode_t errorCode;
+            if (!m_options.path_dpair.src.empty() &&
+                (!fs::is_regular_file(m_options.path_dpair.src, errorCode) ||
+                 m_options.manifest_path.empty()))
+            {
+                printAndThrow(L"The --diff-manifests option takes two manifest files.");
+            }
+        }
+        else if (!m_options.manifest_path.empty() && !m_options.isDstManifest())
+        {
+            printAndThrow(
+                L"Only --compare can use a manifest in place of the destination directory.");
+        }
+
+        if (m_options.path_str_dpair.src.empty() && (Job::Purge != m_options.job))
         {
             printAndThrow(L"No source directory.");
         }
@@ -372,13 +703,57 @@ namespace backup
         }
         else
         {
-            m_options.entry_dpair.src = Entry(WhichDir::Source, false, options().path_dpair.src, 0);
+            if (!m_options.path_str_dpair.src.empty())
+            {
+                m_options.entry_dpair.src =
+                    Entry(WhichDir::Source, false, options().path_dpair.src, 0);
+            }
 
             m_options.entry_dpair.dst =
                 Entry(WhichDir::Destination, false, options().path_dpair.dst, 0);
         }
     }
 
+    void BaseOptionsAndOutput::setOptions_SpillDirectory()
+    {
+        // nothing is ever spilled without a memory limit
+        if (0 == m_options.queue_memory_mb)
+        {
+            return;
+        }
+
+        ErrorCode_t errorCode;
+        if (m_options.spill_dir.empty())
+        {
+            m_options.spill_dir = fs::temp_directory_path(errorCode);
+            if (errorCode)
+            {
+                printAndThrow(
+                    L"Failed to find the temp dir, use --spill-dir to choose one instead. (" +
+                    toString(errorCode) + L")");
+            }
+        }
+
+        if (!fs::is_directory(m_options.spill_dir, errorCode))
+        {
+            printAndThrow(
+                L"The --spill-dir is not a directory: \"" +
+                pathToWideString(m_options.spill_dir) + L"\"");
+        }
+    }
+
+    void BaseOptionsAndOutput::setOptions_MetadataNeeds()
+    {
+        // Cull never compares files with the same name, so it only needs the names and types of
+        // what is listed, which readdir() usually gives without any stat calls at all.  Links are
+        // then removed as links without ever looking at what they point to.
+        if (Job::Cull == m_options.job)
+        {
+            m_options.metadata_needs.file_size   = false;
+            m_options.metadata_needs.link_target = false;
+        }
+    }
+
     void BaseOptionsAndOutput::setOptions_FromCommandLineArgs(const std::vector<std::string> & args)
     {
         if (args.size() <= 1)
@@ -411,6 +786,19 @@ namespace backup
         {
             m_options.job = Job::Cull;
         }
+        else if (arg == "--purge-trash")
+        {
+            m_options.job = Job::Purge;
+        }
+        else if (arg == "--diff-manifests")
+        {
+            m_options.job = Job::Diff;
+        }
+        else if (arg.rfind("--export-manifest=", 0) == 0)
+        {
+            m_options.job           = Job::Export;
+            m_options.manifest_path = fs::absolute(setOptions_MakePathString(arg.substr(18)));
+        }
         else if (arg == "--dry-run")
         {
             m_options.dry_run = true;
@@ -419,6 +807,59 @@ namespace backup
         {
             m_options.background = true;
         }
+        else if (arg == "--autotune")
+        {
+            m_options.autotune = true;
+        }
+        else if (setOptions_IfCountOption(arg, "--autotune-min", m_options.autotune_min))
+        {
+            m_options.autotune = true;
+        }
+        else if (setOptions_IfCountOption(arg, "--autotune-max", m_options.autotune_max))
+        {
+            m_options.autotune = true;
+        }
+        else if (arg == "--snapshot")
+        {
+            m_options.snapshot = true;
+        }
+        else if (arg == "--quick-check")
+        {
+            m_options.quick_check = true;
+        }
+        else if (arg == "--digests")
+        {
+            m_options.digests = true;
+        }
+        else if (arg == "--scrub")
+        {
+            m_options.digests = true;
+            m_options.scrub   = true;
+        }
+        else if (arg == "--probe")
+        {
+            m_options.probe = true;
+        }
+        else if (arg.rfind("--profile=", 0) == 0)
+        {
+            m_options.profile_path = fs::path(setOptions_MakePathString(arg.substr(10)));
+        }
+        else if (setOptions_IfCountOption(arg, "--queue-memory", m_options.queue_memory_mb))
+        {
+            // the count was already set
+        }
+        else if (arg.rfind("--spill-dir=", 0) == 0)
+        {
+            m_options.spill_dir = fs::path(setOptions_MakePathString(arg.substr(12)));
+        }
+        else if (
+            setOptions_IfOrderOption(arg, "--order-dirs", m_options.task_orders.dir_compare) ||
+            setOptions_IfOrderOption(arg, "--order-files", m_options.task_orders.file_compare) ||
+            setOptions_IfOrderOption(arg, "--order-copies", m_options.task_orders.copy) ||
+            setOptions_IfOrderOption(arg, "--order-deletes", m_options.task_orders.remove))
+        {
+            // the order was already set by whichever one matched
+        }
         else if (arg == "--verbose")
         {
             m_options.verbose = true;
@@ -454,6 +895,10 @@ namespace backup
             m_options.ignore_unknown      = true;
             m_options.ignore_warnings     = true;
         }
+        else if (arg == "--trash")
+        {
+            m_options.trash = true;
+        }
         else if (arg == "--show-relative")
         {
             m_options.show_relative_path = true;
@@ -487,6 +932,71 @@ namespace backup
         return true;
     }
 
+    // for options like "--name=N" where N must be a whole number
+    bool BaseOptionsAndOutput::setOptions_IfCountOption(
+        const std::string & arg, const std::string & name, std::size_t & count)
+    {
+        const std::string prefix{ name + "=" };
+
+        if (arg.rfind(prefix, 0) != 0)
+        {
+            return false;
+        }
+
+        const std::string valueStr{ arg.substr(prefix.size()) };
+
+        if (valueStr.empty() ||
+            !std::all_of(std::begin(valueStr), std::end(valueStr), [](const char CH) {
+                return ((CH >= '0') && (CH <= '9'));
+            }))
+        {
+            printAndThrow(L"Invalid number in option: \"" + strutil::toWideString(arg) + L"\"");
+        }
+
+        try
+        {
+            count = static_cast<std::size_t>(std::stoull(valueStr));
+        }
+        catch (const std::exception &)
+        {
+            printAndThrow(L"Invalid number in option: \"" + strutil::toWideString(arg) + L"\"");
+        }
+
+        return true;
+    }
+
+    // for options like "--name=O" where O must be the name of a TaskOrder
+    bool BaseOptionsAndOutput::setOptions_IfOrderOption(
+        const std::string & arg, const std::string & name, TaskOrder & order)
+    {
+        const std::string prefix{ name + "=" };
+
+        if (arg.rfind(prefix, 0) != 0)
+        {
+            return false;
+        }
+
+        const std::wstring valueStr{ strutil::toWideString(arg.substr(prefix.size())) };
+
+        for (const TaskOrder possibleOrder : { TaskOrder::Lifo,
+                                               TaskOrder::Fifo,
+                                               TaskOrder::LargestFirst,
+                                               TaskOrder::SmallestFirst,
+                                               TaskOrder::DeepestFirst,
+                                               TaskOrder::ShallowestFirst,
+                                               TaskOrder::InodeSweep,
+                                               TaskOrder::DiskSweep })
+        {
+            if (valueStr == toString(possibleOrder))
+            {
+                order = possibleOrder;
+                return true;
+            }
+        }
+
+        printAndThrow(L"Invalid order in option: \"" + strutil::toWideString(arg) + L"\"");
+    }
+
     std::wstring BaseOptionsAndOutput::setOptions_MakePathString(const std::string & arg)
     {
         std::string pathStr{ arg };
@@ -533,18 +1043,19 @@ namespace backup
 
         printAndThrowIf(
             whichDir,
-            (pathObj.empty() || pathObj.wstring().empty()),
-            pathObj.wstring(),
+            (pathObj.empty() || pathToWideString(pathObj).empty()),
+            pathToWideString(pathObj),
             L"Path could not be made absolute");
 
         ErrorCode_t errorCode;
         const bool doesExist{ fs::exists(pathObj, errorCode) };
-        printAndThrowIfErrorCode(whichDir, errorCode, pathObj.wstring(), L"Path does not exist");
+        printAndThrowIfErrorCode(
+            whichDir, errorCode, pathToWideString(pathObj), L"Path does not exist");
 
         printAndThrowIf(
             whichDir,
             !doesExist,
-            pathObj.wstring(),
+            pathToWideString(pathObj),
             L"Path does not exist (after cleanup and making absolute)");
 
         errorCode.clear();
@@ -552,17 +1063,32 @@ namespace backup
         printAndThrowIfErrorCode(
             whichDir,
             errorCode,
-            pathObj.wstring(),
-            L"Path failed symlink_status()" + pathObj.wstring());
+            pathToWideString(pathObj),
+            L"Path failed symlink_status()" + pathToWideString(pathObj));
+
+        // a manifest can be compared in place of the dst dir, see isDstManifest()
+        if ((WhichDir::Destination == whichDir) && fs::is_regular_file(status))
+        {
+            m_options.manifest_path                 = pathObj;
+            m_options.path_str_dpair.get(whichDir) = pathToWideString(pathObj);
+            return;
+        }
+
+        // --diff-manifests can come after the paths, so this is checked again once all are set
+        if ((WhichDir::Source == whichDir) && fs::is_regular_file(status))
+        {
+            m_options.path_str_dpair.get(whichDir) = pathToWideString(pathObj);
+            return;
+        }
 
         printAndThrowIf(
             whichDir,
             !fs::is_directory(status),
-            pathObj.wstring(),
+            pathToWideString(pathObj),
             (std::wstring(L"Path is a ") + toString(status.type()) +
              L", which is not a kind of supported directory on this operating system."));
 
-        m_options.path_str_dpair.get(whichDir) = pathObj.wstring();
+        m_options.path_str_dpair.get(whichDir) = pathToWideString(pathObj);
     }
 
     void BaseOptionsAndOutput::streamRelativePath(
@@ -60,9 +60,16 @@ namespace backup
       private:
         void setOptions(const std::vector<std::string> & args);
         void setOptions_ThreadCounts();
+        void setOptions_IoProfile();
         void setOptions_SourceAndDestinationDirectories();
+        void setOptions_SpillDirectory();
+        void setOptions_MetadataNeeds();
         void setOptions_FromCommandLineArgs(const std::vector<std::string> & args);
         bool setOptions_IfOptionString(const std::string & arg);
+        bool setOptions_IfCountOption(
+            const std::string & arg, const std::string & name, std::size_t & count);
+        bool setOptions_IfOrderOption(
+            const std::string & arg, const std::string & name, TaskOrder & order);
         std::wstring setOptions_MakePathString(const std::string & arg);
         void setOptions_setPath(const std::string & arg);
         void setOptions_setPathhSpecific(const WhichDir whichDir, const std::wstring & pathStr);
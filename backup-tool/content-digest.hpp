@@ -0,0 +1,114 @@
+#ifndef BACKUP_CONTENT_DIGEST_HPP_INCLUDED
+#define BACKUP_CONTENT_DIGEST_HPP_INCLUDED
+//
+// content-digest.hpp
+//
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace backup
+{
+
+    // A 64 bit digest of any number of bytes added in any size pieces, which only depends on the
+    // bytes and never on how they were split up.  It is FNV-1a over eight bytes at a time, with a
+    // shift after each multiply so the high bytes change the low bits too.  That is plenty to spot
+    // damaged or changed data, and is much faster than any disk, but it is not meant to stand up
+    // to anyone trying to make two things with the same digest.
+    class ContentDigest
+    {
+      public:
+        ContentDigest()
+            : m_hash(offset_basis)
+            , m_totalSize(0)
+            , m_tail()
+            , m_tailSize(0)
+        {}
+
+        void add(const char * data, std::size_t size) noexcept
+        {
+            // an empty buffer can have a null data, which memcpy() must never be given
+            if (0 == size)
+            {
+                return;
+            }
+
+            m_totalSize += size;
+
+            if (m_tailSize > 0)
+            {
+                const std::size_t copySize{ std::min(size, (word_size - m_tailSize)) };
+                std::memcpy((m_tail + m_tailSize), data, copySize);
+                m_tailSize += copySize;
+                data += copySize;
+                size -= copySize;
+
+                if (m_tailSize < word_size)
+                {
+                    return;
+                }
+
+                addWord(m_tail);
+                m_tailSize = 0;
+            }
+
+            while (size >= word_size)
+            {
+                addWord(data);
+                data += word_size;
+                size -= word_size;
+            }
+
+            std::memcpy(m_tail, data, size);
+            m_tailSize = size;
+        }
+
+        // can be called at any time, and more can still be added after
+        std::uint64_t value() const noexcept
+        {
+            std::uint64_t hash{ m_hash };
+
+            for (std::size_t i{ 0 }; i < m_tailSize; ++i)
+            {
+                hash = ((hash ^ static_cast<std::uint8_t>(m_tail[i])) * prime);
+            }
+
+            hash = ((hash ^ m_totalSize) * prime);
+
+            // the usual splitmix64 finish, so every input bit can change every output bit
+            hash = ((hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9ULL);
+            hash = ((hash ^ (hash >> 27)) * 0x94d049bb133111ebULL);
+            return (hash ^ (hash >> 31));
+        }
+
+        static std::uint64_t make(const char * const data, const std::size_t size) noexcept
+        {
+            ContentDigest digest;
+            digest.add(data, size);
+            return digest.value();
+        }
+
+      private:
+        inline void addWord(const char * const data) noexcept
+        {
+            std::uint64_t word{ 0 };
+            std::memcpy(&word, data, word_size);
+
+            m_hash = ((m_hash ^ word) * prime);
+            m_hash ^= (m_hash >> 29);
+        }
+
+        static inline constexpr std::size_t word_size{ sizeof(std::uint64_t) };
+        static inline constexpr std::uint64_t offset_basis{ 14695981039346656037ULL };
+        static inline constexpr std::uint64_t prime{ 1099511628211ULL };
+
+        std::uint64_t m_hash;
+        std::uint64_t m_totalSize;
+        char m_tail[word_size];
+        std::size_t m_tailSize;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_CONTENT_DIGEST_HPP_INCLUDED
@@ -88,7 +88,26 @@ namespace backup
 
             if (iter == std::end(m_counteds))
             {
-                m_counteds.push_back(Counted{ name, 0_st, 1_st, size });
+                m_counteds.push_back(Counted{ name, 0_st, 1_st, size, PathString_t() });
+            }
+            else
+            {
+                iter->count++;
+                iter->bytes += size;
+            }
+        }
+
+        void Counter::incrementByPathName(const PathStringView_t name, const std::size_t size)
+        {
+            const auto iter{ std::find_if(
+                std::begin(m_counteds), std::end(m_counteds), [&name](const Counted & ct) {
+                    return (ct.path_name == name);
+                }) };
+
+            if (iter == std::end(m_counteds))
+            {
+                const std::wstring wideName{ (name.empty()) ? L"\"\"" : toWideString(name) };
+                m_counteds.push_back(Counted{ wideName, 0_st, 1_st, size, PathString_t(name) });
             }
             else
             {
@@ -224,7 +243,7 @@ namespace backup
                 }
 
                 Counted notListedCounted{
-                    L"(unlisted)", 0, notListedTotalCount, notListedTotalSize
+                    L"(unlisted)", 0, notListedTotalCount, notListedTotalSize, PathString_t()
                 };
 
                 lines.emplace_back(notListedCounted, allCount, allBytes);
@@ -321,8 +340,7 @@ namespace backup
         {
             ++m_fileCount;
 
-            m_fileExtensionCounter.incrementByName(
-                ((entry.extension.empty()) ? L"\"\"" : entry.extension), entry.size);
+            m_fileExtensionCounter.incrementByPathName(entry.extension(), entry.size);
         }
         else
         {
@@ -29,6 +29,9 @@ namespace backup
             std::size_t number = 0;
             std::size_t count  = 0;
             std::size_t bytes  = 0;
+
+            // only used by Counter::incrementByPathName()
+            PathString_t path_name;
         };
 
         using CountedVec_t     = std::vector<Counted>;
@@ -68,6 +71,10 @@ namespace backup
 
             void incrementByName(const std::wstring & name, const std::size_t size);
 
+            // the same but finds by the name as it was listed, so it's only made wide once, and
+            // an empty name is shown as ""
+            void incrementByPathName(const PathStringView_t name, const std::size_t size);
+
             void incrementByNumber(
                 const std::size_t number, const std::wstring & name, const std::size_t size);
 
@@ -120,7 +127,8 @@ namespace backup
         {
             std::scoped_lock scopedLock(m_mutex);
             return (
-                (m_fileExtensionCounter.totalCount() == 0) && (m_enumCounter.totalCount() == 0));
+                (m_fileCount == 0) && (m_directoryCount == 0) &&
+                (m_enumCounter.totalCount() == 0));
         }
 
         template <typename T>
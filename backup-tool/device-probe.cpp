@@ -0,0 +1,476 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// device-probe.cpp
+//
+#include "device-probe.hpp"
+
+#include "dir-fd.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace backup
+{
+
+    namespace
+    {
+        // the read test stops at whichever of these it reaches first
+        constexpr std::size_t probe_max_ms{ 250 };
+        constexpr std::size_t probe_max_files{ 32 };
+        constexpr std::size_t probe_max_entrys{ 10'000 };
+        constexpr std::size_t probe_max_bytes{ 64_st << 20 };
+        constexpr std::size_t probe_max_file_bytes{ 8_st << 20 };
+        constexpr std::size_t probe_read_size{ 1_st << 20 };
+
+        // A device that reads slower than this, or takes longer than this to start reading a file,
+        // is something like a USB stick or a network mount that /sys says nothing useful about.
+        constexpr std::size_t slow_bytes_per_sec{ 40_st << 20 };
+        constexpr std::size_t slow_first_read_us{ 5'000 };
+
+        // a queue this deep is a device (i.e. NVMe) that needs many reads in flight to keep up
+        constexpr std::size_t deep_nr_requests{ 256 };
+
+        constexpr std::size_t max_profile_read_size{ 1_st << 28 };
+
+        // a file under /sys that holds a single number, returns false if it can't be read
+        bool readSysNumber(const fs::path & path, std::size_t & number)
+        {
+            InputFileStream_t stream(path);
+
+            unsigned long long value{ 0 };
+            if (!(stream >> value))
+            {
+                return false;
+            }
+
+            number = static_cast<std::size_t>(value);
+            return true;
+        }
+
+        // The queue of a partition is the queue of the whole disk it is on, which is the parent of
+        // the partition under /sys.  Returns an empty path if it is not a block device at all.
+        fs::path findSysQueuePath(const std::uint64_t device)
+        {
+            const fs::path devicePath{ fs::path(L"/sys/dev/block") / deviceToString(device) };
+
+            ErrorCode_t errorCode;
+            for (const fs::path & queuePath : { (devicePath / "queue"), (devicePath / "../queue") })
+            {
+                if (fs::is_directory(queuePath, errorCode))
+                {
+                    return queuePath;
+                }
+            }
+
+            return fs::path();
+        }
+
+        void probeSysSettings(DeviceInfo & info)
+        {
+            const fs::path queuePath{ findSysQueuePath(info.device) };
+            if (queuePath.empty())
+            {
+                return;
+            }
+
+            std::size_t rotational{ 0 };
+            info.is_known      = readSysNumber((queuePath / "rotational"), rotational);
+            info.is_rotational = (rotational != 0);
+
+            readSysNumber((queuePath / "optimal_io_size"), info.optimal_io_size);
+            readSysNumber((queuePath / "nr_requests"), info.nr_requests);
+        }
+
+        // times reading the first files found under dirPath, with the same kind of stream the file
+        // compares fall back on, and never following any links
+        void probeReadSpeed(const fs::path & dirPath, DeviceInfo & info)
+        {
+            std::vector<char> buffer(probe_read_size);
+
+            std::size_t fileCount{ 0 };
+            std::size_t entryCount{ 0 };
+            std::size_t totalBytes{ 0 };
+            std::size_t firstReadUsTotal{ 0 };
+
+            const Clock_t::time_point startTime{ Clock_t::now() };
+
+            ErrorCode_t errorCode;
+            fs::recursive_directory_iterator iter(
+                dirPath, fs::directory_options::skip_permission_denied, errorCode);
+
+            for (; !errorCode && (iter != fs::recursive_directory_iterator());
+                 iter.increment(errorCode))
+            {
+                if ((++entryCount > probe_max_entrys) || (fileCount >= probe_max_files) ||
+                    (totalBytes >= probe_max_bytes) ||
+                    (elapsedCountMs(startTime) >= probe_max_ms))
+                {
+                    break;
+                }
+
+                ErrorCode_t statusErrorCode;
+                if (!fs::is_regular_file(iter->symlink_status(statusErrorCode)))
+                {
+                    continue;
+                }
+
+                const Clock_t::time_point openTime{ Clock_t::now() };
+
+                InputFileStream_t stream(iter->path(), (std::ios::binary | std::ios::in));
+
+                std::size_t fileBytes{ 0 };
+                while (stream && (fileBytes < probe_max_file_bytes))
+                {
+                    stream.read(&buffer[0], static_cast<std::streamsize>(buffer.size()));
+
+                    const auto readCount{ static_cast<std::size_t>(stream.gcount()) };
+                    if (0 == readCount)
+                    {
+                        break;
+                    }
+
+                    if (0 == fileBytes)
+                    {
+                        using namespace std::chrono;
+                        firstReadUsTotal += static_cast<std::size_t>(
+                            duration_cast<microseconds>(Clock_t::now() - openTime).count());
+                    }
+
+                    fileBytes += readCount;
+                }
+
+                if (fileBytes > 0)
+                {
+                    ++fileCount;
+                    totalBytes += fileBytes;
+                }
+            }
+
+            if (0 == fileCount)
+            {
+                return;
+            }
+
+            using namespace std::chrono;
+            const auto elapsedUs{ static_cast<std::size_t>(
+                duration_cast<microseconds>(Clock_t::now() - startTime).count()) };
+
+            info.read_bytes_per_sec = static_cast<std::size_t>(
+                (static_cast<double>(totalBytes) * 1'000'000.0) /
+                static_cast<double>(std::max(elapsedUs, 1_st)));
+
+            info.first_read_us = (firstReadUsTotal / fileCount);
+        }
+
+        bool isSlow(const DeviceInfo & info)
+        {
+            return (
+                ((info.read_bytes_per_sec > 0) && (info.read_bytes_per_sec < slow_bytes_per_sec)) ||
+                (info.first_read_us > slow_first_read_us));
+        }
+
+        std::size_t roundUpToPowerOfTwo(const std::size_t number)
+        {
+            std::size_t result{ 1 };
+            while (result < number)
+            {
+                result *= 2;
+            }
+
+            return result;
+        }
+
+        // "16K" instead of "16.0K" because read sizes are always whole powers of two
+        std::wstring readSizeToString(const std::size_t size)
+        {
+            if ((size >= (1_st << 20)) && ((size % (1_st << 20)) == 0))
+            {
+                return (std::to_wstring(size >> 20) + L"M");
+            }
+
+            if ((size >= (1_st << 10)) && ((size % (1_st << 10)) == 0))
+            {
+                return (std::to_wstring(size >> 10) + L"K");
+            }
+
+            return std::to_wstring(size);
+        }
+
+        void writeDeviceInfo(
+            std::ostream & os, const std::string & prefix, const DeviceInfo & info)
+        {
+            os << prefix << "device=" << info.device << "\n";
+            os << prefix << "is_known=" << (info.is_known ? 1 : 0) << "\n";
+            os << prefix << "rotational=" << (info.is_rotational ? 1 : 0) << "\n";
+            os << prefix << "optimal_io_size=" << info.optimal_io_size << "\n";
+            os << prefix << "nr_requests=" << info.nr_requests << "\n";
+            os << prefix << "read_bytes_per_sec=" << info.read_bytes_per_sec << "\n";
+            os << prefix << "first_read_us=" << info.first_read_us << "\n";
+        }
+
+        // returns false if the key is not one of the DeviceInfo keys writeDeviceInfo() writes
+        bool setDeviceInfoValue(
+            DeviceInfo & info, const std::string & key, const std::uint64_t value)
+        {
+            const auto size{ static_cast<std::size_t>(value) };
+
+            // clang-format off
+            if      (key == "device")             { info.device             = value;        }
+            else if (key == "is_known")           { info.is_known           = (value != 0); }
+            else if (key == "rotational")         { info.is_rotational      = (value != 0); }
+            else if (key == "optimal_io_size")    { info.optimal_io_size    = size;         }
+            else if (key == "nr_requests")        { info.nr_requests        = size;         }
+            else if (key == "read_bytes_per_sec") { info.read_bytes_per_sec = size;         }
+            else if (key == "first_read_us")      { info.first_read_us      = size;         }
+            else                                  { return false;                           }
+            // clang-format on
+
+            return true;
+        }
+
+    } // namespace
+
+    std::uint64_t findDevice(const fs::path & dirPath)
+    {
+        DirFd dirFd;
+        ErrorCode_t errorCode;
+        dirFd.open(DirFd(), PathStringView_t(), dirPath, errorCode);
+        return dirFd.device();
+    }
+
+    DeviceInfo probeDevice(const fs::path & dirPath)
+    {
+        DeviceInfo info;
+        info.device = findDevice(dirPath);
+
+        if (info.device != 0)
+        {
+            probeSysSettings(info);
+        }
+
+        probeReadSpeed(dirPath, info);
+        return info;
+    }
+
+    IoProfile makeIoProfile(const DirPair<DeviceInfo> & deviceDPair, const std::size_t threadCount)
+    {
+        IoProfile profile;
+        profile.device_dpair = deviceDPair;
+
+        const DeviceInfo & src{ deviceDPair.src };
+        const DeviceInfo & dst{ deviceDPair.dst };
+
+        // both are read from or written to at once, so the slower one sets the pace
+        if (src.is_rotational || dst.is_rotational)
+        {
+            // Every seek takes milliseconds, so read big chunks and only keep a couple of files
+            // going at once, one reading while the other seeks.  More only makes the heads thrash.
+            profile.min_read_size = (1_st << 18);
+            profile.max_read_size = (1_st << 22);
+            profile.file_threads  = 2;
+        }
+        else if (isSlow(src) || isSlow(dst))
+        {
+            profile.file_threads = 2;
+        }
+        else
+        {
+            const std::size_t nrRequests{ ((0 == src.nr_requests) || (0 == dst.nr_requests))
+                                              ? std::max(src.nr_requests, dst.nr_requests)
+                                              : std::min(src.nr_requests, dst.nr_requests) };
+
+            if (nrRequests >= deep_nr_requests)
+            {
+                profile.file_threads = std::clamp(threadCount, 4_st, 64_st);
+            }
+        }
+
+        // reading less than the device prefers at once only splits what it would do anyway
+        const std::size_t optimalIoSize{ std::max(src.optimal_io_size, dst.optimal_io_size) };
+        if (optimalIoSize > profile.max_read_size)
+        {
+            profile.max_read_size =
+                std::min(roundUpToPowerOfTwo(optimalIoSize), (1_st << 24));
+        }
+
+        return profile;
+    }
+
+    bool saveIoProfile(const IoProfile & profile, const fs::path & path, std::wstring & error)
+    {
+        OutputFileStream_t stream(path, (std::ios::out | std::ios::trunc));
+        if (!stream)
+        {
+            error = L"Failed to open the --profile file for writing";
+            return false;
+        }
+
+        stream << "# made by backup --probe, and used by --profile to skip probing next time\n";
+        stream << "min_read_size=" << profile.min_read_size << "\n";
+        stream << "max_read_size=" << profile.max_read_size << "\n";
+        stream << "file_threads=" << profile.file_threads << "\n";
+        writeDeviceInfo(stream, "src_", profile.device_dpair.src);
+        writeDeviceInfo(stream, "dst_", profile.device_dpair.dst);
+
+        stream.flush();
+        if (!stream)
+        {
+            error = L"Failed to write the --profile file";
+            return false;
+        }
+
+        return true;
+    }
+
+    bool loadIoProfile(IoProfile & profile, const fs::path & path, std::wstring & error)
+    {
+        InputFileStream_t stream(path);
+        if (!stream)
+        {
+            error = L"Failed to open the --profile file, use --probe to make one";
+            return false;
+        }
+
+        IoProfile loaded;
+
+        std::string line;
+        std::size_t lineNumber{ 0 };
+        while (std::getline(stream, line))
+        {
+            ++lineNumber;
+
+            strutil::trimWhitespace(line);
+            if (line.empty() || (line.front() == '#'))
+            {
+                continue;
+            }
+
+            const std::wstring lineError{ L" on line " + std::to_wstring(lineNumber) +
+                                          L" of the --profile file" };
+
+            const std::size_t equalsPos{ line.find('=') };
+            if (equalsPos == std::string::npos)
+            {
+                error = (L"Missing '='" + lineError);
+                return false;
+            }
+
+            const std::string key{ line.substr(0, equalsPos) };
+            const std::string valueStr{ line.substr(equalsPos + 1) };
+
+            if (valueStr.empty() ||
+                !std::all_of(std::begin(valueStr), std::end(valueStr), [](const char CH) {
+                    return ((CH >= '0') && (CH <= '9'));
+                }))
+            {
+                error = (L"Invalid number" + lineError);
+                return false;
+            }
+
+            std::uint64_t value{ 0 };
+            try
+            {
+                value = static_cast<std::uint64_t>(std::stoull(valueStr));
+            }
+            catch (const std::exception &)
+            {
+                error = (L"Invalid number" + lineError);
+                return false;
+            }
+
+            const auto size{ static_cast<std::size_t>(value) };
+
+            bool isKnownKey{ true };
+            if (key == "min_read_size")
+            {
+                loaded.min_read_size = size;
+            }
+            else if (key == "max_read_size")
+            {
+                loaded.max_read_size = size;
+            }
+            else if (key == "file_threads")
+            {
+                loaded.file_threads = size;
+            }
+            else if (key.rfind("src_", 0) == 0)
+            {
+                isKnownKey = setDeviceInfoValue(loaded.device_dpair.src, key.substr(4), value);
+            }
+            else if (key.rfind("dst_", 0) == 0)
+            {
+                isKnownKey = setDeviceInfoValue(loaded.device_dpair.dst, key.substr(4), value);
+            }
+            else
+            {
+                isKnownKey = false;
+            }
+
+            if (!isKnownKey)
+            {
+                error = (L"Unknown key \"" + strutil::toWideString(key) + L"\"" + lineError);
+                return false;
+            }
+        }
+
+        if ((0 == loaded.min_read_size) || (loaded.min_read_size > loaded.max_read_size) ||
+            (loaded.max_read_size > max_profile_read_size))
+        {
+            error = L"The read sizes in the --profile file are out of order or too big";
+            return false;
+        }
+
+        profile = loaded;
+        return true;
+    }
+
+    std::wstring toString(const DeviceInfo & info)
+    {
+        std::wstring str{ (0 == info.device) ? std::wstring(L"?") : deviceToString(info.device) };
+
+        if (info.is_known)
+        {
+            str += (info.is_rotational ? L" rotational" : L" non-rotational");
+            str += L", optimal_io_size=" + std::to_wstring(info.optimal_io_size);
+            str += L", nr_requests=" + std::to_wstring(info.nr_requests);
+        }
+        else
+        {
+            str += L" not a block device";
+        }
+
+        if (info.read_bytes_per_sec > 0)
+        {
+            str += L", read=" + fileSizeToString(info.read_bytes_per_sec) + L"/s";
+            str += L", first_read=" + std::to_wstring(info.first_read_us) + L"us";
+        }
+        else
+        {
+            str += L", nothing read";
+        }
+
+        return str;
+    }
+
+    std::wstring toString(const IoProfile & profile)
+    {
+        std::wstring str;
+        str += L"read_sizes=" + readSizeToString(profile.min_read_size);
+        str += L"-" + readSizeToString(profile.max_read_size);
+
+        str += L", file_threads=";
+        if (0 == profile.file_threads)
+        {
+            str += L"default";
+        }
+        else
+        {
+            str += std::to_wstring(profile.file_threads);
+        }
+
+        return str;
+    }
+
+} // namespace backup
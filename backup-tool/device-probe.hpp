@@ -0,0 +1,72 @@
+#ifndef BACKUP_DEVICE_PROBE_HPP_INCLUDED
+#define BACKUP_DEVICE_PROBE_HPP_INCLUDED
+//
+// device-probe.hpp
+//
+#include "dir-pair.hpp"
+#include "filesystem-common.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace backup
+{
+
+    // What --probe found out about the device behind the src or dst dir, from the block queue
+    // settings Linux shows under /sys and from a brief timed read of a few files.  Anything that
+    // could not be found is left zero, which is always the case for the /sys settings of devices
+    // that are not block devices (i.e. tmpfs or network mounts) and on Windows.
+    struct DeviceInfo
+    {
+        std::uint64_t device = 0;
+        bool is_known        = false;
+        bool is_rotational   = false;
+
+        // in bytes and in requests, straight from /sys/dev/block/<major:minor>/queue/
+        std::size_t optimal_io_size = 0;
+        std::size_t nr_requests     = 0;
+
+        // Zero if nothing was read.  These are of whatever the OS had cached, so a device that was
+        // just read from will look faster than it is, but never slower.
+        std::size_t read_bytes_per_sec = 0;
+        std::size_t first_read_us      = 0;
+    };
+
+    // The I/O parameters a job runs with, which are either the defaults, or what --probe picked
+    // from the DeviceInfos, or what was saved to a --profile file by an earlier --probe.
+    struct IoProfile
+    {
+        static inline constexpr std::size_t default_min_read_size{ 1 << 14 };
+        static inline constexpr std::size_t default_max_read_size{ 1 << 20 };
+
+        // every file compare starts reading at the min and doubles each read up to the max
+        std::size_t min_read_size = default_min_read_size;
+        std::size_t max_read_size = default_max_read_size;
+
+        // how many file compares and copies run at once on each pair of devices, zero leaves the
+        // default from the number of threads detected
+        std::size_t file_threads = 0;
+
+        DirPair<DeviceInfo> device_dpair;
+    };
+
+    // the DeviceInfo::device of a dir, or zero if it can't be found
+    std::uint64_t findDevice(const fs::path & dirPath);
+
+    // the /sys settings and a timed read of at most a fraction of a second, never throws
+    DeviceInfo probeDevice(const fs::path & dirPath);
+
+    // picks the read sizes and threads for the slower of the two devices
+    IoProfile makeIoProfile(const DirPair<DeviceInfo> & deviceDPair, const std::size_t threadCount);
+
+    // a "key=value" text file, where both return false and set error if anything goes wrong
+    bool saveIoProfile(const IoProfile & profile, const fs::path & path, std::wstring & error);
+    bool loadIoProfile(IoProfile & profile, const fs::path & path, std::wstring & error);
+
+    std::wstring toString(const DeviceInfo & info);
+    std::wstring toString(const IoProfile & profile);
+
+} // namespace backup
+
+#endif // BACKUP_DEVICE_PROBE_HPP_INCLUDED
@@ -0,0 +1,283 @@
+#ifndef BACKUP_DEVICE_TASK_QUEUES_HPP_INCLUDED
+#define BACKUP_DEVICE_TASK_QUEUES_HPP_INCLUDED
+//
+// device-task-queues.hpp
+//
+#include "dir-pair.hpp"
+#include "task-queue.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace backup
+{
+
+    // the DirNode::device() of the src and dst of a task, where zero means unknown
+    using DeviceDPair_t = DirPair<std::uint64_t>;
+
+    //
+
+    // One ResourceLimitedParallelTaskQueue for every pair of src and dst devices that tasks were
+    // pushed for, each with its own active limit, so that a slow USB disk can only ever tie up
+    // its own share of the threads, and the rest are free to keep a fast NVMe drive busy.
+    //
+    // The first queue is for tasks on unknown devices, and it is the only one when not split by
+    // device.  Queues are only ever added, never removed, until this object is destroyed, and
+    // finding the queue for a task never locks, because there are so few of them.  A pair of
+    // devices past the max_queue_count simply shares the first queue.
+    //
+    // The active limit and spill limit are set on every queue, including any added later, so the
+    // limit is per device pair and not for all of them together.
+    template <typename Resource_t>
+    class DeviceTaskQueues
+    {
+        struct DeviceQueue
+        {
+            DeviceQueue(
+                const DeviceDPair_t & deviceDPair,
+                EntryStore & entryStore,
+                const std::size_t resourceCount,
+                const TaskOrder order)
+                : devices(deviceDPair)
+                , queue(entryStore, resourceCount, order)
+            {}
+
+            const DeviceDPair_t devices;
+            ResourceLimitedParallelTaskQueue<Resource_t> queue;
+        };
+
+      public:
+        using TaskQueue_t = ResourceLimitedParallelTaskQueue<Resource_t>;
+
+        static inline constexpr std::size_t max_queue_count{ 16 };
+
+        DeviceTaskQueues(
+            EntryStore & entryStore,
+            const std::size_t resourceCount,
+            const TaskOrder order,
+            const bool isSplitByDevice)
+            : m_entryStore(entryStore)
+            , m_order(order)
+            , m_isSplitByDevice(isSplitByDevice)
+            , m_mutex()
+            , m_queuePtrs(max_queue_count) // this must be the only time this reallocates!
+            , m_queueCount(0)
+            , m_ownedQueues()
+            , m_activeLimit(resourceCount)
+            , m_spillLimitBytes(0)
+            , m_spillDirPath()
+        {
+            add(DeviceDPair_t{ 0, 0 });
+        }
+
+        DeviceTaskQueues(const DeviceTaskQueues &) = delete;
+        DeviceTaskQueues(DeviceTaskQueues &&)      = delete;
+        DeviceTaskQueues & operator=(const DeviceTaskQueues &) = delete;
+        DeviceTaskQueues & operator=(DeviceTaskQueues &&) = delete;
+
+        std::size_t queueCount() const { return m_queueCount; }
+        TaskQueue_t & queue(const std::size_t index) { return m_queuePtrs[index].load()->queue; }
+
+        const TaskQueue_t & queue(const std::size_t index) const
+        {
+            return m_queuePtrs[index].load()->queue;
+        }
+
+        const DeviceDPair_t & devices(const std::size_t index) const
+        {
+            return m_queuePtrs[index].load()->devices;
+        }
+
+        // every queue has the same, see setActiveLimit()
+        std::size_t resourceCount() const { return queue(0).resourceCount(); }
+        std::size_t activeLimit() const { return m_activeLimit; }
+
+        void setActiveLimit(const std::size_t limit)
+        {
+            std::scoped_lock lock(m_mutex);
+
+            for (std::size_t i{ 0 }; i < m_queueCount; ++i)
+            {
+                queue(i).setActiveLimit(limit);
+            }
+
+            m_activeLimit = queue(0).activeLimit();
+        }
+
+        void setSpillLimit(const std::size_t limitBytes, const fs::path & spillDirPath)
+        {
+            std::scoped_lock lock(m_mutex);
+
+            for (std::size_t i{ 0 }; i < m_queueCount; ++i)
+            {
+                queue(i).setSpillLimit(limitBytes, spillDirPath);
+            }
+
+            m_spillLimitBytes = limitBytes;
+            m_spillDirPath    = spillDirPath;
+        }
+
+        // wasQueueAdded is set to true if this was the first task for its pair of devices
+        TaskQueueStatus push(
+            const EntryConstRefDPair_t & entryDPair,
+            const EntryHandle_t handle,
+            bool & wasQueueAdded)
+        {
+            wasQueueAdded = false;
+
+            if (!m_isSplitByDevice)
+            {
+                return queue(0).push(entryDPair, handle);
+            }
+
+            const DeviceDPair_t deviceDPair{ entryDPair.src.device(), entryDPair.dst.device() };
+
+            const std::size_t count{ m_queueCount };
+
+            std::size_t index{ find(deviceDPair, count) };
+            if (index == count)
+            {
+                index = add(deviceDPair);
+                wasQueueAdded = (index != 0);
+            }
+
+            return queue(index).push(entryDPair, handle);
+        }
+
+        bool isReady() const
+        {
+            const std::size_t count{ m_queueCount };
+            for (std::size_t i{ 0 }; i < count; ++i)
+            {
+                if (queue(i).isReady())
+                {
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        // all the queues added up, so resource_count is the sum of all their active limits
+        TaskQueueStatus status() const
+        {
+            TaskQueueStatus total{ queue(0).status() };
+
+            const std::size_t count{ m_queueCount };
+            for (std::size_t i{ 1 }; i < count; ++i)
+            {
+                total += queue(i).status();
+            }
+
+            return total;
+        }
+
+        std::size_t busyCount() const
+        {
+            std::size_t total{ 0 };
+
+            const std::size_t count{ m_queueCount };
+            for (std::size_t i{ 0 }; i < count; ++i)
+            {
+                total += queue(i).busyCount();
+            }
+
+            return total;
+        }
+
+        std::size_t queueBytes() const
+        {
+            std::size_t total{ 0 };
+
+            const std::size_t count{ m_queueCount };
+            for (std::size_t i{ 0 }; i < count; ++i)
+            {
+                total += queue(i).queueBytes();
+            }
+
+            return total;
+        }
+
+      private:
+        // returns count if not found
+        std::size_t find(const DeviceDPair_t & deviceDPair, const std::size_t count) const
+        {
+            for (std::size_t i{ 0 }; i < count; ++i)
+            {
+                const DeviceDPair_t & devices{ m_queuePtrs[i].load()->devices };
+                if ((devices.src == deviceDPair.src) && (devices.dst == deviceDPair.dst))
+                {
+                    return i;
+                }
+            }
+
+            return count;
+        }
+
+        // returns the index of the queue for these devices, which might have just been added by
+        // another thread, or might be the first queue if there are already too many
+        std::size_t add(const DeviceDPair_t & deviceDPair)
+        {
+            std::scoped_lock lock(m_mutex);
+
+            const std::size_t count{ m_queueCount };
+
+            const std::size_t index{ find(deviceDPair, count) };
+            if (index < count)
+            {
+                return index;
+            }
+
+            if (count == max_queue_count)
+            {
+                return 0;
+            }
+
+            const std::size_t newResourceCount{ (count > 0) ? resourceCount()
+                                                            : m_activeLimit.load() };
+
+            m_ownedQueues.push_back(std::make_unique<DeviceQueue>(
+                deviceDPair, m_entryStore, newResourceCount, m_order));
+
+            TaskQueue_t & newQueue{ m_ownedQueues.back()->queue };
+            if (newQueue.activeLimit() != m_activeLimit)
+            {
+                newQueue.setActiveLimit(m_activeLimit);
+            }
+
+            if (m_spillLimitBytes > 0)
+            {
+                newQueue.setSpillLimit(m_spillLimitBytes, m_spillDirPath);
+            }
+
+            // must be stored before it is counted, so other threads never see it half made
+            m_queuePtrs[count] = m_ownedQueues.back().get();
+            m_queueCount       = (count + 1);
+            return count;
+        }
+
+      private:
+        EntryStore & m_entryStore;
+        const TaskOrder m_order;
+        const bool m_isSplitByDevice;
+
+        // only locked while adding a queue or changing the limits of all of them
+        std::mutex m_mutex;
+
+        // see ResourceLimitedParallelTaskQueue::m_resourcePtrs
+        std::vector<std::atomic<DeviceQueue *>> m_queuePtrs;
+        std::atomic<std::size_t> m_queueCount;
+        std::vector<std::unique_ptr<DeviceQueue>> m_ownedQueues;
+
+        std::atomic<std::size_t> m_activeLimit;
+        std::size_t m_spillLimitBytes;
+        fs::path m_spillDirPath;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_DEVICE_TASK_QUEUES_HPP_INCLUDED
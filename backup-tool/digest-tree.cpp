@@ -0,0 +1,585 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// digest-tree.cpp
+//
+#include "digest-tree.hpp"
+
+#include "content-digest.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace backup
+{
+
+    DigestTree::DigestTree()
+        : m_isOpen(false)
+        , m_srcRootStr()
+        , m_dstRootStr()
+        , m_path()
+        , m_newPath()
+        , m_loadedBytes()
+        , m_loadedDirs()
+        , m_mutex()
+        , m_newDirs()
+        , m_newStream()
+        , m_writeBuffer()
+        , m_recordCount(0)
+        , m_isWriting(false)
+        , m_didWriteFail(false)
+        , m_verifiedCount(0)
+        , m_readCount(0)
+        , m_silentChangeCount(0)
+        , m_rootDigest(0)
+        , m_wasRootLoaded(false)
+        , m_isRootUnchanged(false)
+        , m_changedKeys()
+    {}
+
+    DigestTree::~DigestTree()
+    {
+        if (!m_isWriting)
+        {
+            return;
+        }
+
+        m_newStream.close();
+
+        // the run never finished, so leave the old digests for the next run to use
+        ErrorCode_t errorCode;
+        fs::remove(m_newPath, errorCode);
+    }
+
+    fs::path DigestTree::makePath(const fs::path & dstRootPath)
+    {
+        return (dstRootPath / tool_dir_name / L"digests");
+    }
+
+    bool DigestTree::open(
+        const DirPair<fs::path> & rootPathDPair,
+        const fs::path & path,
+        const bool willWrite,
+        std::wstring & warning)
+    {
+        m_isOpen     = true;
+        m_srcRootStr = rootPathDPair.src.native();
+        m_dstRootStr = rootPathDPair.dst.native();
+        m_path       = path;
+        m_newPath    = m_path;
+        m_newPath += L".new";
+
+        bool isOk{ true };
+
+        ErrorCode_t errorCodeExists;
+        if (fs::exists(m_path, errorCodeExists) && !load(m_path, warning))
+        {
+            m_loadedDirs.clear();
+            m_loadedBytes.clear();
+            isOk = false;
+        }
+
+        if (!willWrite)
+        {
+            return isOk;
+        }
+
+        ErrorCode_t errorCodeCreate;
+        fs::create_directories(m_path.parent_path(), errorCodeCreate);
+
+        m_newStream.open(m_newPath, (std::ios::binary | std::ios::out | std::ios::trunc));
+        if (errorCodeCreate || !m_newStream)
+        {
+            warning = L"Failed to start new digests, so none will be saved this run";
+            return false;
+        }
+
+        m_isWriting = true;
+        m_writeBuffer.reserve(write_buffer_size * 2);
+        m_writeBuffer.insert(std::end(m_writeBuffer), file_magic, (file_magic + magic_size));
+        serialize::appendValue(m_writeBuffer, static_cast<std::uint32_t>(sizeof(PathChar_t)));
+        serialize::appendString(m_writeBuffer, m_srcRootStr);
+        serialize::appendString(m_writeBuffer, m_dstRootStr);
+
+        return isOk;
+    }
+
+    bool DigestTree::load(const fs::path & path, std::wstring & warning)
+    {
+        warning = L"The digests from the last run could not be used, so every file will be read "
+                  L"again";
+
+        std::ifstream stream(path, (std::ios::binary | std::ios::in | std::ios::ate));
+        if (!stream)
+        {
+            return false;
+        }
+
+        const auto fileSize{ static_cast<std::size_t>(stream.tellg()) };
+        const std::size_t headerSize{ magic_size + sizeof(std::uint32_t) };
+        const std::size_t footerSize{ magic_size + sizeof(std::uint64_t) };
+        if (fileSize < (headerSize + footerSize))
+        {
+            return false;
+        }
+
+        m_loadedBytes.resize(fileSize);
+        stream.seekg(0);
+        if (!stream.read(m_loadedBytes.data(), static_cast<std::streamsize>(fileSize)))
+        {
+            return false;
+        }
+
+        const char * pos{ m_loadedBytes.data() };
+        const char * const fileEnd{ m_loadedBytes.data() + fileSize };
+        const char * const end{ fileEnd - footerSize };
+
+        if ((std::memcmp(pos, file_magic, magic_size) != 0) ||
+            (std::memcmp(end, end_magic, magic_size) != 0))
+        {
+            return false;
+        }
+
+        pos += magic_size;
+
+        std::uint32_t charSize{ 0 };
+        PathString_t srcRootStr;
+        PathString_t dstRootStr;
+        if (!serialize::readValue(pos, end, charSize) || (charSize != sizeof(PathChar_t)) ||
+            !serialize::readString(pos, end, srcRootStr) ||
+            !serialize::readString(pos, end, dstRootStr))
+        {
+            return false;
+        }
+
+        // digests of another pair of dirs say nothing about these
+        if ((srcRootStr != m_srcRootStr) || (dstRootStr != m_dstRootStr))
+        {
+            return false;
+        }
+
+        std::uint64_t expectedCount{ 0 };
+        const char * footerPos{ end + magic_size };
+        serialize::readValue(footerPos, fileEnd, expectedCount);
+
+        std::uint64_t recordCount{ 0 };
+        PathString_t key;
+        while (pos < end)
+        {
+            char type{ 0 };
+            if (!serialize::readValue(pos, end, type) || !serialize::readString(pos, end, key))
+            {
+                return false;
+            }
+
+            LoadedDir & dir{ m_loadedDirs[key] };
+
+            if (file_record_type == type)
+            {
+                const char * const filePos{ pos };
+
+                FileDigest file;
+                if (!readFile(pos, end, file))
+                {
+                    return false;
+                }
+
+                dir.file_positions[file.name] = filePos;
+            }
+            else if (dir_record_type == type)
+            {
+                std::uint8_t hasDigest{ 0 };
+                if (!serialize::readValue(pos, end, hasDigest) ||
+                    !serialize::readValue(pos, end, dir.digest))
+                {
+                    return false;
+                }
+
+                dir.has_digest = (hasDigest != 0);
+            }
+            else
+            {
+                return false;
+            }
+
+            ++recordCount;
+        }
+
+        return (recordCount == expectedCount);
+    }
+
+    bool DigestTree::makeKey(const fs::path & dstDirPath, PathString_t & key) const
+    {
+        return makeRelativeKey(WhichDir::Destination, m_dstRootStr, dstDirPath, key);
+    }
+
+    bool DigestTree::find(
+        const PathString_t & key, const PathStringView_t name, FileDigest & file) const
+    {
+        const auto dirIter{ m_loadedDirs.find(key) };
+        if (dirIter == std::end(m_loadedDirs))
+        {
+            return false;
+        }
+
+        const auto & filePositions{ dirIter->second.file_positions };
+        const auto fileIter{ filePositions.find(name) };
+        if (fileIter == std::end(filePositions))
+        {
+            return false;
+        }
+
+        // this was already checked by load()
+        const char * pos{ fileIter->second };
+        const char * const end{ m_loadedBytes.data() + m_loadedBytes.size() };
+        return readFile(pos, end, file);
+    }
+
+    void DigestTree::addDir(
+        const PathString_t & key,
+        const std::size_t expectedFileCount,
+        const std::size_t expectedDirCount)
+    {
+        std::scoped_lock lock(m_mutex);
+
+        NewDir & dir{ m_newDirs[key] };
+        dir.is_listed           = true;
+        dir.expected_file_count = expectedFileCount;
+        dir.expected_dir_count  = expectedDirCount;
+    }
+
+    void DigestTree::addFile(const PathString_t & key, const FileDigest & file)
+    {
+        const std::uint64_t childDigest{ makeChildDigest(
+            file_record_type, file.name, file.size, file.digest) };
+
+        std::scoped_lock lock(m_mutex);
+
+        NewDir & dir{ m_newDirs[key] };
+        ++dir.file_count;
+        dir.file_digest_sum += childDigest;
+
+        if (!m_isWriting)
+        {
+            return;
+        }
+
+        serialize::appendValue(m_writeBuffer, file_record_type);
+        serialize::appendString(m_writeBuffer, key);
+        serialize::appendString(m_writeBuffer, file.name);
+        serialize::appendValue(m_writeBuffer, static_cast<std::uint64_t>(file.size));
+        serialize::appendValue(m_writeBuffer, file.digest);
+        appendStamp(m_writeBuffer, file.src_stamp);
+        appendStamp(m_writeBuffer, file.dst_stamp);
+        ++m_recordCount;
+
+        if (m_writeBuffer.size() >= write_buffer_size)
+        {
+            flush();
+        }
+    }
+
+    void DigestTree::markChanged(const PathString_t & key)
+    {
+        std::scoped_lock lock(m_mutex);
+        m_newDirs[key].is_changed = true;
+    }
+
+    bool DigestTree::readFile(const char *& pos, const char * const end, FileDigest & file)
+    {
+        const char * newPos{ pos };
+
+        std::uint64_t size{ 0 };
+        if (!serialize::readStringView(newPos, end, file.name) ||
+            !serialize::readValue(newPos, end, size) ||
+            !serialize::readValue(newPos, end, file.digest) ||
+            !readStamp(newPos, end, file.src_stamp) || !readStamp(newPos, end, file.dst_stamp))
+        {
+            return false;
+        }
+
+        file.size = static_cast<std::size_t>(size);
+
+        pos = newPos;
+        return true;
+    }
+
+    void DigestTree::appendStamp(serialize::Bytes_t & bytes, const InodeStamp & stamp)
+    {
+        serialize::appendValue(bytes, stamp.device);
+        serialize::appendValue(bytes, stamp.inode);
+        serialize::appendValue(bytes, stamp.mtime_ns);
+        serialize::appendValue(bytes, stamp.ctime_ns);
+    }
+
+    bool DigestTree::readStamp(const char *& pos, const char * const end, InodeStamp & stamp)
+    {
+        return (
+            serialize::readValue(pos, end, stamp.device) &&
+            serialize::readValue(pos, end, stamp.inode) &&
+            serialize::readValue(pos, end, stamp.mtime_ns) &&
+            serialize::readValue(pos, end, stamp.ctime_ns));
+    }
+
+    std::uint64_t DigestTree::makeChildDigest(
+        const char type,
+        const PathStringView_t name,
+        const std::size_t size,
+        const std::uint64_t digest)
+    {
+        const auto sizeValue{ static_cast<std::uint64_t>(size) };
+
+        ContentDigest childDigest;
+        childDigest.add(&type, sizeof(type));
+        childDigest.add(reinterpret_cast<const char *>(&sizeValue), sizeof(sizeValue));
+        childDigest.add(reinterpret_cast<const char *>(&digest), sizeof(digest));
+        childDigest.add(
+            reinterpret_cast<const char *>(name.data()), (name.size() * sizeof(PathChar_t)));
+
+        return childDigest.value();
+    }
+
+    PathString_t DigestTree::parentKey(const PathString_t & key)
+    {
+        std::size_t index{ key.size() };
+        while ((index > 0) && !isDirectorySeparator(key[index - 1]))
+        {
+            --index;
+        }
+
+        while ((index > 0) && isDirectorySeparator(key[index - 1]))
+        {
+            --index;
+        }
+
+        return key.substr(0, index);
+    }
+
+    PathStringView_t DigestTree::lastName(const PathString_t & key)
+    {
+        std::size_t index{ key.size() };
+        while ((index > 0) && !isDirectorySeparator(key[index - 1]))
+        {
+            --index;
+        }
+
+        return PathStringView_t(key).substr(index);
+    }
+
+    void DigestTree::makeDirDigests(
+        std::unordered_map<PathString_t, std::uint64_t> & dirDigests) const
+    {
+        // every dir must be finished before its parent, so the deepest go first
+        std::vector<std::pair<std::size_t, const PathString_t *>> depthKeys;
+        depthKeys.reserve(m_newDirs.size());
+
+        for (const auto & [key, dir] : m_newDirs)
+        {
+            const auto separatorCount{ static_cast<std::size_t>(
+                std::count_if(std::begin(key), std::end(key), isDirectorySeparator)) };
+
+            depthKeys.emplace_back(((key.empty()) ? 0 : (separatorCount + 1)), &key);
+        }
+
+        std::sort(std::begin(depthKeys), std::end(depthKeys), [](const auto & a, const auto & b) {
+            return (a.first > b.first);
+        });
+
+        // the sum of the digests of every dir in a dir that has one, and how many there are
+        std::unordered_map<PathString_t, std::pair<std::uint64_t, std::size_t>> childSums;
+
+        for (const auto & depthKey : depthKeys)
+        {
+            const PathString_t & key{ *depthKey.second };
+            const NewDir & dir{ m_newDirs.at(key) };
+            const auto & [dirDigestSum, dirCount] = childSums[key];
+
+            if (!dir.is_listed || dir.is_changed ||
+                (dir.file_count != dir.expected_file_count) ||
+                (dirCount != dir.expected_dir_count))
+            {
+                continue;
+            }
+
+            const std::uint64_t sums[]{ dir.file_digest_sum,
+                                        dirDigestSum,
+                                        static_cast<std::uint64_t>(dir.file_count),
+                                        static_cast<std::uint64_t>(dirCount) };
+
+            const std::uint64_t digest{ ContentDigest::make(
+                reinterpret_cast<const char *>(sums), sizeof(sums)) };
+
+            dirDigests[key] = digest;
+
+            if (!key.empty())
+            {
+                auto & parentSums{ childSums[parentKey(key)] };
+                parentSums.first += makeChildDigest(dir_record_type, lastName(key), 0, digest);
+                ++parentSums.second;
+            }
+        }
+    }
+
+    void DigestTree::findChangedKeys(
+        const std::unordered_map<PathString_t, std::uint64_t> & dirDigests)
+    {
+        auto isSame = [&](const PathString_t & key) {
+            const auto newIter{ dirDigests.find(key) };
+            const auto oldIter{ m_loadedDirs.find(key) };
+
+            return (
+                (newIter != std::end(dirDigests)) && (oldIter != std::end(m_loadedDirs)) &&
+                oldIter->second.has_digest && (oldIter->second.digest == newIter->second));
+        };
+
+        // every dir that was or is now in the tree, by its parent
+        std::unordered_map<PathString_t, std::vector<const PathString_t *>> childKeys;
+
+        auto addChild = [&](const PathString_t & key) {
+            if (!key.empty())
+            {
+                childKeys[parentKey(key)].push_back(&key);
+            }
+        };
+
+        for (const auto & newDir : m_newDirs)
+        {
+            addChild(newDir.first);
+        }
+
+        for (const auto & loadedDir : m_loadedDirs)
+        {
+            if (m_newDirs.find(loadedDir.first) == std::end(m_newDirs))
+            {
+                addChild(loadedDir.first);
+            }
+        }
+
+        // Only follows dirs whose digests changed, and where none of the dirs in one did then
+        // the change must be in the files of that dir itself.
+        std::vector<const PathString_t *> keysToCheck;
+
+        const PathString_t rootKey;
+        if (!isSame(rootKey))
+        {
+            keysToCheck.push_back(&rootKey);
+        }
+
+        while (!keysToCheck.empty())
+        {
+            const PathString_t & key{ *keysToCheck.back() };
+            keysToCheck.pop_back();
+
+            bool didAnyChildChange{ false };
+            for (const PathString_t * childKeyPtr : childKeys[key])
+            {
+                if (!isSame(*childKeyPtr))
+                {
+                    didAnyChildChange = true;
+                    keysToCheck.push_back(childKeyPtr);
+                }
+            }
+
+            if (!didAnyChildChange)
+            {
+                m_changedKeys.push_back(key);
+            }
+        }
+
+        std::sort(std::begin(m_changedKeys), std::end(m_changedKeys));
+    }
+
+    void DigestTree::flush()
+    {
+        if (!m_writeBuffer.empty() && !m_didWriteFail)
+        {
+            m_newStream.write(
+                m_writeBuffer.data(), static_cast<std::streamsize>(m_writeBuffer.size()));
+
+            m_didWriteFail = !m_newStream;
+        }
+
+        m_writeBuffer.clear();
+    }
+
+    bool DigestTree::finish(std::wstring & error)
+    {
+        if (!m_isOpen)
+        {
+            return true;
+        }
+
+        std::scoped_lock lock(m_mutex);
+
+        std::unordered_map<PathString_t, std::uint64_t> dirDigests;
+        makeDirDigests(dirDigests);
+
+        const auto rootIter{ dirDigests.find(PathString_t()) };
+        m_rootDigest = ((rootIter == std::end(dirDigests)) ? 0 : rootIter->second);
+
+        const auto loadedRootIter{ m_loadedDirs.find(PathString_t()) };
+        m_wasRootLoaded =
+            ((loadedRootIter != std::end(m_loadedDirs)) && loadedRootIter->second.has_digest);
+
+        m_isRootUnchanged = (m_wasRootLoaded && (m_rootDigest != 0) &&
+                             (loadedRootIter->second.digest == m_rootDigest));
+
+        if (m_wasRootLoaded && !m_isRootUnchanged)
+        {
+            findChangedKeys(dirDigests);
+        }
+
+        if (!m_isWriting)
+        {
+            return true;
+        }
+
+        for (const auto & [key, dir] : m_newDirs)
+        {
+            const auto digestIter{ dirDigests.find(key) };
+            const bool hasDigest{ digestIter != std::end(dirDigests) };
+
+            serialize::appendValue(m_writeBuffer, dir_record_type);
+            serialize::appendString(m_writeBuffer, key);
+            serialize::appendValue(m_writeBuffer, static_cast<std::uint8_t>(hasDigest));
+            serialize::appendValue(
+                m_writeBuffer, ((hasDigest) ? digestIter->second : std::uint64_t(0)));
+
+            ++m_recordCount;
+
+            if (m_writeBuffer.size() >= write_buffer_size)
+            {
+                flush();
+            }
+        }
+
+        m_writeBuffer.insert(std::end(m_writeBuffer), end_magic, (end_magic + magic_size));
+        serialize::appendValue(m_writeBuffer, m_recordCount);
+        flush();
+
+        m_newStream.close();
+        m_isWriting = false;
+
+        ErrorCode_t errorCode;
+        if (!m_didWriteFail && !m_newStream.fail())
+        {
+            fs::rename(m_newPath, m_path, errorCode);
+            if (!errorCode)
+            {
+                return true;
+            }
+        }
+
+        error = L"Failed to save the digests";
+        if (errorCode)
+        {
+            error += L" (" + toString(errorCode) + L")";
+        }
+
+        fs::remove(m_newPath, errorCode);
+        fs::remove(m_path, errorCode);
+        return false;
+    }
+
+} // namespace backup
@@ -0,0 +1,197 @@
+#ifndef BACKUP_DIGEST_TREE_HPP_INCLUDED
+#define BACKUP_DIGEST_TREE_HPP_INCLUDED
+//
+// digest-tree.hpp
+//
+#include "dir-fd.hpp"
+#include "dir-pair.hpp"
+#include "filesystem-common.hpp"
+#include "spill-file.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace backup
+{
+
+    // The content digest of every file that --digests found the same in src and dst, and a Merkle
+    // digest of every dir made from the digests of everything in it, kept in the app's own dir in
+    // dst between runs.
+    //
+    // A file whose src and dst both still have the InodeStamps they had when their contents were
+    // last found the same doesn't need to be read again to know they still are, so a compare of a
+    // cold archive only reads what changed.  A --scrub reads everything anyway, and says so if any
+    // file has a different digest even though its stamps never changed.
+    //
+    // A dir only gets a Merkle digest if everything in it and under it was found the same, so a
+    // root digest that is the same as the last run's means the whole tree still is.  When it's not,
+    // finish() follows the digests that changed down to the dirs the changes are in.
+    //
+    // The file is only for this app on this machine, like a DirSnapshot, and is simply ignored if
+    // it was made for a different pair of root dirs.  Only files opened with a DirFd can have their
+    // stamps checked, so this does nothing on Windows.
+    class DigestTree
+    {
+      public:
+        // one file that was found the same in src and dst
+        struct FileDigest
+        {
+            PathStringView_t name;
+            std::size_t size     = 0;
+            std::uint64_t digest = 0;
+            InodeStamp src_stamp;
+            InodeStamp dst_stamp;
+        };
+
+        DigestTree();
+        ~DigestTree();
+
+        DigestTree(const DigestTree &) = delete;
+        DigestTree(DigestTree &&)      = delete;
+        DigestTree & operator=(const DigestTree &) = delete;
+        DigestTree & operator=(DigestTree &&) = delete;
+
+        // Loads whatever the last run left in path, and starts a new file if willWrite.  Returns
+        // false with a warning if the old one couldn't be used, which is never fatal.
+        bool open(
+            const DirPair<fs::path> & rootPathDPair,
+            const fs::path & path,
+            const bool willWrite,
+            std::wstring & warning);
+
+        inline bool isOpen() const noexcept { return m_isOpen; }
+        inline bool isLoaded() const noexcept { return !m_loadedDirs.empty(); }
+
+        // the key of a dst dir, see makeRelativeKey()
+        bool makeKey(const fs::path & dstDirPath, PathString_t & key) const;
+
+        // what the last run found, or false if this file wasn't found the same then
+        bool find(const PathString_t & key, const PathStringView_t name, FileDigest & file) const;
+
+        // The expected counts are of the src dir, and any file or dir of it that is never added
+        // means the dir doesn't get a Merkle digest this run.
+        void addDir(
+            const PathString_t & key,
+            const std::size_t expectedFileCount,
+            const std::size_t expectedDirCount);
+
+        void addFile(const PathString_t & key, const FileDigest & file);
+
+        // something in this dir was different or couldn't be compared
+        void markChanged(const PathString_t & key);
+
+        // Makes the Merkle digests and replaces the old file with the new one, where false means
+        // there was an error and neither is left.  This is never called if the run didn't finish.
+        bool finish(std::wstring & error);
+
+        // how many file compares were skipped because of a digest, and how many were read
+        void countVerify(const bool wasRead) const noexcept
+        {
+            ++((wasRead) ? m_readCount : m_verifiedCount);
+        }
+
+        std::size_t verifiedCount() const noexcept { return m_verifiedCount; }
+        std::size_t readCount() const noexcept { return m_readCount; }
+
+        // files a --scrub found with a new digest but the same stamps, which only bit rot can do
+        void countSilentChange() const noexcept { ++m_silentChangeCount; }
+        std::size_t silentChangeCount() const noexcept { return m_silentChangeCount; }
+
+        // All set by finish().  The root digest is zero if anything in the tree was different,
+        // and the changed keys are the dirs that the Merkle digests that changed lead down to.
+        std::uint64_t rootDigest() const noexcept { return m_rootDigest; }
+        bool wasRootLoaded() const noexcept { return m_wasRootLoaded; }
+        bool isRootUnchanged() const noexcept { return m_isRootUnchanged; }
+        const std::vector<PathString_t> & changedKeys() const noexcept { return m_changedKeys; }
+
+        static fs::path makePath(const fs::path & dstRootPath);
+
+      private:
+        // what the last run left
+        struct LoadedDir
+        {
+            bool has_digest      = false;
+            std::uint64_t digest = 0;
+            std::unordered_map<PathStringView_t, const char *> file_positions;
+        };
+
+        // what this run found so far
+        struct NewDir
+        {
+            bool is_listed                  = false;
+            bool is_changed                 = false;
+            std::size_t expected_file_count = 0;
+            std::size_t expected_dir_count  = 0;
+            std::size_t file_count          = 0;
+
+            // the sum of the digests of every file, so the order they're added in doesn't matter
+            std::uint64_t file_digest_sum = 0;
+        };
+
+        bool load(const fs::path & path, std::wstring & warning);
+
+        static bool readFile(const char *& pos, const char * const end, FileDigest & file);
+        static void appendStamp(serialize::Bytes_t & bytes, const InodeStamp & stamp);
+        static bool readStamp(const char *& pos, const char * const end, InodeStamp & stamp);
+
+        static std::uint64_t makeChildDigest(
+            const char type,
+            const PathStringView_t name,
+            const std::size_t size,
+            const std::uint64_t digest);
+
+        // m_mutex must be locked for these
+        void flush();
+        void makeDirDigests(std::unordered_map<PathString_t, std::uint64_t> & dirDigests) const;
+        void findChangedKeys(const std::unordered_map<PathString_t, std::uint64_t> & dirDigests);
+
+        static PathString_t parentKey(const PathString_t & key);
+        static PathStringView_t lastName(const PathString_t & key);
+
+        static inline constexpr char file_magic[]{ "BKDIGS01" };
+        static inline constexpr char end_magic[]{ "BKDIGSND" };
+        static inline constexpr std::size_t magic_size{ 8 };
+
+        static inline constexpr char file_record_type{ 'f' };
+        static inline constexpr char dir_record_type{ 'd' };
+
+        static inline constexpr std::size_t write_buffer_size{ 1 << 20 };
+
+      private:
+        bool m_isOpen;
+        PathString_t m_srcRootStr;
+        PathString_t m_dstRootStr;
+        fs::path m_path;
+        fs::path m_newPath;
+
+        // the whole loaded file, which every LoadedDir points into
+        std::vector<char> m_loadedBytes;
+        std::unordered_map<PathString_t, LoadedDir> m_loadedDirs;
+
+        std::mutex m_mutex;
+        std::unordered_map<PathString_t, NewDir> m_newDirs;
+        std::ofstream m_newStream;
+        serialize::Bytes_t m_writeBuffer;
+        std::uint64_t m_recordCount;
+        bool m_isWriting;
+        bool m_didWriteFail;
+
+        mutable std::atomic<std::size_t> m_verifiedCount;
+        mutable std::atomic<std::size_t> m_readCount;
+        mutable std::atomic<std::size_t> m_silentChangeCount;
+
+        std::uint64_t m_rootDigest;
+        bool m_wasRootLoaded;
+        bool m_isRootUnchanged;
+        std::vector<PathString_t> m_changedKeys;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_DIGEST_TREE_HPP_INCLUDED
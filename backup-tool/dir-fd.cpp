@@ -0,0 +1,990 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// dir-fd.cpp
+//
+#include "dir-fd.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+// every compiler for Windows defines _WIN32, see is_running_on_windows in util.hpp
+#if !defined(_WIN32)
+#define BACKUP_HAS_DIR_FD
+#include <dirent.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__linux__)
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/sysmacros.h>
+#endif
+#endif
+
+namespace backup
+{
+
+    DirFd::DirFd(DirFd && other) noexcept
+        : m_fd(other.m_fd)
+        , m_isKept(other.m_isKept)
+        , m_device(other.m_device)
+    {
+        other.m_fd     = -1;
+        other.m_isKept = false;
+        other.m_device = 0;
+    }
+
+    DirFd & DirFd::operator=(DirFd && other) noexcept
+    {
+        if (this != &other)
+        {
+            close();
+            m_fd           = other.m_fd;
+            m_isKept       = other.m_isKept;
+            m_device       = other.m_device;
+            other.m_fd     = -1;
+            other.m_isKept = false;
+            other.m_device = 0;
+        }
+
+        return *this;
+    }
+
+    bool DirFd::tryKeep() noexcept
+    {
+        if (!isOpen() || m_isKept)
+        {
+            return m_isKept;
+        }
+
+        if (++m_keptCount > m_keptLimit)
+        {
+            --m_keptCount;
+            return false;
+        }
+
+        m_isKept = true;
+        return true;
+    }
+
+#if defined(BACKUP_HAS_DIR_FD)
+
+    namespace posix
+    {
+        constexpr int dir_open_flags{ O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC };
+
+        inline ErrorCode_t lastError() { return ErrorCode_t(errno, std::generic_category()); }
+
+        // Entry names are views that the *at() functions can't use without a terminating null
+        inline std::string toCString(const PathStringView_t name) { return std::string(name); }
+
+        inline bool isNotFound(const int error)
+        {
+            return ((error == ENOENT) || (error == ENOTDIR));
+        }
+
+        fs::file_type fileTypeFromMode(const mode_t mode)
+        {
+            // clang-format off
+            if (S_ISREG(mode))  { return fs::file_type::regular; }
+            if (S_ISDIR(mode))  { return fs::file_type::directory; }
+            if (S_ISLNK(mode))  { return fs::file_type::symlink; }
+            if (S_ISBLK(mode))  { return fs::file_type::block; }
+            if (S_ISCHR(mode))  { return fs::file_type::character; }
+            if (S_ISFIFO(mode)) { return fs::file_type::fifo; }
+            if (S_ISSOCK(mode)) { return fs::file_type::socket; }
+            // clang-format on
+
+            return fs::file_type::unknown;
+        }
+
+        fs::file_type fileTypeFromDirent(const unsigned char type)
+        {
+            // clang-format off
+            switch (type)
+            {
+                case DT_REG:  { return fs::file_type::regular; }
+                case DT_DIR:  { return fs::file_type::directory; }
+                case DT_LNK:  { return fs::file_type::symlink; }
+                case DT_BLK:  { return fs::file_type::block; }
+                case DT_CHR:  { return fs::file_type::character; }
+                case DT_FIFO: { return fs::file_type::fifo; }
+                case DT_SOCK: { return fs::file_type::socket; }
+                default:      { return fs::file_type::none; }
+            }
+            // clang-format on
+        }
+
+        struct DirCloser
+        {
+            void operator()(DIR * dirPtr) const noexcept { ::closedir(dirPtr); }
+        };
+
+        using DirUPtr_t = std::unique_ptr<DIR, DirCloser>;
+
+        // the returned DIR has its own copy of fd, so closing it leaves fd open
+        DirUPtr_t openDir(const int fd, ErrorCode_t & errorCode)
+        {
+            const int dupFd{ ::fcntl(fd, F_DUPFD_CLOEXEC, 0) };
+            if (dupFd < 0)
+            {
+                errorCode = lastError();
+                return DirUPtr_t();
+            }
+
+            DIR * const dirPtr{ ::fdopendir(dupFd) };
+            if (nullptr == dirPtr)
+            {
+                errorCode = lastError();
+                ::close(dupFd);
+                return DirUPtr_t();
+            }
+
+            // the copy shares its read position with the original, which might have been read
+            ::rewinddir(dirPtr);
+            return DirUPtr_t(dirPtr);
+        }
+
+        bool forEachName(
+            const int fd, const DirFd::NameHandler_t & handler, ErrorCode_t & errorCode)
+        {
+            DirUPtr_t dirUPtr{ openDir(fd, errorCode) };
+            if (!dirUPtr)
+            {
+                return false;
+            }
+
+            while (true)
+            {
+                errno = 0;
+                const dirent * const direntPtr{ ::readdir(dirUPtr.get()) };
+                if (nullptr == direntPtr)
+                {
+                    if (errno != 0)
+                    {
+                        errorCode = lastError();
+                        return false;
+                    }
+
+                    return true;
+                }
+
+                const char * const name{ direntPtr->d_name };
+                if ((std::strcmp(name, ".") == 0) || (std::strcmp(name, "..") == 0))
+                {
+                    continue;
+                }
+
+                handler(name, fileTypeFromDirent(direntPtr->d_type));
+            }
+        }
+
+        std::uintmax_t removeAll(const int parentFd, const char * name, ErrorCode_t & errorCode)
+        {
+            struct stat info;
+            if (::fstatat(parentFd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                if (isNotFound(errno))
+                {
+                    return 0;
+                }
+
+                errorCode = lastError();
+                return 0;
+            }
+
+            std::uintmax_t removedCount{ 0 };
+
+            if (S_ISDIR(info.st_mode))
+            {
+                const int fd{ ::openat(parentFd, name, dir_open_flags) };
+                if (fd < 0)
+                {
+                    errorCode = lastError();
+                    return 0;
+                }
+
+                // all the names are read before removing any, since POSIX doesn't say what
+                // readdir() does when the dir changes while reading it
+                std::vector<std::string> childNames;
+                const bool didReadAll{ forEachName(
+                    fd,
+                    [&](const char * childName, const fs::file_type) {
+                        childNames.emplace_back(childName);
+                    },
+                    errorCode) };
+
+                if (didReadAll)
+                {
+                    for (const std::string & childName : childNames)
+                    {
+                        removedCount += removeAll(fd, childName.c_str(), errorCode);
+                        if (errorCode)
+                        {
+                            break;
+                        }
+                    }
+                }
+
+                ::close(fd);
+
+                if (errorCode)
+                {
+                    return removedCount;
+                }
+            }
+
+            const int flags{ S_ISDIR(info.st_mode) ? AT_REMOVEDIR : 0 };
+            if (::unlinkat(parentFd, name, flags) != 0)
+            {
+                if (!isNotFound(errno))
+                {
+                    errorCode = lastError();
+                }
+
+                return removedCount;
+            }
+
+            return (removedCount + 1);
+        }
+
+        bool copyLink(
+            const int fromDirFd,
+            const char * fromName,
+            const struct stat & info,
+            const int toDirFd,
+            const char * toName,
+            ErrorCode_t & errorCode)
+        {
+            // st_size is the length of the target, but it can change before the read
+            std::vector<char> target(static_cast<std::size_t>(info.st_size) + 1);
+            while (true)
+            {
+                const ssize_t length{ ::readlinkat(
+                    fromDirFd, fromName, &target[0], target.size()) };
+                if (length < 0)
+                {
+                    errorCode = lastError();
+                    return false;
+                }
+
+                if (static_cast<std::size_t>(length) < target.size())
+                {
+                    target[static_cast<std::size_t>(length)] = 0;
+                    break;
+                }
+
+                target.resize(target.size() * 2);
+            }
+
+            if (::symlinkat(&target[0], toDirFd, toName) != 0)
+            {
+                errorCode = lastError();
+                return false;
+            }
+
+            return true;
+        }
+
+        bool copyBytes(const int fromFd, const int toFd, ErrorCode_t & errorCode)
+        {
+#if defined(__linux__)
+            // this lets the kernel copy without ever coming back out to this process, and even
+            // lets some filesystems share the data instead of copying it
+            while (true)
+            {
+                const ssize_t copiedSize{ ::copy_file_range(
+                    fromFd, nullptr, toFd, nullptr, (1_st << 30), 0) };
+
+                if (copiedSize == 0)
+                {
+                    return true;
+                }
+
+                if (copiedSize < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    // not every filesystem or kernel can, but the offsets haven't moved if so
+                    const bool canFallBack{ (errno == EXDEV) || (errno == ENOSYS) ||
+                                            (errno == EINVAL) || (errno == EOPNOTSUPP) };
+
+                    if (canFallBack && (::lseek(toFd, 0, SEEK_CUR) == 0))
+                    {
+                        break;
+                    }
+
+                    errorCode = lastError();
+                    return false;
+                }
+            }
+#endif
+
+            std::vector<char> buffer(256 * 1024);
+            while (true)
+            {
+                const ssize_t readSize{ ::read(fromFd, &buffer[0], buffer.size()) };
+                if (readSize == 0)
+                {
+                    return true;
+                }
+
+                if (readSize < 0)
+                {
+                    if (errno == EINTR)
+                    {
+                        continue;
+                    }
+
+                    errorCode = lastError();
+                    return false;
+                }
+
+                const char * pos{ &buffer[0] };
+                std::size_t remainingSize{ static_cast<std::size_t>(readSize) };
+                while (remainingSize > 0)
+                {
+                    const ssize_t writeSize{ ::write(toFd, pos, remainingSize) };
+                    if (writeSize < 0)
+                    {
+                        if (errno == EINTR)
+                        {
+                            continue;
+                        }
+
+                        errorCode = lastError();
+                        return false;
+                    }
+
+                    pos += writeSize;
+                    remainingSize -= static_cast<std::size_t>(writeSize);
+                }
+            }
+        }
+
+        bool copyFile(
+            const int fromDirFd,
+            const char * fromName,
+            const int toDirFd,
+            const char * toName,
+            ErrorCode_t & errorCode)
+        {
+            struct stat info;
+            if (::fstatat(fromDirFd, fromName, &info, AT_SYMLINK_NOFOLLOW) != 0)
+            {
+                errorCode = lastError();
+                return false;
+            }
+
+            if (S_ISLNK(info.st_mode))
+            {
+                return copyLink(fromDirFd, fromName, info, toDirFd, toName, errorCode);
+            }
+
+            if (!S_ISREG(info.st_mode))
+            {
+                errorCode = std::make_error_code(std::errc::not_supported);
+                return false;
+            }
+
+            const int fromFd{ ::openat(fromDirFd, fromName, (O_RDONLY | O_NOFOLLOW | O_CLOEXEC)) };
+            if (fromFd < 0)
+            {
+                errorCode = lastError();
+                return false;
+            }
+
+            // never replaces what is already there, the same as copyFileCommon()
+            const mode_t mode{ static_cast<mode_t>(info.st_mode & 07777) };
+            const int toFd{ ::openat(
+                toDirFd, toName, (O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC), mode) };
+
+            if (toFd < 0)
+            {
+                errorCode = lastError();
+                ::close(fromFd);
+                return false;
+            }
+
+            // the mode given to openat() was masked by the umask
+            bool success{ (::fchmod(toFd, mode) == 0) };
+            if (!success)
+            {
+                errorCode = lastError();
+            }
+            else
+            {
+                success = copyBytes(fromFd, toFd, errorCode);
+            }
+
+            ::close(fromFd);
+
+            if ((::close(toFd) != 0) && success)
+            {
+                errorCode = lastError();
+                success   = false;
+            }
+
+            return success;
+        }
+
+        InodeStamp makeInodeStamp(const struct stat & info)
+        {
+#if defined(__APPLE__)
+            const struct timespec & mtime{ info.st_mtimespec };
+            const struct timespec & ctime{ info.st_ctimespec };
+#else
+            const struct timespec & mtime{ info.st_mtim };
+            const struct timespec & ctime{ info.st_ctim };
+#endif
+
+            auto toNs = [](const struct timespec & time) {
+                return ((static_cast<std::int64_t>(time.tv_sec) * 1'000'000'000) +
+                        static_cast<std::int64_t>(time.tv_nsec));
+            };
+
+            InodeStamp inodeStamp;
+            inodeStamp.device   = static_cast<std::uint64_t>(info.st_dev);
+            inodeStamp.inode    = static_cast<std::uint64_t>(info.st_ino);
+            inodeStamp.mtime_ns = toNs(mtime);
+            inodeStamp.ctime_ns = toNs(ctime);
+            return inodeStamp;
+        }
+
+    } // namespace posix
+
+    bool DirFd::open(
+        const DirFd & parentDirFd,
+        const PathStringView_t name,
+        const fs::path & path,
+        ErrorCode_t & errorCode)
+    {
+        close();
+        errorCode.clear();
+
+        if (parentDirFd.isOpen() && !name.empty())
+        {
+            m_fd = ::openat(
+                parentDirFd.m_fd, posix::toCString(name).c_str(), posix::dir_open_flags);
+        }
+        else
+        {
+            // the top dirs given on the command line are allowed to be links
+            m_fd = ::open(path.c_str(), (O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+        }
+
+        if (m_fd < 0)
+        {
+            errorCode = posix::lastError();
+            return false;
+        }
+
+        // only used to tell which tasks share a device, so this is not worth failing over
+        struct stat info;
+        if (::fstat(m_fd, &info) == 0)
+        {
+            m_device = static_cast<std::uint64_t>(info.st_dev);
+        }
+
+        return true;
+    }
+
+    void DirFd::close() noexcept
+    {
+        if (m_isKept)
+        {
+            --m_keptCount;
+            m_isKept = false;
+        }
+
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+
+        m_device = 0;
+    }
+
+    bool DirFd::stamp(InodeStamp & dirStamp, ErrorCode_t & errorCode) const
+    {
+        dirStamp = InodeStamp();
+        errorCode.clear();
+
+        struct stat info;
+        if (::fstat(m_fd, &info) != 0)
+        {
+            errorCode = posix::lastError();
+            return false;
+        }
+
+        dirStamp = posix::makeInodeStamp(info);
+        return true;
+    }
+
+    bool DirFd::stampAt(
+        const PathChar_t * name, InodeStamp & inodeStamp, ErrorCode_t & errorCode) const
+    {
+        inodeStamp = InodeStamp();
+        errorCode.clear();
+
+        struct stat info;
+        if (::fstatat(m_fd, name, &info, AT_SYMLINK_NOFOLLOW) != 0)
+        {
+            errorCode = posix::lastError();
+            return false;
+        }
+
+        inodeStamp = posix::makeInodeStamp(info);
+        return true;
+    }
+
+    std::wstring deviceToString(const std::uint64_t device)
+    {
+        const auto dev{ static_cast<dev_t>(device) };
+        return (std::to_wstring(major(dev)) + L":" + std::to_wstring(minor(dev)));
+    }
+
+    std::size_t DirFd::makeDefaultKeptLimit()
+    {
+        struct rlimit limit;
+        if (::getrlimit(RLIMIT_NOFILE, &limit) != 0)
+        {
+            return 0;
+        }
+
+        // half for dirs leaves the rest for the files being compared and copied, the spill and
+        // log files, and whatever else the process has open
+        const std::size_t keptLimitMax{ 64 * 1024 };
+        if (limit.rlim_cur == RLIM_INFINITY)
+        {
+            return keptLimitMax;
+        }
+
+        return std::min(keptLimitMax, static_cast<std::size_t>(limit.rlim_cur / 2));
+    }
+
+    bool DirFd::forEachName(const NameHandler_t & handler, ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+        return posix::forEachName(m_fd, handler, errorCode);
+    }
+
+    fs::file_status DirFd::statusAt(
+        const PathChar_t * name,
+        const bool willFollowLinks,
+        std::uintmax_t & size,
+        ErrorCode_t & errorCode) const
+    {
+        FileLinks links;
+        return statusAt(name, willFollowLinks, size, links, errorCode);
+    }
+
+    fs::file_status DirFd::statusAt(
+        const PathChar_t * name,
+        const bool willFollowLinks,
+        std::uintmax_t & size,
+        FileLinks & links,
+        ErrorCode_t & errorCode) const
+    {
+        size  = 0;
+        links = FileLinks();
+        errorCode.clear();
+
+        struct stat info;
+        const int flags{ (willFollowLinks) ? 0 : AT_SYMLINK_NOFOLLOW };
+        if (::fstatat(m_fd, name, &info, flags) != 0)
+        {
+            const int error{ errno };
+            errorCode = posix::lastError();
+
+            // the same as fs::status(), which says not_found for a link to nothing
+            if (posix::isNotFound(error))
+            {
+                return fs::file_status(fs::file_type::not_found);
+            }
+
+            return fs::file_status();
+        }
+
+        size         = static_cast<std::uintmax_t>(info.st_size);
+        links.device = static_cast<std::uint64_t>(info.st_dev);
+        links.inode  = static_cast<std::uint64_t>(info.st_ino);
+        links.count  = static_cast<std::uint64_t>(info.st_nlink);
+
+        return fs::file_status(
+            posix::fileTypeFromMode(info.st_mode), static_cast<fs::perms>(info.st_mode & 07777));
+    }
+
+    bool DirFd::existsAt(const PathStringView_t name, ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+
+        // follows links, the same as fs::exists()
+        struct stat info;
+        if (::fstatat(m_fd, posix::toCString(name).c_str(), &info, 0) != 0)
+        {
+            if (!posix::isNotFound(errno))
+            {
+                errorCode = posix::lastError();
+            }
+
+            return false;
+        }
+
+        return true;
+    }
+
+    bool DirFd::makeDirectoryAt(const PathStringView_t name, ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+
+        const std::string nativeName{ posix::toCString(name) };
+        if (::mkdirat(m_fd, nativeName.c_str(), 0777) == 0)
+        {
+            return true;
+        }
+
+        // the same as fs::create_directory(), which is not an error if the dir already exists
+        const int error{ errno };
+        struct stat info;
+        const bool isExistingDir{ (error == EEXIST) &&
+                                  (::fstatat(m_fd, nativeName.c_str(), &info, 0) == 0) &&
+                                  S_ISDIR(info.st_mode) };
+
+        if (!isExistingDir)
+        {
+            errorCode = ErrorCode_t(error, std::generic_category());
+        }
+
+        return false;
+    }
+
+    std::uintmax_t DirFd::removeAllAt(
+        const PathStringView_t name, const bool isFile, ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+
+        const std::string nativeName{ posix::toCString(name) };
+        if (!isFile)
+        {
+            return posix::removeAll(m_fd, nativeName.c_str(), errorCode);
+        }
+
+        if (::unlinkat(m_fd, nativeName.c_str(), 0) != 0)
+        {
+            if (!posix::isNotFound(errno))
+            {
+                errorCode = posix::lastError();
+            }
+
+            return 0;
+        }
+
+        return 1;
+    }
+
+    bool DirFd::copyFileAt(
+        const PathStringView_t name,
+        const DirFd & toDirFd,
+        const PathStringView_t toName,
+        ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+
+        return posix::copyFile(
+            m_fd,
+            posix::toCString(name).c_str(),
+            toDirFd.m_fd,
+            posix::toCString(toName).c_str(),
+            errorCode);
+    }
+
+    bool DirFd::linkAt(
+        const PathStringView_t name,
+        const DirFd & toDirFd,
+        const PathStringView_t toName,
+        ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+
+        if (::linkat(
+                m_fd,
+                posix::toCString(name).c_str(),
+                toDirFd.m_fd,
+                posix::toCString(toName).c_str(),
+                0) != 0)
+        {
+            errorCode = posix::lastError();
+            return false;
+        }
+
+        return true;
+    }
+
+    bool DirFd::renameAt(
+        const PathStringView_t name,
+        const DirFd & toDirFd,
+        const PathStringView_t toName,
+        ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+
+        if (::renameat(
+                m_fd,
+                posix::toCString(name).c_str(),
+                toDirFd.m_fd,
+                posix::toCString(toName).c_str()) != 0)
+        {
+            errorCode = posix::lastError();
+            return false;
+        }
+
+        return true;
+    }
+
+    std::uint64_t
+        DirFd::physicalOffsetAt(const PathStringView_t name, ErrorCode_t & errorCode) const
+    {
+#if defined(__linux__)
+        const int fd{ openFileAt(name, errorCode) };
+        if (fd < 0)
+        {
+            return 0;
+        }
+
+        // only room for the first extent, which is all that is needed
+        alignas(struct fiemap) char request[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+        std::memset(request, 0, sizeof(request));
+
+        auto * const mapPtr{ reinterpret_cast<struct fiemap *>(request) };
+        mapPtr->fm_start        = 0;
+        mapPtr->fm_length       = FIEMAP_MAX_OFFSET;
+        mapPtr->fm_extent_count = 1;
+
+        std::uint64_t offset{ 0 };
+        if (::ioctl(fd, FS_IOC_FIEMAP, mapPtr) != 0)
+        {
+            errorCode = posix::lastError();
+        }
+        else if (mapPtr->fm_mapped_extents > 0)
+        {
+            offset = static_cast<std::uint64_t>(mapPtr->fm_extents[0].fe_physical);
+        }
+
+        ::close(fd);
+        return offset;
+#else
+        (void)name;
+        errorCode = std::make_error_code(std::errc::not_supported);
+        return 0;
+#endif
+    }
+
+    int DirFd::openFileAt(const PathStringView_t name, ErrorCode_t & errorCode) const
+    {
+        errorCode.clear();
+
+        const int fd{ ::openat(m_fd, posix::toCString(name).c_str(), (O_RDONLY | O_CLOEXEC)) };
+        if (fd < 0)
+        {
+            errorCode = posix::lastError();
+        }
+
+        return fd;
+    }
+
+    //
+
+    bool FileFd::open(const DirFd & dirFd, const PathStringView_t name, ErrorCode_t & errorCode)
+    {
+        close();
+        m_fd = dirFd.openFileAt(name, errorCode);
+
+        if (isOpen())
+        {
+            // only a hint, so any error is ignored
+            ::posix_fadvise(m_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+        }
+
+        return isOpen();
+    }
+
+    bool FileFd::read(char * buffer, const std::size_t size, ErrorCode_t & errorCode)
+    {
+        errorCode.clear();
+
+        std::size_t remainingSize{ size };
+        while (remainingSize > 0)
+        {
+            const ssize_t readSize{ ::read(m_fd, buffer, remainingSize) };
+            if (readSize < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+
+                errorCode = posix::lastError();
+                return false;
+            }
+
+            // the file got smaller after it was listed
+            if (readSize == 0)
+            {
+                errorCode = std::make_error_code(std::errc::io_error);
+                return false;
+            }
+
+            buffer += readSize;
+            remainingSize -= static_cast<std::size_t>(readSize);
+        }
+
+        return true;
+    }
+
+    void FileFd::close() noexcept
+    {
+        if (m_fd >= 0)
+        {
+            ::close(m_fd);
+            m_fd = -1;
+        }
+    }
+
+#else
+
+    // Windows has no *at() functions, so nothing ever opens and every caller uses whole paths
+
+    bool DirFd::open(const DirFd &, const PathStringView_t, const fs::path &, ErrorCode_t & ec)
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    void DirFd::close() noexcept { m_isKept = false; }
+
+    std::size_t DirFd::makeDefaultKeptLimit() { return 0; }
+
+    std::wstring deviceToString(const std::uint64_t device) { return std::to_wstring(device); }
+
+    bool DirFd::stamp(InodeStamp & dirStamp, ErrorCode_t & ec) const
+    {
+        dirStamp = InodeStamp();
+        ec       = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    bool DirFd::stampAt(const PathChar_t *, InodeStamp & inodeStamp, ErrorCode_t & ec) const
+    {
+        inodeStamp = InodeStamp();
+        ec         = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    bool DirFd::forEachName(const NameHandler_t &, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    fs::file_status DirFd::statusAt(
+        const PathChar_t *, const bool, std::uintmax_t & size, ErrorCode_t & ec) const
+    {
+        size = 0;
+        ec   = std::make_error_code(std::errc::not_supported);
+        return fs::file_status();
+    }
+
+    fs::file_status DirFd::statusAt(
+        const PathChar_t *,
+        const bool,
+        std::uintmax_t & size,
+        FileLinks & links,
+        ErrorCode_t & ec) const
+    {
+        size  = 0;
+        links = FileLinks();
+        ec    = std::make_error_code(std::errc::not_supported);
+        return fs::file_status();
+    }
+
+    bool DirFd::existsAt(const PathStringView_t, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    bool DirFd::makeDirectoryAt(const PathStringView_t, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    std::uintmax_t
+        DirFd::removeAllAt(const PathStringView_t, const bool, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return 0;
+    }
+
+    bool DirFd::copyFileAt(
+        const PathStringView_t, const DirFd &, const PathStringView_t, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    bool DirFd::linkAt(
+        const PathStringView_t, const DirFd &, const PathStringView_t, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    bool DirFd::renameAt(
+        const PathStringView_t, const DirFd &, const PathStringView_t, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    std::uint64_t DirFd::physicalOffsetAt(const PathStringView_t, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return 0;
+    }
+
+    int DirFd::openFileAt(const PathStringView_t, ErrorCode_t & ec) const
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return -1;
+    }
+
+    bool FileFd::open(const DirFd &, const PathStringView_t, ErrorCode_t & ec)
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    bool FileFd::read(char *, const std::size_t, ErrorCode_t & ec)
+    {
+        ec = std::make_error_code(std::errc::not_supported);
+        return false;
+    }
+
+    void FileFd::close() noexcept { m_fd = -1; }
+
+#endif
+
+} // namespace backup
@@ -0,0 +1,220 @@
+#ifndef BACKUP_DIR_FD_HPP_INCLUDED
+#define BACKUP_DIR_FD_HPP_INCLUDED
+//
+// dir-fd.hpp
+//
+#include "filesystem-common.hpp"
+#include "util.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <string_view>
+
+namespace backup
+{
+
+    // the POSIX *at() functions this needs don't exist on Windows, see DirFd
+    constexpr bool is_dir_fd_supported{ !is_running_on_windows };
+
+    //
+
+    // Which file a name is a hard link to, and how many names link to it, from the same stat
+    // call that gets the size.
+    struct FileLinks
+    {
+        std::uint64_t device = 0;
+        std::uint64_t inode  = 0;
+        std::uint64_t count  = 1;
+    };
+
+    // a small number that stands for one FileLinks::device and inode, see HardLinks
+    using LinkId_t = std::uint32_t;
+
+    // Which file or dir this is and when it last changed, so anything found out about it can be
+    // trusted again later if none of these changed.  The ctime can't be set back like the mtime
+    // can, so anything done to a file at all changes it, see DirSnapshot and DigestTree.
+    struct InodeStamp
+    {
+        std::uint64_t device  = 0;
+        std::uint64_t inode   = 0;
+        std::int64_t mtime_ns = 0;
+        std::int64_t ctime_ns = 0;
+    };
+
+    constexpr bool operator==(const InodeStamp & left, const InodeStamp & right)
+    {
+        return (
+            (left.device == right.device) && (left.inode == right.inode) &&
+            (left.mtime_ns == right.mtime_ns) && (left.ctime_ns == right.ctime_ns));
+    }
+
+    constexpr bool operator!=(const InodeStamp & left, const InodeStamp & right)
+    {
+        return !(left == right);
+    }
+
+    // the usual "major:minor" of a device, or just the number where there is no such thing
+    std::wstring deviceToString(const std::uint64_t device);
+
+    //
+
+    // An open directory that everything inside it can be listed, stat'ed, opened, created, and
+    // removed relative to with the POSIX *at() functions, so the OS only has to look up one name
+    // instead of walking the whole path every time.  This is also what lets the app work with
+    // trees so deep that their paths are longer than PATH_MAX.
+    //
+    // Every function returns false or sets the ErrorCode_t on any error, and they are all const
+    // because they don't change the directory that is open, so any thread can use them at once.
+    // On Windows nothing ever opens, so the callers always fall back on using whole paths.
+    class DirFd
+    {
+      public:
+        // called with the name and type of every entry in the dir, where the type is
+        // fs::file_type::none when the OS didn't say what it was
+        using NameHandler_t =
+            std::function<void(const PathChar_t * name, const fs::file_type type)>;
+
+        DirFd() noexcept
+            : m_fd(-1)
+            , m_isKept(false)
+            , m_device(0)
+        {}
+
+        ~DirFd() { close(); }
+
+        DirFd(const DirFd &) = delete;
+        DirFd & operator=(const DirFd &) = delete;
+
+        DirFd(DirFd && other) noexcept;
+        DirFd & operator=(DirFd && other) noexcept;
+
+        inline bool isOpen() const noexcept { return (m_fd >= 0); }
+
+        // the st_dev of the open directory, or zero if not open
+        inline std::uint64_t device() const noexcept { return m_device; }
+
+        // one fstat() of the open directory
+        bool stamp(InodeStamp & dirStamp, ErrorCode_t & errorCode) const;
+
+        // one fstatat() that never follows links
+        bool stampAt(
+            const PathChar_t * name, InodeStamp & inodeStamp, ErrorCode_t & errorCode) const;
+
+        // Opens relative to parentDirFd if it is open, otherwise opens the whole path.  Links are
+        // never followed, see the comments at the top of filesystem-common.hpp.
+        bool open(
+            const DirFd & parentDirFd,
+            const PathStringView_t name,
+            const fs::path & path,
+            ErrorCode_t & errorCode);
+
+        void close() noexcept;
+
+        // Open directories are kept by DirNodes for as long as any Entry listed from them is
+        // still around, which could be a lot of them, so only this many are ever kept at once by
+        // the whole process.  Returns false if there are already too many, and then this one must
+        // be closed when it is no longer needed instead.
+        bool tryKeep() noexcept;
+
+        static std::size_t keptCount() noexcept { return m_keptCount; }
+        static std::size_t keptLimit() noexcept { return m_keptLimit; }
+        static void setKeptLimit(const std::size_t limit) noexcept { m_keptLimit = limit; }
+
+        // a share of what the OS allows this process, leaving plenty for everything else
+        static std::size_t makeDefaultKeptLimit();
+
+        bool forEachName(const NameHandler_t & handler, ErrorCode_t & errorCode) const;
+
+        fs::file_status statusAt(
+            const PathChar_t * name,
+            const bool willFollowLinks,
+            std::uintmax_t & size,
+            ErrorCode_t & errorCode) const;
+
+        fs::file_status statusAt(
+            const PathChar_t * name,
+            const bool willFollowLinks,
+            std::uintmax_t & size,
+            FileLinks & links,
+            ErrorCode_t & errorCode) const;
+
+        bool existsAt(const PathStringView_t name, ErrorCode_t & errorCode) const;
+        bool makeDirectoryAt(const PathStringView_t name, ErrorCode_t & errorCode) const;
+
+        // the same as fs::remove_all(), so it returns how many were removed
+        std::uintmax_t removeAllAt(
+            const PathStringView_t name, const bool isFile, ErrorCode_t & errorCode) const;
+
+        // the same as copyFileCommon(), so links are copied as links and not followed
+        bool copyFileAt(
+            const PathStringView_t name,
+            const DirFd & toDirFd,
+            const PathStringView_t toName,
+            ErrorCode_t & errorCode) const;
+
+        // makes toName in toDirFd another hard link to the file name links to, without following
+        bool linkAt(
+            const PathStringView_t name,
+            const DirFd & toDirFd,
+            const PathStringView_t toName,
+            ErrorCode_t & errorCode) const;
+
+        // the same as fs::rename(), so it fails with EXDEV if toDirFd is on another filesystem
+        bool renameAt(
+            const PathStringView_t name,
+            const DirFd & toDirFd,
+            const PathStringView_t toName,
+            ErrorCode_t & errorCode) const;
+
+        // Where the data of the file starts on the disk, from the first extent FIEMAP gives, which
+        // only Linux has.  Zero with an error if the filesystem can't tell, or if it has no data.
+        std::uint64_t physicalOffsetAt(const PathStringView_t name, ErrorCode_t & errorCode) const;
+
+        // returns the file descriptor of a file opened for reading, or -1
+        int openFileAt(const PathStringView_t name, ErrorCode_t & errorCode) const;
+
+      private:
+        int m_fd;
+        bool m_isKept;
+        std::uint64_t m_device;
+
+        static inline std::atomic<std::size_t> m_keptCount{ 0 };
+        static inline std::atomic<std::size_t> m_keptLimit{ 0 };
+    };
+
+    //
+
+    // A file opened with DirFd::openFileAt() that is read from start to end.
+    class FileFd
+    {
+      public:
+        FileFd() noexcept
+            : m_fd(-1)
+        {}
+
+        ~FileFd() { close(); }
+
+        FileFd(const FileFd &) = delete;
+        FileFd(FileFd &&)      = delete;
+        FileFd & operator=(const FileFd &) = delete;
+        FileFd & operator=(FileFd &&) = delete;
+
+        inline bool isOpen() const noexcept { return (m_fd >= 0); }
+
+        bool open(const DirFd & dirFd, const PathStringView_t name, ErrorCode_t & errorCode);
+
+        // fails if there are less than size bytes left
+        bool read(char * buffer, const std::size_t size, ErrorCode_t & errorCode);
+
+        void close() noexcept;
+
+      private:
+        int m_fd;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_DIR_FD_HPP_INCLUDED
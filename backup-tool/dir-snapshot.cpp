@@ -0,0 +1,382 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// dir-snapshot.cpp
+//
+#include "dir-snapshot.hpp"
+
+#include "content-digest.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+
+namespace backup
+{
+
+    DirSnapshot::DirSnapshot()
+        : m_whichDir(WhichDir::Source)
+        , m_rootStr()
+        , m_path()
+        , m_newPath()
+        , m_loadedBytes()
+        , m_index()
+        , m_writeMutex()
+        , m_newStream()
+        , m_writeBuffer()
+        , m_recordCount(0)
+        , m_isWriting(false)
+        , m_didWriteFail(false)
+        , m_usedCount(0)
+        , m_unusedCount(0)
+    {}
+
+    DirSnapshot::~DirSnapshot()
+    {
+        if (!m_isWriting)
+        {
+            return;
+        }
+
+        m_newStream.close();
+
+        // the run never finished, so leave the old snapshot for the next run to use
+        ErrorCode_t errorCode;
+        fs::remove(m_newPath, errorCode);
+    }
+
+    fs::path DirSnapshot::makePath(const fs::path & dstRootPath, const WhichDir whichDir)
+    {
+        return (dstRootPath / tool_dir_name /
+                ((WhichDir::Source == whichDir) ? L"src-snapshot" : L"dst-snapshot"));
+    }
+
+    bool DirSnapshot::open(
+        const WhichDir whichDir,
+        const fs::path & rootPath,
+        const fs::path & path,
+        const bool willWrite,
+        std::wstring & warning)
+    {
+        m_whichDir = whichDir;
+        m_rootStr = rootPath.native();
+        m_path    = path;
+        m_newPath = m_path;
+        m_newPath += L".new";
+
+        bool isOk{ true };
+
+        ErrorCode_t errorCodeExists;
+        if (fs::exists(m_path, errorCodeExists) && !load(m_path, warning))
+        {
+            m_loadedBytes.clear();
+            m_index.clear();
+            isOk = false;
+        }
+
+        if (!willWrite)
+        {
+            return isOk;
+        }
+
+        ErrorCode_t errorCodeCreate;
+        fs::create_directories(m_path.parent_path(), errorCodeCreate);
+
+        m_newStream.open(m_newPath, (std::ios::binary | std::ios::out | std::ios::trunc));
+        if (errorCodeCreate || !m_newStream)
+        {
+            warning = (L"Failed to start a new " + std::wstring(toStringShort(m_whichDir)) +
+                       L" snapshot, so none will be saved this run");
+            return false;
+        }
+
+        m_isWriting = true;
+        m_writeBuffer.reserve(write_buffer_size * 2);
+        m_writeBuffer.insert(std::end(m_writeBuffer), file_magic, (file_magic + magic_size));
+        serialize::appendValue(m_writeBuffer, static_cast<std::uint32_t>(sizeof(PathChar_t)));
+        serialize::appendString(m_writeBuffer, m_rootStr);
+
+        return isOk;
+    }
+
+    bool DirSnapshot::load(const fs::path & path, std::wstring & warning)
+    {
+        warning = L"The snapshot " + m_path.filename().wstring() +
+                  L" from the last run could not be used, so every dir it had will be listed again";
+
+        std::ifstream stream(path, (std::ios::binary | std::ios::in | std::ios::ate));
+        if (!stream)
+        {
+            return false;
+        }
+
+        const auto fileSize{ static_cast<std::size_t>(stream.tellg()) };
+        const std::size_t headerSize{ magic_size + sizeof(std::uint32_t) };
+        const std::size_t footerSize{ magic_size + sizeof(std::uint64_t) };
+        if (fileSize < (headerSize + footerSize))
+        {
+            return false;
+        }
+
+        m_loadedBytes.resize(fileSize);
+        stream.seekg(0);
+        if (!stream.read(m_loadedBytes.data(), static_cast<std::streamsize>(fileSize)))
+        {
+            return false;
+        }
+
+        const char * pos{ m_loadedBytes.data() };
+        const char * const fileEnd{ m_loadedBytes.data() + fileSize };
+        const char * const end{ fileEnd - footerSize };
+
+        std::uint32_t charSize{ 0 };
+        if ((std::memcmp(pos, file_magic, magic_size) != 0) ||
+            (std::memcmp(end, end_magic, magic_size) != 0))
+        {
+            return false;
+        }
+
+        pos += magic_size;
+        if (!serialize::readValue(pos, end, charSize) || (charSize != sizeof(PathChar_t)))
+        {
+            return false;
+        }
+
+        // the same dst can be used with another src, and then none of it applies
+        PathString_t rootStr;
+        if (!serialize::readString(pos, end, rootStr) || (rootStr != m_rootStr))
+        {
+            return false;
+        }
+
+        std::uint64_t expectedCount{ 0 };
+        const char * footerPos{ end + magic_size };
+        serialize::readValue(footerPos, fileEnd, expectedCount);
+
+        // each record is its key and the offset of its stamp, then everything else
+        std::uint64_t recordCount{ 0 };
+        PathString_t key;
+        while (pos < end)
+        {
+            if (!serialize::readString(pos, end, key))
+            {
+                return false;
+            }
+
+            const std::size_t stampOffset{ static_cast<std::size_t>(pos - m_loadedBytes.data()) };
+
+            InodeStamp dirStamp;
+            std::uint64_t entryCount{ 0 };
+            std::uint64_t digest{ 0 };
+            std::uint64_t entryBytesSize{ 0 };
+            if (!serialize::readValue(pos, end, dirStamp.device) ||
+                !serialize::readValue(pos, end, dirStamp.inode) ||
+                !serialize::readValue(pos, end, dirStamp.mtime_ns) ||
+                !serialize::readValue(pos, end, dirStamp.ctime_ns) ||
+                !serialize::readValue(pos, end, entryCount) ||
+                !serialize::readValue(pos, end, digest) ||
+                !serialize::readValue(pos, end, entryBytesSize) ||
+                (static_cast<std::uint64_t>(end - pos) < entryBytesSize) ||
+                (ContentDigest::make(pos, static_cast<std::size_t>(entryBytesSize)) != digest))
+            {
+                return false;
+            }
+
+            pos += entryBytesSize;
+            m_index[key] = stampOffset;
+            ++recordCount;
+        }
+
+        return (recordCount == expectedCount);
+    }
+
+    bool DirSnapshot::makeKey(const fs::path & dirPath, PathString_t & key) const
+    {
+        return makeRelativeKey(m_whichDir, m_rootStr, dirPath, key);
+    }
+
+    bool DirSnapshot::find(
+        const PathString_t & key, const InodeStamp & dirStamp, DirRecord & record) const
+    {
+        const auto iter{ m_index.find(key) };
+        if (iter == std::end(m_index))
+        {
+            return false;
+        }
+
+        const char * pos{ m_loadedBytes.data() + iter->second };
+        const char * const end{ m_loadedBytes.data() + m_loadedBytes.size() };
+
+        // these were all checked by load()
+        InodeStamp loadedStamp;
+        std::uint64_t entryCount{ 0 };
+        std::uint64_t digest{ 0 };
+        std::uint64_t entryBytesSize{ 0 };
+        serialize::readValue(pos, end, loadedStamp.device);
+        serialize::readValue(pos, end, loadedStamp.inode);
+        serialize::readValue(pos, end, loadedStamp.mtime_ns);
+        serialize::readValue(pos, end, loadedStamp.ctime_ns);
+        serialize::readValue(pos, end, entryCount);
+        serialize::readValue(pos, end, digest);
+        serialize::readValue(pos, end, entryBytesSize);
+
+        if (loadedStamp != dirStamp)
+        {
+            return false;
+        }
+
+        record.entry_count = static_cast<std::size_t>(entryCount);
+        record.begin       = pos;
+        record.end         = (pos + entryBytesSize);
+        return true;
+    }
+
+    bool DirSnapshot::readEntry(const char *& pos, const char * const end, ListedEntry & entry)
+    {
+        const char * newPos{ pos };
+
+        // names are never copied out of the loaded file until they are stored in a DirNode
+        if (!serialize::readStringView(newPos, end, entry.name))
+        {
+            return false;
+        }
+
+        std::uint8_t type{ 0 };
+        std::uint8_t isFile{ 0 };
+        std::uint64_t size{ 0 };
+        if (!serialize::readValue(newPos, end, type) ||
+            !serialize::readValue(newPos, end, isFile) ||
+            !serialize::readValue(newPos, end, size) ||
+            !serialize::readValue(newPos, end, entry.inode) ||
+            !serialize::readValue(newPos, end, entry.link_count))
+        {
+            return false;
+        }
+
+        entry.type    = static_cast<fs::file_type>(type);
+        entry.is_file = (isFile != 0);
+        entry.size    = static_cast<std::size_t>(size);
+
+        pos = newPos;
+        return true;
+    }
+
+    void DirSnapshot::appendEntry(serialize::Bytes_t & bytes, const ListedEntry & entry)
+    {
+        serialize::appendString(bytes, entry.name);
+        serialize::appendValue(bytes, static_cast<std::uint8_t>(entry.type));
+        serialize::appendValue(bytes, static_cast<std::uint8_t>(entry.is_file));
+        serialize::appendValue(bytes, static_cast<std::uint64_t>(entry.size));
+        serialize::appendValue(bytes, entry.inode);
+        serialize::appendValue(bytes, entry.link_count);
+    }
+
+    bool DirSnapshot::readEntrys(const DirRecord & record, std::vector<ListedEntry> & entrys)
+    {
+        entrys.clear();
+        entrys.reserve(record.entry_count);
+
+        const char * pos{ record.begin };
+        ListedEntry entry;
+        while ((pos < record.end) && readEntry(pos, record.end, entry))
+        {
+            entrys.push_back(entry);
+        }
+
+        return ((pos == record.end) && (entrys.size() == record.entry_count));
+    }
+
+    void DirSnapshot::record(
+        const PathString_t & key,
+        const InodeStamp & dirStamp,
+        const std::size_t entryCount,
+        const char * const entryBytesBegin,
+        const char * const entryBytesEnd)
+    {
+        if (!m_isWriting)
+        {
+            return;
+        }
+
+        using namespace std::chrono;
+        const std::int64_t nowNs{ static_cast<std::int64_t>(
+            duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count()) };
+
+        if ((std::max(dirStamp.mtime_ns, dirStamp.ctime_ns) + racy_ns) > nowNs)
+        {
+            return;
+        }
+
+        const auto entryBytesSize{ static_cast<std::size_t>(entryBytesEnd - entryBytesBegin) };
+        const std::uint64_t digest{ ContentDigest::make(entryBytesBegin, entryBytesSize) };
+
+        std::scoped_lock lock(m_writeMutex);
+
+        serialize::appendString(m_writeBuffer, key);
+        serialize::appendValue(m_writeBuffer, dirStamp.device);
+        serialize::appendValue(m_writeBuffer, dirStamp.inode);
+        serialize::appendValue(m_writeBuffer, dirStamp.mtime_ns);
+        serialize::appendValue(m_writeBuffer, dirStamp.ctime_ns);
+        serialize::appendValue(m_writeBuffer, static_cast<std::uint64_t>(entryCount));
+        serialize::appendValue(m_writeBuffer, digest);
+        serialize::appendValue(m_writeBuffer, static_cast<std::uint64_t>(entryBytesSize));
+        m_writeBuffer.insert(std::end(m_writeBuffer), entryBytesBegin, entryBytesEnd);
+        ++m_recordCount;
+
+        if (m_writeBuffer.size() >= write_buffer_size)
+        {
+            flush();
+        }
+    }
+
+    void DirSnapshot::flush()
+    {
+        if (!m_writeBuffer.empty() && !m_didWriteFail)
+        {
+            m_newStream.write(
+                m_writeBuffer.data(), static_cast<std::streamsize>(m_writeBuffer.size()));
+
+            m_didWriteFail = !m_newStream;
+        }
+
+        m_writeBuffer.clear();
+    }
+
+    bool DirSnapshot::finish(std::wstring & error)
+    {
+        if (!m_isWriting)
+        {
+            return true;
+        }
+
+        std::scoped_lock lock(m_writeMutex);
+
+        m_writeBuffer.insert(std::end(m_writeBuffer), end_magic, (end_magic + magic_size));
+        serialize::appendValue(m_writeBuffer, m_recordCount);
+        flush();
+
+        m_newStream.close();
+        m_isWriting = false;
+
+        ErrorCode_t errorCode;
+        if (!m_didWriteFail && !m_newStream.fail())
+        {
+            fs::rename(m_newPath, m_path, errorCode);
+            if (!errorCode)
+            {
+                return true;
+            }
+        }
+
+        error = L"Failed to save the snapshot " + m_path.filename().wstring();
+        if (errorCode)
+        {
+            error += L" (" + toString(errorCode) + L")";
+        }
+
+        fs::remove(m_newPath, errorCode);
+        fs::remove(m_path, errorCode);
+        return false;
+    }
+
+} // namespace backup
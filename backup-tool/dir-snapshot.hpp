@@ -0,0 +1,157 @@
+#ifndef BACKUP_DIR_SNAPSHOT_HPP_INCLUDED
+#define BACKUP_DIR_SNAPSHOT_HPP_INCLUDED
+//
+// dir-snapshot.hpp
+//
+#include "dir-fd.hpp"
+#include "filesystem-common.hpp"
+#include "spill-file.hpp"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace backup
+{
+
+    // What the dirs of the src or dst tree held at the end of the last run with --snapshot, so
+    // the next run can skip listing every dir that hasn't changed since.  Both files are kept in
+    // the app's own dir in dst, because the src might be read only.
+    //
+    // Each dir is kept with its InodeStamp from when it was listed, and is only used again if the
+    // dir still has the same one.  Anything that adds, removes, or renames a name in a dir
+    // changes its mtime and ctime, and that includes this app replacing a modified file, because
+    // copy() removes the old one first.  A dir changed in the same couple of seconds it was listed
+    // in might not have a new time on a filesystem with coarse times, so those are never kept.
+    // What a stamp can't catch is a file changed in place, so every name found this way is still
+    // stat'ed, unless --quick-check says only a few of them need to be, see BaseFileOperations.
+    //
+    // The file is only for this app on this machine, like a SpillFile, so it is in whatever byte
+    // order and wchar size this machine uses, and is simply ignored if it is not, or if it was
+    // made for a different root dir.  The dirs listed during a run are written to a new file as
+    // they go, which only replaces the old one if the run finishes, see finish().  Only dirs
+    // listed with a DirFd are ever kept, so this does nothing on Windows.
+    class DirSnapshot
+    {
+      public:
+        // everything a listing and storeEntry() need to make an Entry again
+        struct ListedEntry
+        {
+            PathStringView_t name;
+            fs::file_type type       = fs::file_type::none;
+            bool is_file             = false;
+            std::size_t size         = 0;
+            std::uint64_t inode      = 0;
+            std::uint64_t link_count = 1;
+        };
+
+        // where the entrys of one dir are in the loaded file
+        struct DirRecord
+        {
+            std::size_t entry_count = 0;
+            const char * begin      = nullptr;
+            const char * end        = nullptr;
+        };
+
+        DirSnapshot();
+        ~DirSnapshot();
+
+        DirSnapshot(const DirSnapshot &) = delete;
+        DirSnapshot(DirSnapshot &&)      = delete;
+        DirSnapshot & operator=(const DirSnapshot &) = delete;
+        DirSnapshot & operator=(DirSnapshot &&) = delete;
+
+        // Loads any snapshot the last run left in path, and starts a new one if willWrite.  Returns
+        // false with a warning if the old one couldn't be used, which is never fatal.
+        bool open(
+            const WhichDir whichDir,
+            const fs::path & rootPath,
+            const fs::path & path,
+            const bool willWrite,
+            std::wstring & warning);
+
+        inline bool isLoaded() const noexcept { return !m_index.empty(); }
+        inline bool isWriting() const noexcept { return m_isWriting; }
+
+        // false if the dir is not in the tree, or is inside the app's own dir in the dst tree
+        bool makeKey(const fs::path & dirPath, PathString_t & key) const;
+
+        // false if the dir was not in the snapshot, or it was but its stamp has changed
+        bool find(const PathString_t & key, const InodeStamp & dirStamp, DirRecord & record) const;
+
+        // counts a dir that was or wasn't made from what find() found, see usedCount()
+        void countUse(const bool wasUsed) const noexcept
+        {
+            ++((wasUsed) ? m_usedCount : m_unusedCount);
+        }
+
+        // false if the record doesn't hold exactly entry_count entrys
+        static bool readEntrys(const DirRecord & record, std::vector<ListedEntry> & entrys);
+        static void appendEntry(serialize::Bytes_t & bytes, const ListedEntry & entry);
+
+        // Adds a dir to the new snapshot, unless it was changed so recently that its stamp can't
+        // be trusted.  Any thread can call this at any time.
+        void record(
+            const PathString_t & key,
+            const InodeStamp & dirStamp,
+            const std::size_t entryCount,
+            const char * const entryBytesBegin,
+            const char * const entryBytesEnd);
+
+        // Replaces the old snapshot with the new one, where false means there was an error and
+        // neither is left, so the next run lists everything.
+        bool finish(std::wstring & error);
+
+        // how many dirs were made from the snapshot instead of listed, and weren't
+        std::size_t usedCount() const noexcept { return m_usedCount; }
+        std::size_t unusedCount() const noexcept { return m_unusedCount; }
+
+        // where the snapshot of the src or dst tree is kept
+        static fs::path makePath(const fs::path & dstRootPath, const WhichDir whichDir);
+
+      private:
+        bool load(const fs::path & path, std::wstring & warning);
+
+        static bool readEntry(const char *& pos, const char * const end, ListedEntry & entry);
+
+        // m_writeMutex must be locked
+        void flush();
+
+        static inline constexpr char file_magic[]{ "BKSNAP03" };
+        static inline constexpr char end_magic[]{ "BKSNAPND" };
+        static inline constexpr std::size_t magic_size{ 8 };
+
+        // dirs changed more recently than this before they were listed are never kept
+        static inline constexpr std::int64_t racy_ns{ 2'000'000'000 };
+
+        static inline constexpr std::size_t write_buffer_size{ 1 << 20 };
+
+      private:
+        WhichDir m_whichDir;
+        PathString_t m_rootStr;
+        fs::path m_path;
+        fs::path m_newPath;
+
+        // the whole loaded file, which every DirRecord and ListedEntry::name points into
+        std::vector<char> m_loadedBytes;
+        std::unordered_map<PathString_t, std::size_t> m_index;
+
+        std::mutex m_writeMutex;
+        std::ofstream m_newStream;
+        serialize::Bytes_t m_writeBuffer;
+        std::uint64_t m_recordCount;
+        bool m_isWriting;
+        bool m_didWriteFail;
+
+        mutable std::atomic<std::size_t> m_usedCount;
+        mutable std::atomic<std::size_t> m_unusedCount;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_DIR_SNAPSHOT_HPP_INCLUDED
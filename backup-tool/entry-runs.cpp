@@ -0,0 +1,368 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// entry-runs.cpp
+//
+#include "entry-runs.hpp"
+
+#include <algorithm>
+#include <stdexcept>
+#include <type_traits>
+
+namespace backup
+{
+
+    namespace
+    {
+        // Comparing whole names means following every Entry to its DirNode's name block, which
+        // is a cache miss each time, and huge directories often have names that all start the
+        // same way, such as "IMG_" or a date.  So instead the sort is done on SortKeys, which
+        // pack the next few chars of each name into one integer that compares the same way.
+        // Names whose keys are equal are then sorted again with the chars after those, which is
+        // an MSD radix sort that uses a digit eight bytes wide.
+        struct SortKey
+        {
+            std::uint64_t key   = 0;
+            std::uint32_t index = 0;
+        };
+
+        using SortKeyIter_t = std::vector<SortKey>::iterator;
+        using PathUChar_t   = std::make_unsigned_t<PathChar_t>;
+
+        constexpr std::size_t char_bits{ sizeof(PathChar_t) * 8 };
+        constexpr std::size_t chars_per_key{ sizeof(std::uint64_t) / sizeof(PathChar_t) };
+        constexpr std::uint64_t last_char_mask{ (std::uint64_t(1) << char_bits) - 1 };
+
+        constexpr std::size_t small_sort_max{ 256 };
+
+        // each part sorts at least this many before the chunks are merged
+        constexpr std::size_t parallel_sort_min{ 64 * 1024 };
+
+        // names can't contain a zero char, so shorter names end up with smaller keys
+        std::uint64_t makeSortKey(const PathStringView_t name, const std::size_t depth)
+        {
+            std::uint64_t key{ 0 };
+            for (std::size_t i{ 0 }; i < chars_per_key; ++i)
+            {
+                key <<= char_bits;
+
+                const std::size_t pos{ depth + i };
+                if (pos < name.size())
+                {
+                    key |= static_cast<PathUChar_t>(name[pos]);
+                }
+            }
+
+            return key;
+        }
+
+        void sortKeysByName(
+            const std::vector<Entry> & entrys,
+            const SortKeyIter_t first,
+            const SortKeyIter_t last,
+            const std::size_t depth)
+        {
+            for (auto iter{ first }; iter != last; ++iter)
+            {
+                iter->key = makeSortKey(entrys[iter->index].name(), depth);
+            }
+
+            std::sort(first, last, [](const SortKey & A, const SortKey & B) {
+                return (A.key < B.key);
+            });
+
+            auto runFirst{ first };
+            while (runFirst != last)
+            {
+                const auto runLast{ std::find_if(runFirst, last, [&](const SortKey & sortKey) {
+                    return (sortKey.key != runFirst->key);
+                }) };
+
+                // if the last char of the key is zero then these names all ended and are equal
+                if (((runLast - runFirst) > 1) && ((runFirst->key & last_char_mask) != 0))
+                {
+                    sortKeysByName(entrys, runFirst, runLast, (depth + chars_per_key));
+                }
+
+                runFirst = runLast;
+            }
+        }
+
+        std::size_t commonPrefixLength(const std::vector<Entry> & entrys)
+        {
+            const PathStringView_t firstName{ entrys.front().name() };
+            std::size_t length{ firstName.size() };
+
+            for (const Entry & entry : entrys)
+            {
+                const PathStringView_t name{ entry.name() };
+                length = std::min(length, name.size());
+
+                std::size_t i{ 0 };
+                while ((i < length) && (name[i] == firstName[i]))
+                {
+                    ++i;
+                }
+
+                length = i;
+                if (0 == length)
+                {
+                    break;
+                }
+            }
+
+            return length;
+        }
+
+        // Huge directories are split into chunks that are sorted by different threads and then
+        // merged, a pair at a time, also by different threads.  Each round is run by runParts().
+        void sortKeysByNameInParts(
+            const std::vector<Entry> & entrys,
+            std::vector<SortKey> & sortKeys,
+            const std::size_t depth,
+            const std::size_t partCount,
+            const RunSortParts_t & runParts)
+        {
+            const std::size_t chunkCount{ std::min(
+                partCount, (sortKeys.size() / parallel_sort_min)) };
+
+            if (chunkCount < 2)
+            {
+                sortKeysByName(entrys, std::begin(sortKeys), std::end(sortKeys), depth);
+                return;
+            }
+
+            std::vector<SortKeyIter_t> bounds;
+            bounds.reserve(chunkCount + 1);
+            for (std::size_t i{ 0 }; i <= chunkCount; ++i)
+            {
+                bounds.push_back(
+                    std::begin(sortKeys) +
+                    static_cast<std::ptrdiff_t>((sortKeys.size() * i) / chunkCount));
+            }
+
+            std::vector<SortPart_t> parts;
+            parts.reserve(chunkCount);
+            for (std::size_t i{ 0 }; i < chunkCount; ++i)
+            {
+                parts.push_back([&entrys, depth, first = bounds[i], last = bounds[i + 1]]() {
+                    sortKeysByName(entrys, first, last, depth);
+                });
+            }
+
+            runParts(parts);
+
+            const auto isLess = [&](const SortKey & A, const SortKey & B) {
+                return (entrys[A.index].name() < entrys[B.index].name());
+            };
+
+            while (bounds.size() > 2)
+            {
+                parts.clear();
+                std::vector<SortKeyIter_t> mergedBounds;
+
+                std::size_t i{ 0 };
+                for (; (i + 2) < bounds.size(); i += 2)
+                {
+                    mergedBounds.push_back(bounds[i]);
+
+                    parts.push_back([&isLess,
+                                     first  = bounds[i],
+                                     middle = bounds[i + 1],
+                                     last   = bounds[i + 2]]() {
+                        std::inplace_merge(first, middle, last, isLess);
+                    });
+                }
+
+                // an odd chunk at the end is merged in the next round
+                for (; i < bounds.size(); ++i)
+                {
+                    mergedBounds.push_back(bounds[i]);
+                }
+
+                runParts(parts);
+
+                bounds.swap(mergedBounds);
+            }
+        }
+
+    } // namespace
+
+    void sortEntrysByName(std::vector<Entry> & entrys)
+    {
+        sortEntrysByName(entrys, 1, [](const std::vector<SortPart_t> &) {});
+    }
+
+    void sortEntrysByName(
+        std::vector<Entry> & entrys, const std::size_t partCount, const RunSortParts_t & runParts)
+    {
+        if (entrys.size() < 2)
+        {
+            return;
+        }
+
+        // not worth making the keys for, and most directories are this small
+        if (entrys.size() < small_sort_max)
+        {
+            std::sort(std::begin(entrys), std::end(entrys), [](const auto & A, const auto & B) {
+                return (A.name() < B.name());
+            });
+
+            return;
+        }
+
+        std::vector<SortKey> sortKeys(entrys.size());
+        for (std::size_t i{ 0 }; i < sortKeys.size(); ++i)
+        {
+            sortKeys[i].index = static_cast<std::uint32_t>(i);
+        }
+
+        sortKeysByNameInParts(
+            entrys, sortKeys, commonPrefixLength(entrys), partCount, runParts);
+
+        std::vector<Entry> sortedEntrys;
+        sortedEntrys.reserve(entrys.size());
+        for (const SortKey & sortKey : sortKeys)
+        {
+            sortedEntrys.push_back(std::move(entrys[sortKey.index]));
+        }
+
+        entrys.swap(sortedEntrys);
+    }
+
+    //
+
+    EntryRuns::EntryRuns()
+        : m_spillFile()
+        , m_entryCount(0)
+        , m_bytes()
+    {}
+
+    void EntryRuns::spill(const fs::path & spillDirPath, std::vector<Entry> & entrys)
+    {
+        sortEntrysByName(entrys);
+
+        m_bytes.clear();
+        for (const Entry & entry : entrys)
+        {
+            serialize::appendEntry(m_bytes, entry);
+        }
+
+        m_spillFile.pushChunk(spillDirPath, m_bytes);
+        m_entryCount += entrys.size();
+        entrys.clear();
+    }
+
+    void EntryRuns::clear()
+    {
+        m_spillFile.clear();
+        m_entryCount = 0;
+        m_bytes.clear();
+    }
+
+    //
+
+    EntryCursor::EntryCursor(const std::vector<Entry> & entrys, EntryRuns & runs)
+        : m_entrys(entrys)
+        , m_entryIndex(0)
+        , m_runs(runs)
+        , m_readers(runs.runCount())
+        , m_currentReaderPtr(nullptr)
+        , m_currentPtr(nullptr)
+    {
+        for (std::size_t i{ 0 }; i < m_readers.size(); ++i)
+        {
+            m_readers[i].chunk_index = i;
+            readNext(m_readers[i]);
+        }
+
+        pickCurrent();
+    }
+
+    void EntryCursor::next()
+    {
+        if (isEnd())
+        {
+            return;
+        }
+
+        if (nullptr == m_currentReaderPtr)
+        {
+            ++m_entryIndex;
+        }
+        else
+        {
+            readNext(*m_currentReaderPtr);
+        }
+
+        pickCurrent();
+    }
+
+    void EntryCursor::readNext(RunReader & reader)
+    {
+        while (!reader.is_end)
+        {
+            const char * pos{ reader.bytes.data() + reader.pos };
+            const char * const end{ reader.bytes.data() + reader.bytes.size() };
+
+            if (serialize::readEntry(pos, end, reader.dir_node_ptr, reader.entry))
+            {
+                reader.pos = static_cast<std::size_t>(pos - reader.bytes.data());
+                return;
+            }
+
+            // not enough bytes left for a whole Entry, so keep what is left and read more
+            reader.bytes.erase(
+                std::begin(reader.bytes),
+                (std::begin(reader.bytes) + static_cast<std::ptrdiff_t>(reader.pos)));
+
+            reader.pos = 0;
+
+            const std::size_t prevSize{ reader.bytes.size() };
+            reader.bytes.resize(prevSize + read_size);
+
+            const std::size_t readCount{ m_runs.spillFile().readChunkPart(
+                reader.chunk_index, reader.offset, (reader.bytes.data() + prevSize), read_size) };
+
+            reader.bytes.resize(prevSize + readCount);
+            reader.offset += readCount;
+
+            if (0 == readCount)
+            {
+                if (!reader.bytes.empty())
+                {
+                    throw std::runtime_error("A spilled directory listing ended in the middle of "
+                                             "an entry.");
+                }
+
+                reader.is_end = true;
+            }
+        }
+    }
+
+    void EntryCursor::pickCurrent()
+    {
+        m_currentReaderPtr = nullptr;
+        m_currentPtr       = nullptr;
+
+        if (m_entryIndex < m_entrys.size())
+        {
+            m_currentPtr = &m_entrys[m_entryIndex];
+        }
+
+        for (RunReader & reader : m_readers)
+        {
+            if (reader.is_end)
+            {
+                continue;
+            }
+
+            if ((nullptr == m_currentPtr) || (reader.entry.name() < m_currentPtr->name()))
+            {
+                m_currentReaderPtr = &reader;
+                m_currentPtr       = &reader.entry;
+            }
+        }
+    }
+
+} // namespace backup
@@ -0,0 +1,103 @@
+#ifndef BACKUP_ENTRY_RUNS_HPP_INCLUDED
+#define BACKUP_ENTRY_RUNS_HPP_INCLUDED
+//
+// entry-runs.hpp
+//
+#include "entry.hpp"
+#include "spill-file.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+namespace backup
+{
+
+    // sorting by name is required by BaseFileOperations::comparEntrysWithSameType()
+    void sortEntrysByName(std::vector<Entry> & entrys);
+
+    using SortPart_t     = std::function<void()>;
+    using RunSortParts_t = std::function<void(const std::vector<SortPart_t> &)>;
+
+    // The same, but a huge directory is split into at most partCount parts that are sorted and
+    // then merged, and runParts() must return only once all the parts it was given have run.
+    void sortEntrysByName(
+        std::vector<Entry> & entrys, const std::size_t partCount, const RunSortParts_t & runParts);
+
+    //
+
+    // The part of one directory listing that was too big to keep in memory.  Each time the
+    // listing gets too big, what was listed so far is sorted by name and written to the
+    // SpillFile as one more run.  EntryCursor then merges these runs with whatever is still in
+    // memory, which is a simple external sort.
+    class EntryRuns
+    {
+      public:
+        EntryRuns();
+
+        inline bool isEmpty() const noexcept { return m_spillFile.isEmpty(); }
+        inline std::size_t runCount() const noexcept { return m_spillFile.chunkCount(); }
+        inline std::size_t entryCount() const noexcept { return m_entryCount; }
+
+        // sorts and writes all the entrys as one new run, and then clears them
+        void spill(const fs::path & spillDirPath, std::vector<Entry> & entrys);
+
+        void clear();
+
+        inline SpillFile & spillFile() noexcept { return m_spillFile; }
+
+      private:
+        SpillFile m_spillFile;
+        std::size_t m_entryCount;
+        serialize::Bytes_t m_bytes;
+    };
+
+    //
+
+    // Visits every Entry of a directory listing in name order, whether they are all in memory or
+    // some were spilled into EntryRuns.  The entrys in memory must already be sorted by name.
+    //
+    // There are only ever a few runs, so the next Entry is found by checking the front of every
+    // run instead of keeping them in a heap.
+    class EntryCursor
+    {
+        struct RunReader
+        {
+            std::size_t chunk_index = 0;
+            std::uint64_t offset    = 0;
+            serialize::Bytes_t bytes;
+            std::size_t pos = 0;
+            DirNodePtr_t dir_node_ptr;
+            Entry entry;
+            bool is_end = false;
+        };
+
+      public:
+        EntryCursor(const std::vector<Entry> & entrys, EntryRuns & runs);
+
+        inline bool isEnd() const noexcept { return (nullptr == m_currentPtr); }
+        inline const Entry & current() const noexcept { return *m_currentPtr; }
+
+        void next();
+
+      private:
+        void readNext(RunReader & reader);
+        void pickCurrent();
+
+      private:
+        static inline constexpr std::size_t read_size{ 64 * 1024 };
+
+        const std::vector<Entry> & m_entrys;
+        std::size_t m_entryIndex;
+        EntryRuns & m_runs;
+        std::vector<RunReader> m_readers;
+
+        // nullptr if current() is from m_entrys, otherwise the reader it came from
+        RunReader * m_currentReaderPtr;
+        const Entry * m_currentPtr;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_ENTRY_RUNS_HPP_INCLUDED
@@ -0,0 +1,135 @@
+#ifndef BACKUP_ENTRY_STORE_HPP_INCLUDED
+#define BACKUP_ENTRY_STORE_HPP_INCLUDED
+//
+// entry-store.hpp
+//
+#include "entry.hpp"
+#include "lock-free-stack.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+namespace backup
+{
+
+    using EntryHandle_t = std::uint32_t;
+
+    constexpr EntryHandle_t no_entry_handle{ std::numeric_limits<EntryHandle_t>::max() };
+
+    //
+
+    // The one place that all the queued tasks keep their EntryDPair_ts, so the task queues only
+    // need to hold an EntryHandle_t for each.  The slots are reference counted, so a pair that
+    // one stage is finished with can be queued for the next stage without copying it again, such
+    // as when a file compare finds a difference that must then be copied.
+    //
+    // The slots are in a SegmentedArray, so they never move, and any thread that holds a
+    // reference to a slot can use it without locking.  Freed slots are re-used through a
+    // LockFreeIndexStack, so the memory used is set by the most tasks ever queued at once.
+    class EntryStore
+    {
+        struct Slot
+        {
+            EntryDPair_t entry_dpair;
+            std::atomic<std::uint32_t> ref_count{ 0 };
+            std::atomic<std::uint32_t> next{ 0 };
+        };
+
+      public:
+        EntryStore()
+            : m_slots()
+            , m_unusedSlotIndex(0)
+            , m_freeSlots(*this)
+            , m_usedCount(0)
+        {}
+
+        EntryStore(const EntryStore &) = delete;
+        EntryStore(EntryStore &&)      = delete;
+        EntryStore & operator=(const EntryStore &) = delete;
+        EntryStore & operator=(EntryStore &&) = delete;
+
+        // the returned handle starts with one reference
+        EntryHandle_t add(const EntryConstRefDPair_t & entryDPair)
+        {
+            const EntryHandle_t handle{ acquireSlot() };
+            Slot & slot{ m_slots.at(handle) };
+            slot.entry_dpair.src = entryDPair.src;
+            slot.entry_dpair.dst = entryDPair.dst;
+            slot.ref_count       = 1;
+            return handle;
+        }
+
+        EntryHandle_t add(EntryDPair_t && entryDPair)
+        {
+            const EntryHandle_t handle{ acquireSlot() };
+            Slot & slot{ m_slots.at(handle) };
+            slot.entry_dpair = std::move(entryDPair);
+            slot.ref_count   = 1;
+            return handle;
+        }
+
+        void addRef(const EntryHandle_t handle)
+        {
+            assert(m_slots.at(handle).ref_count > 0);
+            ++m_slots.at(handle).ref_count;
+        }
+
+        // the slot is emptied and re-used once the last reference is released
+        void release(const EntryHandle_t handle)
+        {
+            Slot & slot{ m_slots.at(handle) };
+            assert(slot.ref_count > 0);
+
+            if (--slot.ref_count > 0)
+            {
+                return;
+            }
+
+            slot.entry_dpair.src.makeEmpty();
+            slot.entry_dpair.dst.makeEmpty();
+            --m_usedCount;
+            m_freeSlots.push(handle);
+        }
+
+        const EntryDPair_t & get(const EntryHandle_t handle) const
+        {
+            return m_slots.at(handle).entry_dpair;
+        }
+
+        std::size_t usedCount() const noexcept { return m_usedCount; }
+
+        // only used by the LockFreeIndexStack of free slots
+        std::atomic<std::uint32_t> & link(const std::uint32_t index)
+        {
+            return m_slots.at(index).next;
+        }
+
+      private:
+        EntryHandle_t acquireSlot()
+        {
+            ++m_usedCount;
+
+            std::uint32_t index{ 0 };
+            if (m_freeSlots.pop(index))
+            {
+                return index;
+            }
+
+            index = m_unusedSlotIndex.fetch_add(1);
+            m_slots.prepare(index);
+            return index;
+        }
+
+      private:
+        SegmentedArray<Slot> m_slots;
+        std::atomic<std::uint32_t> m_unusedSlotIndex;
+        LockFreeIndexStack<EntryStore> m_freeSlots;
+        std::atomic<std::size_t> m_usedCount;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_ENTRY_STORE_HPP_INCLUDED
@@ -3,19 +3,149 @@
 //
 // entry.hpp
 //
+#include "dir-fd.hpp"
 #include "dir-pair.hpp"
 #include "enums.hpp"
 #include "filesystem-common.hpp"
 
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
 
 namespace backup
 {
 
+    // One directory that Entrys were listed from.  Its full path is only stored here once, and
+    // the names of all its Entrys are copied into blocks that are never moved or freed until the
+    // DirNode is, so each Entry only needs a view of its name.  The blocks start small and double
+    // in size, so a DirNode with only one Entry stays small too.
+    //
+    // storeName() is not thread safe, so only the thread that makes the Entrys of a listing can
+    // call it, but any thread can use the Entrys and their names at any time.  Each name is
+    // followed by a zero char, so a stored name can be given to the OS as it is.
+    //
+    // The DirFd the listing was made with is kept here too if DirFd::tryKeep() allows, so that
+    // everything done to the Entrys later can be relative to it instead of using whole paths.
+    class DirNode
+    {
+      public:
+        explicit DirNode(const fs::path & path)
+            : m_path(path)
+            , m_blocks()
+            , m_blockSize(0)
+            , m_blockUsed(0)
+            , m_dirFd()
+            , m_device(0)
+            , m_sameDirNodePtr()
+        {}
+
+        // Another DirNode for the same dir, so another thread can store names in this one while
+        // still sharing the DirFd of the original.
+        explicit DirNode(const std::shared_ptr<DirNode> & sameDirNodePtr)
+            : m_path(sameDirNodePtr->path())
+            , m_blocks()
+            , m_blockSize(0)
+            , m_blockUsed(0)
+            , m_dirFd()
+            , m_device(0)
+            , m_sameDirNodePtr(sameDirNodePtr)
+        {}
+
+        DirNode(const DirNode &) = delete;
+        DirNode(DirNode &&)      = delete;
+        DirNode & operator=(const DirNode &) = delete;
+        DirNode & operator=(DirNode &&) = delete;
+
+        inline const fs::path & path() const noexcept { return m_path; }
+
+        // never open on Windows, or if the DirFd was not kept
+        inline const DirFd & dirFd() const noexcept
+        {
+            return ((m_sameDirNodePtr) ? m_sameDirNodePtr->dirFd() : m_dirFd);
+        }
+
+        // the st_dev of this dir even if its DirFd wasn't kept, or zero if it was never open
+        inline std::uint64_t device() const noexcept
+        {
+            return ((m_sameDirNodePtr) ? m_sameDirNodePtr->device() : m_device);
+        }
+
+        // must be called before any other thread can use this DirNode
+        inline void setDevice(const std::uint64_t device) noexcept { m_device = device; }
+
+        // must be called before any other thread can use this DirNode
+        void keepDirFd(DirFd && dirFd)
+        {
+            m_device = dirFd.device();
+
+            if (dirFd.tryKeep())
+            {
+                m_dirFd = std::move(dirFd);
+            }
+        }
+
+        // the returned view is valid for as long as this DirNode is
+        PathStringView_t storeName(const PathStringView_t name)
+        {
+            if (name.empty())
+            {
+                return {};
+            }
+
+            const std::size_t storedSize{ name.size() + 1 };
+            if ((m_blockUsed + storedSize) > m_blockSize)
+            {
+                m_blockSize = std::clamp((m_blockSize * 2), block_size_min, block_size_max);
+                m_blockSize = std::max(m_blockSize, storedSize);
+
+                m_blocks.push_back(std::make_unique<PathChar_t[]>(m_blockSize));
+                m_blockUsed = 0;
+            }
+
+            PathChar_t * const namePtr{ m_blocks.back().get() + m_blockUsed };
+            std::memcpy(namePtr, name.data(), (name.size() * sizeof(PathChar_t)));
+            namePtr[name.size()] = PathChar_t(0);
+            m_blockUsed += storedSize;
+
+            return { namePtr, name.size() };
+        }
+
+      private:
+        static inline constexpr std::size_t block_size_min{ 32 };
+        static inline constexpr std::size_t block_size_max{ 4096 };
+
+        fs::path m_path;
+        std::vector<std::unique_ptr<PathChar_t[]>> m_blocks;
+        std::size_t m_blockSize;
+        std::size_t m_blockUsed;
+        DirFd m_dirFd;
+        std::uint64_t m_device;
+        std::shared_ptr<DirNode> m_sameDirNodePtr;
+    };
+
+    using DirNodePtr_t = std::shared_ptr<DirNode>;
+
+    //
+
+    // tells the Entry constructor that the name is already stored in the DirNode
+    struct StoredNameTag_t
+    {};
+
+    constexpr StoredNameTag_t stored_name_tag{};
+
+    // A file or directory in one of the two trees.  There are millions of these at once, so the
+    // full path is never stored, only the DirNode it was listed from and a view of the name.
     struct Entry
     {
         Entry() = default;
 
+        // Makes a DirNode just for this Entry, so use the other constructor when making all the
+        // Entrys of a directory.  An empty path makes an isEmpty() Entry.
         Entry(
             const WhichDir dirParam,
             const bool isFileParam,
@@ -23,19 +153,61 @@ namespace backup
             const std::size_t sizeParam)
             : which_dir(dirParam)
             , is_file(isFileParam)
-            , path(pathParam.filename()) // use the path member as a temporary
-            , name(path.wstring())
-            , extension(path.extension().wstring())
             , size(sizeParam)
         {
-            if (path.empty())
+            if (pathParam.empty())
+            {
+                return;
+            }
+
+            const fs::path filename{ pathParam.filename() };
+            if (filename.empty())
+            {
+                // a root dir, or a path that ends with a separator, so there is no parent
+                m_isWholePath = true;
+                m_dirNodePtr  = std::make_shared<DirNode>(pathParam);
+
+                const PathString_t rootStr{ pathParam.root_name().native() +
+                                            pathParam.root_directory().native() };
+
+                setName(m_dirNodePtr->storeName(rootStr), false);
+            }
+            else
             {
-                name = pathParam.root_name().wstring();
-                name += pathParam.root_directory().wstring();
-                extension.clear();
+                m_dirNodePtr = std::make_shared<DirNode>(pathParam.parent_path());
+                setName(m_dirNodePtr->storeName(filename.native()), true);
             }
+        }
+
+        // stores the name in the DirNode of the directory this Entry is in
+        Entry(
+            const WhichDir dirParam,
+            const bool isFileParam,
+            const DirNodePtr_t & dirNodePtr,
+            const PathStringView_t nameParam,
+            const std::size_t sizeParam)
+            : which_dir(dirParam)
+            , is_file(isFileParam)
+            , size(sizeParam)
+            , m_dirNodePtr(dirNodePtr)
+        {
+            setName(m_dirNodePtr->storeName(nameParam), true);
+        }
 
-            path = pathParam;
+        // the same as above, but for a name that DirNode::storeName() already stored in it
+        Entry(
+            const WhichDir dirParam,
+            const bool isFileParam,
+            const DirNodePtr_t & dirNodePtr,
+            const PathStringView_t storedName,
+            const std::size_t sizeParam,
+            const StoredNameTag_t)
+            : which_dir(dirParam)
+            , is_file(isFileParam)
+            , size(sizeParam)
+            , m_dirNodePtr(dirNodePtr)
+        {
+            setName(storedName, true);
         }
 
         Entry(const Entry &) = default;
@@ -45,18 +217,174 @@ namespace backup
         Entry(Entry &&) noexcept = default;
         Entry & operator=(Entry &&) noexcept = default;
 
-        inline bool isEmpty() const noexcept { return path.empty(); }
+        inline bool isEmpty() const noexcept { return !m_dirNodePtr; }
+
+        inline void makeEmpty()
+        {
+            m_dirNodePtr.reset();
+            m_name = {};
+            m_extensionLength = 0;
+            m_isWholePath     = false;
+        }
+
+        // this is made every time, so keep it when it's needed more than once
+        fs::path path() const
+        {
+            if (isEmpty())
+            {
+                return {};
+            }
 
-        inline void makeEmpty() { path.clear(); }
+            if (m_isWholePath)
+            {
+                return m_dirNodePtr->path();
+            }
+
+            return (m_dirNodePtr->path() / m_name);
+        }
+
+        inline PathStringView_t name() const noexcept { return m_name; }
+
+        // the dir this Entry is in, which is only open if this Entry was listed from it
+        inline const DirFd & dirFd() const noexcept
+        {
+            static const DirFd notOpenDirFd;
+
+            if (isEmpty() || m_isWholePath)
+            {
+                return notOpenDirFd;
+            }
+
+            return m_dirNodePtr->dirFd();
+        }
+
+        // the device of the dir this Entry is in, or zero if that is unknown, see DirNode
+        inline std::uint64_t device() const noexcept
+        {
+            return ((isEmpty()) ? 0 : m_dirNodePtr->device());
+        }
+
+        // the DirNode of the dir this Entry is in, or of itself if it has no parent
+        inline const DirNodePtr_t & dirNodePtr() const noexcept { return m_dirNodePtr; }
+
+        // the same as fs::path::extension(), so it includes the dot
+        inline PathStringView_t extension() const noexcept
+        {
+            return m_name.substr(m_name.size() - m_extensionLength);
+        }
+
+        // An estimate of all the memory this Entry uses, that is the same for any copy of it.
+        // The DirNode is shared by all the Entrys of a directory, so only the name is counted.
+        inline std::size_t memoryUsage() const noexcept
+        {
+            return (sizeof(Entry) + (m_name.size() * sizeof(PathChar_t)));
+        }
 
         WhichDir which_dir = WhichDir::Source;
         bool is_file       = false;
-        fs::path path;
-        std::wstring name;
-        std::wstring extension;
+
+        // The same for every Entry that is a hard link to the same file, see HardLinks.  Zero for
+        // anything that isn't a regular file with more than one link.
+        LinkId_t link_id = 0;
+
         std::size_t size = 0;
+
+      private:
+        void setName(const PathStringView_t name, const bool hasExtension) noexcept
+        {
+            m_name            = name;
+            m_extensionLength = 0;
+
+            // same rules as fs::path::extension(), where "." and ".." and ".profile" have none
+            const PathChar_t dot{ '.' };
+            const bool isDotOrDotDot{ (name.size() <= 2) &&
+                                      (name.find_first_not_of(dot) == PathStringView_t::npos) };
+
+            if (!hasExtension || isDotOrDotDot)
+            {
+                return;
+            }
+
+            const std::size_t dotPos{ name.rfind(dot) };
+            if ((dotPos == PathStringView_t::npos) || (dotPos == 0))
+            {
+                return;
+            }
+
+            m_extensionLength = static_cast<std::uint32_t>(name.size() - dotPos);
+        }
+
+      private:
+        bool m_isWholePath              = false;
+        std::uint32_t m_extensionLength = 0;
+        PathStringView_t m_name;
+        DirNodePtr_t m_dirNodePtr;
     };
 
+    // the same as the one that takes a path, but relative to the DirFd of the Entry if it's open
+    [[nodiscard]] inline bool existsIgnoringErrors(const Entry & entry, const bool returnOnError)
+    {
+        if (!entry.dirFd().isOpen())
+        {
+            return existsIgnoringErrors(entry.path(), returnOnError);
+        }
+
+        try
+        {
+            ErrorCode_t errorCode;
+            const bool result{ entry.dirFd().existsAt(entry.name(), errorCode) };
+            return ((errorCode) ? returnOnError : result);
+        }
+        catch (...)
+        {
+            return returnOnError;
+        }
+    }
+
+    // The size of a regular file, or zero for anything else or on any error.  This is only for
+    // jobs that don't list the sizes of files, see MetadataNeeds.
+    [[nodiscard]] inline std::size_t fileSizeIgnoringErrors(const Entry & entry)
+    {
+        try
+        {
+            ErrorCode_t errorCode;
+            std::uintmax_t size{ 0 };
+
+            if (entry.dirFd().isOpen())
+            {
+                const PathString_t name{ entry.name() };
+
+                const fs::file_status status{ entry.dirFd().statusAt(
+                    name.c_str(), false, size, errorCode) };
+
+                if (errorCode || !fs::is_regular_file(status))
+                {
+                    return 0;
+                }
+
+                return static_cast<std::size_t>(size);
+            }
+
+            const fs::path path{ entry.path() };
+            if (!fs::is_regular_file(fs::symlink_status(path, errorCode)) || errorCode)
+            {
+                return 0;
+            }
+
+            size = fs::file_size(path, errorCode);
+            return ((errorCode) ? 0 : static_cast<std::size_t>(size));
+        }
+        catch (...)
+        {
+            return 0;
+        }
+    }
+
+    //
+    using EntryVec_t           = std::vector<Entry>;
+    using EntryDPair_t         = DirPair<Entry>;
+    using EntryConstRefDPair_t = DirPair<const Entry &, const Entry &>;
+
 } // namespace backup
 
 #endif // BACKUP_ENTRY_HPP_INCLUDED
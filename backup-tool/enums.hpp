@@ -4,12 +4,14 @@
 // enums.hpp
 //
 #include <cstddef>
+#include <cstdint>
 #include <string>
 
 namespace backup
 {
 
-    enum class WhichDir
+    // one byte so it packs in with the other small fields of an Entry
+    enum class WhichDir : std::uint8_t
     {
         Source,
         Destination
@@ -29,7 +31,10 @@ namespace backup
     {
         Compare,
         Copy,
-        Cull
+        Cull,
+        Purge,
+        Export,
+        Diff
     };
 
     [[nodiscard]] constexpr auto toString(const Job job) noexcept
@@ -40,11 +45,68 @@ namespace backup
         case Job::Compare: return L"Compare";
         case Job::Copy: return L"Copy";
         case Job::Cull: return L"Cull";
+        case Job::Purge: return L"Purge";
+        case Job::Export: return L"Export";
+        case Job::Diff: return L"Diff";
         default: return L"UNKNOWN_JOB_ENUM_ERROR";
     }
         // clang-format on
     }
 
+    enum class TaskType
+    {
+        DirCompare,
+        FileCompare,
+        Copy,
+        Remove
+    };
+
+    [[nodiscard]] constexpr auto toString(const TaskType type) noexcept
+    {
+        // clang-format off
+        switch (type)
+        {
+            case TaskType::DirCompare:  { return L"Dirs"; }
+            case TaskType::FileCompare: { return L"Files"; }
+            case TaskType::Copy:        { return L"Copies"; }
+            case TaskType::Remove:      { return L"Deletes"; }
+            default:                    { return L"UNKNOWN_TASK_TYPE_ENUM_ERROR"; }
+        }
+        // clang-format on
+    }
+
+    // the order that queued tasks are executed in, see OrderedTaskList
+    enum class TaskOrder
+    {
+        Lifo,
+        Fifo,
+        LargestFirst,
+        SmallestFirst,
+        DeepestFirst,
+        ShallowestFirst,
+        InodeSweep,
+        DiskSweep
+    };
+
+    // these are also the names used by the --order-* command line options
+    [[nodiscard]] constexpr auto toString(const TaskOrder order) noexcept
+    {
+        // clang-format off
+    switch (order)
+    {
+        case TaskOrder::Lifo:            return L"lifo";
+        case TaskOrder::Fifo:            return L"fifo";
+        case TaskOrder::LargestFirst:    return L"largest";
+        case TaskOrder::SmallestFirst:   return L"smallest";
+        case TaskOrder::DeepestFirst:    return L"deepest";
+        case TaskOrder::ShallowestFirst: return L"shallowest";
+        case TaskOrder::InodeSweep:      return L"inode";
+        case TaskOrder::DiskSweep:       return L"disk";
+        default:                         return L"UNKNOWN_TASK_ORDER_ENUM_ERROR";
+    }
+        // clang-format on
+    }
+
     enum class Error
     {
         Exists,
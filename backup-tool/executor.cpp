@@ -0,0 +1,158 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// executor.cpp
+//
+#include "executor.hpp"
+
+namespace backup
+{
+
+    Executor::Executor()
+        : m_jobPtr(nullptr)
+        , m_jobSerial(0)
+        , m_activeCount(0)
+        , m_epoch(0)
+        , m_sleeperCount(0)
+        , m_willStop(false)
+        , m_threadCount(0)
+        , m_threadPool()
+        , m_mutex()
+        , m_workerCondVar()
+        , m_finishedCondVar()
+    {}
+
+    Executor::~Executor()
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            m_willStop = true;
+        }
+
+        m_workerCondVar.notify_all();
+        m_threadPool.joinAndDestroyAll();
+    }
+
+    void Executor::ensureThreadCount(const std::size_t threadCount)
+    {
+        std::scoped_lock lock(m_mutex);
+
+        while (m_threadCount < threadCount)
+        {
+            m_threadPool.add(
+                std::async(std::launch::async, &Executor::workerLoop, this, m_threadCount.load()));
+
+            ++m_threadCount;
+        }
+    }
+
+    std::size_t Executor::threadCount() const { return m_threadCount; }
+
+    bool Executor::workerLoop(const std::size_t workerIndex)
+    {
+        while (!m_willStop)
+        {
+            // both must be loaded before looking for tasks, see m_epoch
+            const std::size_t epoch{ m_epoch };
+            const std::size_t jobSerial{ m_jobSerial };
+
+            // see detachJob() for why this count has to go up before loading the job pointer
+            ++m_activeCount;
+
+            IExecutorJob * jobPtr{ m_jobPtr };
+            bool isJobFinished{ true };
+
+            if (jobPtr != nullptr)
+            {
+                // keep going without touching the mutex for as long as there are tasks to execute
+                while (!m_willStop && jobPtr->executeAnyTask(workerIndex))
+                {
+                    // this thread can only take one ready task, so wake another for the rest
+                    if ((m_sleeperCount > 0) && jobPtr->isAnyTaskReady())
+                    {
+                        notifyOne();
+                    }
+                }
+
+                isJobFinished = jobPtr->isFinished();
+            }
+
+            if ((--m_activeCount == 0) && (m_jobPtr == nullptr))
+            {
+                std::scoped_lock lock(m_mutex);
+                m_finishedCondVar.notify_all();
+            }
+
+            std::unique_lock lock(m_mutex);
+
+            if (isJobFinished)
+            {
+                // a finished job will never have more tasks, so only a new job is worth waking for
+                m_finishedCondVar.notify_all();
+
+                m_workerCondVar.wait(
+                    lock, [&]() { return (m_willStop || (m_jobSerial != jobSerial)); });
+            }
+            else
+            {
+                ++m_sleeperCount;
+
+                m_workerCondVar.wait(lock, [&]() {
+                    return (m_willStop || (m_epoch != epoch) || (m_jobSerial != jobSerial));
+                });
+
+                --m_sleeperCount;
+            }
+        }
+
+        return true;
+    }
+
+    void Executor::attachJob(IExecutorJob & job)
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+            assert(m_jobPtr == nullptr);
+            m_jobPtr = &job;
+            ++m_jobSerial;
+        }
+
+        // not notifyAll() because that would miss the threads waiting for a new job
+        ++m_epoch;
+        m_workerCondVar.notify_all();
+    }
+
+    void Executor::detachJob()
+    {
+        // Any thread that loads m_jobPtr has already counted itself as active, so once the pointer
+        // is cleared the count can only drop to zero, and once it has no thread can still be using
+        // the old job.
+        std::unique_lock lock(m_mutex);
+        m_jobPtr = nullptr;
+        m_finishedCondVar.wait(lock, [&]() { return (m_activeCount == 0); });
+    }
+
+    void Executor::notify(const bool willNotifyAll)
+    {
+        ++m_epoch;
+
+        // if a sleeper counted itself after this check, then it will also see the new m_epoch
+        if (m_sleeperCount == 0)
+        {
+            return;
+        }
+
+        // taking the mutex ensures any sleeper that saw the old m_epoch is already waiting
+        std::scoped_lock lock(m_mutex);
+
+        if (willNotifyAll)
+        {
+            m_workerCondVar.notify_all();
+        }
+        else
+        {
+            m_workerCondVar.notify_one();
+        }
+    }
+
+} // namespace backup
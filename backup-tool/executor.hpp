@@ -0,0 +1,119 @@
+#ifndef BACKUP_EXECUTOR_HPP_INCLUDED
+#define BACKUP_EXECUTOR_HPP_INCLUDED
+//
+// executor.hpp
+//
+#include "thread-pool.hpp"
+#include "util.hpp"
+
+#include <atomic>
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <mutex>
+
+namespace backup
+{
+
+    // Anything that has tasks for the Executor's threads to execute.
+    struct IExecutorJob
+    {
+        virtual ~IExecutorJob() = default;
+
+        // Executes one task if any are ready, and returns false if none were.  Must be safe to call
+        // from any number of threads at once.  The workerIndex is only a hint that allows different
+        // threads to prefer different kinds of tasks.
+        virtual bool executeAnyTask(const std::size_t workerIndex) = 0;
+
+        // true if executeAnyTask() would probably execute something if called now
+        virtual bool isAnyTaskReady() const = 0;
+
+        // once this returns true it must never return false again
+        virtual bool isFinished() const = 0;
+    };
+
+    //
+
+    // One set of threads that is shared by all the taskers, so that no thread sits idle just
+    // because the kind of task it was made for has run out.  The threads live until this object
+    // is destroyed, so a gui that runs many jobs only ever makes them once.
+    //
+    // Nothing in here waits on a timer.  Threads that find nothing to execute sleep until someone
+    // calls notifyOne()/notifyAll(), and the thread that calls run() sleeps until the job is
+    // finished or until it is time for the next status update.
+    class Executor
+    {
+      public:
+        Executor();
+        ~Executor();
+
+        Executor(const Executor &) = delete;
+        Executor(Executor &&)      = delete;
+        Executor & operator=(const Executor &) = delete;
+        Executor & operator=(Executor &&) = delete;
+
+        // threads are only ever added, never removed, until this object is destroyed, and this is
+        // safe to call from any thread at any time, even while a job is running
+        void ensureThreadCount(const std::size_t threadCount);
+        std::size_t threadCount() const;
+
+        // call after anything that might have made a task ready to execute
+        void notifyOne() { notify(false); }
+        void notifyAll() { notify(true); }
+
+        // Blocks until job.isFinished(), and until no thread is still executing any of its tasks,
+        // so that the job can be safely destroyed as soon as this returns.  Only one job can run at
+        // a time.  The statusUpdateFunction must return the time when it next wants to be called.
+        template <typename StatusUpdateFunction_t>
+        void run(IExecutorJob & job, StatusUpdateFunction_t statusUpdateFunction)
+        {
+            attachJob(job);
+
+            bool isJobFinished{ false };
+            while (!isJobFinished)
+            {
+                const Clock_t::time_point nextStatusTime{ statusUpdateFunction() };
+
+                std::unique_lock lock(m_mutex);
+
+                isJobFinished = m_finishedCondVar.wait_until(
+                    lock, nextStatusTime, [&]() { return job.isFinished(); });
+            }
+
+            detachJob();
+        }
+
+      private:
+        bool workerLoop(const std::size_t workerIndex);
+        void attachJob(IExecutorJob & job);
+        void detachJob();
+        void notify(const bool willNotifyAll);
+
+      private:
+        std::atomic<IExecutorJob *> m_jobPtr;
+
+        // changes every time a job is attached, so a thread can tell if there is a new job even if
+        // it happens to be at the same address as the last one
+        std::atomic<std::size_t> m_jobSerial;
+
+        // how many threads might be using m_jobPtr right now, see detachJob()
+        std::atomic<std::size_t> m_activeCount;
+
+        // This is an "eventcount".  Every notify changes m_epoch, and a thread that finds nothing
+        // to do only sleeps if m_epoch has not changed since before it started looking.  Sleepers
+        // count themselves while holding the mutex, so a notify only has to take the mutex when
+        // there is someone to wake, which keeps the mutex out of the way of enqueueing tasks.
+        std::atomic<std::size_t> m_epoch;
+        std::atomic<std::size_t> m_sleeperCount;
+
+        std::atomic<bool> m_willStop;
+        std::atomic<std::size_t> m_threadCount;
+        ThreadPool m_threadPool;
+        std::mutex m_mutex;
+        std::condition_variable m_workerCondVar;
+        std::condition_variable m_finishedCondVar;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_EXECUTOR_HPP_INCLUDED
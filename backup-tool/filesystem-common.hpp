@@ -12,6 +12,7 @@
 #include <fstream>
 #include <sstream>
 #include <string>
+#include <string_view>
 #include <system_error>
 
 //
@@ -61,7 +62,31 @@ namespace backup
 
     using ErrorCode_t        = std::error_code;
     using InputFileStream_t  = std::ifstream;
-    using OutputFileStream_t = std::wofstream;
+    using OutputFileStream_t = std::ofstream;
+
+    // Names and paths are kept in whatever chars the OS uses, which is UTF-8 everywhere but
+    // Windows, so listing and comparing them never converts anything.  They are only made wide
+    // when they are displayed, with one of the toWideString() below.
+    using PathChar_t       = fs::path::value_type;
+    using PathString_t     = fs::path::string_type;
+    using PathStringView_t = std::basic_string_view<PathChar_t>;
+
+    [[nodiscard]] inline std::wstring toWideString(const std::wstring_view str)
+    {
+        return std::wstring(str);
+    }
+
+    [[nodiscard]] inline std::wstring toWideString(const std::string_view str)
+    {
+        return strutil::toWideString(str);
+    }
+
+    // Use this instead of fs::path::wstring(), which depends on the global locale on Linux and
+    // throws on any name that isn't ASCII when that is the default "C" locale.
+    [[nodiscard]] inline std::wstring pathToWideString(const fs::path & path)
+    {
+        return toWideString(PathStringView_t(path.native()));
+    }
 
     inline std::size_t getSizeCommon(const fs::directory_entry & dirEntry, ErrorCode_t & errorCode)
     {
@@ -173,6 +198,61 @@ namespace backup
         return ((ch == fs::path::preferred_separator) || (ch == L'\\') || (ch == L'/'));
     }
 
+    // The app keeps its own files in this dir at the top of the dst tree, so there it is skipped
+    // and never shows up as Extra or gets culled.  A src dir with this name is just another dir.
+    inline const fs::path tool_dir_name{ L".backup-tool" };
+
+    // culled entries are moved into a per-run subdir of this dir when --trash is used
+    [[nodiscard]] inline fs::path makeTrashPath(const fs::path & dstRootPath)
+    {
+        return (dstRootPath / tool_dir_name / L"trash");
+    }
+
+    // true if a key made by makeRelativeKey() is the app's dir or anything inside it
+    [[nodiscard]] inline bool isToolDirKey(const PathStringView_t key)
+    {
+        const PathString_t & toolDirStr{ tool_dir_name.native() };
+
+        return (
+            (key.compare(0, toolDirStr.size(), toolDirStr) == 0) &&
+            ((key.size() == toolDirStr.size()) || isDirectorySeparator(key[toolDirStr.size()])));
+    }
+
+    // The path of a dir relative to the root dir of its tree, so that the app's own files can
+    // find it again in a later run.  False if it is not in the tree, or is inside the app's dir
+    // at the top of the dst tree.
+    [[nodiscard]] inline bool makeRelativeKey(
+        const WhichDir whichDir,
+        const PathString_t & rootStr,
+        const fs::path & dirPath,
+        PathString_t & key)
+    {
+        const PathString_t & pathStr{ dirPath.native() };
+
+        if ((pathStr.size() < rootStr.size()) ||
+            (pathStr.compare(0, rootStr.size(), rootStr) != 0))
+        {
+            return false;
+        }
+
+        std::size_t start{ rootStr.size() };
+        if ((start < pathStr.size()) && !isDirectorySeparator(pathStr[start]) && (start > 0) &&
+            !isDirectorySeparator(pathStr[start - 1]))
+        {
+            // only a name that starts with the root, like "/dst2" for "/dst"
+            return false;
+        }
+
+        while ((start < pathStr.size()) && isDirectorySeparator(pathStr[start]))
+        {
+            ++start;
+        }
+
+        key = pathStr.substr(start);
+
+        return ((WhichDir::Source == whichDir) || !isToolDirKey(key));
+    }
+
     [[nodiscard]] inline bool existsIgnoringErrors(const fs::path & path, const bool returnOnError)
     {
         try
@@ -0,0 +1,224 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// hard-links.cpp
+//
+#include "hard-links.hpp"
+
+#include <limits>
+
+namespace backup
+{
+
+    HardLinks::HardLinks()
+        : m_mutex()
+        , m_finishedCondVar()
+        , m_linkIds()
+        , m_linkCounts()
+        , m_compares()
+        , m_copies()
+    {}
+
+    LinkId_t HardLinks::linkId(const FileLinks & links)
+    {
+        if (links.count < 2)
+        {
+            return 0;
+        }
+
+        std::scoped_lock lock(m_mutex);
+
+        const auto iter{ m_linkIds.find({ links.device, links.inode }) };
+        if (iter != std::end(m_linkIds))
+        {
+            return iter->second;
+        }
+
+        // so many that they can't be told apart is just treated as not linked
+        if (m_linkCounts.size() >= std::numeric_limits<LinkId_t>::max())
+        {
+            return 0;
+        }
+
+        m_linkCounts.push_back(links.count);
+        const auto id{ static_cast<LinkId_t>(m_linkCounts.size()) };
+        m_linkIds.emplace(std::make_pair(links.device, links.inode), id);
+        return id;
+    }
+
+    HardLinks::Compared HardLinks::knownCompare(const Entry & src, const Entry & dst)
+    {
+        if ((0 == src.link_id) || (0 == dst.link_id))
+        {
+            return Compared::Unknown;
+        }
+
+        if (src.link_id == dst.link_id)
+        {
+            return Compared::Same;
+        }
+
+        std::scoped_lock lock(m_mutex);
+
+        const auto iter{ m_compares.find(makeCompareKey(src, dst)) };
+        return ((iter == std::end(m_compares)) ? Compared::Unknown : iter->second);
+    }
+
+    HardLinks::Compared HardLinks::takeCompare(const Entry & src, const Entry & dst)
+    {
+        std::unique_lock lock(m_mutex);
+
+        const std::uint64_t key{ makeCompareKey(src, dst) };
+
+        while (true)
+        {
+            const auto iter{ m_compares.find(key) };
+            if (iter == std::end(m_compares))
+            {
+                m_compares.emplace(key, Compared::Unknown);
+                return Compared::Unknown;
+            }
+
+            if (iter->second != Compared::Unknown)
+            {
+                return iter->second;
+            }
+
+            m_finishedCondVar.wait(lock);
+        }
+    }
+
+    void HardLinks::finishCompare(const Entry & src, const Entry & dst, const Compared compared)
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+
+            const std::uint64_t key{ makeCompareKey(src, dst) };
+            if (Compared::Unknown == compared)
+            {
+                m_compares.erase(key);
+            }
+            else
+            {
+                m_compares[key] = compared;
+            }
+        }
+
+        m_finishedCondVar.notify_all();
+    }
+
+    bool HardLinks::takeCopy(const Entry & src, Entry & copiedDstEntry)
+    {
+        std::unique_lock lock(m_mutex);
+
+        while (true)
+        {
+            const auto iter{ m_copies.find(src.link_id) };
+            if (iter == std::end(m_copies))
+            {
+                CopyRecord & record{ m_copies[src.link_id] };
+                record.remaining_count = (m_linkCounts.at(src.link_id - 1) - 1);
+                return false;
+            }
+
+            CopyRecord & record{ iter->second };
+            if (!record.is_copying)
+            {
+                copiedDstEntry = record.dst_entry;
+
+                // the dst Entry keeps its DirNode around, so let it go after the last link
+                if (--record.remaining_count == 0)
+                {
+                    m_copies.erase(iter);
+                }
+
+                return true;
+            }
+
+            m_finishedCondVar.wait(lock);
+        }
+    }
+
+    void HardLinks::finishCopy(const Entry & src, const Entry & copiedDstEntry)
+    {
+        {
+            std::scoped_lock lock(m_mutex);
+
+            const auto iter{ m_copies.find(src.link_id) };
+            if (iter != std::end(m_copies))
+            {
+                if (copiedDstEntry.isEmpty() || (0 == iter->second.remaining_count))
+                {
+                    m_copies.erase(iter);
+                }
+                else
+                {
+                    iter->second.is_copying = false;
+                    iter->second.dst_entry  = copiedDstEntry;
+                }
+            }
+        }
+
+        m_finishedCondVar.notify_all();
+    }
+
+    //
+
+    HardLinks::CompareClaim::CompareClaim(
+        HardLinks & hardLinks, const Entry & src, const Entry & dst)
+        : m_hardLinks(hardLinks)
+        , m_src(src)
+        , m_dst(dst)
+        , m_isOwner(false)
+        , m_known(Compared::Unknown)
+    {
+        if ((0 == src.link_id) || (0 == dst.link_id))
+        {
+            return;
+        }
+
+        m_known = m_hardLinks.knownCompare(src, dst);
+        if (Compared::Unknown == m_known)
+        {
+            m_known   = m_hardLinks.takeCompare(src, dst);
+            m_isOwner = (Compared::Unknown == m_known);
+        }
+    }
+
+    HardLinks::CompareClaim::~CompareClaim() { finish(Compared::Unknown); }
+
+    void HardLinks::CompareClaim::finish(const Compared compared)
+    {
+        if (m_isOwner)
+        {
+            m_isOwner = false;
+            m_hardLinks.finishCompare(m_src, m_dst, compared);
+        }
+    }
+
+    //
+
+    HardLinks::CopyClaim::CopyClaim(HardLinks & hardLinks, const Entry & src)
+        : m_hardLinks(hardLinks)
+        , m_src(src)
+        , m_isOwner(false)
+        , m_copiedDstEntry()
+    {
+        if (0 != src.link_id)
+        {
+            m_isOwner = !m_hardLinks.takeCopy(src, m_copiedDstEntry);
+        }
+    }
+
+    HardLinks::CopyClaim::~CopyClaim() { finish(Entry()); }
+
+    void HardLinks::CopyClaim::finish(const Entry & copiedDstEntry)
+    {
+        if (m_isOwner)
+        {
+            m_isOwner = false;
+            m_hardLinks.finishCopy(m_src, copiedDstEntry);
+        }
+    }
+
+} // namespace backup
@@ -0,0 +1,151 @@
+#ifndef BACKUP_HARD_LINKS_HPP_INCLUDED
+#define BACKUP_HARD_LINKS_HPP_INCLUDED
+//
+// hard-links.hpp
+//
+#include "dir-fd.hpp"
+#include "entry.hpp"
+
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace backup
+{
+
+    // Every regular file listed with more than one hard link gets a LinkId_t that is the same for
+    // all of its links, so that each file is only compared or copied once no matter how many
+    // names it has.  The first thread to compare a pair of files or copy a file does the work,
+    // and any other thread that gets to another link of the same file waits for it to finish and
+    // then uses what it found.  The one doing the work is never waiting on anything, so this
+    // can't deadlock.
+    //
+    // Only listings made with a DirFd can see which file a name links to, see DirFd::statusAt(),
+    // so on Windows every link id is zero and everything is compared and copied as before.
+    class HardLinks
+    {
+      public:
+        enum class Compared
+        {
+            Unknown,
+            Same,
+            Different
+        };
+
+        HardLinks();
+
+        HardLinks(const HardLinks &) = delete;
+        HardLinks(HardLinks &&)      = delete;
+        HardLinks & operator=(const HardLinks &) = delete;
+        HardLinks & operator=(HardLinks &&) = delete;
+
+        // zero if the file has only one link
+        LinkId_t linkId(const FileLinks & links);
+
+        // Without waiting, what a finished compare of these two found.  Two links to the very same
+        // file are always the Same.
+        Compared knownCompare(const Entry & src, const Entry & dst);
+
+        // Makes this thread the one that compares the two and returns Unknown, unless another
+        // thread already did, and then returns what it found after waiting for it to finish.
+        Compared takeCompare(const Entry & src, const Entry & dst);
+
+        // must be called once by whoever takeCompare() returned Unknown to, where Unknown means
+        // the compare failed so the next link to be compared should try again
+        void finishCompare(const Entry & src, const Entry & dst, const Compared compared);
+
+        // Makes this thread the one that copies the src file and returns false, unless another
+        // thread already did, and then returns true after waiting for it to finish with the dst
+        // Entry it copied to.  If that copy failed then this thread is the one to try again.
+        bool takeCopy(const Entry & src, Entry & copiedDstEntry);
+
+        // must be called once by whoever takeCopy() returned false to, with an empty dst Entry if
+        // the copy failed so that the next link to be copied tries again
+        void finishCopy(const Entry & src, const Entry & copiedDstEntry);
+
+        // An owner of a compare that always finishes it, so any error or exception that returns
+        // early just lets the next link try again.  Does nothing if either link id is zero.
+        class CompareClaim
+        {
+          public:
+            CompareClaim(HardLinks & hardLinks, const Entry & src, const Entry & dst);
+            ~CompareClaim();
+
+            CompareClaim(const CompareClaim &) = delete;
+            CompareClaim(CompareClaim &&)      = delete;
+            CompareClaim & operator=(const CompareClaim &) = delete;
+            CompareClaim & operator=(CompareClaim &&) = delete;
+
+            // what another thread already found, or Unknown if this one has to compare them
+            inline Compared known() const noexcept { return m_known; }
+
+            void finish(const Compared compared);
+
+          private:
+            HardLinks & m_hardLinks;
+            const Entry & m_src;
+            const Entry & m_dst;
+            bool m_isOwner;
+            Compared m_known;
+        };
+
+        // the same as CompareClaim but for copying, see takeCopy()
+        class CopyClaim
+        {
+          public:
+            CopyClaim(HardLinks & hardLinks, const Entry & src);
+            ~CopyClaim();
+
+            CopyClaim(const CopyClaim &) = delete;
+            CopyClaim(CopyClaim &&)      = delete;
+            CopyClaim & operator=(const CopyClaim &) = delete;
+            CopyClaim & operator=(CopyClaim &&) = delete;
+
+            // true if another thread already copied the src to copiedDstEntry()
+            inline bool isCopied() const noexcept { return !m_copiedDstEntry.isEmpty(); }
+            inline const Entry & copiedDstEntry() const noexcept { return m_copiedDstEntry; }
+
+            void finish(const Entry & copiedDstEntry);
+
+          private:
+            HardLinks & m_hardLinks;
+            const Entry & m_src;
+            bool m_isOwner;
+            Entry m_copiedDstEntry;
+        };
+
+      private:
+        static std::uint64_t makeCompareKey(const Entry & src, const Entry & dst) noexcept
+        {
+            return ((static_cast<std::uint64_t>(src.link_id) << 32) | dst.link_id);
+        }
+
+        struct CopyRecord
+        {
+            bool is_copying = true;
+            Entry dst_entry;
+
+            // how many more links to the file there could be, so it can be forgotten after the last
+            std::uint64_t remaining_count = 0;
+        };
+
+      private:
+        std::mutex m_mutex;
+        std::condition_variable m_finishedCondVar;
+
+        std::map<std::pair<std::uint64_t, std::uint64_t>, LinkId_t> m_linkIds;
+        std::vector<std::uint64_t> m_linkCounts;
+
+        // Unknown while a thread is comparing them, and a missing key has never been compared or
+        // failed and needs to be compared again
+        std::unordered_map<std::uint64_t, Compared> m_compares;
+        std::unordered_map<LinkId_t, CopyRecord> m_copies;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_HARD_LINKS_HPP_INCLUDED
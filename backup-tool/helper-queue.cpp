@@ -0,0 +1,144 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// helper-queue.cpp
+//
+#include "helper-queue.hpp"
+
+#include <algorithm>
+
+namespace backup
+{
+
+    HelperQueue::HelperQueue()
+        : m_batchPtrs()
+        , m_waitingCount(0)
+        , m_mutex()
+        , m_finishedCondVar()
+    {}
+
+    void HelperQueue::runAll(
+        const std::vector<Part_t> & parts, const std::function<void()> & notifyFunction)
+    {
+        if (parts.empty())
+        {
+            return;
+        }
+
+        Batch batch;
+        batch.parts_ptr        = &parts;
+        batch.unfinished_count = parts.size();
+
+        {
+            std::scoped_lock lock(m_mutex);
+            m_batchPtrs.push_back(&batch);
+            m_waitingCount += parts.size();
+        }
+
+        if (parts.size() > 1)
+        {
+            notifyFunction();
+        }
+
+        while (true)
+        {
+            std::size_t index{ 0 };
+
+            {
+                std::scoped_lock lock(m_mutex);
+                if (!takePart(batch, index))
+                {
+                    break;
+                }
+            }
+
+            executePart(batch, index);
+        }
+
+        // the batch is on this stack, so it can't be left behind for anyone still executing it
+        {
+            std::unique_lock lock(m_mutex);
+            m_finishedCondVar.wait(lock, [&]() { return (0 == batch.unfinished_count); });
+        }
+
+        if (batch.exception_ptr)
+        {
+            std::rethrow_exception(batch.exception_ptr);
+        }
+    }
+
+    bool HelperQueue::tryHelp()
+    {
+        if (!isAnyWaiting())
+        {
+            return false;
+        }
+
+        Batch * batchPtr{ nullptr };
+        std::size_t index{ 0 };
+
+        {
+            std::scoped_lock lock(m_mutex);
+
+            if (m_batchPtrs.empty())
+            {
+                return false;
+            }
+
+            batchPtr = m_batchPtrs.front();
+            if (!takePart(*batchPtr, index))
+            {
+                return false;
+            }
+        }
+
+        executePart(*batchPtr, index);
+        return true;
+    }
+
+    bool HelperQueue::takePart(Batch & batch, std::size_t & index)
+    {
+        if (batch.next_index >= batch.parts_ptr->size())
+        {
+            return false;
+        }
+
+        index = batch.next_index++;
+        --m_waitingCount;
+
+        // once every part is taken the batch is only waited on, so no one else should find it
+        if (batch.next_index == batch.parts_ptr->size())
+        {
+            m_batchPtrs.erase(std::find(std::begin(m_batchPtrs), std::end(m_batchPtrs), &batch));
+        }
+
+        return true;
+    }
+
+    void HelperQueue::executePart(Batch & batch, const std::size_t index)
+    {
+        std::exception_ptr exceptionPtr;
+
+        try
+        {
+            (*batch.parts_ptr)[index]();
+        }
+        catch (...)
+        {
+            exceptionPtr = std::current_exception();
+        }
+
+        std::scoped_lock lock(m_mutex);
+
+        if (exceptionPtr && !batch.exception_ptr)
+        {
+            batch.exception_ptr = exceptionPtr;
+        }
+
+        if (0 == --batch.unfinished_count)
+        {
+            m_finishedCondVar.notify_all();
+        }
+    }
+
+} // namespace backup
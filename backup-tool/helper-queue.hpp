@@ -0,0 +1,67 @@
+#ifndef BACKUP_HELPER_QUEUE_HPP_INCLUDED
+#define BACKUP_HELPER_QUEUE_HPP_INCLUDED
+//
+// helper-queue.hpp
+//
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+namespace backup
+{
+
+    // Lets one task split its work into parts that any idle Executor thread can help with, such
+    // as stat'ing all the entrys of a huge directory.  The thread that calls runAll() executes
+    // parts too, and then only waits for the parts other threads already took, so it never waits
+    // on a thread that might never come.
+    class HelperQueue
+    {
+        struct Batch
+        {
+            const std::vector<std::function<void()>> * parts_ptr = nullptr;
+            std::size_t next_index                              = 0;
+            std::size_t unfinished_count                        = 0;
+            std::exception_ptr exception_ptr;
+        };
+
+      public:
+        using Part_t = std::function<void()>;
+
+        HelperQueue();
+
+        HelperQueue(const HelperQueue &) = delete;
+        HelperQueue(HelperQueue &&)      = delete;
+        HelperQueue & operator=(const HelperQueue &) = delete;
+        HelperQueue & operator=(HelperQueue &&) = delete;
+
+        // Returns once every part has finished, and re-throws the first exception any part threw.
+        // The notifyFunction is called once the parts are ready for other threads to take.
+        void runAll(
+            const std::vector<Part_t> & parts, const std::function<void()> & notifyFunction);
+
+        // executes one part of any runAll() call, and returns false if there were none waiting
+        bool tryHelp();
+
+        inline bool isAnyWaiting() const noexcept { return (m_waitingCount > 0); }
+
+      private:
+        // m_mutex must be locked
+        bool takePart(Batch & batch, std::size_t & index);
+
+        void executePart(Batch & batch, const std::size_t index);
+
+      private:
+        std::deque<Batch *> m_batchPtrs;
+        std::atomic<std::size_t> m_waitingCount;
+        std::mutex m_mutex;
+        std::condition_variable m_finishedCondVar;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_HELPER_QUEUE_HPP_INCLUDED
@@ -0,0 +1,286 @@
+#ifndef BACKUP_LOCK_FREE_STACK_HPP_INCLUDED
+#define BACKUP_LOCK_FREE_STACK_HPP_INCLUDED
+//
+// lock-free-stack.hpp
+//
+#include "util.hpp"
+
+#include <array>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <utility>
+
+namespace backup
+{
+
+    // A Treiber stack of indexes into some other container, where that other container (Links_t)
+    // keeps all the "next" links.  Since the indexes are re-used, the head also holds a tag that
+    // changes every time the head does.  Without it, a thread that loaded the head could be
+    // delayed while other threads pop and then push back the same index, and then that first
+    // thread's compare_exchange would succeed with a stale next link (the ABA problem).
+    //
+    // Links_t must have a link(index) function that returns a std::atomic<std::uint32_t> &.
+    // Indexes are stored plus one so that zero can mean the end of the stack.
+    template <typename Links_t>
+    class LockFreeIndexStack
+    {
+      public:
+        explicit LockFreeIndexStack(Links_t & links)
+            : m_links(links)
+            , m_head(0)
+        {}
+
+        void push(const std::uint32_t index)
+        {
+            std::uint64_t head{ m_head.load(std::memory_order_relaxed) };
+            std::uint64_t newHead{ 0 };
+
+            do
+            {
+                m_links.link(index).store(indexPlusOne(head), std::memory_order_relaxed);
+                newHead = pack(nextTag(head), (index + 1));
+            } while (!m_head.compare_exchange_weak(
+                head, newHead, std::memory_order_acq_rel, std::memory_order_relaxed));
+        }
+
+        bool pop(std::uint32_t & index)
+        {
+            std::uint64_t head{ m_head.load(std::memory_order_acquire) };
+
+            while (indexPlusOne(head) != 0)
+            {
+                const std::uint32_t headIndex{ indexPlusOne(head) - 1 };
+
+                // this might be a stale link if another thread already popped this index, but in
+                // that case the tag will have changed and the compare_exchange below will fail
+                const std::uint32_t nextIndexPlusOne{ m_links.link(headIndex).load(
+                    std::memory_order_relaxed) };
+
+                if (m_head.compare_exchange_weak(
+                        head,
+                        pack(nextTag(head), nextIndexPlusOne),
+                        std::memory_order_acq_rel,
+                        std::memory_order_acquire))
+                {
+                    index = headIndex;
+                    return true;
+                }
+            }
+
+            return false;
+        }
+
+        bool isEmpty() const noexcept
+        {
+            return (indexPlusOne(m_head.load(std::memory_order_acquire)) == 0);
+        }
+
+      private:
+        static constexpr std::uint32_t indexPlusOne(const std::uint64_t head) noexcept
+        {
+            return static_cast<std::uint32_t>(head & 0xFFFF'FFFF);
+        }
+
+        static constexpr std::uint64_t nextTag(const std::uint64_t head) noexcept
+        {
+            return ((head >> 32) + 1);
+        }
+
+        static constexpr std::uint64_t
+            pack(const std::uint64_t tag, const std::uint32_t indexPlusOne) noexcept
+        {
+            return ((tag << 32) | indexPlusOne);
+        }
+
+      private:
+        Links_t & m_links;
+        std::atomic<std::uint64_t> m_head;
+    };
+
+    //
+
+    // An array that can grow while other threads are using it, because it never moves anything
+    // that is already in it.  The elements are kept in segments that double in size, so that
+    // small arrays stay small.  Any thread can call prepare(index), but at(index) must only be
+    // called after prepare() was called with that index or one after it in the same segment.
+    template <typename T>
+    class SegmentedArray
+    {
+      public:
+        static inline constexpr std::uint32_t max_count{ 1u << 31 };
+
+        SegmentedArray()
+            : m_segments()
+        {
+            for (auto & segment : m_segments)
+            {
+                segment.store(nullptr);
+            }
+        }
+
+        ~SegmentedArray()
+        {
+            for (auto & segment : m_segments)
+            {
+                delete[] segment.load();
+            }
+        }
+
+        SegmentedArray(const SegmentedArray &) = delete;
+        SegmentedArray(SegmentedArray &&)      = delete;
+        SegmentedArray & operator=(const SegmentedArray &) = delete;
+        SegmentedArray & operator=(SegmentedArray &&) = delete;
+
+        // makes the segment that holds index if it doesn't exist yet
+        void prepare(const std::uint32_t index)
+        {
+            if (index >= max_count)
+            {
+                throw std::length_error("SegmentedArray ran out of indexes");
+            }
+
+            const std::size_t segmentIndex{ toSegmentIndex(index) };
+            auto & segment{ m_segments[segmentIndex] };
+
+            if (segment.load(std::memory_order_acquire) == nullptr)
+            {
+                // more than one thread might get here, but only one will get to keep its segment
+                T * newSegment{ new T[segmentSize(segmentIndex)] };
+                T * expected{ nullptr };
+
+                if (!segment.compare_exchange_strong(
+                        expected, newSegment, std::memory_order_acq_rel))
+                {
+                    delete[] newSegment;
+                }
+            }
+        }
+
+        T & at(const std::uint32_t index)
+        {
+            const std::size_t segmentIndex{ toSegmentIndex(index) };
+            T * segment{ m_segments[segmentIndex].load(std::memory_order_acquire) };
+            assert(segment != nullptr);
+            return segment[index - segmentStart(segmentIndex)];
+        }
+
+        const T & at(const std::uint32_t index) const
+        {
+            return const_cast<SegmentedArray &>(*this).at(index);
+        }
+
+      private:
+        // segment zero holds the first (1 << first_segment_bits) elements, and every segment
+        // after that holds as many as all the segments before it combined
+        static std::size_t toSegmentIndex(const std::uint32_t index) noexcept
+        {
+            std::size_t highestBit{ 0 };
+            while ((index >> highestBit) > 1)
+            {
+                ++highestBit;
+            }
+
+            return ((index < (1u << first_segment_bits)) ? 0
+                                                          : (highestBit - first_segment_bits + 1));
+        }
+
+        static constexpr std::size_t segmentStart(const std::size_t segmentIndex) noexcept
+        {
+            return ((segmentIndex == 0) ? 0 : (1_st << (segmentIndex + first_segment_bits - 1)));
+        }
+
+        static constexpr std::size_t segmentSize(const std::size_t segmentIndex) noexcept
+        {
+            return ((segmentIndex == 0) ? (1_st << first_segment_bits)
+                                        : (1_st << (segmentIndex + first_segment_bits - 1)));
+        }
+
+      private:
+        static inline constexpr std::size_t first_segment_bits{ 10 };
+        static inline constexpr std::size_t segment_count{ 31 - first_segment_bits + 1 };
+
+        std::array<std::atomic<T *>, segment_count> m_segments;
+    };
+
+    //
+
+    // An unbounded lock-free LIFO stack of T.  Values live in nodes that are never freed until
+    // this object is destroyed, and popped nodes are recycled through a second lock-free stack, so
+    // memory use is set by the most values ever held at once, not by the total ever pushed.
+    template <typename T>
+    class LockFreeStack
+    {
+        struct Node
+        {
+            T value{};
+            std::atomic<std::uint32_t> next{ 0 };
+        };
+
+      public:
+        LockFreeStack()
+            : m_nodes()
+            , m_unusedNodeIndex(0)
+            , m_valueStack(*this)
+            , m_freeNodeStack(*this)
+        {}
+
+        LockFreeStack(const LockFreeStack &) = delete;
+        LockFreeStack(LockFreeStack &&)      = delete;
+        LockFreeStack & operator=(const LockFreeStack &) = delete;
+        LockFreeStack & operator=(LockFreeStack &&) = delete;
+
+        void push(T && value)
+        {
+            const std::uint32_t index{ acquireNode() };
+            m_nodes.at(index).value = std::move(value);
+            m_valueStack.push(index);
+        }
+
+        bool pop(T & value)
+        {
+            std::uint32_t index{ 0 };
+            if (!m_valueStack.pop(index))
+            {
+                return false;
+            }
+
+            value = std::move(m_nodes.at(index).value);
+            m_freeNodeStack.push(index);
+            return true;
+        }
+
+        bool isEmpty() const noexcept { return m_valueStack.isEmpty(); }
+
+        // only used by the LockFreeIndexStacks above, a node is only ever in one of them at once
+        std::atomic<std::uint32_t> & link(const std::uint32_t index)
+        {
+            return m_nodes.at(index).next;
+        }
+
+      private:
+        std::uint32_t acquireNode()
+        {
+            std::uint32_t index{ 0 };
+            if (m_freeNodeStack.pop(index))
+            {
+                return index;
+            }
+
+            index = m_unusedNodeIndex.fetch_add(1);
+            m_nodes.prepare(index);
+            return index;
+        }
+
+      private:
+        SegmentedArray<Node> m_nodes;
+        std::atomic<std::uint32_t> m_unusedNodeIndex;
+        LockFreeIndexStack<LockFreeStack> m_valueStack;
+        LockFreeIndexStack<LockFreeStack> m_freeNodeStack;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_LOCK_FREE_STACK_HPP_INCLUDED
@@ -0,0 +1,690 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// manifest.cpp
+//
+#include "manifest.hpp"
+
+#include "content-digest.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <utility>
+
+namespace backup
+{
+
+    const ManifestEntry * ManifestDir::find(const PathStringView_t name) const
+    {
+        const auto iter{ std::lower_bound(
+            std::begin(entrys),
+            std::end(entrys),
+            name,
+            [](const ManifestEntry & entry, const PathStringView_t nameToFind) {
+                return (entry.name.compare(nameToFind) < 0);
+            }) };
+
+        if ((iter == std::end(entrys)) || (iter->name != name))
+        {
+            return nullptr;
+        }
+
+        return &*iter;
+    }
+
+    int compareManifestKeys(const PathStringView_t left, const PathStringView_t right) noexcept
+    {
+        using Traits_t = PathStringView_t::traits_type;
+
+        const std::size_t size{ std::min(left.size(), right.size()) };
+        for (std::size_t i{ 0 }; i < size; ++i)
+        {
+            if (Traits_t::eq(left[i], right[i]))
+            {
+                continue;
+            }
+
+            const bool isLeftSeparator{ isDirectorySeparator(left[i]) };
+            const bool isRightSeparator{ isDirectorySeparator(right[i]) };
+            if (isLeftSeparator != isRightSeparator)
+            {
+                return ((isLeftSeparator) ? -1 : 1);
+            }
+
+            return ((Traits_t::lt(left[i], right[i])) ? -1 : 1);
+        }
+
+        if (left.size() == right.size())
+        {
+            return 0;
+        }
+
+        return ((left.size() < right.size()) ? -1 : 1);
+    }
+
+    PathStringView_t parentManifestKey(const PathStringView_t key) noexcept
+    {
+        std::size_t index{ key.size() };
+        while ((index > 0) && !isDirectorySeparator(key[index - 1]))
+        {
+            --index;
+        }
+
+        while ((index > 0) && isDirectorySeparator(key[index - 1]))
+        {
+            --index;
+        }
+
+        return key.substr(0, index);
+    }
+
+    PathString_t
+        makeChildManifestKey(const PathStringView_t parentKey, const PathStringView_t name)
+    {
+        PathString_t key;
+        key.reserve(parentKey.size() + 1 + name.size());
+        key += parentKey;
+
+        if (!key.empty())
+        {
+            key += fs::path::preferred_separator;
+        }
+
+        key += name;
+        return key;
+    }
+
+    //
+
+    ManifestWriter::ManifestWriter()
+        : m_path()
+        , m_newPath()
+        , m_stream()
+        , m_writeBuffer()
+        , m_indexBytes()
+        , m_offset(0)
+        , m_lastIndexOffset(0)
+        , m_indexCount(0)
+        , m_dirCount(0)
+        , m_entryCount(0)
+        , m_prevKey()
+        , m_isWriting(false)
+    {}
+
+    ManifestWriter::~ManifestWriter()
+    {
+        if (!m_isWriting)
+        {
+            return;
+        }
+
+        m_stream.close();
+
+        // never finished, so leave any old manifest as it was
+        ErrorCode_t errorCode;
+        fs::remove(m_newPath, errorCode);
+    }
+
+    bool ManifestWriter::open(
+        const fs::path & path, const PathString_t & rootStr, std::wstring & error)
+    {
+        m_path    = path;
+        m_newPath = m_path;
+        m_newPath += L".new";
+
+        m_stream.open(m_newPath, (std::ios::binary | std::ios::out | std::ios::trunc));
+        if (!m_stream)
+        {
+            error = L"Failed to create the manifest \"" + pathToWideString(m_newPath) + L"\"";
+            return false;
+        }
+
+        m_isWriting = true;
+
+        m_writeBuffer.insert(
+            std::end(m_writeBuffer),
+            ManifestReader::file_magic,
+            (ManifestReader::file_magic + ManifestReader::magic_size));
+
+        serialize::appendValue(m_writeBuffer, static_cast<std::uint32_t>(sizeof(PathChar_t)));
+        serialize::appendString(m_writeBuffer, rootStr);
+
+        return flush(error);
+    }
+
+    bool ManifestWriter::addDir(
+        const PathString_t & key,
+        const std::vector<ManifestEntry> & entrys,
+        std::wstring & error)
+    {
+        if ((m_dirCount > 0) && (compareManifestKeys(m_prevKey, key) >= 0))
+        {
+            error = L"The manifest dirs were not added in order";
+            return false;
+        }
+
+        // the first block is always indexed so that every search has somewhere to start
+        if ((0 == m_dirCount) ||
+            ((m_offset - m_lastIndexOffset) >= ManifestReader::index_interval))
+        {
+            serialize::appendString(m_indexBytes, key);
+            serialize::appendValue(m_indexBytes, m_offset);
+            m_lastIndexOffset = m_offset;
+            ++m_indexCount;
+        }
+
+        ManifestReader::appendDir(m_writeBuffer, key, entrys);
+
+        m_prevKey = key;
+        ++m_dirCount;
+        m_entryCount += entrys.size();
+
+        return flush(error);
+    }
+
+    bool ManifestWriter::finish(std::wstring & error)
+    {
+        if (!m_isWriting)
+        {
+            return true;
+        }
+
+        const std::uint64_t indexOffset{ m_offset };
+
+        m_writeBuffer.insert(
+            std::end(m_writeBuffer), std::begin(m_indexBytes), std::end(m_indexBytes));
+
+        serialize::appendValue(m_writeBuffer, indexOffset);
+        serialize::appendValue(m_writeBuffer, m_indexCount);
+        serialize::appendValue(m_writeBuffer, m_dirCount);
+        serialize::appendValue(m_writeBuffer, m_entryCount);
+
+        m_writeBuffer.insert(
+            std::end(m_writeBuffer),
+            ManifestReader::end_magic,
+            (ManifestReader::end_magic + ManifestReader::magic_size));
+
+        if (!flush(error))
+        {
+            return false;
+        }
+
+        m_stream.close();
+        m_isWriting = false;
+
+        ErrorCode_t errorCode;
+        if (!m_stream.fail())
+        {
+            fs::rename(m_newPath, m_path, errorCode);
+            if (!errorCode)
+            {
+                return true;
+            }
+        }
+
+        error = L"Failed to save the manifest \"" + pathToWideString(m_path) + L"\"";
+        if (errorCode)
+        {
+            error += L" (" + toString(errorCode) + L")";
+        }
+
+        fs::remove(m_newPath, errorCode);
+        return false;
+    }
+
+    bool ManifestWriter::flush(std::wstring & error)
+    {
+        m_stream.write(m_writeBuffer.data(), static_cast<std::streamsize>(m_writeBuffer.size()));
+        m_offset += m_writeBuffer.size();
+        m_writeBuffer.clear();
+
+        if (!m_stream)
+        {
+            error = L"Failed to write the manifest \"" + pathToWideString(m_newPath) + L"\"";
+            return false;
+        }
+
+        return true;
+    }
+
+    //
+
+    ManifestReader::Cursor::Cursor()
+        : m_readBuffer()
+        , m_stream()
+        , m_offset(0)
+        , m_endOffset(0)
+        , m_startKey()
+        , m_isStarted(false)
+    {}
+
+    bool ManifestReader::Cursor::open(
+        const ManifestReader & reader, const PathStringView_t startKey, std::wstring & error)
+    {
+        // the dirs are read in order, so a big buffer makes for far fewer reads
+        m_readBuffer.resize(read_buffer_size);
+        m_stream.rdbuf()->pubsetbuf(
+            m_readBuffer.data(), static_cast<std::streamsize>(m_readBuffer.size()));
+
+        m_offset    = reader.findStartOffset(startKey);
+        m_endOffset = reader.m_indexOffset;
+        m_startKey  = startKey;
+        m_isStarted = false;
+
+        m_stream.open(reader.m_path, (std::ios::binary | std::ios::in));
+        m_stream.seekg(static_cast<std::streamoff>(m_offset));
+        if (!m_stream)
+        {
+            error = L"The manifest could not be read \"" + pathToWideString(reader.m_path) + L"\"";
+            return false;
+        }
+
+        return true;
+    }
+
+    bool ManifestReader::Cursor::next(ManifestDir & dir, std::wstring & error)
+    {
+        error.clear();
+
+        while (m_offset < m_endOffset)
+        {
+            std::uint64_t keyLength{ 0 };
+            if (!readValue(keyLength) ||
+                (keyLength > ((m_endOffset - m_offset) / sizeof(PathChar_t))))
+            {
+                break;
+            }
+
+            dir.key.resize(static_cast<std::size_t>(keyLength));
+            const auto keySize{ static_cast<std::streamsize>(keyLength * sizeof(PathChar_t)) };
+            m_stream.read(reinterpret_cast<char *>(dir.key.data()), keySize);
+            m_offset += static_cast<std::uint64_t>(keySize);
+
+            std::uint64_t bodySize{ 0 };
+            std::uint64_t bodyDigest{ 0 };
+            if (!m_stream || !readValue(bodySize) || !readValue(bodyDigest) ||
+                (bodySize > (m_endOffset - std::min(m_offset, m_endOffset))))
+            {
+                break;
+            }
+
+            dir.bytes.resize(static_cast<std::size_t>(bodySize));
+            m_stream.read(dir.bytes.data(), static_cast<std::streamsize>(bodySize));
+            m_offset += bodySize;
+            if (!m_stream)
+            {
+                break;
+            }
+
+            // an indexed block can be a little before the start
+            if (!m_isStarted && (compareManifestKeys(dir.key, m_startKey) < 0))
+            {
+                continue;
+            }
+
+            m_isStarted = true;
+
+            if (!parseBody(bodyDigest, dir))
+            {
+                break;
+            }
+
+            return true;
+        }
+
+        if (m_offset < m_endOffset)
+        {
+            error = L"The manifest is damaged after the dir \"" + toWideString(dir.key) + L"\"";
+            m_offset = m_endOffset;
+        }
+
+        return false;
+    }
+
+    bool ManifestReader::Cursor::readValue(std::uint64_t & value)
+    {
+        m_stream.read(reinterpret_cast<char *>(&value), sizeof(value));
+        m_offset += sizeof(value);
+        return !m_stream.fail();
+    }
+
+    //
+
+    ManifestReader::ManifestReader()
+        : m_path()
+        , m_rootStr()
+        , m_dirsOffset(0)
+        , m_indexOffset(0)
+        , m_dirCount(0)
+        , m_entryCount(0)
+        , m_index()
+        , m_mutex()
+        , m_stream()
+        , m_cache()
+        , m_cacheOrder()
+        , m_cacheBytes(0)
+    {}
+
+    void ManifestReader::appendDir(
+        serialize::Bytes_t & bytes,
+        const PathStringView_t key,
+        const std::vector<ManifestEntry> & entrys)
+    {
+        serialize::Bytes_t body;
+        serialize::appendValue(body, static_cast<std::uint64_t>(entrys.size()));
+
+        for (const ManifestEntry & entry : entrys)
+        {
+            serialize::appendValue(body, static_cast<std::uint8_t>(entry.is_file));
+            serialize::appendString(body, entry.name);
+            serialize::appendValue(body, static_cast<std::uint64_t>(entry.size));
+            serialize::appendValue(body, entry.mtime_ns);
+            serialize::appendValue(body, entry.digest);
+        }
+
+        serialize::appendString(bytes, key);
+        serialize::appendValue(bytes, static_cast<std::uint64_t>(body.size()));
+        serialize::appendValue(bytes, ContentDigest::make(body.data(), body.size()));
+        bytes.insert(std::end(bytes), std::begin(body), std::end(body));
+    }
+
+    bool ManifestReader::open(const fs::path & path, std::wstring & error)
+    {
+        error = L"The manifest could not be read \"" + pathToWideString(path) + L"\"";
+
+        m_path = path;
+        m_stream.open(path, (std::ios::binary | std::ios::in | std::ios::ate));
+        if (!m_stream)
+        {
+            return false;
+        }
+
+        const auto fileSize{ static_cast<std::uint64_t>(m_stream.tellg()) };
+        const std::uint64_t headerSize{ magic_size + sizeof(std::uint32_t) +
+                                        sizeof(std::uint64_t) };
+
+        if (fileSize < (headerSize + footer_size))
+        {
+            m_stream.close();
+            return false;
+        }
+
+        std::vector<char> header(headerSize);
+        std::vector<char> footer(footer_size);
+        if (!readBytesAt(0, header.data(), header.size()) ||
+            !readBytesAt((fileSize - footer_size), footer.data(), footer.size()) ||
+            (std::memcmp(header.data(), file_magic, magic_size) != 0) ||
+            (std::memcmp((footer.data() + footer_size - magic_size), end_magic, magic_size) != 0))
+        {
+            m_stream.close();
+            return false;
+        }
+
+        const char * pos{ header.data() + magic_size };
+        const char * const headerEnd{ header.data() + header.size() };
+
+        std::uint32_t charSize{ 0 };
+        std::uint64_t rootLength{ 0 };
+        serialize::readValue(pos, headerEnd, charSize);
+        serialize::readValue(pos, headerEnd, rootLength);
+
+        m_dirsOffset = (headerSize + (rootLength * sizeof(PathChar_t)));
+
+        const char * footerPos{ footer.data() };
+        const char * const footerEnd{ footer.data() + footer.size() };
+
+        std::uint64_t indexCount{ 0 };
+        serialize::readValue(footerPos, footerEnd, m_indexOffset);
+        serialize::readValue(footerPos, footerEnd, indexCount);
+        serialize::readValue(footerPos, footerEnd, m_dirCount);
+        serialize::readValue(footerPos, footerEnd, m_entryCount);
+
+        const std::uint64_t footerOffset{ fileSize - footer_size };
+        if ((charSize != sizeof(PathChar_t)) || (m_dirsOffset > m_indexOffset) ||
+            (m_indexOffset > footerOffset))
+        {
+            m_stream.close();
+            return false;
+        }
+
+        m_rootStr.resize(static_cast<std::size_t>(rootLength));
+        std::vector<char> indexBytes(static_cast<std::size_t>(footerOffset - m_indexOffset));
+        if (!readBytesAt(
+                headerSize,
+                reinterpret_cast<char *>(m_rootStr.data()),
+                static_cast<std::size_t>(rootLength * sizeof(PathChar_t))) ||
+            !readBytesAt(m_indexOffset, indexBytes.data(), indexBytes.size()))
+        {
+            m_stream.close();
+            return false;
+        }
+
+        pos = indexBytes.data();
+        const char * const indexEnd{ indexBytes.data() + indexBytes.size() };
+
+        m_index.resize(static_cast<std::size_t>(indexCount));
+        for (IndexEntry & indexEntry : m_index)
+        {
+            if (!serialize::readString(pos, indexEnd, indexEntry.key) ||
+                !serialize::readValue(pos, indexEnd, indexEntry.offset))
+            {
+                m_stream.close();
+                return false;
+            }
+        }
+
+        if ((pos != indexEnd) || (m_index.empty() && (m_dirCount > 0)))
+        {
+            m_stream.close();
+            return false;
+        }
+
+        error.clear();
+        return true;
+    }
+
+    bool ManifestReader::find(
+        const PathStringView_t key, ManifestDirPtr_t & dirPtr, std::wstring & error)
+    {
+        std::scoped_lock lock(m_mutex);
+
+        const PathString_t keyStr{ key };
+
+        const auto cacheIter{ m_cache.find(keyStr) };
+        if (cacheIter != std::end(m_cache))
+        {
+            dirPtr = cacheIter->second;
+            return true;
+        }
+
+        std::uint64_t offset{ findStartOffset(key) };
+        PathString_t blockKey;
+        while (offset < m_indexOffset)
+        {
+            std::uint64_t bodySize{ 0 };
+            std::uint64_t bodyDigest{ 0 };
+            if (!readKeyAt(offset, blockKey, bodySize, bodyDigest))
+            {
+                error = L"The manifest is damaged before the dir \"" + toWideString(key) + L"\"";
+                return false;
+            }
+
+            const int compareResult{ compareManifestKeys(blockKey, key) };
+            if (compareResult > 0)
+            {
+                break;
+            }
+
+            if (compareResult < 0)
+            {
+                offset += bodySize;
+                continue;
+            }
+
+            auto dir{ std::make_shared<ManifestDir>() };
+            dir->key = std::move(blockKey);
+            if (!readBodyAt(offset, bodySize, bodyDigest, *dir))
+            {
+                error = L"The manifest is damaged in the dir \"" + toWideString(key) + L"\"";
+                return false;
+            }
+
+            // the oldest are forgotten first, but the one just found is always kept
+            m_cacheBytes += dir->bytes.size();
+            while (!m_cacheOrder.empty() && (m_cacheBytes > cache_bytes_max))
+            {
+                const auto oldIter{ m_cache.find(m_cacheOrder.front()) };
+                m_cacheBytes -= oldIter->second->bytes.size();
+                m_cache.erase(oldIter);
+                m_cacheOrder.pop_front();
+            }
+
+            m_cache[keyStr] = dir;
+            m_cacheOrder.push_back(keyStr);
+
+            dirPtr = std::move(dir);
+            return true;
+        }
+
+        error.clear();
+        return false;
+    }
+
+    std::vector<PathString_t> ManifestReader::makeSplitKeys(const std::size_t count) const
+    {
+        std::vector<PathString_t> keys;
+
+        // every index entry is about the same number of bytes after the last
+        for (std::size_t i{ 1 }; i < count; ++i)
+        {
+            const std::size_t index{ (i * m_index.size()) / count };
+            if ((index > 0) && (keys.empty() || (keys.back() != m_index[index].key)))
+            {
+                keys.push_back(m_index[index].key);
+            }
+        }
+
+        return keys;
+    }
+
+    std::uint64_t ManifestReader::findStartOffset(const PathStringView_t key) const
+    {
+        const auto iter{ std::upper_bound(
+            std::begin(m_index),
+            std::end(m_index),
+            key,
+            [](const PathStringView_t keyToFind, const IndexEntry & indexEntry) {
+                return (compareManifestKeys(keyToFind, indexEntry.key) < 0);
+            }) };
+
+        if (iter == std::begin(m_index))
+        {
+            return m_dirsOffset;
+        }
+
+        return std::prev(iter)->offset;
+    }
+
+    bool ManifestReader::readKeyAt(
+        std::uint64_t & offset,
+        PathString_t & key,
+        std::uint64_t & bodySize,
+        std::uint64_t & bodyDigest)
+    {
+        std::uint64_t keyLength{ 0 };
+        if (!readBytesAt(offset, reinterpret_cast<char *>(&keyLength), sizeof(keyLength)))
+        {
+            return false;
+        }
+
+        const std::uint64_t keySize{ keyLength * sizeof(PathChar_t) };
+        const std::uint64_t sizesOffset{ offset + sizeof(keyLength) + keySize };
+        if ((keySize > (m_indexOffset - offset)) || (sizesOffset > m_indexOffset))
+        {
+            return false;
+        }
+
+        key.resize(static_cast<std::size_t>(keyLength));
+        if (!readBytesAt(
+                (offset + sizeof(keyLength)),
+                reinterpret_cast<char *>(key.data()),
+                static_cast<std::size_t>(keySize)) ||
+            !readBytesAt(sizesOffset, reinterpret_cast<char *>(&bodySize), sizeof(bodySize)) ||
+            !readBytesAt(
+                (sizesOffset + sizeof(bodySize)),
+                reinterpret_cast<char *>(&bodyDigest),
+                sizeof(bodyDigest)))
+        {
+            return false;
+        }
+
+        offset = (sizesOffset + sizeof(bodySize) + sizeof(bodyDigest));
+        return (bodySize <= (m_indexOffset - std::min(offset, m_indexOffset)));
+    }
+
+    bool ManifestReader::readBodyAt(
+        const std::uint64_t offset,
+        const std::uint64_t bodySize,
+        const std::uint64_t bodyDigest,
+        ManifestDir & dir)
+    {
+        dir.bytes.resize(static_cast<std::size_t>(bodySize));
+        if (!readBytesAt(offset, dir.bytes.data(), dir.bytes.size()))
+        {
+            return false;
+        }
+
+        return parseBody(bodyDigest, dir);
+    }
+
+    bool ManifestReader::parseBody(const std::uint64_t bodyDigest, ManifestDir & dir)
+    {
+        if (ContentDigest::make(dir.bytes.data(), dir.bytes.size()) != bodyDigest)
+        {
+            return false;
+        }
+
+        const char * pos{ dir.bytes.data() };
+        const char * const end{ dir.bytes.data() + dir.bytes.size() };
+
+        std::uint64_t entryCount{ 0 };
+        if (!serialize::readValue(pos, end, entryCount))
+        {
+            return false;
+        }
+
+        dir.entrys.clear();
+        dir.entrys.reserve(static_cast<std::size_t>(entryCount));
+
+        for (std::uint64_t i{ 0 }; i < entryCount; ++i)
+        {
+            ManifestEntry & entry{ dir.entrys.emplace_back() };
+
+            std::uint8_t isFile{ 0 };
+            std::uint64_t size{ 0 };
+            if (!serialize::readValue(pos, end, isFile) ||
+                !serialize::readStringView(pos, end, entry.name) ||
+                !serialize::readValue(pos, end, size) ||
+                !serialize::readValue(pos, end, entry.mtime_ns) ||
+                !serialize::readValue(pos, end, entry.digest))
+            {
+                return false;
+            }
+
+            entry.is_file = (isFile != 0);
+            entry.size    = static_cast<std::size_t>(size);
+        }
+
+        return (pos == end);
+    }
+
+    bool ManifestReader::readBytesAt(
+        const std::uint64_t offset, char * const data, const std::size_t size)
+    {
+        m_stream.clear();
+        m_stream.seekg(static_cast<std::streamoff>(offset));
+        m_stream.read(data, static_cast<std::streamsize>(size));
+        return (static_cast<std::size_t>(m_stream.gcount()) == size);
+    }
+
+} // namespace backup
@@ -0,0 +1,245 @@
+#ifndef BACKUP_MANIFEST_HPP_INCLUDED
+#define BACKUP_MANIFEST_HPP_INCLUDED
+//
+// manifest.hpp
+//
+#include "filesystem-common.hpp"
+#include "spill-file.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace backup
+{
+
+    // A manifest is everything in a tree that --export-manifest found, saved to one file that
+    // --compare can use in place of the dst dir, such as when that dir is on a disk in a safe, and
+    // that --diff-manifests can compare with another manifest without reading either tree.
+    //
+    // Each dir is one block that holds its key (see makeRelativeKey()) and the name, type, size,
+    // mtime, and content digest of everything in it, sorted by name.  The blocks are sorted by
+    // compareManifestKeys(), which is simply the order a walk of the tree in name order finds
+    // them in, so a manifest can be written and read a dir at a time no matter how big it is.
+    // The footer holds an index with the key of about one block in every index_interval bytes,
+    // so finding any dir only takes reading a little of the file.
+    //
+    // Like a SpillFile, this is in whatever byte order and wchar size this machine uses, so it
+    // can only be read on the same kind of machine it was made on.
+
+    // one file or dir in a ManifestDir
+    struct ManifestEntry
+    {
+        PathStringView_t name;
+        bool is_file          = false;
+        std::size_t size      = 0;
+        std::int64_t mtime_ns = 0;
+        std::uint64_t digest  = 0;
+    };
+
+    // one dir read from a manifest, where every name points into bytes
+    struct ManifestDir
+    {
+        // the entry with this name, or null if there isn't one
+        const ManifestEntry * find(const PathStringView_t name) const;
+
+        PathString_t key;
+        std::vector<ManifestEntry> entrys;
+        std::vector<char> bytes;
+    };
+
+    using ManifestDirPtr_t = std::shared_ptr<const ManifestDir>;
+
+    // Less than zero if the left key comes first, where a separator comes before any other char
+    // so that everything in a dir comes before any other dir whose name starts the same.
+    [[nodiscard]] int
+        compareManifestKeys(const PathStringView_t left, const PathStringView_t right) noexcept;
+
+    // the key of the dir that the dir with this key is in, which is empty for the root's subdirs
+    [[nodiscard]] PathStringView_t parentManifestKey(const PathStringView_t key) noexcept;
+
+    // the key of the subdir with this name in the dir with parentKey
+    [[nodiscard]] PathString_t
+        makeChildManifestKey(const PathStringView_t parentKey, const PathStringView_t name);
+
+    //
+
+    class ManifestWriter
+    {
+      public:
+        ManifestWriter();
+        ~ManifestWriter();
+
+        ManifestWriter(const ManifestWriter &) = delete;
+        ManifestWriter(ManifestWriter &&)      = delete;
+        ManifestWriter & operator=(const ManifestWriter &) = delete;
+        ManifestWriter & operator=(ManifestWriter &&) = delete;
+
+        // The file is only written to path when finish() is called, and until then it is a new
+        // file next to it.  The rootStr is only kept to say where the manifest came from.
+        bool open(const fs::path & path, const PathString_t & rootStr, std::wstring & error);
+
+        // The dirs must be added in compareManifestKeys() order, and the entrys in name order.
+        bool addDir(
+            const PathString_t & key,
+            const std::vector<ManifestEntry> & entrys,
+            std::wstring & error);
+
+        // writes the index and replaces any old file at path with the new one
+        bool finish(std::wstring & error);
+
+        std::uint64_t dirCount() const noexcept { return m_dirCount; }
+        std::uint64_t entryCount() const noexcept { return m_entryCount; }
+
+      private:
+        bool flush(std::wstring & error);
+
+      private:
+        fs::path m_path;
+        fs::path m_newPath;
+        std::ofstream m_stream;
+        serialize::Bytes_t m_writeBuffer;
+        serialize::Bytes_t m_indexBytes;
+        std::uint64_t m_offset;
+        std::uint64_t m_lastIndexOffset;
+        std::uint64_t m_indexCount;
+        std::uint64_t m_dirCount;
+        std::uint64_t m_entryCount;
+        PathString_t m_prevKey;
+        bool m_isWriting;
+    };
+
+    //
+
+    class ManifestReader
+    {
+      public:
+        // Reads the dirs one after another, starting from the first with a key that is not before
+        // startKey.  Each has its own stream, so any number can be used at the same time as find().
+        class Cursor
+        {
+          public:
+            Cursor();
+
+            bool open(
+                const ManifestReader & reader,
+                const PathStringView_t startKey,
+                std::wstring & error);
+
+            // false with an empty error after the last dir
+            bool next(ManifestDir & dir, std::wstring & error);
+
+          private:
+            bool readValue(std::uint64_t & value);
+
+            static inline constexpr std::size_t read_buffer_size{ 1 << 20 };
+
+          private:
+            std::vector<char> m_readBuffer;
+            std::ifstream m_stream;
+            std::uint64_t m_offset;
+            std::uint64_t m_endOffset;
+            PathString_t m_startKey;
+            bool m_isStarted;
+        };
+
+        ManifestReader();
+        ~ManifestReader() = default;
+
+        ManifestReader(const ManifestReader &) = delete;
+        ManifestReader(ManifestReader &&)      = delete;
+        ManifestReader & operator=(const ManifestReader &) = delete;
+        ManifestReader & operator=(ManifestReader &&) = delete;
+
+        // only reads the header and the index
+        bool open(const fs::path & path, std::wstring & error);
+
+        inline bool isOpen() const noexcept { return m_stream.is_open(); }
+        inline const PathString_t & rootStr() const noexcept { return m_rootStr; }
+        inline std::uint64_t dirCount() const noexcept { return m_dirCount; }
+        inline std::uint64_t entryCount() const noexcept { return m_entryCount; }
+
+        // The dir with this key, or false with an empty error if there is none.  Any thread can
+        // call this at any time, and the last few dirs found are kept so that finding the same
+        // dir again, as every file compare of it does, doesn't read the file again.
+        bool find(const PathStringView_t key, ManifestDirPtr_t & dirPtr, std::wstring & error);
+
+        // Keys from the index that split the file into about count parts of the same size, in
+        // order and without the first key, so there is one less of them than there are parts.
+        std::vector<PathString_t> makeSplitKeys(const std::size_t count) const;
+
+        static inline constexpr char file_magic[]{ "BKMANI01" };
+        static inline constexpr char end_magic[]{ "BKMANIND" };
+        static inline constexpr std::size_t magic_size{ 8 };
+
+        // about how far apart the blocks with a key in the index are
+        static inline constexpr std::uint64_t index_interval{ 64 * 1024 };
+
+        // the index offset, index count, dir count, and entry count before the end_magic
+        static inline constexpr std::size_t footer_size{ (4 * sizeof(std::uint64_t)) +
+                                                         magic_size };
+
+        // appends a whole block to bytes, see ManifestWriter::addDir()
+        static void appendDir(
+            serialize::Bytes_t & bytes,
+            const PathStringView_t key,
+            const std::vector<ManifestEntry> & entrys);
+
+      private:
+        struct IndexEntry
+        {
+            PathString_t key;
+            std::uint64_t offset = 0;
+        };
+
+        // The offset of the last indexed block with a key that is not after this one, which
+        // is where any search for it has to start.
+        std::uint64_t findStartOffset(const PathStringView_t key) const;
+
+        // Reads the key and the sizes at the start of the block at offset, and moves offset to
+        // its body, which is either read next or skipped over by adding bodySize.
+        bool readKeyAt(
+            std::uint64_t & offset,
+            PathString_t & key,
+            std::uint64_t & bodySize,
+            std::uint64_t & bodyDigest);
+
+        bool readBodyAt(
+            const std::uint64_t offset,
+            const std::uint64_t bodySize,
+            const std::uint64_t bodyDigest,
+            ManifestDir & dir);
+
+        // makes the entrys from the body that has already been read into dir.bytes
+        static bool parseBody(const std::uint64_t bodyDigest, ManifestDir & dir);
+
+        bool readBytesAt(const std::uint64_t offset, char * const data, const std::size_t size);
+
+        static inline constexpr std::size_t cache_bytes_max{ 64 * 1024 * 1024 };
+
+      private:
+        fs::path m_path;
+        PathString_t m_rootStr;
+        std::uint64_t m_dirsOffset;
+        std::uint64_t m_indexOffset;
+        std::uint64_t m_dirCount;
+        std::uint64_t m_entryCount;
+        std::vector<IndexEntry> m_index;
+
+        // everything below is only used with the mutex locked
+        std::mutex m_mutex;
+        std::ifstream m_stream;
+        std::unordered_map<PathString_t, ManifestDirPtr_t> m_cache;
+        std::deque<PathString_t> m_cacheOrder;
+        std::size_t m_cacheBytes;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_MANIFEST_HPP_INCLUDED
@@ -3,6 +3,7 @@
 //
 // options.hpp
 //
+#include "device-probe.hpp"
 #include "entry.hpp"
 #include "enums.hpp"
 #include "filesystem-common.hpp"
@@ -22,6 +23,27 @@ namespace backup
         std::size_t remove         = 0;
     };
 
+    // see OrderedTaskList
+    struct TaskOrders
+    {
+        TaskOrder dir_compare  = TaskOrder::Lifo;
+        TaskOrder file_compare = TaskOrder::Lifo;
+        TaskOrder copy         = TaskOrder::Lifo;
+        TaskOrder remove       = TaskOrder::Lifo;
+    };
+
+    // What the job needs to know about each listed entry, so the listing can skip the stat calls
+    // for everything else.  The type of every entry is always needed, and comes from readdir()
+    // whenever it can.
+    struct MetadataNeeds
+    {
+        // the size of every file, only used to compare and copy them
+        bool file_size = true;
+
+        // what symlinks point to, only used to describe them in warnings and errors
+        bool link_target = true;
+    };
+
     struct Options
     {
         Job job = Job::Compare;
@@ -36,13 +58,49 @@ namespace backup
         bool ignore_unknown      = false;
         bool ignore_warnings     = false;
         bool show_relative_path  = false;
+        bool trash               = false;
+        bool autotune            = false;
+        bool probe               = false;
+        bool snapshot            = false;
+        bool quick_check         = false;
+        bool digests             = false;
+        bool scrub               = false;
 
         ThreadCounts thread_counts;
+        TaskOrders task_orders;
+
+        // picked by --probe or loaded from profile_path, see setOptions_IoProfile()
+        IoProfile io_profile;
+        fs::path profile_path;
+
+        // set by the job, see setOptions_MetadataNeeds()
+        MetadataNeeds metadata_needs;
+
+        // the bounds --autotune keeps each tasker's thread count within
+        std::size_t autotune_min = 1;
+        std::size_t autotune_max = 0;
+
+        // the most memory all the queued tasks together should use, zero means no limit
+        std::size_t queue_memory_mb = 1024;
+
+        // where tasks and directory listings that don't fit in queue_memory_mb are written
+        fs::path spill_dir;
+
+        // What --export-manifest writes, or what --compare reads when it's given a manifest in
+        // place of the dst dir, see isDstManifest().  The --diff-manifests option only uses the
+        // src and dst paths, which are both manifests.
+        fs::path manifest_path;
 
         DirPair<fs::path> path_dpair;
         DirPair<std::wstring> path_str_dpair;
         DirPair<Entry> entry_dpair;
 
+        // true if the dst is a manifest made by --export-manifest instead of a dir
+        inline bool isDstManifest() const noexcept
+        {
+            return ((Job::Compare == job) && !manifest_path.empty());
+        }
+
         // disable color by default on windows because it rarely ever works
         static bool isColorEnabledByDefault() { return !is_running_on_windows; }
     };
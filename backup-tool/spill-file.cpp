@@ -0,0 +1,338 @@
+// This is an open source non-commercial project. Dear PVS-Studio, please check it.
+// PVS-Studio Static Code Analyzer for C, C++ and C#: http://www.viva64.com
+//
+// spill-file.cpp
+//
+#include "spill-file.hpp"
+
+#include "str-util.hpp"
+#include "util.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <stdexcept>
+
+namespace backup
+{
+
+    namespace
+    {
+        // any start of a path shorter than this is opened whole, see reopenDirFd()
+        constexpr std::size_t whole_path_length_max{ 1024 };
+
+        // A DirNode read back from a spill file has lost the DirFd its listing kept, and without
+        // one everything done to its Entrys falls back on whole paths, which fail once they are
+        // longer than PATH_MAX.  So the dir is opened again one name at a time, starting from the
+        // dir read just before if this one is inside it, or otherwise from the longest start of
+        // the path that is short enough to open whole.  If no more DirFds can be kept then the
+        // Entrys still fall back on whole paths, so a tree that deep can still fail then.
+        void reopenDirFd(const DirNodePtr_t & prevDirNodePtr, DirNode & dirNode)
+        {
+            if (!is_dir_fd_supported || (DirFd::keptCount() >= DirFd::keptLimit()))
+            {
+                return;
+            }
+
+            const fs::path & path{ dirNode.path() };
+            const DirFd notOpenDirFd;
+            const DirFd * parentDirFdPtr{ &notOpenDirFd };
+            auto partIter{ std::begin(path) };
+
+            if (prevDirNodePtr && prevDirNodePtr->dirFd().isOpen())
+            {
+                const fs::path & prevPath{ prevDirNodePtr->path() };
+
+                const auto [prevIter, iter] = std::mismatch(
+                    std::begin(prevPath), std::end(prevPath), std::begin(path), std::end(path));
+
+                if (std::end(prevPath) == prevIter)
+                {
+                    parentDirFdPtr = &prevDirNodePtr->dirFd();
+                    partIter       = iter;
+                }
+            }
+
+            DirFd dirFd;
+            ErrorCode_t errorCode;
+
+            if (!parentDirFdPtr->isOpen())
+            {
+                fs::path startPath;
+                while ((partIter != std::end(path)) &&
+                       ((startPath / *partIter).native().size() < whole_path_length_max))
+                {
+                    startPath /= *partIter;
+                    ++partIter;
+                }
+
+                if (startPath.empty() || !dirFd.open(notOpenDirFd, {}, startPath, errorCode))
+                {
+                    return;
+                }
+
+                parentDirFdPtr = &dirFd;
+            }
+
+            for (; partIter != std::end(path); ++partIter)
+            {
+                if (partIter->empty())
+                {
+                    continue;
+                }
+
+                DirFd childDirFd;
+                if (!childDirFd.open(*parentDirFdPtr, partIter->native(), path, errorCode))
+                {
+                    return;
+                }
+
+                dirFd          = std::move(childDirFd);
+                parentDirFdPtr = &dirFd;
+            }
+
+            if (dirFd.isOpen())
+            {
+                dirNode.keepDirFd(std::move(dirFd));
+            }
+        }
+
+    } // namespace
+
+    namespace serialize
+    {
+
+        void appendEntry(Bytes_t & bytes, const Entry & entry)
+        {
+            appendValue(bytes, static_cast<std::uint8_t>(entry.which_dir));
+            appendValue(bytes, static_cast<std::uint8_t>(entry.is_file));
+            appendValue(bytes, static_cast<std::uint32_t>(entry.link_id));
+            appendValue(bytes, static_cast<std::uint64_t>(entry.size));
+            appendValue(bytes, entry.device());
+            appendString(bytes, entry.path().native());
+        }
+
+        bool readEntry(
+            const char *& pos, const char * const end, DirNodePtr_t & dirNodePtr, Entry & entry)
+        {
+            const char * newPos{ pos };
+
+            std::uint8_t whichDir{ 0 };
+            std::uint8_t isFile{ 0 };
+            std::uint32_t linkId{ 0 };
+            std::uint64_t size{ 0 };
+            std::uint64_t device{ 0 };
+            fs::path::string_type pathStr;
+
+            if (!readValue(newPos, end, whichDir) || !readValue(newPos, end, isFile) ||
+                !readValue(newPos, end, linkId) || !readValue(newPos, end, size) ||
+                !readValue(newPos, end, device) || !readString(newPos, end, pathStr))
+            {
+                return false;
+            }
+
+            const fs::path path(pathStr);
+            const fs::path filename{ path.filename() };
+
+            if (filename.empty())
+            {
+                entry = Entry(
+                    static_cast<WhichDir>(whichDir),
+                    (isFile != 0),
+                    path,
+                    static_cast<std::size_t>(size));
+            }
+            else
+            {
+                const fs::path dirPath{ path.parent_path() };
+                if (!dirNodePtr || (dirNodePtr->path() != dirPath))
+                {
+                    const DirNodePtr_t prevDirNodePtr{ std::move(dirNodePtr) };
+                    dirNodePtr = std::make_shared<DirNode>(dirPath);
+                    dirNodePtr->setDevice(device);
+                    reopenDirFd(prevDirNodePtr, *dirNodePtr);
+                }
+
+                entry = Entry(
+                    static_cast<WhichDir>(whichDir),
+                    (isFile != 0),
+                    dirNodePtr,
+                    filename.native(),
+                    static_cast<std::size_t>(size));
+            }
+
+            entry.link_id = static_cast<LinkId_t>(linkId);
+
+            pos = newPos;
+            return true;
+        }
+
+        void appendEntryDPair(Bytes_t & bytes, const Entry & src, const Entry & dst)
+        {
+            appendEntry(bytes, src);
+            appendEntry(bytes, dst);
+        }
+
+        bool readEntryDPair(
+            const char *& pos,
+            const char * const end,
+            DirPair<DirNodePtr_t> & dirNodePtrs,
+            Entry & src,
+            Entry & dst)
+        {
+            const char * newPos{ pos };
+
+            if (!readEntry(newPos, end, dirNodePtrs.src, src) ||
+                !readEntry(newPos, end, dirNodePtrs.dst, dst))
+            {
+                return false;
+            }
+
+            pos = newPos;
+            return true;
+        }
+
+    } // namespace serialize
+
+    //
+
+    SpillFile::SpillFile()
+        : m_path()
+        , m_stream()
+        , m_chunks()
+        , m_endOffset(0)
+    {}
+
+    SpillFile::~SpillFile()
+    {
+        if (m_path.empty())
+        {
+            return;
+        }
+
+        m_stream.close();
+
+        // never throw from a destructor, a stray temp file is the worst that can happen here
+        ErrorCode_t errorCode;
+        fs::remove(m_path, errorCode);
+    }
+
+    void SpillFile::pushChunk(const fs::path & dirPath, const serialize::Bytes_t & bytes)
+    {
+        if (m_path.empty())
+        {
+            open(dirPath);
+        }
+
+        m_stream.clear();
+        m_stream.seekp(static_cast<std::streamoff>(m_endOffset));
+        m_stream.write(bytes.data(), static_cast<std::streamsize>(bytes.size()));
+
+        if (!m_stream)
+        {
+            throwError("write");
+        }
+
+        m_chunks.push_back({ m_endOffset, bytes.size() });
+        m_endOffset += bytes.size();
+    }
+
+    void SpillFile::popChunk(const bool isOldest, serialize::Bytes_t & bytes)
+    {
+        if (m_chunks.empty())
+        {
+            throwError("pop from empty");
+        }
+
+        const Chunk chunk{ (isOldest) ? m_chunks.front() : m_chunks.back() };
+
+        bytes.resize(static_cast<std::size_t>(chunk.size));
+        read(chunk.offset, bytes.data(), bytes.size());
+
+        if (isOldest)
+        {
+            m_chunks.pop_front();
+        }
+        else
+        {
+            m_chunks.pop_back();
+            m_endOffset = chunk.offset;
+        }
+
+        if (m_chunks.empty())
+        {
+            m_endOffset = 0;
+        }
+    }
+
+    std::size_t SpillFile::readChunkPart(
+        const std::size_t chunkIndex,
+        const std::uint64_t offset,
+        char * const bytes,
+        const std::size_t maxCount)
+    {
+        const Chunk & chunk{ m_chunks.at(chunkIndex) };
+
+        if (offset >= chunk.size)
+        {
+            return 0;
+        }
+
+        const std::size_t count{ static_cast<std::size_t>(
+            std::min(static_cast<std::uint64_t>(maxCount), (chunk.size - offset))) };
+
+        read((chunk.offset + offset), bytes, count);
+        return count;
+    }
+
+    void SpillFile::clear()
+    {
+        m_chunks.clear();
+        m_endOffset = 0;
+    }
+
+    void SpillFile::open(const fs::path & dirPath)
+    {
+        m_path = makeUniquePath(dirPath);
+
+        m_stream.open(
+            m_path, (std::ios::binary | std::ios::in | std::ios::out | std::ios::trunc));
+
+        if (!m_stream.is_open())
+        {
+            throwError("create");
+        }
+    }
+
+    void SpillFile::read(const std::uint64_t offset, char * const bytes, const std::size_t count)
+    {
+        m_stream.clear();
+        m_stream.seekg(static_cast<std::streamoff>(offset));
+        m_stream.read(bytes, static_cast<std::streamsize>(count));
+
+        if (!m_stream || (static_cast<std::size_t>(m_stream.gcount()) != count))
+        {
+            throwError("read");
+        }
+    }
+
+    void SpillFile::throwError(const std::string & what) const
+    {
+        throw std::runtime_error(
+            "Failed to " + what + " the temporary spill file \"" + m_path.string() + "\"");
+    }
+
+    fs::path SpillFile::makeUniquePath(const fs::path & dirPath)
+    {
+        // unique within this process by the counter, and between processes by the time
+        static std::atomic<std::size_t> counter{ 0 };
+
+        const auto timeCount{ std::chrono::system_clock::now().time_since_epoch().count() };
+
+        const std::string filename{ "backup-spill-" + std::to_string(timeCount) + "-" +
+                                    std::to_string(counter++) + ".tmp" };
+
+        return (dirPath / filename);
+    }
+
+} // namespace backup
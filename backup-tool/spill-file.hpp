@@ -0,0 +1,200 @@
+#ifndef BACKUP_SPILL_FILE_HPP_INCLUDED
+#define BACKUP_SPILL_FILE_HPP_INCLUDED
+//
+// spill-file.hpp
+//
+#include "entry.hpp"
+#include "filesystem-common.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace backup
+{
+
+    // A compact binary form of Entrys, only for the temporary files this app writes and reads
+    // back itself, so everything is in whatever byte order and wchar size this machine uses.
+    // Only the path is stored, since the name and extension are made from it again by Entry.
+    //
+    // Each read function returns false without changing pos if there were not enough bytes.
+    // The DirNodePtr_t given to a read function is re-used for as long as the Entrys read are
+    // from the same directory, which they usually are, and it must not be shared with any other
+    // thread that reads, see DirNode::storeName().  Each new DirNode opens and keeps a DirFd of
+    // its dir again, so Entrys read back can still be used relative to one like any others.
+    namespace serialize
+    {
+        using Bytes_t = std::vector<char>;
+
+        template <typename T>
+        void appendValue(Bytes_t & bytes, const T value)
+        {
+            const std::size_t startSize{ bytes.size() };
+            bytes.resize(startSize + sizeof(T));
+            std::memcpy(&bytes[startSize], &value, sizeof(T));
+        }
+
+        template <typename T>
+        bool readValue(const char *& pos, const char * const end, T & value)
+        {
+            if (static_cast<std::size_t>(end - pos) < sizeof(T))
+            {
+                return false;
+            }
+
+            std::memcpy(&value, pos, sizeof(T));
+            pos += sizeof(T);
+            return true;
+        }
+
+        template <typename String_t>
+        void appendString(Bytes_t & bytes, const String_t & str)
+        {
+            using Char_t = typename String_t::value_type;
+
+            appendValue(bytes, static_cast<std::uint64_t>(str.size()));
+
+            const std::size_t startSize{ bytes.size() };
+            bytes.resize(startSize + (str.size() * sizeof(Char_t)));
+
+            if (!str.empty())
+            {
+                std::memcpy(&bytes[startSize], str.data(), (str.size() * sizeof(Char_t)));
+            }
+        }
+
+        template <typename String_t>
+        bool readString(const char *& pos, const char * const end, String_t & str)
+        {
+            using Char_t = typename String_t::value_type;
+
+            const char * newPos{ pos };
+            std::uint64_t length{ 0 };
+            if (!readValue(newPos, end, length))
+            {
+                return false;
+            }
+
+            if ((static_cast<std::uint64_t>(end - newPos) / sizeof(Char_t)) < length)
+            {
+                return false;
+            }
+
+            str.resize(static_cast<std::size_t>(length));
+
+            if (length > 0)
+            {
+                std::memcpy(&str[0], newPos, (str.size() * sizeof(Char_t)));
+            }
+
+            pos = (newPos + (str.size() * sizeof(Char_t)));
+            return true;
+        }
+
+        // the same as readString() but without a copy, so the view is only valid for as long as
+        // the bytes it was read from are
+        template <typename Char_t>
+        bool readStringView(
+            const char *& pos, const char * const end, std::basic_string_view<Char_t> & view)
+        {
+            const char * newPos{ pos };
+            std::uint64_t length{ 0 };
+            if (!readValue(newPos, end, length))
+            {
+                return false;
+            }
+
+            if ((static_cast<std::uint64_t>(end - newPos) / sizeof(Char_t)) < length)
+            {
+                return false;
+            }
+
+            view = std::basic_string_view<Char_t>(
+                reinterpret_cast<const Char_t *>(newPos), static_cast<std::size_t>(length));
+
+            pos = (newPos + (view.size() * sizeof(Char_t)));
+            return true;
+        }
+
+        void appendEntry(Bytes_t & bytes, const Entry & entry);
+        bool readEntry(
+            const char *& pos, const char * const end, DirNodePtr_t & dirNodePtr, Entry & entry);
+
+        void appendEntryDPair(Bytes_t & bytes, const Entry & src, const Entry & dst);
+
+        bool readEntryDPair(
+            const char *& pos,
+            const char * const end,
+            DirPair<DirNodePtr_t> & dirNodePtrs,
+            Entry & src,
+            Entry & dst);
+
+    } // namespace serialize
+
+    //
+
+    // A temporary file that holds chunks of bytes that didn't fit in memory.  The file is only
+    // made the first time a chunk is pushed, and is deleted by the destructor.
+    //
+    // Chunks can be popped newest or oldest first.  The space of a popped newest chunk is
+    // re-used by the next push, and popping the last chunk empties the file, so a file used like
+    // a stack never grows past the most it ever had to hold at once.
+    //
+    // Nothing in here is thread safe, and any failure to read or write throws, because there
+    // is no way to continue after losing tasks that were supposed to be done.
+    class SpillFile
+    {
+        struct Chunk
+        {
+            std::uint64_t offset = 0;
+            std::uint64_t size   = 0;
+        };
+
+      public:
+        SpillFile();
+        ~SpillFile();
+
+        SpillFile(const SpillFile &) = delete;
+        SpillFile(SpillFile &&)      = delete;
+        SpillFile & operator=(const SpillFile &) = delete;
+        SpillFile & operator=(SpillFile &&) = delete;
+
+        inline bool isEmpty() const noexcept { return m_chunks.empty(); }
+        inline std::size_t chunkCount() const noexcept { return m_chunks.size(); }
+
+        // the directory must already exist, and is only used if the file has not been made yet
+        void pushChunk(const fs::path & dirPath, const serialize::Bytes_t & bytes);
+        void popChunk(const bool isOldest, serialize::Bytes_t & bytes);
+
+        // reads up to maxCount bytes starting at offset within that chunk, without popping it
+        std::size_t readChunkPart(
+            const std::size_t chunkIndex,
+            const std::uint64_t offset,
+            char * const bytes,
+            const std::size_t maxCount);
+
+        // forgets all chunks, but keeps the file so that it can be used again
+        void clear();
+
+      private:
+        void open(const fs::path & dirPath);
+        void read(const std::uint64_t offset, char * const bytes, const std::size_t count);
+        [[noreturn]] void throwError(const std::string & what) const;
+
+        static fs::path makeUniquePath(const fs::path & dirPath);
+
+      private:
+        fs::path m_path;
+        std::fstream m_stream;
+        std::deque<Chunk> m_chunks;
+        std::uint64_t m_endOffset;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_SPILL_FILE_HPP_INCLUDED
@@ -6,47 +6,159 @@
 #include "util.hpp"
 
 #include <algorithm>
-#include <codecvt>
 #include <string>
+#include <string_view>
 
 namespace strutil
 {
 
-#if defined(_MSC_VER)
-#pragma warning(push)
-#pragma warning(disable : 4996)
-#endif
+    // The UTF-8 conversions are written by hand because std::wstring_convert is deprecated.
+    // Anything that is not valid becomes U+FFFD instead of throwing like std::wstring_convert.
+    // A wchar_t is UTF-16 on Windows and UTF-32 everywhere else.
 
-    [[nodiscard]] inline std::wstring toWideString(std::string_view str)
+    constexpr char32_t replacement_char{ 0xFFFD };
+
+    [[nodiscard]] constexpr bool isValidCodePoint(const char32_t codePoint) noexcept
+    {
+        return ((codePoint <= 0x10FFFF) && ((codePoint < 0xD800) || (codePoint > 0xDFFF)));
+    }
+
+    inline void appendAsWide(std::wstring & str, const char32_t codePoint)
+    {
+        if constexpr (sizeof(wchar_t) == 2)
+        {
+            if (codePoint >= 0x10000)
+            {
+                const char32_t offset{ codePoint - 0x10000 };
+                str.push_back(static_cast<wchar_t>(0xD800 + (offset >> 10)));
+                str.push_back(static_cast<wchar_t>(0xDC00 + (offset & 0x3FF)));
+                return;
+            }
+        }
+
+        str.push_back(static_cast<wchar_t>(codePoint));
+    }
+
+    inline void appendAsUtf8(std::string & str, const char32_t codePoint)
+    {
+        if (codePoint < 0x80)
+        {
+            str.push_back(static_cast<char>(codePoint));
+        }
+        else if (codePoint < 0x800)
+        {
+            str.push_back(static_cast<char>(0xC0 | (codePoint >> 6)));
+            str.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+        }
+        else if (codePoint < 0x10000)
+        {
+            str.push_back(static_cast<char>(0xE0 | (codePoint >> 12)));
+            str.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+            str.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+        }
+        else
+        {
+            str.push_back(static_cast<char>(0xF0 | (codePoint >> 18)));
+            str.push_back(static_cast<char>(0x80 | ((codePoint >> 12) & 0x3F)));
+            str.push_back(static_cast<char>(0x80 | ((codePoint >> 6) & 0x3F)));
+            str.push_back(static_cast<char>(0x80 | (codePoint & 0x3F)));
+        }
+    }
+
+    [[nodiscard]] inline std::wstring toWideString(const std::string_view str)
     {
         std::wstring result;
+        result.reserve(str.size());
 
-        if (!str.empty())
+        std::size_t index{ 0 };
+        while (index < str.size())
         {
-            std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> converter;
-            result = converter.from_bytes(str.data(), (str.data() + str.size()));
+            const auto leadByte{ static_cast<unsigned char>(str[index]) };
+
+            if (leadByte < 0x80)
+            {
+                result.push_back(static_cast<wchar_t>(leadByte));
+                ++index;
+                continue;
+            }
+
+            std::size_t length{ 0 };
+            char32_t codePoint{ 0 };
+            char32_t codePointMin{ 0 };
+
+            if ((leadByte & 0xE0) == 0xC0)
+            {
+                length       = 2;
+                codePoint    = (leadByte & 0x1F);
+                codePointMin = 0x80;
+            }
+            else if ((leadByte & 0xF0) == 0xE0)
+            {
+                length       = 3;
+                codePoint    = (leadByte & 0x0F);
+                codePointMin = 0x800;
+            }
+            else if ((leadByte & 0xF8) == 0xF0)
+            {
+                length       = 4;
+                codePoint    = (leadByte & 0x07);
+                codePointMin = 0x10000;
+            }
+
+            bool isValid{ (length > 0) && ((index + length) <= str.size()) };
+            for (std::size_t i(1); isValid && (i < length); ++i)
+            {
+                const auto byte{ static_cast<unsigned char>(str[index + i]) };
+                isValid   = ((byte & 0xC0) == 0x80);
+                codePoint = ((codePoint << 6) | (byte & 0x3F));
+            }
+
+            if (isValid && (codePoint >= codePointMin) && isValidCodePoint(codePoint))
+            {
+                appendAsWide(result, codePoint);
+                index += length;
+            }
+            else
+            {
+                // only skip the first byte, so whatever is valid after it is still converted
+                appendAsWide(result, replacement_char);
+                ++index;
+            }
         }
 
         return result;
     }
 
-    [[nodiscard]] inline std::string toNarrowString(std::wstring_view str)
+    [[nodiscard]] inline std::string toNarrowString(const std::wstring_view str)
     {
         std::string result;
+        result.reserve(str.size());
 
-        if (!str.empty())
+        for (std::size_t index(0); index < str.size(); ++index)
         {
-            std::wstring_convert<std::codecvt_utf8<wchar_t>, wchar_t> converter;
-            result = converter.to_bytes(str.data(), (str.data() + str.size()));
+            char32_t codePoint{ static_cast<char32_t>(str[index]) };
+
+            if constexpr (sizeof(wchar_t) == 2)
+            {
+                const bool isHighSurrogate{ (codePoint >= 0xD800) && (codePoint <= 0xDBFF) };
+                if (isHighSurrogate && ((index + 1) < str.size()))
+                {
+                    const char32_t lowSurrogate{ static_cast<char32_t>(str[index + 1]) };
+                    if ((lowSurrogate >= 0xDC00) && (lowSurrogate <= 0xDFFF))
+                    {
+                        codePoint = (0x10000 + ((codePoint - 0xD800) << 10) +
+                                     (lowSurrogate - 0xDC00));
+                        ++index;
+                    }
+                }
+            }
+
+            appendAsUtf8(result, (isValidCodePoint(codePoint) ? codePoint : replacement_char));
         }
 
         return result;
     }
 
-#if defined(_MSC_VER)
-#pragma warning(pop)
-#endif
-
     // single character query functions
 
     [[nodiscard]] constexpr bool isUpper(const char ch) noexcept
@@ -0,0 +1,289 @@
+#ifndef BACKUP_TASK_ORDER_HPP_INCLUDED
+#define BACKUP_TASK_ORDER_HPP_INCLUDED
+//
+// task-order.hpp
+//
+#include "dir-fd.hpp"
+#include "entry-store.hpp"
+#include "enums.hpp"
+#include "lock-free-stack.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <deque>
+#include <limits>
+#include <mutex>
+#include <set>
+#include <utility>
+#include <vector>
+
+namespace backup
+{
+
+    // Holds the tasks waiting in a ResourceLimitedParallelTaskQueue, and decides which one is
+    // executed next.  LIFO is the default because it needs no lock at all, but it gives an
+    // uncontrolled mix of depth-first and breadth-first for dirs, and an arbitrary order for files.
+    //
+    //  - Fifo              breadth-first for dirs, which makes the queues as long as possible
+    //  - LargestFirst      starts the slowest files first, so the run doesn't end on one big file
+    //  - SmallestFirst     the most tasks completed soonest
+    //  - DeepestFirst      depth-first for dirs, which keeps the queues as short as possible
+    //  - ShallowestFirst   breadth-first again, but with the newest first within each depth
+    //  - InodeSweep        files in inode order, which is close to the order they are on disk
+    //  - DiskSweep         files in the order FIEMAP says they start on disk, or else by inode
+    //
+    // All but LIFO use a mutex, either around a deque (FIFO) or around a heap keyed by size or
+    // by depth.  Equal keys are taken newest first, which keeps things close to LIFO order.
+    //
+    // The two sweeps are for spinning disks, where each file read in name order is a seek to
+    // somewhere random.  They keep the tasks in a set sorted by key, and always take the next key
+    // up from the last one taken, wrapping around to the lowest at the end, the same as an
+    // elevator does.  Tasks queued behind the sweep wait for the next pass instead of pulling the
+    // heads back.  Whatever is waiting in the queue is the window being sorted, and the keys are
+    // only found for Entrys listed with an open DirFd, so anything else (i.e. on Windows, or read
+    // back from a spill file) has a key of zero and is taken at the start of a pass.
+    // Only EntryHandle_ts are held, and the keys are made when pushed, so the EntryDPair_ts in
+    // the EntryStore are never touched while the lock is held.
+    class OrderedTaskList
+    {
+        struct KeyedTask
+        {
+            std::size_t key    = 0;
+            std::size_t serial    = 0;
+            EntryHandle_t handle = no_entry_handle;
+        };
+
+        // std heaps put the "largest" on top, so this makes the largest key then newest win
+        struct KeyedTaskLess
+        {
+            bool operator()(const KeyedTask & left, const KeyedTask & right) const noexcept
+            {
+                if (left.key != right.key)
+                {
+                    return (left.key < right.key);
+                }
+
+                return (left.serial < right.serial);
+            }
+        };
+
+        // the smallest key first, then the newest, so a set in this order is walked upward
+        struct KeyedTaskSweepLess
+        {
+            bool operator()(const KeyedTask & left, const KeyedTask & right) const noexcept
+            {
+                if (left.key != right.key)
+                {
+                    return (left.key < right.key);
+                }
+
+                return (left.serial > right.serial);
+            }
+        };
+
+      public:
+        explicit OrderedTaskList(const TaskOrder order)
+            : m_order(order)
+            , m_stack()
+            , m_mutex()
+            , m_deque()
+            , m_heap()
+            , m_sweep()
+            , m_sweepKey(0)
+            , m_serial(0)
+            , m_lockedSize(0)
+        {}
+
+        OrderedTaskList(const OrderedTaskList &) = delete;
+        OrderedTaskList(OrderedTaskList &&)      = delete;
+        OrderedTaskList & operator=(const OrderedTaskList &) = delete;
+        OrderedTaskList & operator=(OrderedTaskList &&) = delete;
+
+        TaskOrder order() const noexcept { return m_order; }
+
+        // the entryDPair is only used to make the key, and must be the one the handle is for
+        void push(EntryHandle_t handle, const EntryDPair_t & entryDPair)
+        {
+            if (TaskOrder::Lifo == m_order)
+            {
+                m_stack.push(std::move(handle));
+                return;
+            }
+
+            const std::size_t key{ makeKey(m_order, entryDPair) };
+
+            std::scoped_lock lock(m_mutex);
+
+            if (TaskOrder::Fifo == m_order)
+            {
+                m_deque.push_back(handle);
+            }
+            else if (isSweep(m_order))
+            {
+                m_sweep.insert({ key, m_serial++, handle });
+            }
+            else
+            {
+                m_heap.push_back({ key, m_serial++, handle });
+                std::push_heap(std::begin(m_heap), std::end(m_heap), KeyedTaskLess());
+            }
+
+            ++m_lockedSize;
+        }
+
+        bool pop(EntryHandle_t & handle)
+        {
+            if (TaskOrder::Lifo == m_order)
+            {
+                return m_stack.pop(handle);
+            }
+
+            // avoid the lock when empty, which is the common case for idle threads
+            if (0 == m_lockedSize)
+            {
+                return false;
+            }
+
+            std::scoped_lock lock(m_mutex);
+
+            if (TaskOrder::Fifo == m_order)
+            {
+                if (m_deque.empty())
+                {
+                    return false;
+                }
+
+                handle = m_deque.front();
+                m_deque.pop_front();
+            }
+            else if (isSweep(m_order))
+            {
+                if (m_sweep.empty())
+                {
+                    return false;
+                }
+
+                // every serial is less than max, so this finds the first at or past the sweep
+                const KeyedTask sweepTask{ m_sweepKey,
+                                           std::numeric_limits<std::size_t>::max(),
+                                           no_entry_handle };
+
+                auto iter{ m_sweep.lower_bound(sweepTask) };
+                if (iter == std::end(m_sweep))
+                {
+                    iter = std::begin(m_sweep);
+                }
+
+                m_sweepKey = iter->key;
+                handle     = iter->handle;
+                m_sweep.erase(iter);
+            }
+            else
+            {
+                if (m_heap.empty())
+                {
+                    return false;
+                }
+
+                std::pop_heap(std::begin(m_heap), std::end(m_heap), KeyedTaskLess());
+                handle = m_heap.back().handle;
+                m_heap.pop_back();
+            }
+
+            --m_lockedSize;
+            return true;
+        }
+
+        bool isEmpty() const noexcept
+        {
+            if (TaskOrder::Lifo == m_order)
+            {
+                return m_stack.isEmpty();
+            }
+
+            return (0 == m_lockedSize);
+        }
+
+      private:
+        static bool isSweep(const TaskOrder order) noexcept
+        {
+            return ((TaskOrder::InodeSweep == order) || (TaskOrder::DiskSweep == order));
+        }
+
+        static std::size_t makeKey(const TaskOrder order, const EntryDPair_t & entryDPair)
+        {
+            // only one of the pair is set for copy/remove tasks, and both are the same depth
+            const Entry & entry{ entryDPair.src.isEmpty() ? entryDPair.dst : entryDPair.src };
+            const std::size_t size{ std::max(entryDPair.src.size, entryDPair.dst.size) };
+            constexpr std::size_t max{ std::numeric_limits<std::size_t>::max() };
+
+            // clang-format off
+            switch (order)
+            {
+                case TaskOrder::LargestFirst:    { return size; }
+                case TaskOrder::SmallestFirst:   { return (max - size); }
+                case TaskOrder::DeepestFirst:    { return depth(entry); }
+                case TaskOrder::ShallowestFirst: { return (max - depth(entry)); }
+                case TaskOrder::InodeSweep:      { return diskPlace(false, entry); }
+                case TaskOrder::DiskSweep:       { return diskPlace(true, entry); }
+                case TaskOrder::Lifo:
+                case TaskOrder::Fifo:
+                default:                         { return 0; }
+            }
+            // clang-format on
+        }
+
+        // the number of path separators, which is all the depth ordering needs
+        static std::size_t depth(const Entry & entry)
+        {
+            const fs::path path{ entry.path() };
+            const auto & pathStr{ path.native() };
+
+            return static_cast<std::size_t>(
+                std::count(std::begin(pathStr), std::end(pathStr), fs::path::preferred_separator));
+        }
+
+        // The first byte of the file on disk if isPhysical and FIEMAP works, otherwise its inode,
+        // which is zero if the Entry wasn't listed with an open DirFd.  Some filesystems give
+        // every file an offset of zero (i.e. tmpfs), and then this falls back on the inode too.
+        static std::size_t diskPlace(const bool isPhysical, const Entry & entry)
+        {
+            const DirFd & dirFd{ entry.dirFd() };
+            if (!dirFd.isOpen() || !entry.is_file)
+            {
+                return 0;
+            }
+
+            ErrorCode_t errorCode;
+            if (isPhysical)
+            {
+                const std::uint64_t offset{ dirFd.physicalOffsetAt(entry.name(), errorCode) };
+                if (!errorCode && (offset > 0))
+                {
+                    return static_cast<std::size_t>(offset);
+                }
+            }
+
+            // names listed from a DirFd are always stored with a null after them, see DirNode
+            std::uintmax_t size{ 0 };
+            FileLinks links;
+            dirFd.statusAt(entry.name().data(), false, size, links, errorCode);
+            return static_cast<std::size_t>(links.inode);
+        }
+
+      private:
+        TaskOrder m_order;
+        LockFreeStack<EntryHandle_t> m_stack;
+        std::mutex m_mutex;
+        std::deque<EntryHandle_t> m_deque;
+        std::vector<KeyedTask> m_heap;
+        std::set<KeyedTask, KeyedTaskSweepLess> m_sweep;
+        std::size_t m_sweepKey;
+        std::size_t m_serial;
+        std::atomic<std::size_t> m_lockedSize;
+    };
+
+} // namespace backup
+
+#endif // BACKUP_TASK_ORDER_HPP_INCLUDED
@@ -3,11 +3,20 @@
 //
 // task-queue.hpp
 //
+#include "entry-store.hpp"
+#include "lock-free-stack.hpp"
+#include "spill-file.hpp"
+#include "task-order.hpp"
 #include "task-resources.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cstdint>
+#include <memory>
 #include <mutex>
 #include <sstream>
+#include <stdexcept>
 #include <string>
 #include <vector>
 
@@ -28,6 +37,9 @@ namespace backup
         std::size_t resource_busy_count = 0;
         std::size_t completed_count     = 0;
         Progress_t progress_sum         = 0;
+        std::size_t completed_bytes     = 0;
+        std::size_t queue_bytes         = 0;
+        std::size_t spilled_count       = 0;
     };
 
     constexpr bool operator==(const TaskQueueStatus & left, const TaskQueueStatus & right)
@@ -37,7 +49,10 @@ namespace backup
             (left.resource_count == right.resource_count) &&
             (left.resource_busy_count == right.resource_busy_count) &&
             (left.completed_count == right.completed_count) &&
-            (left.progress_sum == right.progress_sum));
+            (left.progress_sum == right.progress_sum) &&
+            (left.completed_bytes == right.completed_bytes) &&
+            (left.queue_bytes == right.queue_bytes) &&
+            (left.spilled_count == right.spilled_count));
     }
 
     constexpr bool operator!=(const TaskQueueStatus & left, const TaskQueueStatus & right)
@@ -45,17 +60,32 @@ namespace backup
         return !(left == right);
     }
 
+    // for adding up the status of many queues
+    constexpr TaskQueueStatus &
+        operator+=(TaskQueueStatus & left, const TaskQueueStatus & right) noexcept
+    {
+        left.queue_size += right.queue_size;
+        left.resource_count += right.resource_count;
+        left.resource_busy_count += right.resource_busy_count;
+        left.completed_count += right.completed_count;
+        left.progress_sum += right.progress_sum;
+        left.completed_bytes += right.completed_bytes;
+        left.queue_bytes += right.queue_bytes;
+        left.spilled_count += right.spilled_count;
+        return left;
+    }
+
     //
 
     // This class maintains a queue of filesystem "Task"s that are waiting to be executed by
     // multiple threads.  A thread cannot execute an enqueued task without it's own dedicated
     // Resource_t.  So this class also maintains a limited number of these Resource_ts in
-    // m_resourceCache.  This means the number of tasks that can be run in parallel is limited by
-    // the number of cached Resource_ts, or put another way, m_resourceCache.size().
+    // m_resourcePtrs.  This means the number of tasks that can be run in parallel is limited by
+    // the number of cached Resource_ts, or put another way, resourceCount().
     //
     // Simply spawn as many threads as you want, and have each loop that calls popAndExecute()
     // repeatedly.  Each thread running popAndExecute():
-    //  - will execute their taskFunction without the mutex locked, and are free to change their
+    //  - will execute their taskFunction without anything locked, and are free to change their
     // Resource_t without the need to lock anything. and are free to call push() to enqueue
     // more Tasks.
     //
@@ -64,113 +94,421 @@ namespace backup
     // the cache, and that calling thread will either have to wait until a Task is added to the
     // queue or until another thread finishes and frees up one of the Rescource_ts.
     //
+    // Nothing in here locks except what the TaskOrder needs.  The queued tasks are kept in an
+    // OrderedTaskList (which is a LockFreeStack for the default LIFO order), the free Resource_ts
+    // are kept in a LockFreeIndexStack, and the status counters are atomics.
+    // Since the counters can't all be read at exactly the same instant, m_pendingCount counts
+    // every task that is either queued or executing, and it is what decides when a queue is done.
+    // Tasks pushed while executing another task are always counted before that task stops being
+    // counted, so m_pendingCount can never touch zero while there is still work to do.
+    //
+    // The active limit is how many of the cached Resource_ts can be used at once, and it can be
+    // changed at any time, even while tasks are executing.  Raising it above resourceCount() adds
+    // more Resource_ts, but lowering it never destroys any, it just leaves the extras unused until
+    // the limit is raised again.  The status() resource_count is this limit, not the cache size.
+    //
+    // The memory used by queued tasks is estimated with Entry::memoryUsage() and kept in
+    // m_queueBytes, so that BackupTool can hold all its queues to one memory budget.  Once that
+    // is over the spill limit, pushed tasks are written to a SpillFile instead (in chunks, and
+    // under m_spillMutex) and are only read back once there are none left in memory.  So the
+    // queue_size includes spilled tasks, but the queue_bytes does not.  The spilled tasks are
+    // read back newest chunk first, or oldest first if the order is FIFO, so a queue that
+    // spills only follows its TaskOrder within each chunk.
+    //
+    // The queued tasks are only EntryHandle_ts into an EntryStore that all the queues share.
+    // A popped task keeps its reference until release(), so the Resource_t can point right into
+    // the EntryStore instead of holding a copy, and can pass that same handle on to push().
+    //
     template <typename Resource_t>
     class ResourceLimitedParallelTaskQueue
     {
+        // RAII to ensure that setup()/teardown() are always called, and that the resource is
+        // always given back and all the counters are always updated, even if an exception is thrown
+        class ScopedResource
+        {
+          public:
+            ScopedResource(ResourceLimitedParallelTaskQueue & queue, Resource_t * resourcePtr)
+                : m_queue(queue)
+                , m_resourcePtr(resourcePtr)
+            {}
+
+            ~ScopedResource()
+            {
+                if (m_resourcePtr != nullptr)
+                {
+                    m_queue.release(*m_resourcePtr, true);
+                }
+            }
+
+            ScopedResource(const ScopedResource &) = delete;
+            ScopedResource(ScopedResource &&)      = delete;
+            ScopedResource & operator=(const ScopedResource &) = delete;
+            ScopedResource & operator=(ScopedResource &&) = delete;
+
+            inline bool isValid() const noexcept { return (m_resourcePtr != nullptr); }
+            inline Resource_t & resource() noexcept { return *m_resourcePtr; }
+
+          private:
+            ResourceLimitedParallelTaskQueue & m_queue;
+            Resource_t * m_resourcePtr;
+        };
+
+        // the "next" links for m_freeResources, see LockFreeIndexStack
+        struct ResourceLinks
+        {
+            explicit ResourceLinks(const std::size_t count)
+                : links(count)
+            {}
+
+            std::atomic<std::uint32_t> & link(const std::uint32_t index) { return links[index]; }
+
+            std::vector<std::atomic<std::uint32_t>> links;
+        };
+
       public:
         using resource_t = Resource_t;
 
-        explicit ResourceLimitedParallelTaskQueue(const std::size_t resourceCount)
-            : m_mutex()
+        static inline constexpr std::size_t max_resource_count{ 1024 };
+
+        ResourceLimitedParallelTaskQueue(
+            EntryStore & entryStore, const std::size_t resourceCount, const TaskOrder order)
+            : m_entryStore(entryStore)
+            , m_pendingCount(0)
+            , m_busyCount(0)
             , m_completedCount(0)
-            , m_queue()
-            , m_resourceCache(resourceCount) // this must be the only time this vector reallocates!
+            , m_completedBytes(0)
+            , m_activeLimit(0)
+            , m_queueBytes(0)
+            , m_queue(order)
+            , m_spillMutex()
+            , m_spillLimitBytes(0)
+            , m_spillDirPath()
+            , m_spilledCount(0)
+            , m_spillBytes()
+            , m_unspillBytes()
+            , m_unspillDirNodePtrs()
+            , m_spillFile()
+            , m_resourcePtrs(max_resource_count) // this must be the only time this reallocates!
+            , m_resourceCount(0)
+            , m_ownedResources()
+            , m_growMutex()
+            , m_resourceLinks(max_resource_count)
+            , m_freeResources(m_resourceLinks)
         {
-            // m_queue.reserve(reserveCount);//TODO put this back after testing
+            grow(resourceCount);
+            m_activeLimit = m_resourceCount.load();
         }
 
         std::size_t completedCount() const { return m_completedCount; }
-        std::size_t resourceCount() const { return m_resourceCache.size(); }
-        std::size_t queueLength() const { return m_queue.size(); }
-        std::size_t queueMaxCapacity() const { return m_queue.capacity(); }
+        std::size_t resourceCount() const { return m_resourceCount; }
+        std::size_t queueLength() const { return status().queue_size; }
+        std::size_t activeLimit() const { return m_activeLimit; }
+        std::size_t busyCount() const { return m_busyCount; }
+        std::size_t queueBytes() const { return m_queueBytes; }
 
-        TaskQueueStatus push(const EntryConstRefDPair_t & entryDPair)
+        // Clamped to [1, max_resource_count], and safe to call from any thread at any time.  Tasks
+        // already executing are not interrupted when lowered, they just finish as usual.
+        void setActiveLimit(const std::size_t limit)
         {
-            std::scoped_lock scopedLock(m_mutex);
-            m_queue.push_back({ entryDPair.src, entryDPair.dst });
-            return status_WithoutLock();
+            const std::size_t newLimit{ std::clamp(limit, 1_st, max_resource_count) };
+
+            // must grow before raising the limit, otherwise pop() might allow more than there are
+            grow(newLimit);
+            m_activeLimit = newLimit;
+        }
+
+        // zero means never spill, which is the default
+        void setSpillLimit(const std::size_t limitBytes, const fs::path & spillDirPath)
+        {
+            std::scoped_lock lock(m_spillMutex);
+            m_spillDirPath    = spillDirPath;
+            m_spillLimitBytes = limitBytes;
+        }
+
+        // If the handle is given then it must be for this same entryDPair, and this queue adds
+        // its own reference to it instead of adding a copy to the EntryStore.
+        TaskQueueStatus push(
+            const EntryConstRefDPair_t & entryDPair, const EntryHandle_t handle = no_entry_handle)
+        {
+            // must count it before it can be popped, see m_pendingCount above
+            ++m_pendingCount;
+
+            const std::size_t bytes{ memoryUsage(entryDPair) };
+            const std::size_t spillLimitBytes{ m_spillLimitBytes };
+
+            if ((spillLimitBytes > 0) && ((m_queueBytes + bytes) > spillLimitBytes))
+            {
+                spill(entryDPair);
+                return status();
+            }
+
+            m_queueBytes += bytes;
+
+            if (no_entry_handle == handle)
+            {
+                const EntryHandle_t newHandle{ m_entryStore.add(entryDPair) };
+                m_queue.push(newHandle, m_entryStore.get(newHandle));
+            }
+            else
+            {
+                m_entryStore.addRef(handle);
+                m_queue.push(handle, m_entryStore.get(handle));
+            }
+
+            return status();
         }
 
         template <typename TaskExecuteFunction_t>
         bool popAndExecute(TaskExecuteFunction_t taskExecute)
         {
-            ScopedTaskResource<Resource_t> scopedResource{ pop() };
+            ScopedResource scopedResource{ *this, pop() };
 
-            if (!scopedResource.is_valid)
+            if (!scopedResource.isValid())
             {
                 return false;
             }
 
-            scopedResource.resource.setup();
-            taskExecute(scopedResource.resource);
+            Resource_t & resource{ scopedResource.resource() };
+            resource.setup();
+            taskExecute(resource);
             ++m_completedCount;
-            scopedResource.resource.teardown();
+
+            m_completedBytes += resource.completedBytes();
+
+            resource.teardown();
             return true;
         }
 
-        TaskQueueStatus status() const
+        // the same as status().isReady() without adding up the progress of every resource
+        bool isReady() const
         {
-            std::scoped_lock scopedLock(m_mutex);
-            return status_WithoutLock();
+            // pending must be loaded first, see m_pendingCount above
+            const std::size_t pendingCount{ m_pendingCount.load() };
+            const std::size_t busyCount{ m_busyCount.load() };
+            return ((pendingCount > busyCount) && (busyCount < m_activeLimit));
         }
 
-      private:
-        ScopedTaskResource<Resource_t> pop()
+        TaskQueueStatus status() const
         {
-            std::scoped_lock scopedLock(m_mutex);
+            // pending must be loaded first, see m_pendingCount above
+            const std::size_t pendingCount{ m_pendingCount.load() };
+            const std::size_t busyCount{ m_busyCount.load() };
 
-            std::size_t i{ 0 };
-            const std::size_t resourceCount{ m_resourceCache.size() };
-            for (; i < resourceCount; ++i)
+            // both counts can include a task that is moving from the queue to a resource
+            const std::size_t queueSize{ pendingCount - std::min(pendingCount, busyCount) };
+
+            Progress_t progressCountTotal{ 0 };
+            const std::size_t cacheCount{ m_resourceCount.load() };
+            for (std::size_t i{ 0 }; i < cacheCount; ++i)
             {
-                if (m_resourceCache[i].isAvailable())
+                const Resource_t & resource{ *m_resourcePtrs[i].load() };
+                if (!resource.isAvailable())
                 {
-                    break;
+                    progressCountTotal += resource.progress.load(std::memory_order_relaxed);
                 }
             }
 
-            if ((i < resourceCount) && !m_queue.empty())
+            return { queueSize,
+                     m_activeLimit.load(),
+                     busyCount,
+                     m_completedCount.load(),
+                     progressCountTotal,
+                     m_completedBytes.load(),
+                     m_queueBytes.load(),
+                     m_spilledCount.load() };
+        }
+
+      private:
+        // returns nullptr if the queue was empty or if there were no resources available
+        Resource_t * pop()
+        {
+            if (m_queue.isEmpty() && !unspill())
+            {
+                return nullptr;
+            }
+
+            std::uint32_t index{ 0 };
+            if (!m_freeResources.pop(index))
+            {
+                return nullptr;
+            }
+
+            const std::size_t busyCount{ ++m_busyCount };
+
+            Resource_t & resource{ *m_resourcePtrs[index].load() };
+            assert(resource.is_available);
+
+            if (busyCount > m_activeLimit)
+            {
+                release(resource, false);
+                return nullptr;
+            }
+
+            // another thread might have taken the last task after the isEmpty() check above
+            if (!m_queue.pop(resource.entry_handle))
             {
-                Resource_t & resource{ m_resourceCache[i] };
-                resource.entry_dpair = std::move(m_queue.back());
-                m_queue.pop_back();
+                release(resource, false);
+                return nullptr;
+            }
+
+            resource.entry_dpair_ptr = &m_entryStore.get(resource.entry_handle);
+            m_queueBytes -= memoryUsage(resource.entryDPair());
+
+            resource.is_available = false;
+            return &resource;
+        }
 
-                return ScopedTaskResource<Resource_t>(true, m_mutex, resource);
+        template <typename DPair_t>
+        static std::size_t memoryUsage(const DPair_t & entryDPair) noexcept
+        {
+            return (entryDPair.src.memoryUsage() + entryDPair.dst.memoryUsage());
+        }
+
+        void release(Resource_t & resource, const bool wasTaskExecuted)
+        {
+            if (resource.entry_handle != no_entry_handle)
+            {
+                m_entryStore.release(resource.entry_handle);
+                resource.entry_handle    = no_entry_handle;
+                resource.entry_dpair_ptr = nullptr;
+            }
+
+            resource.is_available = true;
+
+            if (wasTaskExecuted)
+            {
+                --m_pendingCount;
+            }
+
+            --m_busyCount;
+
+            m_freeResources.push(resource.cache_index);
+        }
+
+        void spill(const EntryConstRefDPair_t & entryDPair)
+        {
+            std::scoped_lock lock(m_spillMutex);
+
+            serialize::appendEntryDPair(m_spillBytes, entryDPair.src, entryDPair.dst);
+            ++m_spilledCount;
+
+            // a chunk takes more memory once it is read back in, so keep them well under the limit
+            const std::size_t chunkSize{ std::min(spill_chunk_size_max, (m_spillLimitBytes / 4)) };
+            if (m_spillBytes.size() >= chunkSize)
+            {
+                m_spillFile.pushChunk(m_spillDirPath, m_spillBytes);
+                m_spillBytes.clear();
+            }
+        }
+
+        // moves one chunk of spilled tasks back into memory, and returns true if there are any
+        // tasks in memory afterward
+        bool unspill()
+        {
+            if (0 == m_spilledCount)
+            {
+                return false;
+            }
+
+            std::scoped_lock lock(m_spillMutex);
+
+            // another thread might have just done this
+            if (!m_queue.isEmpty())
+            {
+                return true;
+            }
+
+            // the chunk not yet written is always the newest
+            const bool isFifo{ (TaskOrder::Fifo == m_queue.order()) };
+            if (!m_spillFile.isEmpty() && (isFifo || m_spillBytes.empty()))
+            {
+                m_spillFile.popChunk(isFifo, m_unspillBytes);
             }
             else
             {
-                return ScopedTaskResource<Resource_t>(false, m_mutex, m_resourceCache.back());
+                m_unspillBytes.swap(m_spillBytes);
+                m_spillBytes.clear();
+            }
+
+            const char * pos{ m_unspillBytes.data() };
+            const char * const end{ m_unspillBytes.data() + m_unspillBytes.size() };
+
+            EntryDPair_t entryDPair;
+            while (serialize::readEntryDPair(
+                pos, end, m_unspillDirNodePtrs, entryDPair.src, entryDPair.dst))
+            {
+                m_queueBytes += memoryUsage(entryDPair);
+                const EntryHandle_t handle{ m_entryStore.add(std::move(entryDPair)) };
+                m_queue.push(handle, m_entryStore.get(handle));
+                --m_spilledCount;
+            }
+
+            if (pos != end)
+            {
+                throw std::runtime_error(
+                    "A spilled task queue chunk ended in the middle of a task.");
             }
+
+            return !m_queue.isEmpty();
         }
 
-        TaskQueueStatus status_WithoutLock() const
+        // adds Resource_ts until there are at least count
+        void grow(const std::size_t count)
         {
-            std::size_t busyCount{ 0 };
-            Progress_t progressCountTotal{ 0 };
+            std::scoped_lock lock(m_growMutex);
 
-            for (auto & resource : m_resourceCache)
+            const std::size_t prevCount{ m_resourceCount };
+            if (count <= prevCount)
             {
-                if (!resource.isAvailable())
-                {
-                    ++busyCount;
-                    progressCountTotal += resource.progress;
-                }
+                return;
             }
 
-            assert(busyCount <= m_resourceCache.size());
+            for (std::size_t i{ prevCount }; i < count; ++i)
+            {
+                m_ownedResources.push_back(std::make_unique<Resource_t>());
+                m_ownedResources.back()->cache_index = static_cast<std::uint32_t>(i);
+                m_resourcePtrs[i] = m_ownedResources.back().get();
+            }
 
-            return { m_queue.size(),
-                     m_resourceCache.size(),
-                     busyCount,
-                     m_completedCount,
-                     progressCountTotal };
+            // push in reverse so that the first resource is the first one used
+            for (std::size_t i{ count }; i > prevCount; --i)
+            {
+                m_freeResources.push(static_cast<std::uint32_t>(i - 1));
+            }
+
+            m_resourceCount = count;
         }
 
       private:
-        mutable std::mutex m_mutex;
-        std::size_t m_completedCount;
-        std::vector<EntryDPair_t> m_queue;
-        std::vector<Resource_t> m_resourceCache;
+        EntryStore & m_entryStore;
+        std::atomic<std::size_t> m_pendingCount;
+        std::atomic<std::size_t> m_busyCount;
+        std::atomic<std::size_t> m_completedCount;
+        std::atomic<std::size_t> m_completedBytes;
+        std::atomic<std::size_t> m_activeLimit;
+        std::atomic<std::size_t> m_queueBytes;
+        OrderedTaskList m_queue;
+
+        static inline constexpr std::size_t spill_chunk_size_max{ 4 * 1024 * 1024 };
+
+        std::mutex m_spillMutex;
+        std::atomic<std::size_t> m_spillLimitBytes;
+        fs::path m_spillDirPath;
+        std::atomic<std::size_t> m_spilledCount;
+        serialize::Bytes_t m_spillBytes;
+        serialize::Bytes_t m_unspillBytes;
+        DirPair<DirNodePtr_t> m_unspillDirNodePtrs;
+        SpillFile m_spillFile;
+
+        // Resource_ts are never moved or destroyed until this queue is, so threads can use them
+        // without locking while more are being added.  Other threads only ever see the pointers.
+        std::vector<std::atomic<Resource_t *>> m_resourcePtrs;
+        std::atomic<std::size_t> m_resourceCount;
+        std::vector<std::unique_ptr<Resource_t>> m_ownedResources;
+        std::mutex m_growMutex;
+
+        ResourceLinks m_resourceLinks;
+        LockFreeIndexStack<ResourceLinks> m_freeResources;
     };
 
 } // namespace backup
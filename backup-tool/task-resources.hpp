@@ -3,15 +3,20 @@
 //
 // task-resources.hpp
 //
+#include "dir-fd.hpp"
 #include "dir-pair.hpp"
+#include "entry-runs.hpp"
+#include "entry-store.hpp"
 #include "entry.hpp"
 #include "enums.hpp"
 #include "filesystem-common.hpp"
 #include "util.hpp"
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cstddef>
-#include <mutex>
+#include <cstdint>
 #include <string>
 #include <vector>
 
@@ -20,21 +25,19 @@ namespace backup
 
     constexpr std::size_t reserveCount{ 4096 };
 
-    //
-    using EntryVec_t           = std::vector<Entry>;
-    using EntryDPair_t         = DirPair<Entry>;
-    using EntryConstRefDPair_t = DirPair<const Entry &, const Entry &>;
-
     //
 
     // since one of the TaskResource classes needs to use this clock to keep track of time elapsed,
     // we are forced to use whatever that clock uses for a progress counter type
     using Progress_t = Clock_t::rep;
 
+    // atomic because other threads read progress at any time to make a TaskQueueStatus
+    using ProgressCounter_t = std::atomic<Progress_t>;
+
     //
 
     template <typename Resource_t>
-    struct ScopedResource;
+    class ResourceLimitedParallelTaskQueue;
 
     struct TaskResourcesBase
     {
@@ -45,25 +48,51 @@ namespace backup
         // must always be safe to call this function at any time, repeatedly, from the owning thread
         virtual void teardown() {}
 
-        EntryDPair_t entry_dpair;
+        // The pair of Entrys this task is for.  Queued tasks point into the EntryStore and keep
+        // a reference to it in entry_handle until they are done, but any task not from a queue
+        // can point to any EntryDPair_t that lives as long as the task does.
+        inline const EntryDPair_t & entryDPair() const noexcept
+        {
+            assert(entry_dpair_ptr != nullptr);
+            return *entry_dpair_ptr;
+        }
+
+        const EntryDPair_t * entry_dpair_ptr{ nullptr };
+        EntryHandle_t entry_handle{ no_entry_handle };
 
         // different derived TaskResource classes have different meanings for this counter
-        Progress_t progress = 0;
+        ProgressCounter_t progress{ 0 };
+
+        // how many bytes the task just executed handled, called after the task and before teardown
+        virtual std::size_t completedBytes() const
+        {
+            return std::max(entryDPair().src.size, entryDPair().dst.size);
+        }
 
         inline bool isAvailable() const noexcept { return is_available; }
 
-        // this is private with ScopedResource a friend to ensure only ScopedResource changes it
+        // this is private with the queue a friend to ensure only the queue changes it
       private:
         template <typename Resource_t>
-        friend struct ScopedTaskResource;
+        friend class ResourceLimitedParallelTaskQueue;
 
-        bool is_available = true;
+        std::atomic<bool> is_available{ true };
+        std::uint32_t cache_index{ 0 };
     };
 
     //
 
     // progress is the total bytes copied so far
-    using CopyTaskResources = TaskResourcesBase;
+    struct CopyTaskResources : public TaskResourcesBase
+    {
+        virtual ~CopyTaskResources() = default;
+
+        // a copied dir has no size of its own, but progress includes everything copied into it
+        std::size_t completedBytes() const override
+        {
+            return static_cast<std::size_t>(progress.load());
+        }
+    };
 
     //
 
@@ -82,11 +111,17 @@ namespace backup
 
     //
 
+    // Reads with a FileFd opened relative to the DirFd of the Entry if that is open, otherwise
+    // with a stream opened by the whole path.  The buffer grows to the biggest read so far, which
+    // is never more than the IoProfile::max_read_size.
     struct FileReadResources
     {
         FileReadResources()
-            : buffer(max_read_size)
+            : buffer()
             , stream()
+            , file_fd()
+            , is_using_file_fd(false)
+            , error_code()
         {}
 
         ~FileReadResources()
@@ -100,19 +135,27 @@ namespace backup
             }
         }
 
-        void open(const fs::path & path)
+        void open(const Entry & entry)
         {
-            if (stream.is_open())
+            close();
+
+            is_using_file_fd = entry.dirFd().isOpen();
+            if (is_using_file_fd)
             {
-                close();
+                file_fd.open(entry.dirFd(), entry.name(), error_code);
+            }
+            else
+            {
+                stream.clear();
+                stream.open(entry.path(), (std::ios::binary | std::ios::in));
             }
-
-            stream.clear();
-            stream.open(path, (std::ios::binary | std::ios::in));
         }
 
         void close()
         {
+            file_fd.close();
+            error_code.clear();
+
             if (stream.is_open())
             {
                 stream.close();
@@ -122,8 +165,9 @@ namespace backup
 
         std::vector<char> buffer;
         InputFileStream_t stream;
-        static inline constexpr std::size_t min_read_size{ 1 << 14 };
-        static inline constexpr std::size_t max_read_size{ 1 << 20 };
+        FileFd file_fd;
+        bool is_using_file_fd;
+        ErrorCode_t error_code;
     };
 
     //
@@ -136,8 +180,8 @@ namespace backup
         void setup() override
         {
             TaskResourcesBase::setup();
-            file_dpair.src.open(entry_dpair.src.path);
-            file_dpair.dst.open(entry_dpair.dst.path);
+            file_dpair.src.open(entryDPair().src);
+            file_dpair.dst.open(entryDPair().dst);
         }
 
         void teardown() override
@@ -160,6 +204,8 @@ namespace backup
         DirectoryCompareTaskResources()
             : file_entrys_dpair()
             , dir_entrys_dpair()
+            , file_runs_dpair()
+            , dir_runs_dpair()
         {
             file_entrys_dpair.src.reserve(reserveCount);
             file_entrys_dpair.dst.reserve(reserveCount);
@@ -185,51 +231,18 @@ namespace backup
             file_entrys_dpair.dst.clear();
             dir_entrys_dpair.src.clear();
             dir_entrys_dpair.dst.clear();
+            file_runs_dpair.src.clear();
+            file_runs_dpair.dst.clear();
+            dir_runs_dpair.src.clear();
+            dir_runs_dpair.dst.clear();
         }
 
         DirPair<EntryVec_t> file_entrys_dpair;
         DirPair<EntryVec_t> dir_entrys_dpair;
-    };
 
-    // This is a helper class used by ResourceLimitedParallelTaskQueue (see below) that uses RAII to
-    // ensure that setup()/teardown()/is_available are always correctly called/set.
-    template <typename Resource_t>
-    struct ScopedTaskResource
-    {
-        //  creates an invalid object that never touches the resource or the mutex
-        ScopedTaskResource(const bool isValid, std::mutex & mut, Resource_t & res)
-            : is_valid(isValid)
-            , resource(res)
-            , mutex(mut)
-        {
-            if (is_valid)
-            {
-                assert(resource.is_available);
-                resource.is_available = false;
-            }
-        }
-
-        ~ScopedTaskResource()
-        {
-            if (is_valid)
-            {
-                std::scoped_lock scopedLock(mutex);
-                assert(!resource.is_available);
-                resource.is_available = true;
-            }
-        }
-
-        // move only
-        ScopedTaskResource(ScopedTaskResource &&) noexcept = default;
-        ScopedTaskResource & operator=(ScopedTaskResource &&) noexcept = default;
-        ScopedTaskResource(const ScopedTaskResource &)                 = delete;
-        ScopedTaskResource & operator=(const ScopedTaskResource &) = delete;
-
-        const bool is_valid;
-        Resource_t & resource;
-
-      private:
-        std::mutex & mutex;
+        // only used by directories too big to list in memory, see EntryRuns
+        DirPair<EntryRuns> file_runs_dpair;
+        DirPair<EntryRuns> dir_runs_dpair;
     };
 
 } // namespace backup
@@ -8,21 +8,27 @@
 namespace backup
 {
 
-    bool DirectoryCompareTasker::isAllowedToWake() const
+    bool DirectoryCompareTasker::isAllowedToExecute() const
     {
-        const TaskQueueStatus myStatus{ status() };
+        const TaskQueueStatus fileStatus{ m_context.fileCompareTasker().status() };
 
-        if (!myStatus.isReady() && !myStatus.isDone())
+        const bool tooManyFileTasksWaiting{ (
+            fileStatus.queue_size > (fileStatus.resource_count * 2)) };
+
+        if (tooManyFileTasksWaiting)
         {
             return false;
         }
 
-        const TaskQueueStatus fileStatus{ m_context.fileCompareTasker().status() };
-
-        const bool tooManyFileTasksWaiting{ (
-            fileStatus.queue_size > (fileStatus.resource_count * 2)) };
+        // Always let one dir compare execute, even when over the budget.  The copy and remove
+        // queues can't drain until all the dir compares are done, so stopping all of them would
+        // mean never finishing.
+        if (m_context.isOverQueueMemoryBudget())
+        {
+            return (0 == busyCount());
+        }
 
-        return !tooManyFileTasksWaiting;
+        return true;
     }
 
 } // namespace backup
@@ -3,11 +3,11 @@
 //
 // tasker.hpp
 //
-#include "task-queue.hpp"
+#include "device-task-queues.hpp"
 #include "task-resources.hpp"
-#include "thread-pool.hpp"
 
-#include <future>
+#include <atomic>
+#include <cstddef>
 
 namespace backup
 {
@@ -19,9 +19,15 @@ namespace backup
     {
         virtual ~IBackupContext() = default;
 
-        virtual void notifyAll()               = 0;
-        virtual bool willAbort()               = 0;
-        virtual void printStatusUpdateIfTime() = 0;
+        virtual void notifyOne() = 0;
+        virtual void notifyAll() = 0;
+        virtual bool willAbort() = 0;
+
+        // true if all the queued tasks together are using more than the memory budget allows
+        virtual bool isOverQueueMemoryBudget() = 0;
+
+        // called after a tasker added a queue for another device, see DeviceTaskQueues
+        virtual void onDeviceQueueAdded() = 0;
 
         virtual FileCompareTasker & fileCompareTasker()           = 0;
         virtual DirectoryCompareTasker & directoryCompareTasker() = 0;
@@ -34,84 +40,173 @@ namespace backup
 
     //
 
+    // the parts of a tasker that can be watched and adjusted while it is running
+    struct ITunableTasker
+    {
+        virtual ~ITunableTasker() = default;
+
+        virtual TaskQueueStatus status() const               = 0;
+        virtual std::size_t resourceCount() const            = 0;
+        virtual std::size_t activeLimit() const              = 0;
+        virtual void setActiveLimit(const std::size_t limit) = 0;
+
+        // true once a user has chosen this tasker's limit, which the Autotuner must not override
+        virtual bool isManuallyLimited() const = 0;
+    };
+
+    //
+
+    // A ParallelTasker has no threads of its own.  It holds one kind of task and the resources
+    // needed to execute them, and whatever threads the Executor has call tryExecuteTask() on every
+    // tasker in turn.  So the resource count is this tasker's limit on how many of its tasks can
+    // execute at once, not a count of threads that will sit idle when there is nothing to do.
+    //
+    // If split by device then that limit is per pair of src and dst devices, see DeviceTaskQueues,
+    // and each call to tryExecuteTask() starts looking in the next device's queue so that they
+    // all get their turn.
     template <typename TaskResource_t>
-    class ParallelTasker
+    class ParallelTasker : public ITunableTasker
     {
       public:
         using TaskQueue_t = ResourceLimitedParallelTaskQueue<TaskResource_t>;
-
-        explicit ParallelTasker(IBackupContext & backupContext, const std::size_t parallelCount)
+        using DeviceTaskQueues_t = DeviceTaskQueues<TaskResource_t>;
+
+        ParallelTasker(
+            IBackupContext & backupContext,
+            EntryStore & entryStore,
+            const std::size_t parallelCount,
+            const TaskOrder order,
+            const bool isSplitByDevice = false)
             : m_context(backupContext)
+            , m_isStarted(false)
             , m_isFinished(false)
-            , m_threadPool()
-            , m_taskQueue(parallelCount)
-            , m_condVar()
+            , m_isManuallyLimited(false)
+            , m_taskQueues(entryStore, parallelCount, order, isSplitByDevice)
+            , m_nextQueueIndex(0)
         {}
 
         virtual ~ParallelTasker() = default;
 
+        bool isStarted() const { return m_isStarted; }
         bool isFinished() const { return m_isFinished; }
-        TaskQueueStatus status() const { return m_taskQueue.status(); }
+        std::size_t resourceCount() const override { return m_taskQueues.resourceCount(); }
+        std::size_t activeLimit() const override { return m_taskQueues.activeLimit(); }
+        std::size_t busyCount() const { return m_taskQueues.busyCount(); }
+        std::size_t queueBytes() const { return m_taskQueues.queueBytes(); }
+        std::size_t queueCount() const { return m_taskQueues.queueCount(); }
+
+        // the status and devices of each queue, see DeviceTaskQueues
+        TaskQueueStatus status(const std::size_t queueIndex) const
+        {
+            return m_taskQueues.queue(queueIndex).status();
+        }
 
-        void notifyOne() { m_condVar.notify_one(); }
-        void notifyAll() { m_condVar.notify_all(); }
+        const DeviceDPair_t & devices(const std::size_t queueIndex) const
+        {
+            return m_taskQueues.devices(queueIndex);
+        }
 
-        virtual void enqueue(const EntryConstRefDPair_t & entryDPair)
+        void setSpillLimit(const std::size_t limitBytes, const fs::path & spillDirPath)
         {
-            // after pushing a new task on the queue, check if a thread needs to wake and execute it
-            if (m_taskQueue.push(entryDPair).isReady())
-            {
-                notifyOne();
-            }
+            m_taskQueues.setSpillLimit(limitBytes, spillDirPath);
         }
+        TaskQueueStatus status() const override { return m_taskQueues.status(); }
 
-        void start()
+        void setActiveLimit(const std::size_t limit) override
         {
-            m_isFinished = false;
+            m_taskQueues.setActiveLimit(limit);
 
-            for (std::size_t i{ 0 }; i < m_taskQueue.resourceCount(); ++i)
-            {
-                m_threadPool.add(std::async(
-                    std::launch::async, &ParallelTasker<TaskResource_t>::executeLoop, this));
-            }
+            // if the limit went up then there might be tasks that are now allowed to execute
+            m_context.notifyAll();
+        }
+
+        bool isManuallyLimited() const override { return m_isManuallyLimited; }
+
+        void setManualLimit(const std::size_t limit)
+        {
+            m_isManuallyLimited = true;
+            setActiveLimit(limit);
         }
 
-        void waitUntilFinished()
+        // see ResourceLimitedParallelTaskQueue::push() for when to give a handle
+        void enqueue(
+            const EntryConstRefDPair_t & entryDPair, const EntryHandle_t handle = no_entry_handle)
         {
-            notifyAll();
+            bool wasQueueAdded{ false };
+            const TaskQueueStatus queueStatus{ m_taskQueues.push(
+                entryDPair, handle, wasQueueAdded) };
 
-            auto printStatusIfTime = [&]() { m_context.printStatusUpdateIfTime(); };
-            m_threadPool.waitUntilAllJoinedAndDestroyed(printStatusIfTime);
+            if (wasQueueAdded)
+            {
+                m_context.onDeviceQueueAdded();
+            }
 
-            m_isFinished = true;
+            // after pushing a new task on the queue, check if a thread needs to wake and execute it
+            if (queueStatus.isReady() && isStarted())
+            {
+                m_context.notifyOne();
+            }
+        }
 
+        void start()
+        {
+            m_isStarted = true;
             m_context.notifyAll();
         }
 
-      private:
-        bool executeLoop()
+        // returns false if no task was executed, either because none were ready or because this
+        // tasker is not started, is finished, or is not allowed to execute any more right now
+        bool tryExecuteTask()
         {
-            while (!m_context.willAbort())
+            if (!m_isStarted || m_isFinished || !isAllowedToExecute())
             {
-                if (executeTask(m_taskQueue))
-                {
-                    continue;
-                }
+                return false;
+            }
+
+            const std::size_t count{ m_taskQueues.queueCount() };
+            if (1 == count)
+            {
+                return executeTask(m_taskQueues.queue(0));
+            }
 
-                if (isDoneAndAllowedToFinish())
+            const std::size_t first{ m_nextQueueIndex++ };
+            for (std::size_t i{ 0 }; i < count; ++i)
+            {
+                if (executeTask(m_taskQueues.queue((first + i) % count)))
                 {
-                    break;
+                    return true;
                 }
+            }
+
+            return false;
+        }
+
+        // true if tryExecuteTask() would probably execute a task if called now
+        bool isReadyToExecute() const
+        {
+            return (
+                m_isStarted && !m_isFinished && isAllowedToExecute() && m_taskQueues.isReady());
+        }
 
-                std::unique_lock lock(m_condVarMutex);
+        // returns true only for the one call that changed this tasker to finished
+        bool updateIsFinished()
+        {
+            if (!m_isStarted || m_isFinished || !isDoneAndAllowedToFinish())
+            {
+                return false;
+            }
 
-                m_condVar.wait_for(
-                    lock, std::chrono::milliseconds(250), [&]() { return isAllowedToWake(); });
+            bool wasFinished{ false };
+            if (!m_isFinished.compare_exchange_strong(wasFinished, true))
+            {
+                return false;
             }
 
+            m_context.notifyAll();
             return true;
         }
 
+      private:
         bool isDoneAndAllowedToFinish() const
         {
             const TaskQueueStatus myStatus{ status() };
@@ -127,19 +222,18 @@ namespace backup
         }
 
         virtual bool executeTask(TaskQueue_t & myTaskQueue) = 0;
-        virtual bool isAllowedToWake() const { return true; }
+        virtual bool isAllowedToExecute() const { return true; }
         virtual bool isAllowedToFinish(const TaskQueueStatus & myStatus) const = 0;
 
       protected:
         IBackupContext & m_context;
 
       private:
-        bool m_isFinished;
-        ThreadPool m_threadPool;
-        TaskQueue_t m_taskQueue;
-        std::condition_variable m_condVar;
-
-        static inline std::mutex m_condVarMutex;
+        std::atomic<bool> m_isStarted;
+        std::atomic<bool> m_isFinished;
+        std::atomic<bool> m_isManuallyLimited;
+        DeviceTaskQueues_t m_taskQueues;
+        std::atomic<std::size_t> m_nextQueueIndex;
     };
 
     //
@@ -147,9 +241,13 @@ namespace backup
     class DirectoryCompareTasker : public ParallelTasker<DirectoryCompareTaskResources>
     {
       public:
-        explicit DirectoryCompareTasker(
-            IBackupContext & backupContext, const std::size_t parallelCount)
-            : ParallelTasker<DirectoryCompareTaskResources>(backupContext, parallelCount)
+        DirectoryCompareTasker(
+            IBackupContext & backupContext,
+            EntryStore & entryStore,
+            const std::size_t parallelCount,
+            const TaskOrder order)
+            : ParallelTasker<DirectoryCompareTaskResources>(
+                  backupContext, entryStore, parallelCount, order)
         {}
 
         virtual ~DirectoryCompareTasker() = default;
@@ -161,9 +259,11 @@ namespace backup
             return myTaskQueue.popAndExecute(compareDirs);
         }
 
-        // not allowed to wake if the number of queued file or dir compare tasks are getting out of
-        // hand which helps keep the queue sizes from getting out of hand and using too much memory
-        bool isAllowedToWake() const override;
+        // Not allowed to execute if the number of queued file compare tasks is getting out of hand,
+        // which leaves the threads free to work on those instead, and keeps the queue sizes from
+        // getting out of hand and using too much memory.  Dir compares are what fill all the other
+        // queues, so this is also where the memory budget is enforced.
+        bool isAllowedToExecute() const override;
 
         // there should always be at least one dir compare task, the first/initial task
         // if there are any other dirs to compare, then it could'nt finish without add more
@@ -180,8 +280,14 @@ namespace backup
     class FileCompareTasker : public ParallelTasker<FileCompareTaskResources>
     {
       public:
-        explicit FileCompareTasker(IBackupContext & backupContext, const std::size_t parallelCount)
-            : ParallelTasker<FileCompareTaskResources>(backupContext, parallelCount)
+        FileCompareTasker(
+            IBackupContext & backupContext,
+            EntryStore & entryStore,
+            const std::size_t parallelCount,
+            const TaskOrder order,
+            const bool isSplitByDevice)
+            : ParallelTasker<FileCompareTaskResources>(
+                  backupContext, entryStore, parallelCount, order, isSplitByDevice)
         {}
 
         virtual ~FileCompareTasker() = default;
@@ -193,16 +299,6 @@ namespace backup
             return myTaskQueue.popAndExecute(compareFiles);
         }
 
-        bool isAllowedToWake() const override
-        {
-            const TaskQueueStatus myStatus{ status() };
-
-            const bool isReadyToExecuteTask{ myStatus.isReady() };
-            const bool isFinished{ (myStatus.isDone() && isAllowedToFinish(myStatus)) };
-
-            return (isReadyToExecuteTask || isFinished);
-        }
-
         // not allowed to finish until all the directories have been compared
         bool isAllowedToFinish(const TaskQueueStatus &) const override
         {
@@ -215,8 +311,14 @@ namespace backup
     class CopyTasker : public ParallelTasker<CopyTaskResources>
     {
       public:
-        explicit CopyTasker(IBackupContext & backupContext, const std::size_t parallelCount)
-            : ParallelTasker<CopyTaskResources>(backupContext, parallelCount)
+        CopyTasker(
+            IBackupContext & backupContext,
+            EntryStore & entryStore,
+            const std::size_t parallelCount,
+            const TaskOrder order,
+            const bool isSplitByDevice)
+            : ParallelTasker<CopyTaskResources>(
+                  backupContext, entryStore, parallelCount, order, isSplitByDevice)
         {}
 
         virtual ~CopyTasker() = default;
@@ -242,8 +344,12 @@ namespace backup
     class RemoveTasker : public ParallelTasker<RemoveTaskResources>
     {
       public:
-        explicit RemoveTasker(IBackupContext & backupContext, const std::size_t parallelCount)
-            : ParallelTasker<RemoveTaskResources>(backupContext, parallelCount)
+        RemoveTasker(
+            IBackupContext & backupContext,
+            EntryStore & entryStore,
+            const std::size_t parallelCount,
+            const TaskOrder order)
+            : ParallelTasker<RemoveTaskResources>(backupContext, entryStore, parallelCount, order)
         {}
 
         virtual ~RemoveTasker() = default;
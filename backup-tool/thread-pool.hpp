@@ -3,8 +3,8 @@
 //
 // thread-pool.hpp
 //
-
 #include <future>
+#include <vector>
 
 namespace backup
 {
@@ -18,37 +18,7 @@ namespace backup
 
         void add(std::future<bool> && boolFuture) { m_futures.push_back(std::move(boolFuture)); }
 
-        template <typename StatusUpdateFunction_t>
-        void waitUntilAllJoinedAndDestroyed(StatusUpdateFunction_t statusUpdateFunction)
-        {
-            std::size_t sleepCurrentMs{ 0 };
-            const std::size_t sleepMaxMs{ 330 };
-            const std::size_t sleepIncrementMs{ 5 };
-
-            while (isAnyRunning())
-            {
-                std::this_thread::sleep_for(std::chrono::milliseconds(sleepCurrentMs));
-                sleepCurrentMs = std::clamp((sleepCurrentMs + sleepIncrementMs), 0_st, sleepMaxMs);
-                statusUpdateFunction();
-            }
-
-            joinAndDestroyAll();
-        }
-
-      private:
-        bool isAnyRunning()
-        {
-            for (auto & future : m_futures)
-            {
-                if (future.wait_for(std::chrono::milliseconds(0)) != std::future_status::ready)
-                {
-                    return true;
-                }
-            }
-
-            return false;
-        }
-
+        // whoever calls this must have already told all the threads to stop
         void joinAndDestroyAll()
         {
             for (auto & future : m_futures)
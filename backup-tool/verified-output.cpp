@@ -59,7 +59,7 @@ namespace backup
 
         if (canWriteToLogfile())
         {
-            printTo_internal(m_logFileStream, sv, Color::Disabled);
+            printToLogfile_internal(sv);
         }
     }
 
@@ -129,7 +129,8 @@ namespace backup
         {
             print_internal(
                 std::wstring(L"Error: ") + getStreamStateString(m_logFileStream.rdstate()) +
-                    L": While trying to create/truncate the logfile: \"" + path.wstring() + L"\"",
+                    L": While trying to create/truncate the logfile: \"" +
+                    pathToWideString(path) + L"\"",
                 Color::Red);
 
             return false;
@@ -144,7 +145,7 @@ namespace backup
 
         if (canWriteToLogfile())
         {
-            printTo_internal(m_logFileStream, sv, Color::Disabled);
+            printToLogfile_internal(sv);
         }
     }
 
@@ -201,6 +202,12 @@ namespace backup
         m_lastPrintTime = Clock_t::now();
     }
 
+    void VerifiedOutput::printToLogfile_internal(std::wstring_view sv)
+    {
+        m_logFileStream << strutil::toNarrowString(sv) << std::endl;
+        m_lastPrintTime = Clock_t::now();
+    }
+
     void VerifiedOutput::colorStart(std::wostream & os, const Color color) const
     {
         if (!m_isColorAllowed || (color == Color::Disabled))
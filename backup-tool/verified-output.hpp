@@ -47,6 +47,10 @@ namespace backup
         void printTo_internal(
             std::wostream & os, std::wstring_view sv, const Color color = Color::Default);
 
+        // The logfile is written as UTF-8, which every char converts to, so unlike wcout it never
+        // stops working because of some strange name.
+        void printToLogfile_internal(std::wstring_view sv);
+
         void colorStart(std::wostream & os, const Color color) const;
         void colorStop(std::wostream & os) const;
         void alertColorSwitch(std::wostream & os, const Color color) const;
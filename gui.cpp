@@ -44,8 +44,23 @@ namespace backup_gui
         ImGui::RadioButton("Copy", &task.job, Job::Copy);
         ImGui::SameLine();
         ImGui::RadioButton("Cull", &task.job, Job::Cull);
+        ImGui::SameLine();
+        ImGui::RadioButton("Purge Trash", &task.job, Job::Purge);
+
+        // purging the trash only needs the dst dir
+        const bool isSourceUnused{ Job::Purge == task.job };
+        if (isSourceUnused)
+        {
+            ImGui::BeginDisabled();
+        }
 
         ImGui::InputText("Source", &task.src_dir);
+
+        if (isSourceUnused)
+        {
+            ImGui::EndDisabled();
+        }
+
         ImGui::InputText("Destination", &task.dst_dir);
 
         ImGui::Checkbox("Dry Run", &task.opt_dryrun);
@@ -54,9 +69,15 @@ namespace backup_gui
         ImGui::Checkbox("Single Thread", &task.opt_background);
         HelpMarker("Runs minimal threads to prevent slowing your computer down");
 
+        ImGui::Checkbox("Autotune Threads", &task.opt_autotune);
+        HelpMarker("Keeps adjusting how many of each task run at once to find the fastest mix");
+
         ImGui::Checkbox("Skip File Content Compare", &task.opt_skipread);
         HelpMarker("Files with the exact same size are assumed to have the same contents");
 
+        ImGui::Checkbox("Use Trash", &task.opt_trash);
+        HelpMarker("Culled files/dirs are quickly moved into a trash dir instead of deleted");
+
         ImGui::Checkbox("Relative Paths", &task.opt_relative);
         HelpMarker("Displays relative paths instead of absolute paths");
 
@@ -111,14 +132,18 @@ namespace backup_gui
     {
         std::scoped_lock lock(task.mutex);
         ImGui::Begin("Output");
-        setupStatusBlock("Directory Comparer", task.dir_status);
-        setupStatusBlock("File Comparer", task.file_status);
-        setupStatusBlock("File Copier", task.copy_status);
-        setupStatusBlock("File Deleter", task.remove_status);
+        setupStatusBlock(task, "Directory Comparer", task.dir_status, backup::TaskType::DirCompare);
+        setupStatusBlock(task, "File Comparer", task.file_status, backup::TaskType::FileCompare);
+        setupStatusBlock(task, "File Copier", task.copy_status, backup::TaskType::Copy);
+        setupStatusBlock(task, "File Deleter", task.remove_status, backup::TaskType::Remove);
         ImGui::End();
     }
 
-    void setupStatusBlock(const std::string & title, const TaskStatus & status)
+    void setupStatusBlock(
+        Task & task,
+        const std::string & title,
+        const TaskStatus & status,
+        const backup::TaskType type)
     {
         ImGui::Text("%s", title.data(), title.size());
         ImGui::Indent();
@@ -129,6 +154,20 @@ namespace backup_gui
         ImGui::Text(
             "Queued/Completed: %d/%d", status.stats.queue_size, status.stats.completed_count);
 
+        // a tasker with no threads is not used by this job, so there is nothing to change
+        if (task.is_running && task.m_toolUPtr && (status.stats.resource_count > 0))
+        {
+            // not from status, which is only refreshed every 100ms, so it would lag behind a drag
+            const int prevThreadCount{ static_cast<int>(task.m_toolUPtr->concurrency(type)) };
+            int threadCount{ prevThreadCount };
+            const std::string label{ "Threads##" + title };
+            if (ImGui::SliderInt(label.c_str(), &threadCount, 1, 64) &&
+                (threadCount != prevThreadCount))
+            {
+                task.m_toolUPtr->setConcurrency(type, static_cast<std::size_t>(threadCount));
+            }
+        }
+
         ImGui::PlotLines(
             "",
             &status.unit_vec[0],
@@ -190,6 +229,10 @@ namespace backup_gui
         {
             commandLineArgs.push_back("--cull");
         }
+        else if (Job::Purge == job)
+        {
+            commandLineArgs.push_back("--purge-trash");
+        }
         else
         {
             commandLineArgs.push_back("--compare");
@@ -205,11 +248,21 @@ namespace backup_gui
             commandLineArgs.push_back("--background");
         }
 
+        if (opt_autotune)
+        {
+            commandLineArgs.push_back("--autotune");
+        }
+
         if (opt_skipread)
         {
             commandLineArgs.push_back("--skip-file-read");
         }
 
+        if (opt_trash)
+        {
+            commandLineArgs.push_back("--trash");
+        }
+
         if (opt_relative)
         {
             commandLineArgs.push_back("--show-relative");
@@ -240,10 +293,14 @@ namespace backup_gui
             commandLineArgs.push_back("--ignore-warnings");
         }
 
-        commandLineArgs.push_back(src_dir);
+        if (Job::Purge != job)
+        {
+            commandLineArgs.push_back(src_dir);
+        }
+
         commandLineArgs.push_back(dst_dir);
 
-        m_toolUPtr = std::make_unique<backup::BackupTool>(commandLineArgs);
+        m_toolUPtr = std::make_unique<backup::BackupTool>(commandLineArgs, m_executor);
 
         // don't hold the lock while the backup job is running
         lock.unlock();
@@ -19,7 +19,8 @@ namespace backup_gui
     {
         Compare = 0,
         Copy,
-        Cull
+        Cull,
+        Purge
     };
 
     struct TaskStatus
@@ -51,15 +52,18 @@ namespace backup_gui
         std::string dst_dir;
         bool opt_dryrun          = false;
         bool opt_background      = false;
+        bool opt_autotune        = false;
         bool opt_skipread        = false;
         bool opt_relative        = false;
+        bool opt_trash           = false;
         bool opt_verbose         = false;
         bool opt_ignore_extra    = false;
         bool opt_ignore_access   = false;
         bool opt_ignore_unknown  = false;
         bool opt_ignore_warnings = false;
 
-        // job workers
+        // job workers, the executor's threads are kept for all the jobs this task ever runs
+        backup::Executor m_executor;
         std::unique_ptr<backup::BackupTool> m_toolUPtr;
 
         void backupLoop();
@@ -72,5 +76,9 @@ namespace backup_gui
     void setupGUI(Task & task);
     void setupOptionsWindow(Task & task);
     void setupOutputWindow(Task & task);
-    void setupStatusBlock(const std::string & title, const TaskStatus & status);
+    void setupStatusBlock(
+        Task & task,
+        const std::string & title,
+        const TaskStatus & status,
+        const backup::TaskType type);
 } // namespace backup_gui